@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sort_engine.h"
+#include "util.h"
+
+// Compares the run sort engines across key distributions, with and without scratch memory, and shows which engine
+// SORT_ENGINE_AUTO picks for each.
+//
+// usage: sort_engine_benchmark [values]
+
+static size_t const DEFAULT_NUM_VALUES = (size_t) 1 << 22;
+
+enum distribution {
+    DISTRIBUTION_UNIFORM = 0,
+    DISTRIBUTION_SKEWED,
+    DISTRIBUTION_FEW_UNIQUE,
+    DISTRIBUTION_NARROW,
+    DISTRIBUTION_SORTED,
+    DISTRIBUTION_REVERSED,
+    NUM_DISTRIBUTIONS
+};
+
+static char const *const distribution_names[] = {
+        [DISTRIBUTION_UNIFORM] = "uniform",
+        [DISTRIBUTION_SKEWED] = "skewed",
+        [DISTRIBUTION_FEW_UNIQUE] = "few unique",
+        [DISTRIBUTION_NARROW] = "narrow range",
+        [DISTRIBUTION_SORTED] = "sorted",
+        [DISTRIBUTION_REVERSED] = "reversed",
+};
+
+static uint64_t random_state = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t next_random(void)
+{
+    return (uint32_t) (util_next_random(&random_state) >> 32);
+}
+
+static void generate(enum distribution distribution, uint32_t *values, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        switch (distribution) {
+            case DISTRIBUTION_SKEWED:
+                // Roughly exponential: small values are far more common than large ones.
+                values[i] = next_random() >> (next_random() % 32);
+                break;
+            case DISTRIBUTION_FEW_UNIQUE:
+                values[i] = (next_random() % 16) * 0x10000001u;
+                break;
+            case DISTRIBUTION_NARROW:
+                values[i] = next_random() & 0xFFFF;
+                break;
+            case DISTRIBUTION_SORTED:
+                values[i] = (uint32_t) i;
+                break;
+            case DISTRIBUTION_REVERSED:
+                values[i] = (uint32_t) (count - i);
+                break;
+            case DISTRIBUTION_UNIFORM:
+            default:
+                values[i] = next_random();
+                break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t const count = (argc > 1) ? (size_t) strtoull(argv[1], NULL, 0) : DEFAULT_NUM_VALUES;
+    uint32_t *input = (uint32_t *) malloc(count * sizeof(uint32_t));
+    uint32_t *values = (uint32_t *) malloc(count * sizeof(uint32_t));
+    uint32_t *scratch = (uint32_t *) malloc(count * sizeof(uint32_t));
+    if (!input || !values || !scratch) {
+        fprintf(stderr, "ERROR: unable to allocate %lu values\n", count);
+        return EXIT_FAILURE;
+    }
+
+    enum sort_engine const engines[] = {SORT_ENGINE_QSORT, SORT_ENGINE_RADIX, SORT_ENGINE_SIMD};
+    size_t const num_engines = sizeof(engines) / sizeof(engines[0]);
+    printf("%lu values, million values per second\n\n", count);
+    printf("%-14s %-8s", "distribution", "scratch");
+    for (size_t e = 0; e < num_engines; e++) {
+        printf(" %8s", sort_engine_get_name(engines[e]));
+    }
+    printf("   auto picks\n");
+
+    for (int d = 0; d < NUM_DISTRIBUTIONS; d++) {
+        generate((enum distribution) d, input, count);
+        for (int with_scratch = 0; with_scratch <= 1; with_scratch++) {
+            printf("%-14s %-8s", distribution_names[d], with_scratch ? "yes" : "no");
+            for (size_t e = 0; e < num_engines; e++) {
+                memcpy(values, input, count * sizeof(uint32_t));
+                double const start = util_now_seconds();
+                sort_engine_sort(engines[e], values, count, with_scratch ? scratch : NULL);
+                double const seconds = util_now_seconds() - start;
+                for (size_t i = 1; i < count; i++) {
+                    if (values[i - 1] > values[i]) {
+                        fprintf(stderr, "ERROR: %s didn't sort\n", sort_engine_get_name(engines[e]));
+                        return EXIT_FAILURE;
+                    }
+                }
+                printf(" %8.1f", (double) count / seconds / 1e6);
+            }
+            printf("   %s\n", sort_engine_get_name(sort_engine_choose(input, count, with_scratch ? scratch : NULL)));
+        }
+    }
+
+    free(scratch);
+    free(values);
+    free(input);
+    return EXIT_SUCCESS;
+}
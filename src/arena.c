@@ -0,0 +1,275 @@
+#include "arena.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Size of the huge pages that are requested. This is the default huge page size on x86-64 and most arm64 kernels.
+#define HUGE_PAGE_SIZE ((size_t) 2 * (1 << 20))
+
+struct arena {
+    // The whole mapping, as returned by mmap.
+    void *mapping;
+    size_t mapping_size;
+
+    // The usable part of the mapping. For transparent huge pages, this is the mapping trimmed to a huge page boundary.
+    char *base;
+    size_t size;
+
+    size_t used;
+    enum arena_backing backing;
+    bool locked;
+
+    // Why locking failed (an errno value), or zero if it succeeded or wasn't asked for.
+    int lock_error;
+};
+
+static size_t round_up(size_t value, size_t multiple);
+
+static bool map_explicit_huge_pages(struct arena *arena, size_t size);
+
+static bool map_transparent_huge_pages(struct arena *arena, size_t size);
+
+static bool map_normal_pages(struct arena *arena, size_t size);
+
+
+/*
+ * Creates an arena that backs size bytes of working memory.
+ *
+ * With ARENA_FLAG_HUGE_PAGES, this first tries explicit huge pages (MAP_HUGETLB), which only succeeds if the
+ * administrator has reserved a huge page pool. It then tries transparent huge pages by aligning a normal mapping to a
+ * huge page boundary and advising the kernel (MADV_HUGEPAGE). If neither works, it uses normal pages. With
+ * ARENA_FLAG_LOCK, the memory is locked so that it cannot be swapped out. Locking failures (e.g. due to
+ * RLIMIT_MEMLOCK) are not fatal. Use arena_get_backing() and arena_is_locked() to find out what was achieved, and
+ * arena_get_lock_error() to find out why locking failed.
+ */
+struct arena *arena_new(size_t size, unsigned int flags)
+{
+    if (size == 0) {
+        return NULL;
+    }
+
+    struct arena *arena = (struct arena *) malloc(sizeof(struct arena));
+    if (!arena) {
+        return NULL;
+    }
+    arena->mapping = NULL;
+    arena->mapping_size = 0;
+    arena->base = NULL;
+    arena->size = size;
+    arena->used = 0;
+    arena->backing = ARENA_BACKING_NORMAL_PAGES;
+    arena->locked = false;
+    arena->lock_error = 0;
+
+    bool mapped = false;
+    if (flags & ARENA_FLAG_HUGE_PAGES) {
+        mapped = map_explicit_huge_pages(arena, size) || map_transparent_huge_pages(arena, size);
+    }
+    if (!mapped) {
+        mapped = map_normal_pages(arena, size);
+    }
+    if (!mapped) {
+        free(arena);
+        return NULL;
+    }
+
+    if (flags & ARENA_FLAG_LOCK) {
+        arena->locked = (mlock(arena->base, arena->size) == 0);
+        arena->lock_error = arena->locked ? 0 : errno;
+    }
+    return arena;
+}
+
+/*
+ * Creates an arena out of size bytes of another one, e.g. to give each of several threads an arena of its own, since
+ * an arena can't be shared between threads. The memory is taken from the parent with arena_alloc(), and it shares the
+ * parent's backing and locking. Delete the child before the parent is released past it.
+ */
+struct arena *arena_new_within(struct arena *parent, size_t size)
+{
+    assert(parent);
+
+    if (size == 0) {
+        return NULL;
+    }
+    // The range is taken last, so that a failure never leaves it taken from the parent.
+    struct arena *arena = (struct arena *) malloc(sizeof(struct arena));
+    if (!arena) {
+        return NULL;
+    }
+    char *base = (char *) arena_alloc(parent, size, ARENA_PAGE_ALIGNMENT);
+    if (!base) {
+        free(arena);
+        return NULL;
+    }
+    // No mapping of its own, so deleting the child leaves the parent's memory alone.
+    arena->mapping = NULL;
+    arena->mapping_size = 0;
+    arena->base = base;
+    arena->size = size;
+    arena->used = 0;
+    arena->backing = parent->backing;
+    arena->locked = parent->locked;
+    arena->lock_error = parent->lock_error;
+    return arena;
+}
+
+/*
+ * Hands out a sub-buffer of the arena. alignment must be a power of two. Returns NULL if the arena doesn't have enough
+ * space left.
+ */
+void *arena_alloc(struct arena *arena, size_t size, size_t alignment)
+{
+    assert(arena);
+    assert(alignment && !(alignment & (alignment - 1)));
+
+    size_t const offset = round_up((size_t) (uintptr_t) (arena->base + arena->used), alignment) -
+                          (size_t) (uintptr_t) arena->base;
+    if ((offset > arena->size) || (size > arena->size - offset)) {
+        return NULL;
+    }
+    arena->used = offset + size;
+    return arena->base + offset;
+}
+
+size_t arena_available(struct arena const *arena, size_t alignment)
+{
+    assert(arena);
+    assert(alignment && !(alignment & (alignment - 1)));
+
+    size_t const offset = round_up((size_t) (uintptr_t) (arena->base + arena->used), alignment) -
+                          (size_t) (uintptr_t) arena->base;
+    if (offset >= arena->size) {
+        return 0;
+    }
+    return arena->size - offset;
+}
+
+size_t arena_size(struct arena const *arena)
+{
+    assert(arena);
+    return arena->size;
+}
+
+/*
+ * Returns a mark that arena_release() can later roll the arena back to, freeing everything allocated since.
+ */
+size_t arena_mark(struct arena const *arena)
+{
+    assert(arena);
+    return arena->used;
+}
+
+void arena_release(struct arena *arena, size_t mark)
+{
+    assert(arena);
+    assert(mark <= arena->used);
+    arena->used = mark;
+}
+
+enum arena_backing arena_get_backing(struct arena const *arena)
+{
+    assert(arena);
+    return arena->backing;
+}
+
+bool arena_is_locked(struct arena const *arena)
+{
+    assert(arena);
+    return arena->locked;
+}
+
+/*
+ * Gets the errno value that locking the arena failed with. It's zero if the arena is locked or locking wasn't asked
+ * for. It's saved when the arena is created, so later calls can't change it before a caller gets to report it.
+ */
+int arena_get_lock_error(struct arena const *arena)
+{
+    assert(arena);
+    return arena->lock_error;
+}
+
+void arena_delete(struct arena *arena)
+{
+    if (arena) {
+        if (arena->mapping) {
+            if (arena->locked) {
+                munlock(arena->base, arena->size);
+            }
+            munmap(arena->mapping, arena->mapping_size);
+        }
+        free(arena);
+    }
+}
+
+static size_t round_up(size_t value, size_t multiple)
+{
+    return (value + multiple - 1) & ~(multiple - 1);
+}
+
+static bool map_explicit_huge_pages(struct arena *arena, size_t size)
+{
+#ifdef MAP_HUGETLB
+    size_t const mapping_size = round_up(size, HUGE_PAGE_SIZE);
+    void *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    arena->mapping = mapping;
+    arena->mapping_size = mapping_size;
+    arena->base = (char *) mapping;
+    arena->backing = ARENA_BACKING_EXPLICIT_HUGE_PAGES;
+    return true;
+#else
+    (void) arena;
+    (void) size;
+    return false;
+#endif
+}
+
+static bool map_transparent_huge_pages(struct arena *arena, size_t size)
+{
+#ifdef MADV_HUGEPAGE
+    // The kernel can only back huge-page-aligned ranges with huge pages. Over-allocate so that the usable range can
+    // start on a huge page boundary.
+    size_t const mapping_size = round_up(size, HUGE_PAGE_SIZE) + HUGE_PAGE_SIZE;
+    void *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    char *base = (char *) round_up((size_t) (uintptr_t) mapping, HUGE_PAGE_SIZE);
+    if (madvise(base, round_up(size, HUGE_PAGE_SIZE), MADV_HUGEPAGE) != 0) {
+        // Transparent huge pages are disabled or unsupported.
+        munmap(mapping, mapping_size);
+        return false;
+    }
+    arena->mapping = mapping;
+    arena->mapping_size = mapping_size;
+    arena->base = base;
+    arena->backing = ARENA_BACKING_TRANSPARENT_HUGE_PAGES;
+    return true;
+#else
+    (void) arena;
+    (void) size;
+    return false;
+#endif
+}
+
+static bool map_normal_pages(struct arena *arena, size_t size)
+{
+    size_t const page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t const mapping_size = round_up(size, page_size);
+    void *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    arena->mapping = mapping;
+    arena->mapping_size = mapping_size;
+    arena->base = (char *) mapping;
+    arena->backing = ARENA_BACKING_NORMAL_PAGES;
+    return true;
+}
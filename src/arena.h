@@ -0,0 +1,47 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Alignments that sub-buffers are commonly handed out with.
+#define ARENA_CACHE_LINE_ALIGNMENT ((size_t) 64)
+#define ARENA_PAGE_ALIGNMENT ((size_t) 4096)
+
+enum arena_flags {
+    ARENA_FLAG_NONE = 0,
+    ARENA_FLAG_HUGE_PAGES = 1 << 0,
+    ARENA_FLAG_LOCK = 1 << 1
+};
+
+enum arena_backing {
+    ARENA_BACKING_NORMAL_PAGES = 0,
+    ARENA_BACKING_TRANSPARENT_HUGE_PAGES,
+    ARENA_BACKING_EXPLICIT_HUGE_PAGES
+};
+
+struct arena;
+
+struct arena *arena_new(size_t size, unsigned int flags);
+
+struct arena *arena_new_within(struct arena *parent, size_t size);
+
+void *arena_alloc(struct arena *arena, size_t size, size_t alignment);
+
+size_t arena_available(struct arena const *arena, size_t alignment);
+
+size_t arena_size(struct arena const *arena);
+
+size_t arena_mark(struct arena const *arena);
+
+void arena_release(struct arena *arena, size_t mark);
+
+enum arena_backing arena_get_backing(struct arena const *arena);
+
+bool arena_is_locked(struct arena const *arena);
+
+int arena_get_lock_error(struct arena const *arena);
+
+void arena_delete(struct arena *arena);
+
+#endif // ARENA_H
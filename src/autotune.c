@@ -0,0 +1,364 @@
+// mkostemp() is a GNU extension.
+#define _GNU_SOURCE
+#include "autotune.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "io_util.h"
+#include "sort_engine.h"
+#include "util.h"
+
+// The block sizes that sequential reads are timed at. The device's sequential throughput is the best of them.
+static size_t const SEQUENTIAL_BLOCK_SIZES[] = {64 * 1024, 1024 * 1024, 4 * 1024 * 1024};
+
+// The block sizes that random reads are timed at, and how many reads are timed at each. The time a read takes grows
+// with its size from a fixed cost, which is the seek.
+static size_t const RANDOM_BLOCK_SIZES[] = {4 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024};
+static size_t const RANDOM_READS = 32;
+
+// The largest of the block sizes, which the probe file is made of.
+static size_t const PROBE_BLOCK_SIZE = 4 * 1024 * 1024;
+
+// Values that the CPU sorts to time it.
+static size_t const SORT_PROBE_VALUES = 1024 * 1024;
+
+// A device that seems not to seek at all, e.g. one that's in memory, is still charged this much per seek, so that a
+// measured seek is never taken for a missing one (see plan_device).
+static double const MIN_SEEK_SECONDS = 1e-6;
+
+// Run sizes that are tried, halving from the memory size, when the run size is left to the autotuner.
+static size_t const RUN_SIZE_CANDIDATES = 8;
+
+static bool time_sequential_reads(int fd, size_t probe_size, void *buffer, double *bytes_per_second);
+
+static bool time_random_reads(int fd, size_t probe_size, void *buffer, double *seek_seconds);
+
+static bool time_sort(double *bytes_per_second);
+
+static void drop_cached_pages(int fd);
+
+
+/*
+ * Measures the device that holds directory, and the CPU, for the cost model. A probe file of probe_size bytes (rounded
+ * down to whole 4MB blocks, but at least one) is written to the directory, and its cached pages are dropped before
+ * each timing so that the reads go to the device. The file is removed as soon as it's created, so nothing is left
+ * behind.
+ *
+ * Sequential reads give the device's throughput. Random reads at several block sizes give the seek: a straight line is
+ * fitted to how long a read takes against its size, and the seek is where it crosses zero size. The CPU's rate is how
+ * fast the default sort engine sorts a buffer of random values.
+ */
+bool autotune_probe(char const *directory, size_t probe_size, struct plan_device *device)
+{
+    assert(directory);
+    assert(device);
+
+    probe_size -= probe_size % PROBE_BLOCK_SIZE;
+    if (probe_size == 0) {
+        probe_size = PROBE_BLOCK_SIZE;
+    }
+
+    char filename[PATH_MAX] = {0};
+    snprintf(filename, sizeof(filename), "%s/bigsort-probe-XXXXXX", directory);
+    int const fd = mkostemp(filename, O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: unable to create probe file in %s: %s\n", directory, strerror(errno));
+        return false;
+    }
+    remove(filename);
+
+    // Random data, so that a device that compresses can't make the probe look faster than the runs will be.
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, 4096, PROBE_BLOCK_SIZE) != 0) {
+        close(fd);
+        return false;
+    }
+    uint64_t state = 0x853c49e6748fea9bu;
+    for (size_t i = 0; i < PROBE_BLOCK_SIZE / sizeof(uint64_t); i++) {
+        ((uint64_t *) buffer)[i] = util_next_random(&state);
+    }
+    bool success = true;
+    for (size_t offset = 0; success && (offset < probe_size); offset += PROBE_BLOCK_SIZE) {
+        success = io_pwrite_fully(fd, buffer, PROBE_BLOCK_SIZE, offset);
+    }
+    success = success && (fdatasync(fd) == 0);
+    if (!success) {
+        fprintf(stderr, "ERROR: unable to write probe file: %s\n", strerror(errno));
+    }
+
+    struct plan_device measured = {0};
+    success = success &&
+              time_sequential_reads(fd, probe_size, buffer, &measured.sequential_bytes_per_second) &&
+              time_random_reads(fd, probe_size, buffer, &measured.seek_seconds) &&
+              time_sort(&measured.sort_bytes_per_second);
+    free(buffer);
+    close(fd);
+    if (success) {
+        *device = measured;
+    }
+    return success;
+}
+
+/*
+ * Gets the name of the file that caches the probe of the device that holds directory. Devices are told apart by their
+ * device number, and their probes are kept under $XDG_CACHE_HOME/bigsort, or ~/.cache/bigsort. Returns false if
+ * there's nowhere to keep them.
+ */
+bool autotune_get_cache_filename(char const *directory, char *buffer, size_t buffer_size)
+{
+    assert(directory);
+    assert(buffer);
+
+    struct stat status = {0};
+    if (stat(directory, &status) != 0) {
+        return false;
+    }
+    char const *cache_home = getenv("XDG_CACHE_HOME");
+    char const *home = getenv("HOME");
+    int length = 0;
+    if (cache_home && (cache_home[0] != '\0')) {
+        length = snprintf(buffer, buffer_size, "%s/bigsort/device-%lx", cache_home, (unsigned long) status.st_dev);
+    } else if (home && (home[0] != '\0')) {
+        length = snprintf(buffer, buffer_size, "%s/.cache/bigsort/device-%lx", home, (unsigned long) status.st_dev);
+    } else {
+        return false;
+    }
+    return (length > 0) && ((size_t) length < buffer_size);
+}
+
+/*
+ * Loads a cached probe. Returns false if there's none, or it can't be read.
+ */
+bool autotune_load_device(char const *cache_filename, struct plan_device *device)
+{
+    assert(cache_filename);
+    assert(device);
+
+    FILE *file = fopen(cache_filename, "r");
+    if (!file) {
+        return false;
+    }
+    struct plan_device loaded = {0};
+    int const num_fields = fscanf(
+            file,
+            "bigsort device 1 sequential_bytes_per_second %lf seek_seconds %lf sort_bytes_per_second %lf",
+            &loaded.sequential_bytes_per_second, &loaded.seek_seconds, &loaded.sort_bytes_per_second);
+    fclose(file);
+    if ((num_fields != 3) || !(loaded.sequential_bytes_per_second > 0.0) || !(loaded.seek_seconds > 0.0) ||
+        !(loaded.sort_bytes_per_second > 0.0)) {
+        return false;
+    }
+    *device = loaded;
+    return true;
+}
+
+/*
+ * Caches a probe, creating the cache's directory if need be. The cache is written to a temporary file that replaces
+ * the old one, so that a sort that's loading it at the same time never sees half of it.
+ */
+bool autotune_save_device(char const *cache_filename, struct plan_device const *device)
+{
+    assert(cache_filename);
+    assert(device);
+
+    // Create each missing directory on the way to the file.
+    char path[PATH_MAX] = {0};
+    snprintf(path, sizeof(path), "%s", cache_filename);
+    for (char *separator = strchr(path + 1, '/'); separator; separator = strchr(separator + 1, '/')) {
+        *separator = '\0';
+        if ((mkdir(path, 0755) != 0) && (errno != EEXIST)) {
+            fprintf(stderr, "ERROR: unable to create %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        *separator = '/';
+    }
+
+    snprintf(path, sizeof(path), "%s.XXXXXX", cache_filename);
+    int const fd = mkostemp(path, O_CLOEXEC);
+    FILE *file = (fd >= 0) ? fdopen(fd, "w") : NULL;
+    if (!file) {
+        fprintf(stderr, "ERROR: unable to write %s: %s\n", cache_filename, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            remove(path);
+        }
+        return false;
+    }
+    fprintf(file,
+            "bigsort device 1\n"
+            "sequential_bytes_per_second %.0f\n"
+            "seek_seconds %.9f\n"
+            "sort_bytes_per_second %.0f\n",
+            device->sequential_bytes_per_second, device->seek_seconds, device->sort_bytes_per_second);
+    bool const written = (fclose(file) == 0) && (rename(path, cache_filename) == 0);
+    if (!written) {
+        fprintf(stderr, "ERROR: unable to write %s: %s\n", cache_filename, strerror(errno));
+        remove(path);
+    }
+    return written;
+}
+
+/*
+ * Plans a sort like plan_sort() does, for the device in plan->device. If run_size is zero, it's picked too: run sizes
+ * from the memory size down are each planned, and the one that the cost model expects to create and merge the runs
+ * the fastest wins. A smaller run only wins if it's strictly faster, since a bigger one leaves fewer runs to merge.
+ */
+bool autotune_plan(
+        struct sort_plan *plan,
+        size_t memory_size, size_t run_size, uint64_t input_size,
+        size_t max_files)
+{
+    assert(plan);
+
+    if (run_size != 0) {
+        return plan_sort(plan, memory_size, run_size, input_size, max_files);
+    }
+
+    struct sort_plan best = {0};
+    double best_seconds = -1.0;
+    size_t candidate = memory_size;
+    for (size_t i = 0; (i < RUN_SIZE_CANDIDATES) && (candidate >= sizeof(uint32_t) * 2); i++, candidate /= 2) {
+        struct sort_plan trial = *plan;
+        if (!plan_sort(&trial, memory_size, candidate, input_size, max_files)) {
+            continue;
+        }
+        double const seconds = trial.estimated_run_seconds + trial.estimated_merge_seconds;
+        if ((best_seconds < 0.0) || (seconds < best_seconds)) {
+            best = trial;
+            best_seconds = seconds;
+        }
+    }
+    if (best_seconds < 0.0) {
+        return false;
+    }
+    *plan = best;
+    return true;
+}
+
+/*
+ * Picks how many threads to sort or merge with in parallel (e.g. with partitioning or output shards). Each thread
+ * works at about the CPU's sort rate, so it takes as many as it takes to keep up with the device's sequential
+ * throughput. Beyond that, more threads just queue up for the device.
+ */
+size_t autotune_choose_threads(struct sort_plan const *plan, size_t max_threads)
+{
+    assert(plan);
+    assert(max_threads > 0);
+
+    struct plan_device const *device = &plan->device;
+    if ((device->sequential_bytes_per_second <= 0.0) || (device->sort_bytes_per_second <= 0.0)) {
+        return max_threads;
+    }
+    double const ratio = device->sequential_bytes_per_second / device->sort_bytes_per_second;
+    if (ratio >= (double) max_threads) {
+        return max_threads;
+    }
+    size_t needed = (size_t) ratio;
+    if ((double) needed < ratio) {
+        needed++;
+    }
+    return (needed < 1) ? 1 : needed;
+}
+
+static bool time_sequential_reads(int fd, size_t probe_size, void *buffer, double *bytes_per_second)
+{
+    *bytes_per_second = 0.0;
+    for (size_t i = 0; i < sizeof(SEQUENTIAL_BLOCK_SIZES) / sizeof(SEQUENTIAL_BLOCK_SIZES[0]); i++) {
+        size_t const block_size = SEQUENTIAL_BLOCK_SIZES[i];
+        drop_cached_pages(fd);
+        double const start = util_now_seconds();
+        for (size_t offset = 0; offset < probe_size; offset += block_size) {
+            if (!io_pread_fully(fd, buffer, block_size, offset)) {
+                fprintf(stderr, "ERROR: unable to read probe file: %s\n", strerror(errno));
+                return false;
+            }
+        }
+        double const seconds = util_now_seconds() - start;
+        double const throughput = (double) probe_size / ((seconds > 0.0) ? seconds : 1e-9);
+        if (throughput > *bytes_per_second) {
+            *bytes_per_second = throughput;
+        }
+    }
+    return true;
+}
+
+static bool time_random_reads(int fd, size_t probe_size, void *buffer, double *seek_seconds)
+{
+    size_t const num_sizes = sizeof(RANDOM_BLOCK_SIZES) / sizeof(RANDOM_BLOCK_SIZES[0]);
+    double read_seconds[sizeof(RANDOM_BLOCK_SIZES) / sizeof(RANDOM_BLOCK_SIZES[0])] = {0};
+    uint64_t state = 0x2545f4914f6cdd1du;
+    for (size_t i = 0; i < num_sizes; i++) {
+        size_t const block_size = RANDOM_BLOCK_SIZES[i];
+        size_t const num_blocks = probe_size / block_size;
+        drop_cached_pages(fd);
+        double const start = util_now_seconds();
+        for (size_t j = 0; j < RANDOM_READS; j++) {
+            uint64_t const offset = (util_next_random(&state) % num_blocks) * block_size;
+            if (!io_pread_fully(fd, buffer, block_size, offset)) {
+                fprintf(stderr, "ERROR: unable to read probe file: %s\n", strerror(errno));
+                return false;
+            }
+        }
+        read_seconds[i] = (util_now_seconds() - start) / (double) RANDOM_READS;
+    }
+
+    // Fit read_seconds = seek_seconds + block_size * seconds_per_byte by least squares.
+    double mean_size = 0.0;
+    double mean_seconds = 0.0;
+    for (size_t i = 0; i < num_sizes; i++) {
+        mean_size += (double) RANDOM_BLOCK_SIZES[i] / (double) num_sizes;
+        mean_seconds += read_seconds[i] / (double) num_sizes;
+    }
+    double covariance = 0.0;
+    double variance = 0.0;
+    for (size_t i = 0; i < num_sizes; i++) {
+        double const size_difference = (double) RANDOM_BLOCK_SIZES[i] - mean_size;
+        covariance += size_difference * (read_seconds[i] - mean_seconds);
+        variance += size_difference * size_difference;
+    }
+    double const seconds_per_byte = covariance / variance;
+    *seek_seconds = mean_seconds - (seconds_per_byte * mean_size);
+    if (*seek_seconds < MIN_SEEK_SECONDS) {
+        *seek_seconds = MIN_SEEK_SECONDS;
+    }
+    return true;
+}
+
+static bool time_sort(double *bytes_per_second)
+{
+    uint32_t *values = (uint32_t *) malloc(2 * SORT_PROBE_VALUES * sizeof(uint32_t));
+    if (!values) {
+        return false;
+    }
+    uint64_t state = 0x9e3779b97f4a7c15u;
+    for (size_t i = 0; i < SORT_PROBE_VALUES; i++) {
+        values[i] = (uint32_t) util_next_random(&state);
+    }
+    // Runs pick their engine before they're sorted, so the pick isn't part of the rate.
+    enum sort_engine engine = sort_engine_get_default();
+    if (engine == SORT_ENGINE_AUTO) {
+        engine = sort_engine_choose(values, SORT_PROBE_VALUES, values + SORT_PROBE_VALUES);
+    }
+    double const start = util_now_seconds();
+    sort_engine_sort(engine, values, SORT_PROBE_VALUES, values + SORT_PROBE_VALUES);
+    double const seconds = util_now_seconds() - start;
+    free(values);
+    *bytes_per_second = (double) (SORT_PROBE_VALUES * sizeof(uint32_t)) / ((seconds > 0.0) ? seconds : 1e-9);
+    return true;
+}
+
+/*
+ * Asks the kernel to drop the file's pages from the page cache, so that the next reads go to the device. The file has
+ * been synced, so its pages are clean and can be dropped. A file system that's in memory (e.g. tmpfs) keeps them
+ * anyway, which is right, since that's how fast its runs will be read too.
+ */
+static void drop_cached_pages(int fd)
+{
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
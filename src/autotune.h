@@ -0,0 +1,24 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "plan.h"
+
+bool autotune_probe(char const *directory, size_t probe_size, struct plan_device *device);
+
+bool autotune_get_cache_filename(char const *directory, char *buffer, size_t buffer_size);
+
+bool autotune_load_device(char const *cache_filename, struct plan_device *device);
+
+bool autotune_save_device(char const *cache_filename, struct plan_device const *device);
+
+bool autotune_plan(
+        struct sort_plan *plan,
+        size_t memory_size, size_t run_size, uint64_t input_size,
+        size_t max_files);
+
+size_t autotune_choose_threads(struct sort_plan const *plan, size_t max_threads);
+
+#endif // AUTOTUNE_H
@@ -0,0 +1,350 @@
+#include "batch.h"
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "bigsort.h"
+#include "merge_kernel.h"
+#include "partition.h"
+#include "plan.h"
+
+// The separators between a job's input and output file names.
+static char const JOB_SEPARATORS[] = " \t\r\n";
+
+struct job_size {
+    size_t job;
+    uint64_t size;
+};
+
+struct batch_context {
+    struct batch_job const *jobs;
+    size_t max_files;
+
+    // The small jobs, largest first, and an arena per thread to sort them in.
+    struct job_size const *small_jobs;
+    size_t num_small;
+    struct arena **arenas;
+
+    atomic_size_t next_job;
+    atomic_size_t num_failed;
+};
+
+static bool add_job(
+        struct batch_job **jobs, size_t *num_jobs, size_t *capacity,
+        char const *input_filename, char const *output_filename);
+
+static int compare_job_sizes_descending(void const *a, void const *b);
+
+static void sort_small_jobs(void *context, size_t thread_index);
+
+static bool sort_large_job(
+        struct batch_job const *job, uint64_t input_size,
+        struct arena *arena, struct thread_pool *pool, size_t thread_share, size_t max_files);
+
+static bool sort_with_runs(struct batch_job const *job, struct arena *arena, size_t max_files);
+
+
+/*
+ * Reads a job file, which lists a job per line: the file to sort and the file to write the sorted values to, separated
+ * by whitespace. Blank lines and lines that start with '#' are skipped. No two jobs may write the same output file,
+ * since each job's runs are named after its output.
+ *
+ * Returns: The jobs, to be freed with batch_free_jobs(), with their number stored in num_jobs. NULL if an error occurs
+ *          or if the file lists no jobs.
+ */
+struct batch_job *batch_read_jobs(char const *filename, size_t *num_jobs)
+{
+    assert(filename);
+    assert(num_jobs);
+
+    *num_jobs = 0;
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        fprintf(stderr, "ERROR: unable to open job file %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
+
+    struct batch_job *jobs = NULL;
+    size_t capacity = 0;
+    bool success = true;
+    char line[(2 * PATH_MAX) + 2] = {0};
+    for (size_t line_number = 1; success && fgets(line, sizeof(line), file); line_number++) {
+        if (!strchr(line, '\n') && !feof(file)) {
+            fprintf(stderr, "ERROR: %s:%lu: line is too long\n", filename, line_number);
+            success = false;
+            break;
+        }
+        char *save = NULL;
+        char const *input_filename = strtok_r(line, JOB_SEPARATORS, &save);
+        if (!input_filename || (input_filename[0] == '#')) {
+            continue;
+        }
+        char const *output_filename = strtok_r(NULL, JOB_SEPARATORS, &save);
+        if (!output_filename || strtok_r(NULL, JOB_SEPARATORS, &save)) {
+            fprintf(stderr, "ERROR: %s:%lu: expected an input and an output file\n", filename, line_number);
+            success = false;
+        } else {
+            success = add_job(&jobs, num_jobs, &capacity, input_filename, output_filename);
+        }
+    }
+    if (success && ferror(file)) {
+        fprintf(stderr, "ERROR: unable to read job file %s\n", filename);
+        success = false;
+    }
+    fclose(file);
+
+    if (success && (*num_jobs == 0)) {
+        fprintf(stderr, "ERROR: job file %s lists no jobs\n", filename);
+        success = false;
+    }
+    for (size_t i = 0; success && (i < *num_jobs); i++) {
+        for (size_t j = i + 1; success && (j < *num_jobs); j++) {
+            if (strcmp(jobs[i].output_filename, jobs[j].output_filename) == 0) {
+                fprintf(stderr, "ERROR: more than one job writes %s\n", jobs[i].output_filename);
+                success = false;
+            }
+        }
+    }
+    if (!success) {
+        batch_free_jobs(jobs, *num_jobs);
+        *num_jobs = 0;
+        return NULL;
+    }
+    return jobs;
+}
+
+void batch_free_jobs(struct batch_job *jobs, size_t num_jobs)
+{
+    if (jobs) {
+        for (size_t i = 0; i < num_jobs; i++) {
+            free(jobs[i].input_filename);
+            free(jobs[i].output_filename);
+        }
+        free(jobs);
+    }
+}
+
+/*
+ * Sorts every job's input into its output within one arena and one pool of threads, so that memory is mapped and
+ * threads are started once for the whole batch rather than once per file.
+ *
+ * A job is small if its input fits in a thread's share of the arena. Each thread is given an arena of its share (see
+ * arena_new_within()), and the threads take the small jobs, largest first, and sort each one in a single run. Many
+ * small files are thus sorted at once. The large jobs are then sorted one after another with the whole arena and all
+ * of the threads, by partitioning (see partition.h), or with runs and merges in the whole arena if they have too many
+ * buckets to partition.
+ *
+ * A job that fails doesn't stop the others. stats is filled in either way.
+ *
+ * Returns: true if every job succeeds, false otherwise.
+ */
+bool batch_run(
+        struct batch_job const *jobs, size_t num_jobs,
+        struct arena *arena, struct thread_pool *pool, size_t max_files,
+        struct batch_stats *stats)
+{
+    assert(jobs);
+    assert(arena);
+    assert(pool);
+    assert(stats);
+
+    memset(stats, 0, sizeof(*stats));
+
+    // The merge kernel is chosen the first time it's asked for. Choose it now, before the threads would race to.
+    merge_kernel_get_active();
+
+    struct job_size *sizes = (struct job_size *) malloc(num_jobs * sizeof(struct job_size));
+    if (!sizes) {
+        fprintf(stderr, "ERROR: unable to allocate job table\n");
+        stats->num_failed = num_jobs;
+        return false;
+    }
+
+    // Split the jobs by size. The small ones go to the front, and the large ones to the back in their listed order.
+    size_t const num_threads = thread_pool_get_num_threads(pool);
+    size_t const thread_share = (arena_available(arena, ARENA_PAGE_ALIGNMENT) / num_threads) &
+                                ~(ARENA_PAGE_ALIGNMENT - 1);
+    size_t num_large = 0;
+    for (size_t i = 0; i < num_jobs; i++) {
+        struct stat input_status = {0};
+        if (stat(jobs[i].input_filename, &input_status) != 0) {
+            fprintf(stderr, "ERROR: unable to read %s: %s\n", jobs[i].input_filename, strerror(errno));
+            stats->num_failed++;
+            continue;
+        }
+        struct job_size const size = {.job = i, .size = (uint64_t) input_status.st_size};
+        if ((thread_share > 0) && (size.size <= thread_share)) {
+            sizes[stats->num_small++] = size;
+        } else {
+            num_large++;
+            sizes[num_jobs - num_large] = size;
+        }
+    }
+    stats->num_large = num_large;
+
+    // Sort the small jobs in parallel, each thread in its own part of the arena.
+    if (stats->num_small > 0) {
+        qsort(sizes, stats->num_small, sizeof(struct job_size), compare_job_sizes_descending);
+
+        struct batch_context batch = {0};
+        batch.jobs = jobs;
+        batch.max_files = max_files;
+        batch.small_jobs = sizes;
+        batch.num_small = stats->num_small;
+        atomic_init(&batch.next_job, 0);
+        atomic_init(&batch.num_failed, 0);
+
+        size_t const mark = arena_mark(arena);
+        batch.arenas = (struct arena **) calloc(num_threads, sizeof(struct arena *));
+        bool arenas_created = (batch.arenas != NULL);
+        for (size_t i = 0; arenas_created && (i < num_threads); i++) {
+            batch.arenas[i] = arena_new_within(arena, thread_share);
+            arenas_created = (batch.arenas[i] != NULL);
+        }
+        if (arenas_created) {
+            thread_pool_run(pool, sort_small_jobs, &batch);
+            stats->num_failed += atomic_load(&batch.num_failed);
+        } else {
+            fprintf(stderr, "ERROR: unable to share working memory between threads\n");
+            stats->num_failed += stats->num_small;
+        }
+        for (size_t i = 0; batch.arenas && (i < num_threads); i++) {
+            arena_delete(batch.arenas[i]);
+        }
+        free(batch.arenas);
+        arena_release(arena, mark);
+    }
+
+    // Then sort the large jobs one at a time with everything.
+    for (size_t i = num_jobs; i > num_jobs - num_large; i--) {
+        struct job_size const *size = &sizes[i - 1];
+        if (!sort_large_job(&jobs[size->job], size->size, arena, pool, thread_share, max_files)) {
+            stats->num_failed++;
+        }
+    }
+
+    free(sizes);
+    return stats->num_failed == 0;
+}
+
+static bool add_job(
+        struct batch_job **jobs, size_t *num_jobs, size_t *capacity,
+        char const *input_filename, char const *output_filename)
+{
+    if (*num_jobs == *capacity) {
+        size_t const new_capacity = (*capacity > 0) ? (*capacity * 2) : 16;
+        struct batch_job *new_jobs = (struct batch_job *) realloc(*jobs, new_capacity * sizeof(struct batch_job));
+        if (!new_jobs) {
+            fprintf(stderr, "ERROR: unable to allocate job table\n");
+            return false;
+        }
+        *jobs = new_jobs;
+        *capacity = new_capacity;
+    }
+    struct batch_job *job = &(*jobs)[*num_jobs];
+    job->input_filename = strdup(input_filename);
+    job->output_filename = strdup(output_filename);
+    (*num_jobs)++;
+    if (!job->input_filename || !job->output_filename) {
+        fprintf(stderr, "ERROR: unable to allocate job table\n");
+        return false;
+    }
+    return true;
+}
+
+static int compare_job_sizes_descending(void const *a, void const *b)
+{
+    uint64_t const size_a = ((struct job_size const *) a)->size;
+    uint64_t const size_b = ((struct job_size const *) b)->size;
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+/*
+ * Runs on every thread in the pool. Each thread takes the next small job until there are none left, and sorts it in
+ * its own arena.
+ */
+static void sort_small_jobs(void *context, size_t thread_index)
+{
+    struct batch_context *batch = (struct batch_context *) context;
+    struct arena *arena = batch->arenas[thread_index];
+    while (true) {
+        size_t const i = atomic_fetch_add(&batch->next_job, 1);
+        if (i >= batch->num_small) {
+            return;
+        }
+        if (!sort_with_runs(&batch->jobs[batch->small_jobs[i].job], arena, batch->max_files)) {
+            atomic_fetch_add(&batch->num_failed, 1);
+        }
+    }
+}
+
+/*
+ * Sorts a job that's too big for a thread's share of the arena. Partitioning sorts its buckets with every thread, but
+ * it holds a file open per bucket. A job with more buckets than that allows is sorted with runs and merges instead.
+ */
+static bool sort_large_job(
+        struct batch_job const *job, uint64_t input_size,
+        struct arena *arena, struct thread_pool *pool, size_t thread_share, size_t max_files)
+{
+    // Partitioning plans its buckets to fill part of a thread's share, so allow for twice as many as fill it.
+    bool const partition = (thread_share > 0) && ((input_size / thread_share) < plan_get_open_file_limit() / 2);
+    if (!partition) {
+        return sort_with_runs(job, arena, max_files);
+    }
+
+    FILE *input_file = fopen(job->input_filename, "rb");
+    if (!input_file) {
+        fprintf(stderr, "ERROR: unable to open %s: %s\n", job->input_filename, strerror(errno));
+        return false;
+    }
+    setvbuf(input_file, NULL, _IONBF, 0);
+    size_t num_buckets = 0;
+    bool const sorted = partition_sort(input_file, job->output_filename, arena, pool, NULL, &num_buckets);
+    fclose(input_file);
+    if (!sorted) {
+        fprintf(stderr, "ERROR: unable to sort %s into %s\n", job->input_filename, job->output_filename);
+    }
+    return sorted;
+}
+
+/*
+ * Sorts a job with runs and merges in the arena, the way a single sort does, and gives the arena back afterwards.
+ */
+static bool sort_with_runs(struct batch_job const *job, struct arena *arena, size_t max_files)
+{
+    struct sort_plan plan = {0};
+    struct stat input_status = {0};
+    if (stat(job->input_filename, &input_status) != 0) {
+        fprintf(stderr, "ERROR: unable to read %s: %s\n", job->input_filename, strerror(errno));
+        return false;
+    }
+    if (!plan_sort(&plan, arena_available(arena, ARENA_PAGE_ALIGNMENT), 0, (uint64_t) input_status.st_size,
+                   max_files)) {
+        fprintf(stderr, "ERROR: working memory is too small to sort %s\n", job->input_filename);
+        return false;
+    }
+
+    FILE *input_file = fopen(job->input_filename, "rb");
+    if (!input_file) {
+        fprintf(stderr, "ERROR: unable to open %s: %s\n", job->input_filename, strerror(errno));
+        return false;
+    }
+    setvbuf(input_file, NULL, _IONBF, 0);
+    size_t const mark = arena_mark(arena);
+    size_t const num_runs = create_runs(input_file, job->output_filename, arena, plan.run_size, NULL, NULL);
+    fclose(input_file);
+    size_t generations = 0;
+    bool const sorted = (num_runs > 0) &&
+                        merge_runs(job->output_filename, num_runs, arena, plan.fan_in, plan.block_size, 0, false,
+                                   NULL, NULL, &generations);
+    arena_release(arena, mark);
+    if (!sorted) {
+        fprintf(stderr, "ERROR: unable to sort %s into %s\n", job->input_filename, job->output_filename);
+    }
+    return sorted;
+}
@@ -0,0 +1,29 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "arena.h"
+#include "thread_pool.h"
+
+// A file to sort and where to write it, as listed in a job file.
+struct batch_job {
+    char *input_filename;
+    char *output_filename;
+};
+
+// How a batch's jobs were run.
+struct batch_stats {
+    size_t num_small;
+    size_t num_large;
+    size_t num_failed;
+};
+
+struct batch_job *batch_read_jobs(char const *filename, size_t *num_jobs);
+void batch_free_jobs(struct batch_job *jobs, size_t num_jobs);
+bool batch_run(
+        struct batch_job const *jobs, size_t num_jobs,
+        struct arena *arena, struct thread_pool *pool, size_t max_files,
+        struct batch_stats *stats);
+
+#endif // BATCH_H
@@ -1,154 +1,707 @@
+// fallocate() is a GNU extension.
+#define _GNU_SOURCE
+
 #include "bigsort.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include "arena.h"
+#include "fence_index.h"
+#include "manifest.h"
 #include "merge.h"
+#include "progress.h"
 #include "run.h"
+#include "spill.h"
+
+static bool get_file_size(FILE *input_file, uint64_t *size, bool *size_known);
+
+static size_t count_merge_generations(size_t num_runs, size_t max_files_per_merge, size_t max_remaining_runs);
+
+static size_t create_runs_with_context(
+        struct run_context *run, char const *output_filename, size_t first_run, FILE *consumed_input,
+        uint64_t index_interval, struct spill_store *spill, struct manifest *manifest, struct progress *progress);
+
+static bool consume_input_range(FILE *input_file, uint64_t offset, uint64_t size);
+
+static void report_consumed_runs(char const *output_filename, size_t num_consumed_runs, uint64_t consumed_size);
 
-static bool check_file_size(FILE *input_file);
+static bool reduce_runs_of_records(
+        char const *base_filename, size_t num_runs, size_t record_size,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, size_t max_remaining_runs, uint64_t limit,
+        bool keep_runs, struct manifest *manifest, struct progress *progress, size_t *generation,
+        size_t *remaining_runs);
 
-static size_t create_runs_with_context(struct run_context *run, char const *output_filename);
+static struct merge_context *new_merge_context(
+        struct arena *arena, size_t block_size, size_t max_files_per_merge, uint64_t limit);
 
-static size_t merge_runs_with_context(
-        struct merge_context *merge,
+static bool merge_runs_with_context(
+        struct merge_context *merge, struct spill_store *spill,
         char const *output_filename, size_t num_runs,
-        size_t max_files_per_merge);
+        size_t max_files_per_merge, size_t max_remaining_runs, bool keep_runs,
+        struct manifest *manifest, struct progress *progress, size_t *generation, size_t *remaining_runs);
 
 static bool merge_single_run(
-        char const *output_filename,
+        struct spill_store *spill, char const *output_filename,
         size_t run_generation, size_t run_number,
-        size_t new_generation, size_t new_run_number);
+        size_t new_generation, size_t new_run_number,
+        bool resumable);
 
 static bool merge_multiple_runs(
-        struct merge_context *merge, char const *output_filename,
+        struct merge_context *merge, struct spill_store *spill, char const *output_filename,
+        size_t run_generation, size_t base_run_number, size_t num_runs,
+        size_t new_generation, size_t new_run_number, bool keep_runs,
+        struct manifest *manifest, struct progress *progress);
+
+static void keep_failed_merge(
+        struct merge_context const *merge, char const *output_filename,
         size_t run_generation, size_t base_run_number, size_t num_runs,
         size_t new_generation, size_t new_run_number);
 
+static bool merge_runs_to_stream_with_file(
+        char const *base_filename, size_t num_runs, char const *sorted_filename,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, uint64_t limit, bool validate,
+        struct spill_store *spill, FILE *output_file, struct progress *progress, size_t *generations);
+
+static bool stream_final_runs(
+        struct merge_context *merge, struct spill_store *spill, char const *base_filename,
+        size_t run_generation, size_t num_runs,
+        FILE *output_file, struct progress *progress);
+
+static bool merge_spilled_runs(
+        struct merge_context *merge, struct spill_store *spill,
+        size_t run_generation, size_t base_run_number, size_t num_runs,
+        FILE *output_file, struct progress *progress);
+
+static FILE *create_run_file(
+        struct spill_store *spill, char const *base_filename, size_t run_generation, size_t run_number);
+
+static bool sync_run_file(struct spill_store *spill, FILE *run_file);
+
+static bool finish_run_file(struct spill_store *spill, FILE *run_file);
+
 static bool open_run_files(
         FILE **run_files, size_t num_runs,
-        char const *base_filename, size_t base_run_number, size_t run_generation);
+        char const *base_filename, size_t base_run_number, size_t run_generation, bool release);
 
-static bool close_and_remove_run_files(
-        FILE **run_files, size_t num_runs,
-        char const *base_filename, size_t base_run_number, size_t run_generation);
+static FILE *open_run_file(char const *filename, bool release);
+
+static void close_run_files(FILE **run_files, size_t num_runs);
+
+static void remove_run_files(
+        struct spill_store *spill,
+        char const *base_filename, size_t base_run_number, size_t num_runs, size_t run_generation);
+
+static void remove_run_indexes(char const *base_filename, size_t num_runs);
+
+static void remove_all_run_files(char const *base_filename, size_t num_runs);
 
 
-size_t create_runs(FILE *input_file, char const *output_filename, void *run_data, size_t run_data_size)
+size_t create_runs(
+        FILE *input_file, char const *output_filename, struct arena *arena, size_t run_size,
+        struct run_options const *options, struct progress *progress)
 {
-    if (!check_file_size(input_file)) {
+    assert(arena);
+
+    struct run_options const plain_runs = {0};
+    if (!options) {
+        options = &plain_runs;
+    }
+    struct manifest *manifest = options->manifest;
+    assert(!options->consume_input || (!manifest && !options->spill));
+    assert(!options->spill || !manifest);
+    assert(!options->index_interval || (!options->spill && !manifest));
+
+    // The input may be a pipe, in which case its size isn't known until it has all been read. Progress then learns it
+    // as the runs are created.
+    uint64_t input_size = 0;
+    bool size_known = false;
+    if (!get_file_size(input_file, &input_size, &size_known)) {
+        fprintf(stderr, "ERROR: unable to determine input file size: %s\n", strerror(errno));
+        return 0;
+    }
+    // Check that the file size is a multiple of 4. This bit magic checks that the lowest two bits are zero. If they
+    // are, then the file size is a multiple of 4. For a pipe, the run reader catches a trailing partial value instead.
+    if (size_known && ((input_size & 0x03) != 0)) {
         fprintf(stderr, "ERROR: input file's size must be a multiple of 4.\n");
         return 0;
     }
 
-    struct run_context *run = run_new(input_file, run_data, run_data_size);
+    // When resuming from a checkpoint, pick up after the last run that it recorded, if there's anything left to do.
+    size_t first_run = 0;
+    if (manifest) {
+        first_run = manifest_get_num_runs(manifest);
+        if (manifest_runs_complete(manifest)) {
+            progress_start(progress, input_size, size_known);
+            return first_run;
+        }
+        if (fseeko(input_file, (off_t) (first_run * run_size), SEEK_SET) != 0) {
+            fprintf(stderr, "ERROR: unable to seek to resume run creation: %s\n", strerror(errno));
+            return 0;
+        }
+    }
+
+    // Take the run buffer from the arena. It's page aligned so that reads land directly in it.
+    size_t const arena_mark_before_runs = arena_mark(arena);
+    void *run_data = arena_alloc(arena, run_size, ARENA_PAGE_ALIGNMENT);
+    if (!run_data) {
+        fprintf(stderr, "ERROR: working memory is too small for the run size\n");
+        return 0;
+    }
+
+    struct run_context *run = run_new(input_file, run_data, run_size);
     if (!run) {
+        arena_release(arena, arena_mark_before_runs);
         fprintf(stderr, "ERROR: Failed to create run context\n");
         return 0;
     }
+    // Spare memory for a second run buffer lets the sort engine sort out of place.
+    uint32_t *scratch = NULL;
+    if (arena_available(arena, ARENA_PAGE_ALIGNMENT) >= run_size) {
+        scratch = (uint32_t *) arena_alloc(arena, run_size, ARENA_PAGE_ALIGNMENT);
+    }
+    run_set_sort_engine(run, sort_engine_get_default(), scratch);
+
+    // A limit that's at least a run's worth of values doesn't drop anything from a run.
+    if (options->limit < (uint64_t) (run_size / sizeof(uint32_t))) {
+        run_set_limit(run, (size_t) options->limit);
+    }
+
+    progress_start(progress, input_size, size_known);
 
-    size_t runs = create_runs_with_context(run, output_filename);
+    size_t runs = create_runs_with_context(
+            run, output_filename, first_run, options->consume_input ? input_file : NULL, options->index_interval,
+            options->spill, manifest, progress);
 
     run_delete(run);
+    arena_release(arena, arena_mark_before_runs);
     return runs;
 }
 
-size_t merge_runs(
+bool merge_runs(
         char const *output_filename, size_t num_runs,
-        void *merge_data, size_t merge_data_size, size_t open_file_limit)
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, uint64_t limit, bool keep_runs,
+        struct manifest *manifest, struct progress *progress, size_t *generations)
 {
-    // Create a new merge context
-    struct merge_context *merge = merge_new(merge_data, merge_data_size);
-    if (!merge) {
-        return 0;
+    assert(generations);
+
+    // Merge down to a single run.
+    size_t remaining_runs = 0;
+    if (!reduce_runs_of_records(
+            output_filename, num_runs, sizeof(uint32_t),
+            arena, max_files_per_merge, block_size, 1, limit,
+            keep_runs, manifest, progress, generations, &remaining_runs)) {
+        return false;
     }
 
-    // Given the data buffer we have to work with, determine the maximum number of files we can merge per pass.
-    // If this is larger than the caller-supplied limit, cap it at that limit.
-    size_t max_files_per_merge = merge_get_max_input_files(merge);
-    if (max_files_per_merge > open_file_limit) {
-        max_files_per_merge = open_file_limit;
+    // Just rename the final run file to the final output.
+    if (!merge_single_run(NULL, output_filename, *generations, 0, 0, 0, manifest != NULL)) {
+        fprintf(stderr, "ERROR: unable to rename final run to output file: %s\n", strerror(errno));
+        return false;
     }
+    progress_finish(progress);
+    return true;
+}
 
-    // Perform the merge
-    size_t generations = merge_runs_with_context(merge, output_filename, num_runs, max_files_per_merge);
+bool reduce_runs(
+        char const *base_filename, size_t num_runs,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, size_t max_remaining_runs, uint64_t limit,
+        struct manifest *manifest, struct progress *progress, size_t *generation, size_t *remaining_runs)
+{
+    return reduce_runs_of_records(
+            base_filename, num_runs, sizeof(uint32_t),
+            arena, max_files_per_merge, block_size, max_remaining_runs, limit,
+            false, manifest, progress, generation, remaining_runs);
+}
+
+bool reduce_record_runs(
+        char const *base_filename, size_t num_runs, size_t record_size,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, size_t max_remaining_runs,
+        struct progress *progress, size_t *generation, size_t *remaining_runs)
+{
+    return reduce_runs_of_records(
+            base_filename, num_runs, record_size,
+            arena, max_files_per_merge, block_size, max_remaining_runs, 0,
+            false, NULL, progress, generation, remaining_runs);
+}
+
+/*
+ * Gets the size of the input. Only regular files have a size that can be known before they're read. For anything else
+ * (pipes, terminals, sockets, streams without a file descriptor), size is set to zero and size_known to false.
+ */
+static bool get_file_size(FILE *input_file, uint64_t *size, bool *size_known)
+{
+    int const fd = fileno(input_file);
+    if (fd < 0) {
+        *size_known = false;
+        *size = 0;
+        return true;
+    }
+    struct stat file_status = {0};
+    if (fstat(fd, &file_status) != 0) {
+        return false;
+    }
+    *size_known = S_ISREG(file_status.st_mode);
+    *size = *size_known ? (uint64_t) file_status.st_size : 0;
+    return true;
+}
+
+bool merge_runs_to_stream(
+        char const *base_filename, size_t num_runs,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, uint64_t limit,
+        struct spill_store *spill, FILE *output_file, struct progress *progress, size_t *generations)
+{
+    return merge_runs_to_stream_with_file(
+            base_filename, num_runs, NULL, arena, max_files_per_merge, block_size, limit, false,
+            spill, output_file, progress, generations);
+}
+
+bool merge_runs_with_sorted_file(
+        char const *base_filename, size_t num_runs, char const *sorted_filename,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, uint64_t limit, bool validate,
+        FILE *output_file, struct progress *progress, size_t *generations)
+{
+    assert(sorted_filename);
+    return merge_runs_to_stream_with_file(
+            base_filename, num_runs, sorted_filename, arena, max_files_per_merge, block_size, limit, validate,
+            NULL, output_file, progress, generations);
+}
+
+bool merge_files(
+        char const *const *input_filenames, size_t num_inputs, char const *base_filename,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, uint64_t limit, bool validate,
+        FILE *output_file, struct progress *progress, size_t *generations)
+{
+    assert(input_filenames);
+    assert(num_inputs > 0);
+    assert(arena);
+    assert(output_file);
+    assert(generations);
+
+    // Link each input in as a generation-0 run. Merging a run removes it, which only removes the link.
+    uint64_t total_size = 0;
+    char filename[PATH_MAX] = {0};
+    char target[PATH_MAX] = {0};
+    bool success = true;
+    size_t num_linked = 0;
+    for (; success && (num_linked < num_inputs); num_linked++) {
+        struct stat input_status = {0};
+        if ((stat(input_filenames[num_linked], &input_status) != 0) || !realpath(input_filenames[num_linked], target)) {
+            fprintf(stderr, "ERROR: unable to open input file %s: %s\n", input_filenames[num_linked], strerror(errno));
+            success = false;
+            break;
+        }
+        if ((input_status.st_size & 0x03) != 0) {
+            fprintf(stderr, "ERROR: input file %s's size must be a multiple of 4.\n", input_filenames[num_linked]);
+            success = false;
+            break;
+        }
+        total_size += (uint64_t) input_status.st_size;
+        snprintf(filename, sizeof(filename), "%s.0.%lu", base_filename, num_linked);
+        if (symlink(target, filename) != 0) {
+            fprintf(stderr, "ERROR: unable to link input file in as a run: %s\n", strerror(errno));
+            success = false;
+            break;
+        }
+    }
+    if (!success) {
+        remove_run_files(NULL, base_filename, 0, num_linked, 0);
+        return false;
+    }
+
+    size_t const arena_mark_before_merge = arena_mark(arena);
+    struct merge_context *merge = new_merge_context(arena, block_size, max_files_per_merge, limit);
+    if (!merge) {
+        arena_release(arena, arena_mark_before_merge);
+        remove_run_files(NULL, base_filename, 0, num_inputs, 0);
+        return false;
+    }
+    max_files_per_merge = merge_get_max_input_files(merge);
+    merge_set_validate_inputs(merge, validate);
+
+    // There's no run creation, so the merge generations are the only passes. The last one goes to the output, even if
+    // there's only a single input to copy out.
+    progress_skip_first_pass(progress);
+    progress_plan_merge(progress, count_merge_generations(num_inputs, max_files_per_merge, max_files_per_merge) + 1);
+    progress_start(progress, total_size, true);
+
+    size_t generation = 0;
+    size_t remaining_runs = 0;
+    success = merge_runs_with_context(
+            merge, NULL, base_filename, num_inputs, max_files_per_merge, max_files_per_merge, false,
+            NULL, progress, &generation, &remaining_runs);
+    if (success) {
+        progress_begin_generation(progress, generation + 1);
+        success = stream_final_runs(merge, NULL, base_filename, generation, remaining_runs, output_file, progress);
+    }
+    if (success) {
+        *generations = generation + 1;
+        progress_finish(progress);
+    } else {
+        // Whatever is left of the links to the inputs and of the runs merged from them, including a partly written one.
+        remove_all_run_files(base_filename, num_inputs);
+    }
 
-    // Delete the merge context
     merge_delete(merge);
+    arena_release(arena, arena_mark_before_merge);
+    return success;
+}
 
-    // Return the number of generations that the merge took.
-    return generations;
+bool select_smallest(
+        FILE *input_file, FILE *output_file, struct arena *arena, size_t buffer_size, uint64_t limit,
+        struct progress *progress)
+{
+    assert(input_file);
+    assert(output_file);
+    assert(arena);
+
+    size_t const capacity = buffer_size / sizeof(uint32_t);
+    if ((limit == 0) || (limit > (uint64_t) (capacity / 2))) {
+        fprintf(stderr, "ERROR: limit is too large to select in memory\n");
+        return false;
+    }
+    size_t const keep = (size_t) limit;
+
+    uint64_t input_size = 0;
+    bool size_known = false;
+    if (!get_file_size(input_file, &input_size, &size_known)) {
+        fprintf(stderr, "ERROR: unable to determine input file size: %s\n", strerror(errno));
+        return false;
+    }
+    if (size_known && ((input_size & 0x03) != 0)) {
+        fprintf(stderr, "ERROR: input file's size must be a multiple of 4.\n");
+        return false;
+    }
+
+    size_t const arena_mark_before_select = arena_mark(arena);
+    uint32_t *values = (uint32_t *) arena_alloc(arena, capacity * sizeof(uint32_t), ARENA_PAGE_ALIGNMENT);
+    if (!values) {
+        fprintf(stderr, "ERROR: working memory is too small for the run size\n");
+        return false;
+    }
+
+    progress_start(progress, input_size, size_known);
+
+    // Fill the buffer behind the values kept so far, and cut it back down to the smallest ones whenever it's full. A
+    // short read means the input is exhausted.
+    size_t count = 0;
+    bool success = true;
+    for (;;) {
+        size_t const bytes_wanted = (capacity - count) * sizeof(uint32_t);
+        size_t const num_bytes = fread(values + count, 1, bytes_wanted, input_file);
+        if (ferror(input_file)) {
+            fprintf(stderr, "ERROR: unable to read input file: %s\n", strerror(errno));
+            success = false;
+            break;
+        }
+        if ((num_bytes % sizeof(uint32_t)) != 0) {
+            fprintf(stderr, "ERROR: input size must be a multiple of 4.\n");
+            success = false;
+            break;
+        }
+        progress_update(progress, num_bytes);
+        count += num_bytes / sizeof(uint32_t);
+        if (count > keep) {
+            run_select(values, count, keep);
+            count = keep;
+        }
+        if (num_bytes < bytes_wanted) {
+            break;
+        }
+    }
+
+    if (success) {
+        run_sort(values, count);
+        fwrite(values, sizeof(uint32_t), count, output_file);
+        if (ferror(output_file) || (fflush(output_file) != 0)) {
+            fprintf(stderr, "ERROR: unable to write output: %s\n", strerror(errno));
+            success = false;
+        }
+    }
+    if (success) {
+        progress_finish(progress);
+    }
+
+    arena_release(arena, arena_mark_before_select);
+    return success;
 }
 
-static bool check_file_size(FILE *input_file) {
-    struct stat file_status = {0};
-    fstat(fileno(input_file), &file_status);
-    // Check that the file size is a multiple of 4. This bit magic checks that the lowest two bits are zero. If they
-    // are, then the file size is a multiple of 4.
-    return ((file_status.st_size & 0x03) == 0);
+/*
+ * This determines how many generations it takes to merge num_runs runs down to max_remaining_runs when up to
+ * max_files_per_merge runs are merged at a time. This mirrors the loop in merge_runs_with_context().
+ */
+static size_t count_merge_generations(size_t num_runs, size_t max_files_per_merge, size_t max_remaining_runs)
+{
+    size_t generations = 0;
+    if (max_files_per_merge < 2) {
+        return generations;
+    }
+    while (num_runs > max_remaining_runs) {
+        num_runs = (num_runs + max_files_per_merge - 1) / max_files_per_merge;
+        generations++;
+    }
+    return generations;
 }
 
 /*
- * This creates the initial sorted runs given an acquired run context.
+ * This creates the initial sorted runs given an acquired run context, numbering them from first_run. With a manifest,
+ * each run is synced to disk and then recorded before the next one is started. With a spill store, the runs are
+ * created in it. If creating a run fails, the runs that hold input that has been consumed are kept, and the rest are
+ * removed.
  */
-static size_t create_runs_with_context(struct run_context *run, char const *output_filename)
+static size_t create_runs_with_context(
+        struct run_context *run, char const *output_filename, size_t first_run, FILE *consumed_input,
+        uint64_t index_interval, struct spill_store *spill, struct manifest *manifest, struct progress *progress)
 {
-    size_t num_runs = 0;
+    size_t num_runs = first_run;
+    size_t num_consumed_runs = 0;
+    uint64_t consumed_size = 0;
     while (!run_finished(run)) {
-        // Format the next run filename using the output filename as a base. We'll use the format:
-        // "[output_filename].[generation_number].[run_number]"
-        // The generation number starts at zero for the initial runs. This will increment later
-        // during the merging phase.
-        char run_filename[PATH_MAX] = {0};
-        snprintf(run_filename, sizeof(run_filename), "%s.0.%lu", output_filename, num_runs);
-
-        // Create and open the run file
-        FILE *run_file = fopen(run_filename, "wb");
+        // Create and open the run file. The generation number starts at zero for the initial runs. This will increment
+        // later during the merging phase.
+        FILE *run_file = create_run_file(spill, output_filename, 0, num_runs);
         if (!run_file) {
             fprintf(stderr, "ERROR: unable to create run file: %s\n", strerror(errno));
+            report_consumed_runs(output_filename, num_consumed_runs, consumed_size);
             return 0;
         }
 
+        // Index the run as it's written, if asked to.
+        struct fence_index_writer *index = NULL;
+        if (index_interval) {
+            char index_filename[PATH_MAX] = {0};
+            snprintf(index_filename, sizeof(index_filename), "%s.idx.0.%lu", output_filename, num_runs);
+            index = fence_index_writer_new(index_filename, index_interval, run_file);
+        }
+
         // Generate the run
-        bool success = run_create_run(run, run_file);
+        uint64_t const bytes_before = run_bytes_read(run);
+        bool success = (!index_interval || index) &&
+                       run_create_run(run, index ? fence_index_writer_get_stream(index) : run_file);
+        uint64_t const run_bytes = run_bytes_read(run) - bytes_before;
+        progress_update(progress, run_bytes);
+
+        // An empty run after the first is dropped below, so its index is left unfinished, which removes it.
+        if (index) {
+            if (success && ((run_bytes > 0) || (num_runs == 0))) {
+                success = fence_index_writer_finish(index);
+            }
+            fence_index_writer_delete(index);
+        }
+
+        // A run must be on disk before the manifest says it is, or before the input that it came from is gone.
+        if (success && (manifest || consumed_input) && (run_bytes > 0) && !sync_run_file(spill, run_file)) {
+            success = false;
+        }
 
         // Close the run file
-        fclose(run_file);
+        success = finish_run_file(spill, run_file) && success;
+
+        if (success && manifest && (run_bytes > 0)) {
+            success = manifest_add_run(manifest);
+        }
+        if (success && consumed_input && (run_bytes > 0)) {
+            if (consume_input_range(consumed_input, bytes_before, run_bytes)) {
+                num_consumed_runs = num_runs + 1;
+                consumed_size = bytes_before + run_bytes;
+            } else {
+                fprintf(stderr, "WARNING: unable to release sorted input, so the rest of it is kept: %s\n",
+                        strerror(errno));
+                consumed_input = NULL;
+            }
+        }
 
         if (!success) {
             fprintf(stderr, "ERROR: unable to create run.\n");
+            // Don't leave the runs created so far behind, unless they've been checkpointed for a later resume, or
+            // they hold input that's gone from the input file.
+            size_t const first_removed_run = manifest ? num_runs : num_consumed_runs;
+            remove_run_files(spill, output_filename, first_removed_run, num_runs + 1 - first_removed_run, 0);
+            if (index_interval) {
+                remove_run_indexes(output_filename, num_runs + 1);
+            }
+            report_consumed_runs(output_filename, num_consumed_runs, consumed_size);
             return 0;
         }
 
+        // When the input is an exact multiple of the run size, the end of the file is only discovered by a read that
+        // comes back empty. Don't keep that empty run around for the merge to process. An entirely empty input still
+        // gets a single (empty) run.
+        if ((run_bytes == 0) && (num_runs > 0)) {
+            remove_run_files(spill, output_filename, num_runs, 1, 0);
+            break;
+        }
+
         // Update run counter
         num_runs++;
     }
+    if (manifest && !manifest_finish_runs(manifest)) {
+        return 0;
+    }
+    // All of the input is in the runs now, and what's left of the input file is holes.
+    if (consumed_input && (ftruncate(fileno(consumed_input), 0) != 0)) {
+        fprintf(stderr, "WARNING: unable to truncate the consumed input: %s\n", strerror(errno));
+    }
     return num_runs;
 }
 
-static size_t merge_runs_with_context(
-        struct merge_context *merge,
+/*
+ * Punches a range of the input file that has been sorted into a run out of the file, giving its blocks back to the
+ * file system.
+ */
+static bool consume_input_range(FILE *input_file, uint64_t offset, uint64_t size)
+{
+    return fallocate(fileno(input_file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) offset, (off_t) size) == 0;
+}
+
+/*
+ * Says where the input is after creating runs failed part way through consuming it: the runs hold its start, and the
+ * input file still holds the rest.
+ */
+static void report_consumed_runs(char const *output_filename, size_t num_consumed_runs, uint64_t consumed_size)
+{
+    if (num_consumed_runs > 0) {
+        fprintf(stderr, "ERROR: the input's first %lu bytes were consumed into runs %s.0.0 to %s.0.%lu, which are "
+                        "kept. The rest of the input is still in the input file from byte %lu on.\n",
+                consumed_size, output_filename, output_filename, num_consumed_runs - 1, consumed_size);
+    }
+}
+
+/*
+ * Does the work of reduce_runs() for runs of records of record_size bytes (see merge_set_record_size()).
+ */
+static bool reduce_runs_of_records(
+        char const *base_filename, size_t num_runs, size_t record_size,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, size_t max_remaining_runs, uint64_t limit,
+        bool keep_runs, struct manifest *manifest, struct progress *progress, size_t *generation,
+        size_t *remaining_runs)
+{
+    assert(arena);
+    assert(generation);
+    assert(remaining_runs);
+    assert(max_remaining_runs >= 1);
+
+    // The merge groups that a checkpoint records only line up with the runs on disk for the same fan-in.
+    size_t const checkpoint_fan_in = manifest ? manifest_get_fan_in(manifest) : 0;
+    if (checkpoint_fan_in != 0) {
+        max_files_per_merge = checkpoint_fan_in;
+    }
+
+    // Create a new merge context. It takes its heap and blocks from the arena, fitting as many inputs as it can up to
+    // the caller-supplied limit.
+    size_t const arena_mark_before_merge = arena_mark(arena);
+    struct merge_context *merge = new_merge_context(arena, block_size, max_files_per_merge, limit);
+    if (merge && !merge_set_record_size(merge, record_size)) {
+        fprintf(stderr, "ERROR: unable to merge records of %lu bytes with the block size.\n", record_size);
+        merge_delete(merge);
+        merge = NULL;
+    }
+    if (!merge) {
+        arena_release(arena, arena_mark_before_merge);
+        return false;
+    }
+    max_files_per_merge = merge_get_max_input_files(merge);
+    if (manifest) {
+        bool checkpointed = false;
+        if (checkpoint_fan_in == 0) {
+            checkpointed = manifest_set_fan_in(manifest, max_files_per_merge);
+        } else if (checkpoint_fan_in == max_files_per_merge) {
+            checkpointed = true;
+        } else {
+            fprintf(stderr, "ERROR: working memory is too small to resume the merge with %lu files per merge.\n",
+                    checkpoint_fan_in);
+        }
+        if (!checkpointed) {
+            merge_delete(merge);
+            arena_release(arena, arena_mark_before_merge);
+            return false;
+        }
+    }
+
+    // Now that the fan-in is known, so is the number of passes the merge will make over the data.
+    progress_plan_merge(progress, count_merge_generations(num_runs, max_files_per_merge, max_remaining_runs));
+
+    // Perform the merge
+    bool success = merge_runs_with_context(
+            merge, NULL, base_filename, num_runs, max_files_per_merge, max_remaining_runs, keep_runs,
+            manifest, progress, generation, remaining_runs);
+
+    // Delete the merge context and give its memory back to the arena
+    merge_delete(merge);
+    arena_release(arena, arena_mark_before_merge);
+
+    return success;
+}
+
+/*
+ * Creates a merge context that takes its heap and blocks from the arena. On failure, the caller is responsible for
+ * releasing anything that was taken from the arena. With a limit, every merge stops after that many values, since no
+ * merged run ever needs more than the final output does.
+ */
+static struct merge_context *new_merge_context(
+        struct arena *arena, size_t block_size, size_t max_files_per_merge, uint64_t limit)
+{
+    struct merge_context *merge = merge_new(arena, block_size, max_files_per_merge);
+    if (!merge) {
+        fprintf(stderr, "ERROR: working memory is too small to merge with the block size.\n");
+        return NULL;
+    }
+
+    // Given the memory and block size we have to work with, determine the maximum number of files we can merge per
+    // pass.
+    if (merge_get_max_input_files(merge) < 2) {
+        fprintf(stderr, "ERROR: merge memory is too small to merge two runs.\n");
+        merge_delete(merge);
+        return NULL;
+    }
+    merge_set_output_limit(merge, limit);
+    return merge;
+}
+
+static bool merge_runs_with_context(
+        struct merge_context *merge, struct spill_store *spill,
         char const *output_filename, size_t num_runs,
-        size_t max_files_per_merge)
+        size_t max_files_per_merge, size_t max_remaining_runs, bool keep_runs,
+        struct manifest *manifest, struct progress *progress, size_t *generation, size_t *remaining_runs)
 {
-    size_t generation = 0; // Generation counter
+    size_t current_generation = 0; // Generation counter
     size_t num_runs_in_generation = num_runs;
 
-    // Keep merging runs into new generations of longer runs until there are no more runs to merge.
-    while (num_runs_in_generation >= 2) {
-        size_t const output_generation = generation + 1;
+    // When resuming, the groups that the checkpoint recorded as complete are skipped. The sequence of groups only
+    // depends on the number of runs and the fan-in, so the count is enough to know which ones those are.
+    size_t groups_to_skip = manifest ? manifest_get_num_groups(manifest) : 0;
+
+    // Keep merging runs into new generations of longer runs until few enough runs remain.
+    while (num_runs_in_generation > max_remaining_runs) {
+        size_t const output_generation = current_generation + 1;
         size_t input_current_run = 0;
         size_t num_runs_in_output_generation = 0;
 
+        progress_begin_generation(progress, output_generation);
+
         // Merge all runs in the current generation.
         while (input_current_run < num_runs_in_generation) {
             size_t num_runs_remaining = num_runs_in_generation - input_current_run;
-            if (num_runs_remaining >= 2) {
+            if (groups_to_skip > 0) {
+                // This group was completed before. If the process died right after recording it, its inputs may still
+                // be around.
+                size_t num_runs_to_skip = max_files_per_merge;
+                if (num_runs_to_skip > num_runs_remaining) {
+                    num_runs_to_skip = num_runs_remaining;
+                }
+                if (num_runs_to_skip >= 2) {
+                    remove_run_files(spill, output_filename, input_current_run, num_runs_to_skip, current_generation);
+                }
+                input_current_run += num_runs_to_skip;
+                groups_to_skip--;
+            } else if (num_runs_remaining >= 2) {
                 // If there are more than two run files remaining, merge as many as we can.
                 size_t num_runs_to_merge = max_files_per_merge;
                 if (num_runs_to_merge > num_runs_remaining) {
@@ -157,10 +710,11 @@ static size_t merge_runs_with_context(
 
                 // Merge the runs
                 if (!merge_multiple_runs(
-                        merge, output_filename,
-                        generation, input_current_run, num_runs_to_merge,
-                        output_generation, num_runs_in_output_generation)) {
-                    return 0;
+                        merge, spill, output_filename,
+                        current_generation, input_current_run, num_runs_to_merge,
+                        output_generation, num_runs_in_output_generation, keep_runs,
+                        manifest, progress)) {
+                    return false;
                 }
                 // Update the run counter to reflect that we've merged multiple runs
                 input_current_run += num_runs_to_merge;
@@ -168,10 +722,14 @@ static size_t merge_runs_with_context(
                 // If there's only one run left in the current generation, merge it with itself. This just
                 // renames the file so it becomes a run in the next generation.
                 if (!merge_single_run(
-                        output_filename,
-                        generation, input_current_run,
-                        output_generation, num_runs_in_output_generation)) {
-                    return 0;
+                        spill, output_filename,
+                        current_generation, input_current_run,
+                        output_generation, num_runs_in_output_generation,
+                        manifest != NULL)) {
+                    return false;
+                }
+                if (manifest && !manifest_add_group(manifest, output_generation, num_runs_in_output_generation)) {
+                    return false;
                 }
                 // Update the run counter to reflect that we've merged one run
                 input_current_run++;
@@ -181,26 +739,33 @@ static size_t merge_runs_with_context(
         }
 
         // Update the current generation for the next loop iteration.
-        generation = output_generation;
+        current_generation = output_generation;
         num_runs_in_generation = num_runs_in_output_generation;
     }
 
-    // We've now merged down to a single run. Just rename the run file to the final output.
-    if (!merge_single_run(output_filename, generation, 0, 0, 0)) {
-        return 0;
-    }
-    return generation;
+    *generation = current_generation;
+    *remaining_runs = num_runs_in_generation;
+    return true;
 }
 
 /*
  * This "merges" a single sorted run. It does so by moving the current generation run file to the next generation. This
  * is simply a rename operation that updates the filename to reflect the new generation.
+ *
+ * If resumable is set, a rename that already happened counts as a success. A checkpoint only records the rename after
+ * it's done, so a resumed sort may repeat one. A run in a spill store is renamed in the store's extent table.
  */
 static bool merge_single_run(
-        char const *output_filename,
+        struct spill_store *spill, char const *output_filename,
         size_t run_generation, size_t run_number,
-        size_t new_generation, size_t new_run_number)
+        size_t new_generation, size_t new_run_number,
+        bool resumable)
 {
+    if (spill) {
+        assert(new_generation != 0);
+        return spill_rename_run(spill, run_generation, run_number, new_generation, new_run_number);
+    }
+
     char input_run_filename[PATH_MAX] = {0};
     char output_run_filename[PATH_MAX] = {0};
 
@@ -218,7 +783,7 @@ static bool merge_single_run(
 
     // No need to copy data. Just rename the input file to the new output file.
     if (rename(input_run_filename, output_run_filename) != 0) {
-        return false;
+        return resumable && (errno == ENOENT) && (access(output_run_filename, F_OK) == 0);
     }
     return true;
 }
@@ -226,42 +791,74 @@ static bool merge_single_run(
 /*
  * This merges multiple run files. It does so by acquiring all input/output file resources and then passing those to
  * a library function that performs the actual merge.
+ *
+ * With a manifest, the output is synced to disk and the group is recorded before the inputs are removed. If anything
+ * fails, the inputs are kept so that a resumed sort can redo the group. With keep_runs, a failed merge keeps its inputs
+ * as well, along with what it wrote (see keep_failed_merge()). With a spill store, the output is created in it, and
+ * the inputs are read from it.
  */
 static bool merge_multiple_runs(
-        struct merge_context *merge, char const *output_filename,
+        struct merge_context *merge, struct spill_store *spill, char const *output_filename,
         size_t run_generation, size_t base_run_number, size_t num_runs,
-        size_t new_generation, size_t new_run_number)
+        size_t new_generation, size_t new_run_number, bool keep_runs,
+        struct manifest *manifest, struct progress *progress)
 {
-    char filename[PATH_MAX] = {0};
-    snprintf(filename, sizeof(filename),
-             "%s.%lu.%lu", output_filename, new_generation, new_run_number);
+    assert(!spill || !manifest);
+    assert(!spill || !keep_runs);
 
     // Create and open the output run file
-    FILE *output_run_file = fopen(filename, "wb");
+    FILE *output_run_file = create_run_file(spill, output_filename, new_generation, new_run_number);
     if (!output_run_file) {
         fprintf(stderr, "ERROR: unable to create run file: %s\n", strerror(errno));
         return false;
     }
 
-    FILE **input_run_files = (FILE **) malloc(num_runs * sizeof(FILE *));
+    FILE **input_run_files = NULL;
+    bool success = true;
+    if (spill) {
+        success = merge_spilled_runs(
+                merge, spill, run_generation, base_run_number, num_runs, output_run_file, progress);
+    } else {
+        input_run_files = (FILE **) calloc(num_runs, sizeof(FILE *));
+        if (!input_run_files) {
+            finish_run_file(spill, output_run_file);
+            fprintf(stderr, "ERROR: unable to allocate run file list\n");
+            return false;
+        }
 
-    // Open all of the input run files and add them to the list.
-    bool success = open_run_files(
-            input_run_files, num_runs,
-            output_filename, base_run_number, run_generation);
+        // Open all of the input run files and add them to the list. Unless they're needed to resume, they give up
+        // their disk space as they're merged.
+        success = open_run_files(
+                input_run_files, num_runs,
+                output_filename, base_run_number, run_generation, manifest == NULL);
 
-    if (success) {
-        // Perform the multi-way merge.
-        success = merge_perform_merge(merge, input_run_files, num_runs, output_run_file);
+        if (success) {
+            // Perform the multi-way merge.
+            success = merge_perform_merge(merge, input_run_files, num_runs, output_run_file, progress);
+        }
+    }
+    if (success && manifest && !sync_run_file(spill, output_run_file)) {
+        fprintf(stderr, "ERROR: unable to sync run file: %s\n", strerror(errno));
+        success = false;
     }
 
     // Close the output file.
-    fclose(output_run_file);
+    success = finish_run_file(spill, output_run_file) && success;
+
+    if (success && manifest) {
+        success = manifest_add_group(manifest, new_generation, new_run_number);
+    }
 
-    // Close and remove all of the input run files.
-    close_and_remove_run_files(
-            input_run_files, num_runs,
-            output_filename, base_run_number, run_generation);
+    // Close all of the input run files, and remove them unless they're needed to resume.
+    if (input_run_files) {
+        close_run_files(input_run_files, num_runs);
+    }
+    if (success || (!manifest && !keep_runs)) {
+        remove_run_files(spill, output_filename, base_run_number, num_runs, run_generation);
+    } else if (!manifest) {
+        keep_failed_merge(
+                merge, output_filename, run_generation, base_run_number, num_runs, new_generation, new_run_number);
+    }
 
     // Free the run file list
     free(input_run_files);
@@ -269,9 +866,243 @@ static bool merge_multiple_runs(
     return success;
 }
 
+/*
+ * Leaves a failed merge's runs so that none of their values are lost, even though the merge released the parts of its
+ * inputs that it had merged. The output is cut back to the blocks that were written whole, which hold each input up
+ * to where the merge got to in it, and the inputs hold the rest. Where that is is printed for each input that was
+ * partly merged. If nothing was written, the output is just removed.
+ */
+static void keep_failed_merge(
+        struct merge_context const *merge, char const *output_filename,
+        size_t run_generation, size_t base_run_number, size_t num_runs,
+        size_t new_generation, size_t new_run_number)
+{
+    char filename[PATH_MAX] = {0};
+    snprintf(filename, sizeof(filename), "%s.%lu.%lu", output_filename, new_generation, new_run_number);
+    uint64_t const merged_size = merge_get_output_size(merge);
+    if (merged_size == 0) {
+        remove(filename);
+        return;
+    }
+    if (truncate(filename, (off_t) merged_size) != 0) {
+        fprintf(stderr, "ERROR: unable to cut %s back to the values that were merged: %s\n", filename,
+                strerror(errno));
+    }
+    fprintf(stderr, "ERROR: %s holds the values that were merged before the merge failed\n", filename);
+    for (size_t i = 0; i < num_runs; i++) {
+        off_t const merged_offset = merge_get_merged_offset(merge, i);
+        if (merged_offset > 0) {
+            fprintf(stderr, "ERROR: %s.%lu.%lu holds the rest of its values from byte %lu on\n",
+                    output_filename, run_generation, base_run_number + i, (uint64_t) merged_offset);
+        }
+    }
+}
+
+/*
+ * Merges runs down to a single merge's worth and streams that last merge to output_file. If sorted_filename is given
+ * (and the file exists), it's linked in as one more run just for the last merge, so that it's only read once. That
+ * leaves room for one run fewer in the last merge.
+ */
+static bool merge_runs_to_stream_with_file(
+        char const *base_filename, size_t num_runs, char const *sorted_filename,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, uint64_t limit, bool validate,
+        struct spill_store *spill, FILE *output_file, struct progress *progress, size_t *generations)
+{
+    assert(arena);
+    assert(output_file);
+    assert(generations);
+    assert(!spill || !sorted_filename);
+
+    char sorted_target[PATH_MAX] = {0};
+    uint64_t sorted_size = 0;
+    if (sorted_filename) {
+        struct stat sorted_status = {0};
+        if (stat(sorted_filename, &sorted_status) != 0) {
+            if (errno != ENOENT) {
+                fprintf(stderr, "ERROR: unable to open sorted file: %s\n", strerror(errno));
+                return false;
+            }
+            // There's nothing to merge into yet.
+            sorted_filename = NULL;
+        } else if (!realpath(sorted_filename, sorted_target)) {
+            fprintf(stderr, "ERROR: unable to open sorted file: %s\n", strerror(errno));
+            return false;
+        } else if ((sorted_status.st_size & 0x03) != 0) {
+            fprintf(stderr, "ERROR: sorted file's size must be a multiple of 4.\n");
+            return false;
+        } else {
+            sorted_size = (uint64_t) sorted_status.st_size;
+        }
+    }
+
+    size_t const arena_mark_before_merge = arena_mark(arena);
+    struct merge_context *merge = new_merge_context(arena, block_size, max_files_per_merge, limit);
+    if (!merge) {
+        arena_release(arena, arena_mark_before_merge);
+        return false;
+    }
+    max_files_per_merge = merge_get_max_input_files(merge);
+    merge_set_validate_inputs(merge, validate);
+    size_t const max_remaining_runs = sorted_filename ? max_files_per_merge - 1 : max_files_per_merge;
+
+    // Merge down to a single merge's worth of runs. The last merge goes to the stream, which takes one more pass over
+    // the data, even if there's only a single run to copy out. It also reads all of the sorted file.
+    progress_plan_merge(progress, count_merge_generations(num_runs, max_files_per_merge, max_remaining_runs) + 1);
+    progress_add_bytes(progress, sorted_size);
+
+    size_t generation = 0;
+    size_t remaining_runs = 0;
+    bool success = merge_runs_with_context(
+            merge, spill, base_filename, num_runs, max_files_per_merge, max_remaining_runs, false,
+            NULL, progress, &generation, &remaining_runs);
+    if (success && sorted_filename) {
+        char filename[PATH_MAX] = {0};
+        snprintf(filename, sizeof(filename), "%s.%lu.%lu", base_filename, generation, remaining_runs);
+        if (symlink(sorted_target, filename) != 0) {
+            fprintf(stderr, "ERROR: unable to link sorted file in as a run: %s\n", strerror(errno));
+            success = false;
+        } else {
+            remaining_runs++;
+        }
+    }
+    if (success) {
+        progress_begin_generation(progress, generation + 1);
+        success = stream_final_runs(merge, spill, base_filename, generation, remaining_runs, output_file, progress);
+    }
+    if (success) {
+        *generations = generation + 1;
+        progress_finish(progress);
+    }
+
+    merge_delete(merge);
+    arena_release(arena, arena_mark_before_merge);
+    return success;
+}
+
+/*
+ * This merges the remaining runs of the final generation into an output stream rather than into a run file. Once a
+ * run is open, its file is unlinked. Nothing could pick up a half-written stream where it left off, so there's no
+ * point in keeping the runs around if the reader goes away (e.g. SIGPIPE) and takes this process with it. Runs in a
+ * spill store go with the store, and are removed from it once the merge is over, whether it succeeded or not.
+ */
+static bool stream_final_runs(
+        struct merge_context *merge, struct spill_store *spill, char const *base_filename,
+        size_t run_generation, size_t num_runs,
+        FILE *output_file, struct progress *progress)
+{
+    FILE **input_run_files = NULL;
+    bool success = true;
+    if (spill) {
+        success = merge_spilled_runs(merge, spill, run_generation, 0, num_runs, output_file, progress);
+    } else {
+        input_run_files = (FILE **) calloc(num_runs, sizeof(FILE *));
+        if (!input_run_files) {
+            fprintf(stderr, "ERROR: unable to allocate run file list\n");
+            return false;
+        }
+
+        char filename[PATH_MAX] = {0};
+        for (size_t i = 0; success && (i < num_runs); i++) {
+            snprintf(filename, sizeof(filename), "%s.%lu.%lu", base_filename, run_generation, i);
+            input_run_files[i] = open_run_file(filename, true);
+            if (!input_run_files[i]) {
+                fprintf(stderr, "ERROR: unable to open run file: %s\n", strerror(errno));
+                success = false;
+                break;
+            }
+            remove(filename);
+        }
+        success = success && merge_perform_merge(merge, input_run_files, num_runs, output_file, progress);
+    }
+
+    if (!success) {
+        // A merge that failed for any other reason than writing (e.g. an input that isn't sorted) has said why.
+        if (ferror(output_file)) {
+            fprintf(stderr, "ERROR: unable to write output stream: %s\n", strerror(errno));
+        }
+    } else if (fflush(output_file) != 0) {
+        fprintf(stderr, "ERROR: unable to write output stream: %s\n", strerror(errno));
+        success = false;
+    }
+
+    if (input_run_files) {
+        close_run_files(input_run_files, num_runs);
+        free(input_run_files);
+    } else {
+        remove_run_files(spill, base_filename, 0, num_runs, run_generation);
+    }
+    return success;
+}
+
+/*
+ * Merges runs in the spill store into output_file. The runs are read by their offsets in the spill file, so the merge
+ * holds no descriptor per run, and they give up their space in the file as they're merged.
+ */
+static bool merge_spilled_runs(
+        struct merge_context *merge, struct spill_store *spill,
+        size_t run_generation, size_t base_run_number, size_t num_runs,
+        FILE *output_file, struct progress *progress)
+{
+    struct merge_extent *extents = (struct merge_extent *) calloc(num_runs, sizeof(struct merge_extent));
+    if (!extents) {
+        fprintf(stderr, "ERROR: unable to allocate run extent list\n");
+        return false;
+    }
+    bool success = true;
+    for (size_t i = 0; success && (i < num_runs); i++) {
+        if (!spill_find_run(spill, run_generation, base_run_number + i, &extents[i].offset, &extents[i].size)) {
+            fprintf(stderr, "ERROR: run %lu.%lu is missing from the spill file\n", run_generation, base_run_number + i);
+            success = false;
+        }
+    }
+    success = success && merge_perform_extent_merge(
+            merge, spill_get_fd(spill), extents, num_runs, true, output_file, progress);
+    free(extents);
+    return success;
+}
+
+/*
+ * Creates a run, either in the spill store or as a file of its own, named "[base_filename].[generation].[run_number]".
+ */
+static FILE *create_run_file(
+        struct spill_store *spill, char const *base_filename, size_t run_generation, size_t run_number)
+{
+    if (spill) {
+        return spill_create_run(spill, run_generation, run_number);
+    }
+    char filename[PATH_MAX] = {0};
+    snprintf(filename, sizeof(filename), "%s.%lu.%lu", base_filename, run_generation, run_number);
+    FILE *run_file = fopen(filename, "wb");
+    if (run_file) {
+        // Runs and merges write whole blocks, so stdio buffering would only add a copy and memory that isn't accounted
+        // for in the arena.
+        setvbuf(run_file, NULL, _IONBF, 0);
+    }
+    return run_file;
+}
+
+static bool sync_run_file(struct spill_store *spill, FILE *run_file)
+{
+    if (spill) {
+        return spill_sync(spill);
+    }
+    return fsync(fileno(run_file)) == 0;
+}
+
+/*
+ * Closes a run that create_run_file() created, once it has been written.
+ */
+static bool finish_run_file(struct spill_store *spill, FILE *run_file)
+{
+    if (spill) {
+        return spill_finish_run(spill, run_file);
+    }
+    return fclose(run_file) == 0;
+}
+
 static bool open_run_files(
         FILE **run_files, size_t num_runs,
-        char const *base_filename, size_t base_run_number, size_t run_generation)
+        char const *base_filename, size_t base_run_number, size_t run_generation, bool release)
 {
     char filename[PATH_MAX] = {0};
 
@@ -280,7 +1111,7 @@ static bool open_run_files(
         // Format the run file name based on the run number and current generation. Open the file.
         snprintf(filename, sizeof(filename),
                  "%s.%lu.%lu", base_filename, run_generation, base_run_number + i);
-        FILE *run_file = fopen(filename, "rb");
+        FILE *run_file = open_run_file(filename, release);
         if (!run_file) {
             fprintf(stderr, "ERROR: unable to open run file: %s\n", strerror(errno));
             return false;
@@ -291,19 +1122,48 @@ static bool open_run_files(
     return true;
 }
 
-static bool close_and_remove_run_files(
-        FILE **run_files, size_t num_runs,
-        char const *base_filename, size_t base_run_number, size_t run_generation)
+/*
+ * Opens a run file for merging. If release is set, the run is opened for writing as well, which lets the merge release
+ * the data it has consumed from the file (see merge_perform_merge()). A run that's a symbolic link stands for a sorted
+ * file that was handed in, which is never written to.
+ */
+static FILE *open_run_file(char const *filename, bool release)
 {
-    char filename[PATH_MAX] = {0};
+    struct stat run_status = {0};
+    if (release && ((lstat(filename, &run_status) != 0) || S_ISLNK(run_status.st_mode))) {
+        release = false;
+    }
+    FILE *run_file = fopen(filename, release ? "r+b" : "rb");
+    if (run_file) {
+        // The merge reads whole blocks into its own buffers. Don't let stdio allocate a buffer per open run on top.
+        setvbuf(run_file, NULL, _IONBF, 0);
+    }
+    return run_file;
+}
 
-    // Close all open file pointers in the run file list.
+static void close_run_files(FILE **run_files, size_t num_runs)
+{
+    // Close all open file pointers in the run file list. Runs that were never opened are NULL.
     for (size_t i = 0; i < num_runs; i++) {
-        if (fclose(run_files[i]) != 0) {
+        if (run_files[i] && (fclose(run_files[i]) != 0)) {
             fprintf(stderr, "ERROR: unable to close run file: %s\n", strerror(errno));
         }
         run_files[i] = NULL;
     }
+}
+
+static void remove_run_files(
+        struct spill_store *spill,
+        char const *base_filename, size_t base_run_number, size_t num_runs, size_t run_generation)
+{
+    if (spill) {
+        for (size_t i = 0; i < num_runs; i++) {
+            spill_remove_run(spill, run_generation, base_run_number + i);
+        }
+        return;
+    }
+
+    char filename[PATH_MAX] = {0};
 
     // Remove all of the run files.
     for (size_t i = 0; i < num_runs; i++) {
@@ -311,11 +1171,35 @@ static bool close_and_remove_run_files(
         snprintf(filename, sizeof(filename),
                  "%s.%lu.%lu", base_filename, run_generation, base_run_number + i);
 
-        // Delete run file
-        if (remove(filename) != 0) {
+        // Delete run file. One that's already gone was left over from before a resume.
+        if ((remove(filename) != 0) && (errno != ENOENT)) {
             fprintf(stderr, "ERROR: unable to remove run file: %s\n", strerror(errno));
         }
     }
+}
 
-    return true;
+/*
+ * Removes every run that a failed merge of num_runs initial runs may have left, in any generation. The merge doesn't
+ * say how far it got, but with at least two runs per merge, generation g never has more than num_runs / 2^g runs
+ * (rounded up), so that bounds the files to look for.
+ */
+static void remove_all_run_files(char const *base_filename, size_t num_runs)
+{
+    size_t num_runs_in_generation = num_runs;
+    for (size_t generation = 0; num_runs_in_generation > 0; generation++) {
+        remove_run_files(NULL, base_filename, 0, num_runs_in_generation, generation);
+        num_runs_in_generation = (num_runs_in_generation > 1) ? ((num_runs_in_generation + 1) / 2) : 0;
+    }
+}
+
+/*
+ * Removes the indexes of initial runs, named "[base_filename].idx.0.[run_number]", that create_runs() wrote.
+ */
+static void remove_run_indexes(char const *base_filename, size_t num_runs)
+{
+    char filename[PATH_MAX] = {0};
+    for (size_t i = 0; i < num_runs; i++) {
+        snprintf(filename, sizeof(filename), "%s.idx.0.%lu", base_filename, i);
+        remove(filename);
+    }
 }
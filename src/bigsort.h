@@ -3,27 +3,225 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
+/*
+ * The phases that a sort moves through. Progress reports carry the phase that was active when they were generated. A
+ * partitioned sort (see partition.h) distributes the input into buckets and then sorts the buckets instead of creating
+ * and merging runs. A counting sort (see count_sort.h) counts the input's values instead of creating runs, and its
+ * merge generations merge and expand the counts.
+ */
+enum bigsort_phase {
+    BIGSORT_PHASE_CREATE_RUNS = 0,
+    BIGSORT_PHASE_MERGE,
+    BIGSORT_PHASE_DONE,
+    BIGSORT_PHASE_PARTITION,
+    BIGSORT_PHASE_SORT_BUCKETS,
+    BIGSORT_PHASE_COUNT
+};
+
+/*
+ * A snapshot of a sort's progress.
+ *
+ * bytes_total is planned from the input size and the number of passes over the data: one pass to create the initial
+ * runs plus one pass per planned merge generation. bytes_processed counts towards that same total, so their ratio is
+ * the overall completion fraction. throughput is the rate of actual I/O since the previous report, in bytes/second.
+ * eta_seconds is negative when it cannot be estimated yet.
+ */
+struct bigsort_progress {
+    enum bigsort_phase phase;
+    size_t generation;
+    size_t planned_generations;
+    uint64_t bytes_processed;
+    uint64_t bytes_total;
+    double elapsed_seconds;
+    double throughput;
+    double eta_seconds;
+};
+
+/*
+ * Called with a progress snapshot at most once per reporting interval (see progress_new() in progress.h), plus once at
+ * the start of each phase/generation and once when the sort completes.
+ */
+typedef void (*bigsort_progress_callback)(struct bigsort_progress const *progress, void *user_data);
+
+/*
+ * Progress tracker. May be passed as NULL to any function that accepts one, in which case no progress is reported.
+ */
+struct progress;
+
+/*
+ * Working memory arena (see arena.h). The run and merge phases carve their sub-buffers out of it and give them back
+ * when they're done, so the same memory serves both phases.
+ */
+struct arena;
+
+/*
+ * Checkpoint manifest (see manifest.h). May be passed as NULL to any function that accepts one, in which case nothing
+ * is checkpointed. With a manifest, every run and merge group is synced to disk and recorded in it as it completes, and
+ * a sort that was interrupted picks up after the last one that was recorded when it's run again with a manifest that
+ * was opened for resuming.
+ */
+struct manifest;
+
+/*
+ * Spill store (see spill.h). May be passed as NULL to any function that accepts one, in which case each run is a file
+ * of its own. With a spill store, every run is an extent of a single temporary file, and merges read the runs by their
+ * offsets in it. A merge then doesn't hold a file open per run, so the open file limit doesn't bound its fan-in.
+ */
+struct spill_store;
+
+/*
+ * How create_runs() creates the initial runs. Zeroed options, or none at all, create every run in full, as a file of
+ * its own, without touching the input or checkpointing anything.
+ *
+ * If limit is non-zero, each run only keeps its limit smallest values. Those are picked out with a partial selection,
+ * so only they are sorted.
+ *
+ * If consume_input is set, the input file must be a regular file that's open for writing. Each run is synced to disk,
+ * and the part of the input that it came from is then punched out of the input file, so that the sort needs little
+ * more disk space than the input takes up. Once all of the runs are created, the input file is truncated to nothing.
+ * If the file system can't punch holes, a warning is printed and the input is left alone. If creating a run fails, the
+ * runs that hold consumed input are kept, and where the rest of the input starts in the input file is printed.
+ * Consuming can't be combined with a manifest or a spill store, whose runs don't outlive the process.
+ *
+ * If index_interval is non-zero, a sparse index of each run (see fence_index.h) with every index_interval-th value is
+ * written as the run is, named "[output_filename].idx.0.[run_number]". The runs can then be queried as a sorted view
+ * (see sorted_view.h) without merging them. Indexes can't be combined with a spill store or a manifest.
+ *
+ * With a spill store, the runs are created in it rather than as files. A spill store can't be combined with a manifest.
+ */
+struct run_options {
+    uint64_t limit;
+    bool consume_input;
+    uint64_t index_interval;
+    struct spill_store *spill;
+    struct manifest *manifest;
+};
+
 /*
  * This creates the initial sorted runs. It acquires needed resources, calls another function to create the runs, and
- * then ensures that the resources are released.
+ * then ensures that the resources are released. Each run is run_size bytes (except, possibly, the last), and a buffer
+ * of that size is taken from the arena for the duration of the call. options may be NULL for plain runs (see
+ * struct run_options).
+ *
+ * input_file may be a pipe. It's read until EOF, and progress learns its size along the way. When resuming from a
+ * manifest, input_file must be seekable so that reading can continue where the recorded runs end.
  *
  * Returns: The number of runs created (will always be at least 1 if creation succeeds), or zero if an error occurs.
  */
-size_t create_runs(FILE *input_file, char const *output_filename, void *run_data, size_t run_data_size);
+size_t create_runs(
+        FILE *input_file, char const *output_filename, struct arena *arena, size_t run_size,
+        struct run_options const *options, struct progress *progress);
 
 /*
  * This merges the initial, sorted runs down into a single, fully sorted, fully merged file.
- * It does so by first merging up to open_file_limit first-generation runs into larger, next-generation runs. It then
- * proceeds to merge up to open_file_limit of next-generation runs into even larger next-next-generation runs. This
- * continues until only one large, final-generation runs remains. This is then renamed to the final output file.
+ * It does so by first merging up to max_files_per_merge first-generation runs into larger, next-generation runs. It
+ * then proceeds to merge up to max_files_per_merge of next-generation runs into even larger next-next-generation runs.
+ * This continues until only one large, final-generation runs remains. This is then renamed to the final output file.
+ *
+ * The remaining space in the arena is split between the merge heap, a read block of block_size bytes for each input
+ * run, and an output block of the same size. If fewer than max_files_per_merge inputs fit, the merge uses as many as do
+ * fit. A max_files_per_merge of zero means as many as fit. When a manifest already records the number of files per
+ * merge, that number is used instead, and the merge fails if it no longer fits.
+ *
+ * If limit is non-zero, each merge stops after writing limit values, so only the limit smallest values make it to the
+ * output file.
+ *
+ * If keep_runs is set, no run is removed when a merge fails, e.g. because the runs hold the only copy of an input that
+ * create_runs() consumed. A failed merge keeps what it wrote, and says where in its inputs the values that it didn't
+ * get to start.
  *
- * Returns: The number of generations that the merge required (will always be at least 1 if merge succeeds), or zero if
- *          an error occurs.
+ * Returns: true if the merge succeeds, in which case the number of generations that the merge required is stored in
+ *          generations (zero if there was only a single run to begin with). false if an error occurs.
  */
-size_t merge_runs(
+bool merge_runs(
         char const *output_filename, size_t num_runs,
-        void *merge_data, size_t merge_data_size, size_t open_file_limit);
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, uint64_t limit, bool keep_runs,
+        struct manifest *manifest, struct progress *progress, size_t *generations);
+
+/*
+ * This merges generations of runs the same way that merge_runs() does, but stops as soon as no more than
+ * max_remaining_runs runs remain. Those runs are left in place, named "[base_filename].[generation].[run_number]" with
+ * run numbers counting up from zero. This lets a caller merge the last few runs itself, e.g. to stream the result
+ * somewhere other than a file.
+ *
+ * Returns: true if the merge succeeds, in which case the generation of the remaining runs is stored in generation and
+ *          their number in remaining_runs. false if an error occurs.
+ */
+bool reduce_runs(
+        char const *base_filename, size_t num_runs,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, size_t max_remaining_runs, uint64_t limit,
+        struct manifest *manifest, struct progress *progress, size_t *generation, size_t *remaining_runs);
+
+/*
+ * This reduces runs the same way that reduce_runs() does, except that the runs hold records of record_size bytes that
+ * are ordered by the 32-bit key in their first four bytes (see merge_set_record_size()). Records with equal keys keep
+ * the order of the runs they came from. block_size must hold a whole number of records.
+ */
+bool reduce_record_runs(
+        char const *base_filename, size_t num_runs, size_t record_size,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, size_t max_remaining_runs,
+        struct progress *progress, size_t *generation, size_t *remaining_runs);
+
+/*
+ * This merges runs the same way that merge_runs() does, except that the final merge is written to output_file instead
+ * of being renamed into place. output_file can be anything that can be written to sequentially, such as stdout or a
+ * pipe. The runs are named as for reduce_runs(), which makes base_filename a prefix for temporary files. If the runs
+ * were created in a spill store, the same store must be passed here, and the merges keep their runs in it.
+ *
+ * Returns: true if the merge succeeds, in which case the number of generations that the merge required is stored in
+ *          generations. This includes the final pass to output_file, so it's at least one. false if an error occurs.
+ */
+bool merge_runs_to_stream(
+        char const *base_filename, size_t num_runs,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, uint64_t limit,
+        struct spill_store *spill, FILE *output_file, struct progress *progress, size_t *generations);
+
+/*
+ * This merges runs the same way that merge_runs_to_stream() does, and merges them into sorted_filename, a file that's
+ * already sorted, on the way to output_file. The sorted file only takes part in the final merge, so it's read once and
+ * the runs are all that go through the earlier generations. This lets a batch of new values be added to a large sorted
+ * file at a cost that mostly depends on the size of the batch. A sorted file that doesn't exist yet counts as empty.
+ * It's linked in as a run, named as for reduce_runs(), which leaves the file itself alone.
+ *
+ * If validate is set, the merges check that everything they read is in order, which catches a sorted file that isn't.
+ *
+ * Returns: true if the merge succeeds, in which case the number of generations that the merge required is stored in
+ *          generations. This includes the final pass to output_file, so it's at least one. false if an error occurs.
+ */
+bool merge_runs_with_sorted_file(
+        char const *base_filename, size_t num_runs, char const *sorted_filename,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, uint64_t limit, bool validate,
+        FILE *output_file, struct progress *progress, size_t *generations);
+
+/*
+ * This merges files that are each already sorted, without creating any runs. The input files are linked in as the
+ * initial runs, named as for reduce_runs(), and merged the same way that merge_runs_to_stream() merges runs, with the
+ * final merge written to output_file. The input files themselves are left alone.
+ *
+ * If validate is set, every block that's read from an input is checked to be in order, and the merge fails at the
+ * first value that's out of order. Otherwise, unsorted inputs give unsorted output.
+ *
+ * Returns: true if the merge succeeds, in which case the number of generations that the merge required is stored in
+ *          generations. This includes the final pass to output_file, so it's at least one. false if an error occurs.
+ */
+bool merge_files(
+        char const *const *input_filenames, size_t num_inputs, char const *base_filename,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, uint64_t limit, bool validate,
+        FILE *output_file, struct progress *progress, size_t *generations);
+
+/*
+ * This writes the limit smallest values of input_file to output_file, in sorted order, without creating any runs. It
+ * takes a buffer of buffer_size bytes from the arena, which must hold at least twice limit values. The input is read
+ * into the buffer behind the smallest values so far, and each time the buffer fills up, the limit smallest values are
+ * selected and the rest are dropped. This costs a single read of the input.
+ *
+ * Returns: true on success, false if an error occurs.
+ */
+bool select_smallest(
+        FILE *input_file, FILE *output_file, struct arena *arena, size_t buffer_size, uint64_t limit,
+        struct progress *progress);
 
 #endif // BIGSORT_H
@@ -0,0 +1,45 @@
+#ifndef BITONIC_AVX2_H
+#define BITONIC_AVX2_H
+
+// Building blocks for bitonic sorting networks on AVX2 registers of eight uint32_t values. They're compiled for AVX2
+// regardless of the build's target, so only call them once the CPU is known to support it.
+
+#include <immintrin.h>
+
+// Values per AVX2 register.
+#define AVX2_VALUES 8
+
+__attribute__((target("avx2")))
+static inline __m256i bitonic_reverse_8(__m256i v)
+{
+    return _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+/*
+ * Sorts a bitonic sequence of eight values with three rounds of compare-exchange, at distances 4, 2 and 1.
+ */
+__attribute__((target("avx2")))
+static inline __m256i bitonic_sort_8(__m256i v)
+{
+    __m256i swapped = _mm256_permute2x128_si256(v, v, 0x01);
+    v = _mm256_blend_epi32(_mm256_min_epu32(v, swapped), _mm256_max_epu32(v, swapped), 0xF0);
+    swapped = _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+    v = _mm256_blend_epi32(_mm256_min_epu32(v, swapped), _mm256_max_epu32(v, swapped), 0xCC);
+    swapped = _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm256_blend_epi32(_mm256_min_epu32(v, swapped), _mm256_max_epu32(v, swapped), 0xAA);
+    return v;
+}
+
+/*
+ * Merges two sorted registers. The smaller eight values end up sorted in low and the larger eight sorted in high.
+ * Reversing b makes a and b together a bitonic sequence, which one round of min/max splits into two bitonic halves.
+ */
+__attribute__((target("avx2")))
+static inline void bitonic_merge_8x8(__m256i a, __m256i b, __m256i *low, __m256i *high)
+{
+    b = bitonic_reverse_8(b);
+    *low = bitonic_sort_8(_mm256_min_epu32(a, b));
+    *high = bitonic_sort_8(_mm256_max_epu32(a, b));
+}
+
+#endif // BITONIC_AVX2_H
@@ -0,0 +1,1030 @@
+// fopencookie() is a GNU extension.
+#define _GNU_SOURCE
+
+#include "cluster.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bigsort.h"
+#include "io_util.h"
+#include "plan.h"
+#include "run.h"
+#include "util.h"
+
+// Every message starts with this, so that anything else that connects is turned away.
+static uint64_t const MESSAGE_MAGIC = 0x62696773727431ULL; // "bigsrt1"
+
+enum message_type {
+    // Coordinator to worker: the worker's index, the number of workers and its shard of the input, followed by the
+    // input filename, the output part filename and every worker's address.
+    MESSAGE_JOB = 1,
+    // Worker to coordinator: a count followed by that many values sampled from the worker's runs.
+    MESSAGE_SAMPLES,
+    // Coordinator to worker: a count followed by the splitters between the workers' key ranges.
+    MESSAGE_SPLITTERS,
+    // Worker to worker: the sending worker's index, a number of slices and whether the sender has failed, in which
+    // case it sends no slices. Each slice is a count followed by that many sorted values in the receiving worker's key
+    // range.
+    MESSAGE_SLICES,
+    // Worker to coordinator: whether the worker's part was written, and how many values it holds.
+    MESSAGE_DONE
+};
+
+struct message {
+    uint64_t magic;
+    uint64_t type;
+    uint64_t arguments[4];
+};
+
+// Size of the blocks that slices are sent, received and copied in.
+static size_t const MAX_TRANSFER_BLOCK_SIZE = (size_t) 1 << 20;
+
+// Workers might be started after the coordinator, so keep trying to connect for a while.
+static double const CONNECT_TIMEOUT_SECONDS = 10.0;
+static useconds_t const CONNECT_RETRY_MICROSECONDS = 50000;
+
+// Workers send to each other one at a time, so a worker can wait a long while for a peer that's busy sending to the
+// workers before it. A peer that takes longer than this to connect, or stalls while sending, has most likely died.
+static int const EXCHANGE_TIMEOUT_SECONDS = 600;
+
+// Longest host:port address, including the terminator.
+#define MAX_ADDRESS_SIZE 256
+
+struct cluster_worker {
+    int listen_fd;
+    char address[MAX_ADDRESS_SIZE];
+};
+
+struct job {
+    size_t worker_index;
+    size_t num_workers;
+    uint64_t shard_offset;
+    uint64_t shard_size;
+    char input_filename[PATH_MAX];
+    char part_filename[PATH_MAX];
+    char (*worker_addresses)[MAX_ADDRESS_SIZE];
+};
+
+// A worker's incoming slices, and its own, each become a run of the final merge. Both are numbered from the same
+// counter since they're created concurrently.
+struct slice_runs {
+    char const *base_filename;
+    atomic_size_t num_runs;
+    atomic_bool failed;
+};
+
+struct receiver {
+    struct cluster_worker *worker;
+    struct slice_runs *runs;
+    size_t num_senders;
+    uint32_t *buffer;
+    size_t buffer_values;
+};
+
+struct shard_reader {
+    int fd;
+    uint64_t position;
+    uint64_t end;
+};
+
+static bool run_job(
+        struct cluster_worker *worker, struct job const *job, int coordinator_fd,
+        struct arena *arena, size_t run_size, size_t max_files, uint64_t *num_values);
+
+static size_t create_shard_runs(
+        struct job const *job, char const *shard_base_filename, struct arena *arena, size_t run_size);
+
+static bool send_samples(int coordinator_fd, char const *shard_base_filename, size_t num_shard_runs);
+
+static bool find_slice_bounds(
+        char const *run_filename, uint32_t const *splitters, size_t num_workers, uint64_t *bounds);
+
+static bool exchange_slices(
+        struct job const *job, char const *shard_base_filename, size_t num_shard_runs, bool failed,
+        uint64_t const *bounds, struct slice_runs *runs, uint32_t *buffer, size_t buffer_values);
+
+static void *receive_slices(void *arg);
+
+static int accept_peer(int listen_fd);
+
+static bool receive_slice(int fd, struct slice_runs *runs, uint32_t *buffer, size_t buffer_values);
+
+static bool transfer_values(
+        int from_fd, uint64_t from_offset, bool from_socket, int to_fd, bool to_socket,
+        uint64_t num_values, uint32_t *buffer, size_t buffer_values);
+
+static bool merge_slice_runs(
+        struct job const *job, size_t num_runs, struct arena *arena, size_t run_size, size_t max_files);
+
+static void remove_runs(char const *base_filename, size_t num_runs);
+
+static bool gather_parts(
+        char const *output_filename, char const (*part_filenames)[PATH_MAX], size_t num_workers);
+
+static ssize_t read_shard(void *cookie, char *buffer, size_t size);
+
+static int connect_to(char const *address);
+
+static bool resolve(char const *address, bool passive, struct addrinfo **info);
+
+static bool send_message(int fd, enum message_type type, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3);
+
+static bool receive_message(int fd, enum message_type type, struct message *message);
+
+static bool send_string(int fd, char const *string);
+
+static bool receive_string(int fd, char *string, size_t string_size);
+
+static bool send_fully(int fd, void const *buffer, size_t size);
+
+static bool receive_fully(int fd, void *buffer, size_t size);
+
+
+/*
+ * Sorts the input file into the output file with a set of workers, each of which is a bigsort process that was started
+ * with --worker and may be on another machine that shares the file system.
+ *
+ * Each worker creates runs from its own shard of the input. Every worker then sends the coordinator a sample of its
+ * runs, and the coordinator sends back splitters that divide the key range between the workers. The workers then
+ * exchange slices of their runs directly with each other over TCP so that each ends up with every value in its range,
+ * which it merges into an output part. Finally, the coordinator concatenates the parts, in key order, into the output.
+ *
+ * Messages carry integers and values in the hosts' byte order, so the workers must all share the coordinator's.
+ */
+bool cluster_coordinate(
+        char const *input_filename, char const *output_filename,
+        char const *const *worker_addresses, size_t num_workers,
+        uint64_t *num_values)
+{
+    assert(input_filename);
+    assert(output_filename);
+    assert(worker_addresses);
+    assert(num_workers > 0);
+    assert(num_values);
+
+    struct stat input_status = {0};
+    if ((stat(input_filename, &input_status) != 0) || !S_ISREG(input_status.st_mode)) {
+        fprintf(stderr, "ERROR: distributed sorting requires an input file that workers can open\n");
+        return false;
+    }
+    uint64_t const input_size = (uint64_t) input_status.st_size;
+    if ((input_size & 0x03) != 0) {
+        fprintf(stderr, "ERROR: input file's size must be a multiple of 4.\n");
+        return false;
+    }
+    uint64_t const input_values = input_size / sizeof(uint32_t);
+
+    // Workers don't share the coordinator's working directory, so give them absolute paths.
+    char input_path[PATH_MAX] = {0};
+    char output_path[PATH_MAX] = {0};
+    char working_directory[PATH_MAX] = {0};
+    if (!realpath(input_filename, input_path) || !getcwd(working_directory, sizeof(working_directory))) {
+        fprintf(stderr, "ERROR: unable to resolve file paths: %s\n", strerror(errno));
+        return false;
+    }
+    int const output_path_length = (output_filename[0] == '/')
+            ? snprintf(output_path, sizeof(output_path), "%s", output_filename)
+            : snprintf(output_path, sizeof(output_path), "%s/%s", working_directory, output_filename);
+    if ((size_t) output_path_length >= sizeof(output_path)) {
+        fprintf(stderr, "ERROR: output file path is too long\n");
+        return false;
+    }
+
+    int *fds = (int *) malloc(num_workers * sizeof(int));
+    char (*part_filenames)[PATH_MAX] = calloc(num_workers, sizeof(*part_filenames));
+    uint32_t *samples = NULL;
+    size_t num_samples = 0;
+    bool success = fds && part_filenames;
+    for (size_t i = 0; fds && (i < num_workers); i++) {
+        fds[i] = -1;
+    }
+
+    // Hand each worker an equal shard of the input.
+    for (size_t i = 0; success && (i < num_workers); i++) {
+        if ((size_t) snprintf(part_filenames[i], sizeof(part_filenames[i]), "%s.part.%lu", output_path, i) >=
+            sizeof(part_filenames[i])) {
+            fprintf(stderr, "ERROR: output file path is too long\n");
+            success = false;
+            break;
+        }
+        fds[i] = connect_to(worker_addresses[i]);
+        if (fds[i] < 0) {
+            fprintf(stderr, "ERROR: unable to connect to worker %s: %s\n", worker_addresses[i], strerror(errno));
+            success = false;
+            break;
+        }
+        uint64_t const first_value = (input_values * i) / num_workers;
+        uint64_t const end_value = (input_values * (i + 1)) / num_workers;
+        success = send_message(fds[i], MESSAGE_JOB, i, num_workers,
+                               first_value * sizeof(uint32_t), (end_value - first_value) * sizeof(uint32_t)) &&
+                  send_string(fds[i], input_path) &&
+                  send_string(fds[i], part_filenames[i]);
+        for (size_t j = 0; success && (j < num_workers); j++) {
+            success = send_string(fds[i], worker_addresses[j]);
+        }
+        if (!success) {
+            fprintf(stderr, "ERROR: unable to send job to worker %s: %s\n", worker_addresses[i], strerror(errno));
+        }
+    }
+
+    // Choose splitters from everyone's samples.
+    for (size_t i = 0; success && (i < num_workers); i++) {
+        struct message message = {0};
+        success = receive_message(fds[i], MESSAGE_SAMPLES, &message);
+        size_t const count = success ? (size_t) message.arguments[0] : 0;
+        uint32_t *more_samples = success ? (uint32_t *) realloc(samples, (num_samples + count + 1) * sizeof(uint32_t))
+                                         : NULL;
+        if (more_samples) {
+            samples = more_samples;
+            success = receive_fully(fds[i], samples + num_samples, count * sizeof(uint32_t));
+            num_samples += count;
+        } else {
+            success = false;
+        }
+        if (!success) {
+            fprintf(stderr, "ERROR: unable to receive samples from worker %s\n", worker_addresses[i]);
+        }
+    }
+    uint32_t *splitters = (uint32_t *) calloc(num_workers, sizeof(uint32_t));
+    if (success && splitters) {
+        run_sort(samples, num_samples);
+        // Worker w gets the values v with splitters[w - 1] <= v < splitters[w].
+        for (size_t i = 1; (i < num_workers) && (num_samples > 0); i++) {
+            splitters[i - 1] = samples[(i * num_samples) / num_workers];
+        }
+    } else {
+        success = false;
+    }
+    for (size_t i = 0; success && (i < num_workers); i++) {
+        success = send_message(fds[i], MESSAGE_SPLITTERS, num_workers - 1, 0, 0, 0) &&
+                  send_fully(fds[i], splitters, (num_workers - 1) * sizeof(uint32_t));
+        if (!success) {
+            fprintf(stderr, "ERROR: unable to send splitters to worker %s\n", worker_addresses[i]);
+        }
+    }
+
+    // Wait for every part, and then put them together.
+    *num_values = 0;
+    for (size_t i = 0; success && (i < num_workers); i++) {
+        struct message message = {0};
+        success = receive_message(fds[i], MESSAGE_DONE, &message) && (message.arguments[0] != 0);
+        if (!success) {
+            fprintf(stderr, "ERROR: worker %s was unable to sort its part\n", worker_addresses[i]);
+        }
+        *num_values += message.arguments[1];
+    }
+    if (success && (*num_values != input_values)) {
+        fprintf(stderr, "ERROR: workers sorted %lu values, but the input has %lu\n",
+                (size_t) *num_values, (size_t) input_values);
+        success = false;
+    }
+    success = success && gather_parts(output_path, (char const (*)[PATH_MAX]) part_filenames, num_workers);
+
+    for (size_t i = 0; fds && (i < num_workers); i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+        if (!success) {
+            remove(part_filenames[i]);
+        }
+    }
+    free(splitters);
+    free(samples);
+    free(part_filenames);
+    free(fds);
+    return success;
+}
+
+/*
+ * Starts listening for a coordinator on an address of the form host:port. A port of 0 picks any free port, which
+ * cluster_worker_get_address() then reports.
+ */
+struct cluster_worker *cluster_worker_new(char const *address)
+{
+    assert(address);
+
+    struct addrinfo *info = NULL;
+    if (!resolve(address, true, &info)) {
+        return NULL;
+    }
+    int const fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    int const reuse = 1;
+    if ((fd < 0) ||
+        (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0) ||
+        (bind(fd, info->ai_addr, info->ai_addrlen) != 0) ||
+        (listen(fd, SOMAXCONN) != 0)) {
+        fprintf(stderr, "ERROR: unable to listen on %s: %s\n", address, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        freeaddrinfo(info);
+        return NULL;
+    }
+    freeaddrinfo(info);
+
+    struct cluster_worker *worker = (struct cluster_worker *) malloc(sizeof(struct cluster_worker));
+    if (!worker) {
+        close(fd);
+        return NULL;
+    }
+    worker->listen_fd = fd;
+
+    // Report the port that was actually bound, which matters when it was picked by the system.
+    struct sockaddr_storage bound = {0};
+    socklen_t bound_size = sizeof(bound);
+    char port[16] = {0};
+    getsockname(fd, (struct sockaddr *) &bound, &bound_size);
+    getnameinfo((struct sockaddr *) &bound, bound_size, NULL, 0, port, sizeof(port), NI_NUMERICSERV);
+    char const *const separator = strrchr(address, ':');
+    snprintf(worker->address, sizeof(worker->address), "%.*s:%s", (int) (separator - address), address, port);
+    return worker;
+}
+
+char const *cluster_worker_get_address(struct cluster_worker const *worker)
+{
+    assert(worker);
+    return worker->address;
+}
+
+/*
+ * Waits for a coordinator and carries out the job it hands over (see cluster_coordinate()). Runs are created with the
+ * given run size and merged with up to max_files files at once, all within the arena.
+ */
+bool cluster_worker_serve(struct cluster_worker *worker, struct arena *arena, size_t run_size, size_t max_files)
+{
+    assert(worker);
+    assert(arena);
+
+    int const coordinator_fd = accept(worker->listen_fd, NULL, NULL);
+    if (coordinator_fd < 0) {
+        fprintf(stderr, "ERROR: unable to accept coordinator: %s\n", strerror(errno));
+        return false;
+    }
+
+    struct job job = {0};
+    struct message message = {0};
+    bool success = receive_message(coordinator_fd, MESSAGE_JOB, &message);
+    if (success) {
+        job.worker_index = (size_t) message.arguments[0];
+        job.num_workers = (size_t) message.arguments[1];
+        job.shard_offset = message.arguments[2];
+        job.shard_size = message.arguments[3];
+        job.worker_addresses = calloc(job.num_workers, sizeof(*job.worker_addresses));
+        success = (job.worker_index < job.num_workers) && job.worker_addresses &&
+                  receive_string(coordinator_fd, job.input_filename, sizeof(job.input_filename)) &&
+                  receive_string(coordinator_fd, job.part_filename, sizeof(job.part_filename));
+        for (size_t i = 0; success && (i < job.num_workers); i++) {
+            success = receive_string(coordinator_fd, job.worker_addresses[i], sizeof(job.worker_addresses[i]));
+        }
+    }
+    if (!success) {
+        fprintf(stderr, "ERROR: unable to receive job from coordinator\n");
+    }
+
+    uint64_t num_values = 0;
+    success = success && run_job(worker, &job, coordinator_fd, arena, run_size, max_files, &num_values);
+    if (!send_message(coordinator_fd, MESSAGE_DONE, success, num_values, 0, 0)) {
+        fprintf(stderr, "ERROR: unable to report to coordinator: %s\n", strerror(errno));
+        success = false;
+    }
+    close(coordinator_fd);
+    free(job.worker_addresses);
+    return success;
+}
+
+void cluster_worker_delete(struct cluster_worker *worker)
+{
+    if (!worker) {
+        return;
+    }
+    close(worker->listen_fd);
+    free(worker);
+}
+
+/*
+ * Creates runs from the shard, samples them for the coordinator, swaps slices with the other workers according to the
+ * splitters the coordinator sends back, and merges the slices that this worker ends up with into its output part.
+ */
+static bool run_job(
+        struct cluster_worker *worker, struct job const *job, int coordinator_fd,
+        struct arena *arena, size_t run_size, size_t max_files, uint64_t *num_values)
+{
+    char shard_base_filename[PATH_MAX] = {0};
+    if ((size_t) snprintf(shard_base_filename, sizeof(shard_base_filename), "%s.shard", job->part_filename) >=
+        sizeof(shard_base_filename)) {
+        fprintf(stderr, "ERROR: part file path is too long\n");
+        return false;
+    }
+
+    size_t const num_shard_runs = create_shard_runs(job, shard_base_filename, arena, run_size);
+    if (num_shard_runs == 0) {
+        return false;
+    }
+
+    // Find where each of the splitters falls in each run.
+    size_t const num_workers = job->num_workers;
+    struct message message = {0};
+    uint32_t *splitters = (uint32_t *) malloc(num_workers * sizeof(uint32_t));
+    uint64_t *bounds = (uint64_t *) malloc(num_shard_runs * (num_workers + 1) * sizeof(uint64_t));
+    bool success = splitters && bounds &&
+                   send_samples(coordinator_fd, shard_base_filename, num_shard_runs) &&
+                   receive_message(coordinator_fd, MESSAGE_SPLITTERS, &message) &&
+                   (message.arguments[0] == num_workers - 1) &&
+                   receive_fully(coordinator_fd, splitters, (num_workers - 1) * sizeof(uint32_t));
+    if (!success) {
+        // Nobody gets splitters until every worker has sent samples, so the other workers can't be waiting for this one
+        // to exchange slices with them.
+        fprintf(stderr, "ERROR: unable to agree on splitters with coordinator\n");
+        remove_runs(shard_base_filename, num_shard_runs);
+        free(bounds);
+        free(splitters);
+        return false;
+    }
+    char run_filename[PATH_MAX] = {0};
+    for (size_t i = 0; success && (i < num_shard_runs); i++) {
+        success = ((size_t) snprintf(run_filename, sizeof(run_filename), "%s.0.%lu", shard_base_filename, i) <
+                   sizeof(run_filename)) &&
+                  find_slice_bounds(run_filename, splitters, num_workers, bounds + (i * (num_workers + 1)));
+    }
+
+    // Receive the other workers' slices while sending ours. Each direction gets its own block. The other workers are
+    // waiting for this one, so even if it has failed, it still tells each of them so, and hears them all out.
+    struct slice_runs runs = {.base_filename = job->part_filename};
+    atomic_init(&runs.num_runs, 0);
+    atomic_init(&runs.failed, false);
+    size_t const arena_mark_before_exchange = arena_mark(arena);
+    size_t block_size = (arena_available(arena, ARENA_PAGE_ALIGNMENT) / 2) & ~(ARENA_PAGE_ALIGNMENT - 1);
+    if (block_size > MAX_TRANSFER_BLOCK_SIZE) {
+        block_size = MAX_TRANSFER_BLOCK_SIZE;
+    }
+    uint32_t *send_buffer = (uint32_t *) arena_alloc(arena, block_size, ARENA_PAGE_ALIGNMENT);
+    uint32_t *receive_buffer = (uint32_t *) arena_alloc(arena, block_size, ARENA_PAGE_ALIGNMENT);
+    if (success && (!send_buffer || !receive_buffer)) {
+        fprintf(stderr, "ERROR: working memory is too small to exchange slices\n");
+        success = false;
+    }
+    // A failed receiver only hears out the other workers, without keeping their slices.
+    atomic_store(&runs.failed, !success);
+    struct receiver receiver = {
+            .worker = worker,
+            .runs = &runs,
+            .num_senders = num_workers - 1,
+            .buffer = receive_buffer,
+            .buffer_values = block_size / sizeof(uint32_t)};
+    pthread_t receiver_thread;
+    bool const receiving = (pthread_create(&receiver_thread, NULL, receive_slices, &receiver) == 0);
+    if (!receiving) {
+        fprintf(stderr, "ERROR: unable to start receiving slices: %s\n", strerror(errno));
+        success = false;
+    }
+    success = exchange_slices(
+            job, shard_base_filename, num_shard_runs, !success, bounds, &runs,
+            send_buffer, block_size / sizeof(uint32_t));
+    if (receiving) {
+        pthread_join(receiver_thread, NULL);
+    }
+    success = success && receiving && !atomic_load(&runs.failed);
+    arena_release(arena, arena_mark_before_exchange);
+    remove_runs(shard_base_filename, num_shard_runs);
+    free(bounds);
+    free(splitters);
+
+    // Merge everything in this worker's range into its part.
+    size_t const num_runs = atomic_load(&runs.num_runs);
+    success = success && merge_slice_runs(job, num_runs, arena, run_size, max_files);
+    if (!success) {
+        remove_runs(job->part_filename, num_runs);
+        remove(job->part_filename);
+        return false;
+    }
+    struct stat part_status = {0};
+    if (stat(job->part_filename, &part_status) != 0) {
+        return false;
+    }
+    *num_values = (uint64_t) part_status.st_size / sizeof(uint32_t);
+    return true;
+}
+
+/*
+ * Creates runs from the worker's shard of the input. The shard is read through a stream that ends where the shard
+ * does, so that create_runs() can read it like any other input.
+ */
+static size_t create_shard_runs(
+        struct job const *job, char const *shard_base_filename, struct arena *arena, size_t run_size)
+{
+    struct shard_reader reader = {
+            .fd = open(job->input_filename, O_RDONLY),
+            .position = job->shard_offset,
+            .end = job->shard_offset + job->shard_size};
+    if (reader.fd < 0) {
+        fprintf(stderr, "ERROR: unable to open input file: %s\n", strerror(errno));
+        return 0;
+    }
+    cookie_io_functions_t const functions = {.read = read_shard};
+    FILE *shard_file = fopencookie(&reader, "rb", functions);
+    if (!shard_file) {
+        close(reader.fd);
+        fprintf(stderr, "ERROR: unable to open input shard: %s\n", strerror(errno));
+        return 0;
+    }
+    size_t const num_runs = create_runs(shard_file, shard_base_filename, arena, run_size, NULL, NULL);
+    fclose(shard_file);
+    close(reader.fd);
+    return num_runs;
+}
+
+/*
+ * Sends the coordinator a sample of the shard's runs (see run_sample_file()) to choose the splitters from.
+ */
+static bool send_samples(int coordinator_fd, char const *shard_base_filename, size_t num_shard_runs)
+{
+    uint64_t *run_values = (uint64_t *) calloc(num_shard_runs, sizeof(uint64_t));
+    uint32_t *samples = (uint32_t *) malloc((RUN_SAMPLES_PER_PART + num_shard_runs) * sizeof(uint32_t));
+    if (!run_values || !samples) {
+        free(samples);
+        free(run_values);
+        return false;
+    }
+
+    char run_filename[PATH_MAX] = {0};
+    uint64_t total_values = 0;
+    bool success = true;
+    for (size_t i = 0; success && (i < num_shard_runs); i++) {
+        snprintf(run_filename, sizeof(run_filename), "%s.0.%lu", shard_base_filename, i);
+        struct stat run_status = {0};
+        success = (stat(run_filename, &run_status) == 0);
+        run_values[i] = (uint64_t) run_status.st_size / sizeof(uint32_t);
+        total_values += run_values[i];
+    }
+
+    size_t num_samples = 0;
+    for (size_t i = 0; success && (i < num_shard_runs); i++) {
+        snprintf(run_filename, sizeof(run_filename), "%s.0.%lu", shard_base_filename, i);
+        int const fd = open(run_filename, O_RDONLY);
+        size_t run_samples = 0;
+        success = (fd >= 0) && run_sample_file(
+                fd, run_values[i], total_values, RUN_SAMPLES_PER_PART, samples + num_samples, &run_samples);
+        num_samples += run_samples;
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    success = success &&
+              send_message(coordinator_fd, MESSAGE_SAMPLES, num_samples, 0, 0, 0) &&
+              send_fully(coordinator_fd, samples, num_samples * sizeof(uint32_t));
+    free(samples);
+    free(run_values);
+    return success;
+}
+
+/*
+ * Finds the bounds of each worker's slice of a sorted run. Worker w's slice is [bounds[w], bounds[w + 1]).
+ */
+static bool find_slice_bounds(
+        char const *run_filename, uint32_t const *splitters, size_t num_workers, uint64_t *bounds)
+{
+    int const fd = open(run_filename, O_RDONLY);
+    struct stat run_status = {0};
+    if ((fd < 0) || (fstat(fd, &run_status) != 0)) {
+        fprintf(stderr, "ERROR: unable to open run file: %s\n", strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    uint64_t const run_values = (uint64_t) run_status.st_size / sizeof(uint32_t);
+
+    // Each bound is the first value that's at least the splitter.
+    bool success = true;
+    bounds[0] = 0;
+    bounds[num_workers] = run_values;
+    for (size_t w = 1; success && (w < num_workers); w++) {
+        success = run_find_lower_bound(fd, bounds[w - 1], run_values, splitters[w - 1], bounds + w);
+    }
+    close(fd);
+    if (!success) {
+        fprintf(stderr, "ERROR: unable to read run file: %s\n", strerror(errno));
+    }
+    return success;
+}
+
+/*
+ * Sends every other worker its slices of this worker's runs, and copies this worker's own slices into runs for its
+ * merge. Workers are sent to one at a time, each over a connection of its own. Every other worker is waiting to hear
+ * from this one, so once this worker has failed, it tells each of the rest that it has instead of sending them slices.
+ */
+static bool exchange_slices(
+        struct job const *job, char const *shard_base_filename, size_t num_shard_runs, bool failed,
+        uint64_t const *bounds, struct slice_runs *runs, uint32_t *buffer, size_t buffer_values)
+{
+    size_t const num_workers = job->num_workers;
+    char run_filename[PATH_MAX] = {0};
+    bool success = !failed;
+    for (size_t w = 0; w < num_workers; w++) {
+        bool const own_range = (w == job->worker_index);
+        size_t num_slices = 0;
+        for (size_t i = 0; success && (i < num_shard_runs); i++) {
+            uint64_t const *run_bounds = bounds + (i * (num_workers + 1));
+            num_slices += (run_bounds[w + 1] > run_bounds[w]) ? 1 : 0;
+        }
+
+        int peer_fd = -1;
+        if (!own_range) {
+            peer_fd = connect_to(job->worker_addresses[w]);
+            if ((peer_fd < 0) ||
+                !send_message(peer_fd, MESSAGE_SLICES, job->worker_index, success ? num_slices : 0, !success, 0)) {
+                fprintf(stderr, "ERROR: unable to send slices to worker %s: %s\n",
+                        job->worker_addresses[w], strerror(errno));
+                success = false;
+            }
+        }
+        for (size_t i = 0; success && (i < num_shard_runs); i++) {
+            uint64_t const *run_bounds = bounds + (i * (num_workers + 1));
+            uint64_t const count = run_bounds[w + 1] - run_bounds[w];
+            if (count == 0) {
+                continue;
+            }
+            snprintf(run_filename, sizeof(run_filename), "%s.0.%lu", shard_base_filename, i);
+            int const run_fd = open(run_filename, O_RDONLY);
+            if (run_fd < 0) {
+                fprintf(stderr, "ERROR: unable to open run file: %s\n", strerror(errno));
+                success = false;
+                break;
+            }
+            if (own_range) {
+                // Keep this slice as a run of its own.
+                snprintf(run_filename, sizeof(run_filename), "%s.0.%lu",
+                         runs->base_filename, atomic_fetch_add(&runs->num_runs, 1));
+                int const slice_fd = open(run_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                success = (slice_fd >= 0) &&
+                          transfer_values(run_fd, run_bounds[w] * sizeof(uint32_t), false, slice_fd, false,
+                                          count, buffer, buffer_values);
+                if ((slice_fd >= 0) && (close(slice_fd) != 0)) {
+                    success = false;
+                }
+            } else {
+                success = send_fully(peer_fd, &count, sizeof(count)) &&
+                          transfer_values(run_fd, run_bounds[w] * sizeof(uint32_t), false, peer_fd, true,
+                                          count, buffer, buffer_values);
+            }
+            close(run_fd);
+            if (!success) {
+                fprintf(stderr, "ERROR: unable to transfer slice: %s\n", strerror(errno));
+            }
+        }
+        if (peer_fd >= 0) {
+            close(peer_fd);
+        }
+    }
+    return success;
+}
+
+/*
+ * Accepts a connection from each of the other workers in turn and writes each slice they send to a run of its own.
+ * A sender only connects once it's ready to send everything, so taking one connection at a time can't stall.
+ *
+ * Every sender is heard from, even after the receive has failed, so that none of them is left waiting to connect. Once
+ * it has failed, the rest of the senders' slices aren't kept, and their connections are simply closed.
+ */
+static void *receive_slices(void *arg)
+{
+    struct receiver *receiver = (struct receiver *) arg;
+    for (size_t i = 0; i < receiver->num_senders; i++) {
+        int const fd = accept_peer(receiver->worker->listen_fd);
+        if (fd < 0) {
+            fprintf(stderr, "ERROR: gave up waiting for slices from another worker: %s\n", strerror(errno));
+            atomic_store(&receiver->runs->failed, true);
+            break;
+        }
+        struct message message = {0};
+        bool success = receive_message(fd, MESSAGE_SLICES, &message);
+        if (success && (message.arguments[2] != 0)) {
+            fprintf(stderr, "ERROR: worker %lu was unable to send its slices\n", (size_t) message.arguments[0]);
+            success = false;
+        }
+        for (uint64_t slice = 0; success && !atomic_load(&receiver->runs->failed) && (slice < message.arguments[1]);
+             slice++) {
+            success = receive_slice(fd, receiver->runs, receiver->buffer, receiver->buffer_values);
+            if (!success) {
+                fprintf(stderr, "ERROR: unable to receive slices from another worker: %s\n", strerror(errno));
+            }
+        }
+        close(fd);
+        if (!success) {
+            atomic_store(&receiver->runs->failed, true);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Waits for the next worker to connect, for up to EXCHANGE_TIMEOUT_SECONDS, and accepts it. Receiving from it times
+ * out after as long. Returns the connected socket, or -1.
+ */
+static int accept_peer(int listen_fd)
+{
+    struct pollfd listener = {.fd = listen_fd, .events = POLLIN};
+    int ready = 0;
+    do {
+        ready = poll(&listener, 1, EXCHANGE_TIMEOUT_SECONDS * 1000);
+    } while ((ready < 0) && (errno == EINTR));
+    if (ready <= 0) {
+        errno = (ready == 0) ? ETIMEDOUT : errno;
+        return -1;
+    }
+    int const fd = accept(listen_fd, NULL, NULL);
+    struct timeval const timeout = {.tv_sec = EXCHANGE_TIMEOUT_SECONDS};
+    if ((fd >= 0) && (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool receive_slice(int fd, struct slice_runs *runs, uint32_t *buffer, size_t buffer_values)
+{
+    uint64_t count = 0;
+    if (!receive_fully(fd, &count, sizeof(count))) {
+        return false;
+    }
+    char run_filename[PATH_MAX] = {0};
+    snprintf(run_filename, sizeof(run_filename), "%s.0.%lu", runs->base_filename, atomic_fetch_add(&runs->num_runs, 1));
+    int const run_fd = open(run_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (run_fd < 0) {
+        return false;
+    }
+    bool success = transfer_values(fd, 0, true, run_fd, false, count, buffer, buffer_values);
+    if (close(run_fd) != 0) {
+        success = false;
+    }
+    return success;
+}
+
+/*
+ * Copies num_values values from one descriptor to another a block at a time. A file is read from from_offset
+ * onwards, while a socket is read from wherever it's at.
+ */
+static bool transfer_values(
+        int from_fd, uint64_t from_offset, bool from_socket, int to_fd, bool to_socket,
+        uint64_t num_values, uint32_t *buffer, size_t buffer_values)
+{
+    while (num_values > 0) {
+        size_t const chunk_values = (num_values < buffer_values) ? (size_t) num_values : buffer_values;
+        size_t const chunk_size = chunk_values * sizeof(uint32_t);
+        bool const read = from_socket ? receive_fully(from_fd, buffer, chunk_size)
+                                      : io_pread_fully(from_fd, buffer, chunk_size, from_offset);
+        bool const written = read && (to_socket ? send_fully(to_fd, buffer, chunk_size)
+                                                : io_write_fully(to_fd, buffer, chunk_size));
+        if (!written) {
+            return false;
+        }
+        from_offset += chunk_size;
+        num_values -= chunk_values;
+    }
+    return true;
+}
+
+/*
+ * Merges the slices this worker received, and its own, into its part. The merge is planned for the actual number of
+ * slices, which can be many more than the shard had runs.
+ */
+static bool merge_slice_runs(
+        struct job const *job, size_t num_runs, struct arena *arena, size_t run_size, size_t max_files)
+{
+    // A worker whose range is empty still writes an (empty) part.
+    if (num_runs == 0) {
+        char run_filename[PATH_MAX] = {0};
+        bool const named = ((size_t) snprintf(run_filename, sizeof(run_filename), "%s.0.0", job->part_filename) <
+                            sizeof(run_filename));
+        FILE *run_file = named ? fopen(run_filename, "wb") : NULL;
+        if (!run_file) {
+            fprintf(stderr, "ERROR: unable to create run file: %s\n", strerror(errno));
+            return false;
+        }
+        fclose(run_file);
+        num_runs = 1;
+    }
+
+    struct sort_plan plan = {.memory_size = arena_available(arena, ARENA_PAGE_ALIGNMENT), .run_size = run_size};
+    if (!plan_merge(&plan, num_runs, max_files)) {
+        fprintf(stderr, "ERROR: working memory is too small to merge %lu slices\n", num_runs);
+        remove_runs(job->part_filename, num_runs);
+        return false;
+    }
+    size_t generations = 0;
+    return merge_runs(
+            job->part_filename, num_runs, arena, plan.fan_in, plan.block_size, 0, false, NULL, NULL, &generations);
+}
+
+static void remove_runs(char const *base_filename, size_t num_runs)
+{
+    char run_filename[PATH_MAX] = {0};
+    for (size_t i = 0; i < num_runs; i++) {
+        // A truncated name isn't the run's, so it's not to be removed.
+        if ((size_t) snprintf(run_filename, sizeof(run_filename), "%s.0.%lu", base_filename, i) <
+            sizeof(run_filename)) {
+            remove(run_filename);
+        }
+    }
+}
+
+/*
+ * Concatenates the workers' parts into the output, in order, removing each part once it has been copied.
+ */
+static bool gather_parts(
+        char const *output_filename, char const (*part_filenames)[PATH_MAX], size_t num_workers)
+{
+    int const output_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    void *buffer = malloc(MAX_TRANSFER_BLOCK_SIZE);
+    bool success = (output_fd >= 0) && buffer;
+    for (size_t i = 0; success && (i < num_workers); i++) {
+        int const part_fd = open(part_filenames[i], O_RDONLY);
+        success = (part_fd >= 0);
+        while (success) {
+            ssize_t const num_read = read(part_fd, buffer, MAX_TRANSFER_BLOCK_SIZE);
+            if (num_read <= 0) {
+                success = (num_read == 0);
+                break;
+            }
+            success = io_write_fully(output_fd, buffer, (size_t) num_read);
+        }
+        if (part_fd >= 0) {
+            close(part_fd);
+        }
+        if (success) {
+            remove(part_filenames[i]);
+        }
+    }
+    if ((output_fd >= 0) && (close(output_fd) != 0)) {
+        success = false;
+    }
+    if (!success) {
+        fprintf(stderr, "ERROR: unable to write output file: %s\n", strerror(errno));
+    }
+    free(buffer);
+    return success;
+}
+
+static ssize_t read_shard(void *cookie, char *buffer, size_t size)
+{
+    struct shard_reader *reader = (struct shard_reader *) cookie;
+    uint64_t const remaining = reader->end - reader->position;
+    if (size > remaining) {
+        size = (size_t) remaining;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    ssize_t num_read = 0;
+    do {
+        num_read = pread(reader->fd, buffer, size, (off_t) reader->position);
+    } while ((num_read < 0) && (errno == EINTR));
+    if (num_read > 0) {
+        reader->position += (uint64_t) num_read;
+    }
+    return num_read;
+}
+
+/*
+ * Connects to an address of the form host:port, retrying for a while in case nothing is listening there yet. Returns
+ * the connected socket, or -1.
+ */
+static int connect_to(char const *address)
+{
+    double const start_seconds = util_now_seconds();
+    for (;;) {
+        struct addrinfo *info = NULL;
+        if (!resolve(address, false, &info)) {
+            return -1;
+        }
+        int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if ((fd >= 0) && (connect(fd, info->ai_addr, info->ai_addrlen) == 0)) {
+            freeaddrinfo(info);
+            // Messages are small and are each followed by a wait for a reply, so don't hold them back.
+            int const no_delay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+            return fd;
+        }
+        int const connect_errno = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        freeaddrinfo(info);
+
+        if ((connect_errno != ECONNREFUSED) || (util_now_seconds() - start_seconds >= CONNECT_TIMEOUT_SECONDS)) {
+            errno = connect_errno;
+            return -1;
+        }
+        usleep(CONNECT_RETRY_MICROSECONDS);
+    }
+}
+
+static bool resolve(char const *address, bool passive, struct addrinfo **info)
+{
+    char host[MAX_ADDRESS_SIZE] = {0};
+    char const *const separator = strrchr(address, ':');
+    if (!separator || ((size_t) (separator - address) >= sizeof(host))) {
+        fprintf(stderr, "ERROR: address must be of the form host:port: %s\n", address);
+        return false;
+    }
+    memcpy(host, address, (size_t) (separator - address));
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    int const result = getaddrinfo(host[0] ? host : NULL, separator + 1, &hints, info);
+    if (result != 0) {
+        fprintf(stderr, "ERROR: unable to resolve %s: %s\n", address, gai_strerror(result));
+        return false;
+    }
+    return true;
+}
+
+static bool send_message(int fd, enum message_type type, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3)
+{
+    struct message const message = {.magic = MESSAGE_MAGIC, .type = type, .arguments = {a0, a1, a2, a3}};
+    return send_fully(fd, &message, sizeof(message));
+}
+
+static bool receive_message(int fd, enum message_type type, struct message *message)
+{
+    if (!receive_fully(fd, message, sizeof(*message))) {
+        return false;
+    }
+    if ((message->magic != MESSAGE_MAGIC) || (message->type != (uint64_t) type)) {
+        fprintf(stderr, "ERROR: unexpected message\n");
+        return false;
+    }
+    return true;
+}
+
+static bool send_string(int fd, char const *string)
+{
+    uint64_t const length = strlen(string);
+    return send_fully(fd, &length, sizeof(length)) && send_fully(fd, string, (size_t) length);
+}
+
+static bool receive_string(int fd, char *string, size_t string_size)
+{
+    uint64_t length = 0;
+    if (!receive_fully(fd, &length, sizeof(length)) || (length >= string_size)) {
+        return false;
+    }
+    string[length] = '\0';
+    return receive_fully(fd, string, (size_t) length);
+}
+
+static bool send_fully(int fd, void const *buffer, size_t size)
+{
+    char const *position = (char const *) buffer;
+    while (size > 0) {
+        // A peer that goes away should fail the send rather than kill the process.
+        ssize_t const num_sent = send(fd, position, size, MSG_NOSIGNAL);
+        if (num_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        position += num_sent;
+        size -= (size_t) num_sent;
+    }
+    return true;
+}
+
+static bool receive_fully(int fd, void *buffer, size_t size)
+{
+    char *position = (char *) buffer;
+    while (size > 0) {
+        ssize_t const num_received = recv(fd, position, size, 0);
+        if (num_received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (num_received == 0) {
+            errno = ECONNRESET;
+            return false;
+        }
+        position += num_received;
+        size -= (size_t) num_received;
+    }
+    return true;
+}
+
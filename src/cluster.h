@@ -0,0 +1,24 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+
+struct cluster_worker;
+
+bool cluster_coordinate(
+        char const *input_filename, char const *output_filename,
+        char const *const *worker_addresses, size_t num_workers,
+        uint64_t *num_values);
+
+struct cluster_worker *cluster_worker_new(char const *address);
+
+char const *cluster_worker_get_address(struct cluster_worker const *worker);
+
+bool cluster_worker_serve(struct cluster_worker *worker, struct arena *arena, size_t run_size, size_t max_files);
+
+void cluster_worker_delete(struct cluster_worker *worker);
+
+#endif // CLUSTER_H
@@ -0,0 +1,653 @@
+#include "count_sort.h"
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bigsort.h"
+#include "io_util.h"
+#include "min_heap.h"
+#include "plan.h"
+#include "run.h"
+
+// The pre-scan reads this many clumps of consecutive values from across the input.
+static size_t const SAMPLE_CLUMPS = 64;
+static size_t const SAMPLE_CLUMP_VALUES = 1024;
+
+// Counting only pays off if each distinct value in the sample turns up at least this many times on average, and if the
+// histogram can hold this many times as many distinct values as the sample has, since the sample misses rare values.
+static size_t const MIN_SAMPLE_REPEATS = 4;
+static size_t const DISTINCT_HEADROOM = 4;
+
+// A value and the number of times it occurs. The histogram is a hash table of these in which a zero count marks an
+// empty slot, and histogram runs are arrays of them sorted by value.
+struct count_entry {
+    uint32_t key;
+    uint32_t reserved;
+    uint64_t count;
+};
+
+struct count_sort_context {
+    char const *run_base_filename;
+    struct arena *arena;
+    struct progress *progress;
+};
+
+struct count_run_input {
+    FILE *file;
+    struct count_entry *block;
+    size_t count;
+    size_t position;
+};
+
+// Collects the entries coming out of a merge into a block, and writes the block out whenever it fills up. When
+// expanding, each entry is written as its value repeated count times, up to the limit, instead of as the entry itself.
+struct count_writer {
+    FILE *file;
+    bool expand;
+    void *block;
+    size_t block_size;
+    size_t fill;
+    uint64_t remaining;
+    uint64_t distinct;
+    struct progress *progress;
+};
+
+static bool create_count_runs(
+        struct count_sort_context const *context, FILE *input_file, FILE *output_file, uint64_t limit,
+        size_t *num_runs, uint64_t *num_distinct);
+
+static bool spill_histogram(
+        struct count_sort_context const *context, size_t run_number, struct count_entry *table, size_t capacity);
+
+static size_t gather_histogram(struct count_entry *table, size_t capacity);
+
+static bool merge_count_runs(
+        struct count_sort_context const *context, size_t generation, size_t first_run, size_t num_runs,
+        size_t block_size, FILE *output_file, bool expand, uint64_t limit, uint64_t *num_distinct);
+
+static bool refill_input(struct count_run_input *input, size_t block_entries);
+
+static void writer_init(
+        struct count_writer *writer, FILE *file, bool expand, void *block, size_t block_size, uint64_t limit,
+        struct progress *progress);
+
+static bool writer_add(struct count_writer *writer, uint32_t key, uint64_t count);
+
+static bool writer_flush(struct count_writer *writer);
+
+static int compare_entries(void const *a, void const *b);
+
+static size_t hash_slot(uint32_t key, unsigned int bits);
+
+static size_t count_generations(size_t num_runs, size_t fan_in);
+
+static void format_run_filename(
+        char *buffer, size_t buffer_size, struct count_sort_context const *context, size_t generation, size_t run);
+
+static void remove_runs(struct count_sort_context const *context, size_t generation, size_t num_runs);
+
+
+/*
+ * Decides whether the input has few enough distinct values for count_sort() to be the better way to sort it. Clumps of
+ * values are read from across the input, sorted and their distinct values counted. The input is worth counting if the
+ * values in the sample repeat often, and the histogram that the arena can hold has plenty of room for the number of
+ * distinct values seen.
+ *
+ * The input must be a regular file, since it's read at random. The sample is taken out of the arena and given back.
+ */
+bool count_sort_is_worthwhile(int input_fd, uint64_t input_size, struct arena *arena)
+{
+    assert(arena);
+
+    uint64_t const num_values = input_size / sizeof(uint32_t);
+    size_t num_samples = SAMPLE_CLUMPS * SAMPLE_CLUMP_VALUES;
+    bool const sample_everything = (num_values <= num_samples);
+    if (sample_everything) {
+        num_samples = (size_t) num_values;
+    }
+    if (num_samples == 0) {
+        return false;
+    }
+    size_t const arena_mark_before_samples = arena_mark(arena);
+    uint32_t *samples = (uint32_t *) arena_alloc(arena, num_samples * sizeof(uint32_t), ARENA_CACHE_LINE_ALIGNMENT);
+    if (!samples) {
+        return false;
+    }
+    // Clumps are evenly spaced, so that a time-ordered input's early values don't stand in for all of it.
+    size_t const clump_values = sample_everything ? num_samples : SAMPLE_CLUMP_VALUES;
+    uint64_t const clump_spacing = sample_everything ? 0 : (num_values - clump_values) / (SAMPLE_CLUMPS - 1);
+    for (size_t i = 0; i < num_samples; i += clump_values) {
+        uint64_t const position = (i / clump_values) * clump_spacing;
+        if (!io_pread_fully(input_fd, samples + i, clump_values * sizeof(uint32_t), position * sizeof(uint32_t))) {
+            arena_release(arena, arena_mark_before_samples);
+            return false;
+        }
+    }
+
+    run_sort(samples, num_samples);
+    size_t distinct = 1;
+    for (size_t i = 1; i < num_samples; i++) {
+        if (samples[i] != samples[i - 1]) {
+            distinct++;
+        }
+    }
+    arena_release(arena, arena_mark_before_samples);
+
+    // Most of the histogram's memory goes to the table, which is kept no more than three quarters full.
+    size_t const histogram_capacity = ((arena_available(arena, ARENA_CACHE_LINE_ALIGNMENT) / 2) /
+                                       sizeof(struct count_entry)) / 4 * 3;
+    return (distinct * MIN_SAMPLE_REPEATS <= num_samples) && (distinct * DISTINCT_HEADROOM <= histogram_capacity);
+}
+
+/*
+ * Sorts by counting instead of by comparing. The input is streamed once into a histogram: a hash table of the distinct
+ * values and the number of times each occurs. The histogram is then sorted by value and expanded, each value written
+ * out as many times as it was counted, straight into the output file. That is one read and one write of the data, no
+ * matter how large the input is, as long as the distinct values fit in memory.
+ *
+ * If the histogram fills up, it's sorted and written out as a histogram run, and counting starts over with an empty
+ * one. The runs are then merged, adding up the counts of values that occur in more than one, in as many generations as
+ * max_files requires, and the final merge expands the counts into the output. Runs are named after run_base_filename.
+ *
+ * With a limit, only the limit smallest values are written. Returns the number of histogram runs (zero if the histogram
+ * fit in memory), the number of merge generations including the one that expands the counts, and the number of
+ * distinct values written.
+ */
+bool count_sort(
+        FILE *input_file, FILE *output_file, char const *run_base_filename, uint64_t limit,
+        struct arena *arena, size_t max_files, struct progress *progress,
+        size_t *num_runs, size_t *generations, uint64_t *num_distinct)
+{
+    assert(input_file);
+    assert(output_file);
+    assert(run_base_filename);
+    assert(arena);
+    assert(num_runs);
+    assert(generations);
+    assert(num_distinct);
+
+    struct stat input_status = {0};
+    if (fstat(fileno(input_file), &input_status) != 0) {
+        fprintf(stderr, "ERROR: unable to determine input file size: %s\n", strerror(errno));
+        return false;
+    }
+    bool const input_size_known = S_ISREG(input_status.st_mode);
+    uint64_t const input_size = input_size_known ? (uint64_t) input_status.st_size : 0;
+
+    struct count_sort_context const context = {
+            .run_base_filename = run_base_filename,
+            .arena = arena,
+            .progress = progress,
+    };
+
+    // Counting is the first pass. Expanding the histogram into the output counts as a generation, and so does every
+    // merge of histogram runs on the way to it. Every pass reports progress in terms of the values it stands for.
+    progress_set_pass_phases(progress, BIGSORT_PHASE_COUNT, BIGSORT_PHASE_MERGE);
+    progress_plan_merge(progress, 1);
+    progress_start(progress, input_size, input_size_known);
+    size_t runs = 0;
+    if (!create_count_runs(&context, input_file, output_file, limit, &runs, num_distinct)) {
+        return false;
+    }
+    if (runs == 0) {
+        progress_finish(progress);
+        *num_runs = 0;
+        *generations = 1;
+        return true;
+    }
+
+    // Each merge needs a block per input plus one for its output, and a heap element per input.
+    size_t fan_in = plan_get_open_file_limit();
+    if ((max_files != 0) && (max_files < fan_in)) {
+        fan_in = max_files;
+    }
+    size_t const merge_memory = arena_available(arena, ARENA_PAGE_ALIGNMENT);
+    size_t const per_input_memory = PLAN_MIN_BLOCK_SIZE + sizeof(struct min_heap_element);
+    if (merge_memory / per_input_memory < fan_in + 2) {
+        fan_in = (merge_memory / per_input_memory > 2) ? (merge_memory / per_input_memory) - 2 : 0;
+    }
+    if (fan_in < 2) {
+        remove_runs(&context, 0, runs);
+        fprintf(stderr, "ERROR: working memory is too small to merge histogram runs\n");
+        return false;
+    }
+    size_t block_size = (merge_memory - (fan_in * sizeof(struct min_heap_element))) / (fan_in + 1);
+    if (block_size > PLAN_MAX_BLOCK_SIZE) {
+        block_size = PLAN_MAX_BLOCK_SIZE;
+    }
+    block_size &= ~(PLAN_MIN_BLOCK_SIZE - 1);
+    progress_plan_merge(progress, count_generations(runs, fan_in));
+
+    // Merge down until a single merge can take the rest.
+    bool success = true;
+    size_t generation = 0;
+    size_t remaining_runs = runs;
+    while (success && (remaining_runs > fan_in)) {
+        progress_begin_generation(progress, generation + 1);
+        size_t next_run = 0;
+        char filename[PATH_MAX] = {0};
+        for (size_t first = 0; success && (first < remaining_runs); first += fan_in) {
+            size_t const count = (remaining_runs - first < fan_in) ? remaining_runs - first : fan_in;
+            format_run_filename(filename, sizeof(filename), &context, generation + 1, next_run++);
+            FILE *run_file = fopen(filename, "wb");
+            if (!run_file) {
+                fprintf(stderr, "ERROR: unable to create histogram run file: %s\n", strerror(errno));
+                success = false;
+                break;
+            }
+            setvbuf(run_file, NULL, _IONBF, 0);
+            uint64_t merged_distinct = 0;
+            success = merge_count_runs(
+                    &context, generation, first, count, block_size, run_file, false, 0, &merged_distinct);
+            if ((fclose(run_file) != 0) && success) {
+                fprintf(stderr, "ERROR: unable to write histogram run file: %s\n", strerror(errno));
+                success = false;
+            }
+        }
+        if (!success) {
+            remove_runs(&context, generation, remaining_runs);
+            remove_runs(&context, generation + 1, next_run);
+        }
+        generation++;
+        remaining_runs = next_run;
+    }
+
+    // The final merge expands the counts into the output.
+    if (success) {
+        progress_begin_generation(progress, generation + 1);
+        success = merge_count_runs(
+                &context, generation, 0, remaining_runs, block_size, output_file, true, limit, num_distinct);
+        if (!success) {
+            remove_runs(&context, generation, remaining_runs);
+        }
+    }
+    if (success) {
+        progress_finish(progress);
+        *num_runs = runs;
+        *generations = generation + 1;
+    }
+    return success;
+}
+
+/*
+ * Counts the input's values into a histogram that takes up most of the arena, spilling it as a histogram run each time
+ * it fills up. If it never fills up, there are no runs, and the histogram is expanded straight into the output file.
+ */
+static bool create_count_runs(
+        struct count_sort_context const *context, FILE *input_file, FILE *output_file, uint64_t limit,
+        size_t *num_runs, uint64_t *num_distinct)
+{
+    struct arena *arena = context->arena;
+    size_t const arena_mark_before_counting = arena_mark(arena);
+
+    // The input is read in a small block, which also serves as the output block when expanding. The rest of the arena
+    // holds the table, whose size is a power of two so that a value's slot is a shift of its hash.
+    size_t read_size = arena_available(arena, ARENA_PAGE_ALIGNMENT) / 8;
+    if (read_size > PLAN_MAX_BLOCK_SIZE) {
+        read_size = PLAN_MAX_BLOCK_SIZE;
+    }
+    read_size &= ~(PLAN_MIN_BLOCK_SIZE - 1);
+    uint32_t *read_block = (read_size > 0) ? (uint32_t *) arena_alloc(arena, read_size, ARENA_PAGE_ALIGNMENT) : NULL;
+    size_t const table_memory = arena_available(arena, ARENA_CACHE_LINE_ALIGNMENT);
+    unsigned int bits = 0;
+    while ((bits < 32) && ((((size_t) 2 << bits) * sizeof(struct count_entry)) <= table_memory)) {
+        bits++;
+    }
+    size_t const capacity = (size_t) 1 << bits;
+    // A table too small to count in before spilling isn't worth having.
+    struct count_entry *table = (bits >= 8) ? (struct count_entry *) arena_alloc(
+            arena, capacity * sizeof(struct count_entry), ARENA_CACHE_LINE_ALIGNMENT) : NULL;
+    if (!read_block || !table) {
+        arena_release(arena, arena_mark_before_counting);
+        fprintf(stderr, "ERROR: working memory is too small to count values\n");
+        return false;
+    }
+    memset(table, 0, capacity * sizeof(struct count_entry));
+    size_t const mask = capacity - 1;
+    size_t const max_used = (capacity / 4) * 3;
+
+    bool success = true;
+    size_t used = 0;
+    size_t runs = 0;
+    struct count_entry *last_entry = NULL;
+    while (success) {
+        size_t const num_bytes = fread(read_block, 1, read_size, input_file);
+        if (ferror(input_file)) {
+            fprintf(stderr, "ERROR: unable to read input file: %s\n", strerror(errno));
+            success = false;
+            break;
+        }
+        if ((num_bytes % sizeof(uint32_t)) != 0) {
+            fprintf(stderr, "ERROR: input size must be a multiple of 4.\n");
+            success = false;
+            break;
+        }
+        size_t const num_values = num_bytes / sizeof(uint32_t);
+        for (size_t i = 0; i < num_values; i++) {
+            uint32_t const value = read_block[i];
+            // Repeats often come in a row, and then the slot is already known.
+            if (last_entry && (last_entry->key == value)) {
+                last_entry->count++;
+                continue;
+            }
+            size_t slot = hash_slot(value, bits);
+            while ((table[slot].count != 0) && (table[slot].key != value)) {
+                slot = (slot + 1) & mask;
+            }
+            if (table[slot].count == 0) {
+                if (used == max_used) {
+                    success = spill_histogram(context, runs++, table, capacity);
+                    if (!success) {
+                        break;
+                    }
+                    used = 0;
+                    slot = hash_slot(value, bits);
+                }
+                table[slot].key = value;
+                used++;
+            }
+            table[slot].count++;
+            last_entry = &table[slot];
+        }
+        progress_update(context->progress, num_bytes);
+        if (num_bytes < read_size) {
+            break;
+        }
+    }
+
+    if (success && (runs > 0) && (used > 0)) {
+        success = spill_histogram(context, runs++, table, capacity);
+    } else if (success && (runs == 0)) {
+        // Everything fit, so expand the histogram in value order straight into the output.
+        size_t const distinct = gather_histogram(table, capacity);
+        progress_begin_generation(context->progress, 1);
+        struct count_writer writer;
+        writer_init(&writer, output_file, true, read_block, read_size, limit, context->progress);
+        for (size_t i = 0; success && (i < distinct) && (writer.remaining > 0); i++) {
+            success = writer_add(&writer, table[i].key, table[i].count);
+        }
+        success = success && writer_flush(&writer);
+        *num_distinct = writer.distinct;
+    }
+
+    arena_release(arena, arena_mark_before_counting);
+    if (!success) {
+        remove_runs(context, 0, runs);
+        return false;
+    }
+    *num_runs = runs;
+    return true;
+}
+
+/*
+ * Writes the histogram's entries out in value order as a histogram run, and empties it.
+ */
+static bool spill_histogram(
+        struct count_sort_context const *context, size_t run_number, struct count_entry *table, size_t capacity)
+{
+    size_t const distinct = gather_histogram(table, capacity);
+
+    char filename[PATH_MAX] = {0};
+    format_run_filename(filename, sizeof(filename), context, 0, run_number);
+    FILE *run_file = fopen(filename, "wb");
+    if (!run_file) {
+        fprintf(stderr, "ERROR: unable to create histogram run file: %s\n", strerror(errno));
+        return false;
+    }
+    setvbuf(run_file, NULL, _IONBF, 0);
+    bool success = (fwrite(table, sizeof(struct count_entry), distinct, run_file) == distinct);
+    if ((fclose(run_file) != 0) || !success) {
+        fprintf(stderr, "ERROR: unable to write histogram run file: %s\n", strerror(errno));
+        success = false;
+    }
+    memset(table, 0, capacity * sizeof(struct count_entry));
+    return success;
+}
+
+/*
+ * Moves the histogram's entries to the front of the table and sorts them by value. After this, the table is no longer
+ * a hash table until it's cleared.
+ *
+ * Returns: The number of entries.
+ */
+static size_t gather_histogram(struct count_entry *table, size_t capacity)
+{
+    size_t distinct = 0;
+    for (size_t i = 0; i < capacity; i++) {
+        if (table[i].count != 0) {
+            table[distinct++] = table[i];
+        }
+    }
+    qsort(table, distinct, sizeof(struct count_entry), compare_entries);
+    return distinct;
+}
+
+/*
+ * Merges num_runs consecutive histogram runs of a generation into output_file, and removes them once they've been
+ * merged. A value's counts from different runs are added up. If expand is set, the values are written out rather than
+ * the entries, and the merge stops once limit values (if not zero) have been written.
+ */
+static bool merge_count_runs(
+        struct count_sort_context const *context, size_t generation, size_t first_run, size_t num_runs,
+        size_t block_size, FILE *output_file, bool expand, uint64_t limit, uint64_t *num_distinct)
+{
+    struct arena *arena = context->arena;
+    size_t const block_entries = block_size / sizeof(struct count_entry);
+    size_t const arena_mark_before_merge = arena_mark(arena);
+    struct count_entry *blocks = (struct count_entry *) arena_alloc(
+            arena, (num_runs + 1) * block_size, ARENA_PAGE_ALIGNMENT);
+    size_t const heap_size = num_runs * sizeof(struct min_heap_element);
+    void *heap_data = arena_alloc(arena, heap_size, ARENA_CACHE_LINE_ALIGNMENT);
+    struct count_run_input *inputs = (struct count_run_input *) calloc(num_runs, sizeof(struct count_run_input));
+    struct min_heap *heap = heap_data ? min_heap_new(heap_data, heap_size) : NULL;
+    bool success = blocks && inputs && heap;
+    if (!success) {
+        fprintf(stderr, "ERROR: unable to allocate merge blocks\n");
+    }
+
+    // Open every run and read its first block. Runs that turn out to be empty never make it into the heap.
+    char filename[PATH_MAX] = {0};
+    for (size_t i = 0; success && (i < num_runs); i++) {
+        format_run_filename(filename, sizeof(filename), context, generation, first_run + i);
+        inputs[i].file = fopen(filename, "rb");
+        if (!inputs[i].file) {
+            fprintf(stderr, "ERROR: unable to open histogram run file: %s\n", strerror(errno));
+            success = false;
+            break;
+        }
+        setvbuf(inputs[i].file, NULL, _IONBF, 0);
+        inputs[i].block = blocks + (i * block_entries);
+        success = refill_input(&inputs[i], block_entries);
+        if (success && (inputs[i].count > 0)) {
+            min_heap_add(heap, inputs[i].block[0].key, (uint32_t) i);
+        }
+    }
+
+    // Entries come off the heap in value order. Add up the counts of each value before passing it on.
+    struct count_writer writer;
+    writer_init(&writer, output_file, expand, blocks + (num_runs * block_entries), block_size, limit,
+                context->progress);
+    bool pending = false;
+    struct count_entry total = {0};
+    uint32_t key = 0;
+    uint32_t input_index = 0;
+    while (success && (writer.remaining > 0) && min_heap_pop(heap, &key, &input_index)) {
+        struct count_run_input *input = &inputs[input_index];
+        uint64_t const count = input->block[input->position++].count;
+        if (pending && (total.key == key)) {
+            total.count += count;
+        } else {
+            if (pending) {
+                success = writer_add(&writer, total.key, total.count);
+            }
+            total.key = key;
+            total.count = count;
+            pending = true;
+        }
+        if (input->position == input->count) {
+            success = success && refill_input(input, block_entries);
+        }
+        if (success && (input->position < input->count)) {
+            min_heap_add(heap, input->block[input->position].key, input_index);
+        }
+    }
+    if (success && pending) {
+        success = writer_add(&writer, total.key, total.count);
+    }
+    success = success && writer_flush(&writer);
+    *num_distinct = writer.distinct;
+
+    for (size_t i = 0; inputs && (i < num_runs); i++) {
+        if (inputs[i].file) {
+            fclose(inputs[i].file);
+        }
+    }
+    if (success) {
+        for (size_t i = 0; i < num_runs; i++) {
+            format_run_filename(filename, sizeof(filename), context, generation, first_run + i);
+            remove(filename);
+        }
+    }
+    min_heap_delete(heap);
+    free(inputs);
+    arena_release(arena, arena_mark_before_merge);
+    return success;
+}
+
+static bool refill_input(struct count_run_input *input, size_t block_entries)
+{
+    input->count = fread(input->block, sizeof(struct count_entry), block_entries, input->file);
+    input->position = 0;
+    if (ferror(input->file)) {
+        fprintf(stderr, "ERROR: unable to read histogram run file: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void writer_init(
+        struct count_writer *writer, FILE *file, bool expand, void *block, size_t block_size, uint64_t limit,
+        struct progress *progress)
+{
+    writer->file = file;
+    writer->expand = expand;
+    writer->block = block;
+    writer->block_size = block_size;
+    writer->fill = 0;
+    writer->remaining = (expand && (limit != 0)) ? limit : UINT64_MAX;
+    writer->distinct = 0;
+    writer->progress = progress;
+}
+
+/*
+ * Adds a value and its count to the writer's block, writing the block out whenever it fills up.
+ */
+static bool writer_add(struct count_writer *writer, uint32_t key, uint64_t count)
+{
+    if (writer->remaining == 0) {
+        return true;
+    }
+    writer->distinct++;
+    if (!writer->expand) {
+        struct count_entry *entries = (struct count_entry *) writer->block;
+        entries[writer->fill].key = key;
+        entries[writer->fill].reserved = 0;
+        entries[writer->fill].count = count;
+        writer->fill++;
+        if ((writer->fill == writer->block_size / sizeof(struct count_entry)) && !writer_flush(writer)) {
+            return false;
+        }
+        // The entry stands for count values' worth of the data.
+        progress_update(writer->progress, count * sizeof(uint32_t));
+        return true;
+    }
+
+    uint32_t *values = (uint32_t *) writer->block;
+    size_t const block_values = writer->block_size / sizeof(uint32_t);
+    if (count > writer->remaining) {
+        count = writer->remaining;
+    }
+    writer->remaining -= count;
+    while (count > 0) {
+        size_t span = block_values - writer->fill;
+        if (span > count) {
+            span = (size_t) count;
+        }
+        for (size_t i = 0; i < span; i++) {
+            values[writer->fill + i] = key;
+        }
+        writer->fill += span;
+        count -= span;
+        if ((writer->fill == block_values) && !writer_flush(writer)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool writer_flush(struct count_writer *writer)
+{
+    if (writer->fill == 0) {
+        return true;
+    }
+    size_t const element_size = writer->expand ? sizeof(uint32_t) : sizeof(struct count_entry);
+    if (fwrite(writer->block, element_size, writer->fill, writer->file) != writer->fill) {
+        fprintf(stderr, "ERROR: unable to write %s: %s\n", writer->expand ? "output" : "histogram run file",
+                strerror(errno));
+        return false;
+    }
+    if (writer->expand) {
+        progress_update(writer->progress, writer->fill * sizeof(uint32_t));
+    }
+    writer->fill = 0;
+    return true;
+}
+
+static int compare_entries(void const *a, void const *b)
+{
+    uint32_t const x = ((struct count_entry const *) a)->key;
+    uint32_t const y = ((struct count_entry const *) b)->key;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Fibonacci hashing: multiplying by 2^32 divided by the golden ratio spreads nearby values across the table, and the
+ * top bits of the product pick the slot.
+ */
+static size_t hash_slot(uint32_t key, unsigned int bits)
+{
+    return (size_t) ((uint32_t) (key * 0x9E3779B1u) >> (32 - bits));
+}
+
+/*
+ * Counts the merge passes needed to get num_runs histogram runs into one, counting the final pass even if there's only
+ * one run to begin with, since that pass also expands the counts.
+ */
+static size_t count_generations(size_t num_runs, size_t fan_in)
+{
+    size_t generations = 1;
+    while (num_runs > fan_in) {
+        num_runs = (num_runs + fan_in - 1) / fan_in;
+        generations++;
+    }
+    return generations;
+}
+
+static void format_run_filename(
+        char *buffer, size_t buffer_size, struct count_sort_context const *context, size_t generation, size_t run)
+{
+    snprintf(buffer, buffer_size, "%s.counts.%lu.%lu", context->run_base_filename, generation, run);
+}
+
+static void remove_runs(struct count_sort_context const *context, size_t generation, size_t num_runs)
+{
+    char filename[PATH_MAX] = {0};
+    for (size_t i = 0; i < num_runs; i++) {
+        format_run_filename(filename, sizeof(filename), context, generation, i);
+        remove(filename);
+    }
+}
+
@@ -0,0 +1,18 @@
+#ifndef COUNT_SORT_H
+#define COUNT_SORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "arena.h"
+#include "progress.h"
+
+bool count_sort_is_worthwhile(int input_fd, uint64_t input_size, struct arena *arena);
+
+bool count_sort(
+        FILE *input_file, FILE *output_file, char const *run_base_filename, uint64_t limit,
+        struct arena *arena, size_t max_files, struct progress *progress,
+        size_t *num_runs, size_t *generations, uint64_t *num_distinct);
+
+#endif // COUNT_SORT_H
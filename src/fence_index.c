@@ -0,0 +1,345 @@
+// fopencookie() is a GNU extension.
+#define _GNU_SOURCE
+
+#include "fence_index.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "io_util.h"
+
+// Every index file starts with this, so that nothing else is mistaken for one. Bump it whenever the format changes.
+static uint64_t const INDEX_MAGIC = 0x62696769647832ULL; // "bigidx2"
+
+struct fence_index_header {
+    uint64_t magic;
+    uint64_t interval;
+    uint64_t num_values;
+    uint64_t num_fences;
+
+    // When the indexed file was last modified as of the index being finished. A file that has been rewritten since,
+    // even with as many values, is no longer the one that the fences point into.
+    int64_t modified_seconds;
+    int64_t modified_nanoseconds;
+};
+
+struct fence_index_writer {
+    FILE *index_file;
+    char filename[PATH_MAX];
+    FILE *output_file;
+    FILE *stream;
+    uint64_t interval;
+    bool finished;
+
+    // Bytes of output passed on so far, and where the next fence's key starts. A key may be split across writes, so
+    // it's collected a byte at a time.
+    uint64_t position;
+    uint64_t next_fence_offset;
+    uint8_t key_bytes[sizeof(uint32_t)];
+    size_t key_size;
+    uint64_t num_fences;
+};
+
+struct fence_index {
+    void *mapping;
+    size_t mapping_size;
+    struct fence_index_header const *header;
+    struct fence const *fences;
+};
+
+static ssize_t write_output(void *cookie, char const *buffer, size_t size);
+
+
+/*
+ * Creates a sparse index of a sorted file as it's written. Everything that's written to the writer's stream (see
+ * fence_index_writer_get_stream()) is passed on to output_file, and every interval-th value is recorded along with its
+ * offset as a fence in the index file. This costs a few bytes of index per interval values, and no extra pass over the
+ * output.
+ *
+ * The index file is a header followed by the fences in order. It's removed again unless the writer is finished.
+ */
+struct fence_index_writer *fence_index_writer_new(char const *filename, uint64_t interval, FILE *output_file)
+{
+    assert(filename);
+    assert(interval > 0);
+    assert(output_file);
+
+    struct fence_index_writer *writer = (struct fence_index_writer *) malloc(sizeof(struct fence_index_writer));
+    if (!writer) {
+        return NULL;
+    }
+    snprintf(writer->filename, sizeof(writer->filename), "%s", filename);
+    writer->output_file = output_file;
+    writer->stream = NULL;
+    writer->interval = interval;
+    writer->finished = false;
+    writer->position = 0;
+    writer->next_fence_offset = 0;
+    writer->key_size = 0;
+    writer->num_fences = 0;
+
+    // The header is written last, once the counts are known. Until then, a zeroed one keeps its place.
+    struct fence_index_header const header = {0};
+    writer->index_file = fopen(filename, "wb");
+    if (!writer->index_file || (fwrite(&header, sizeof(header), 1, writer->index_file) != 1)) {
+        fprintf(stderr, "ERROR: unable to create index file: %s\n", strerror(errno));
+        fence_index_writer_delete(writer);
+        return NULL;
+    }
+
+    cookie_io_functions_t const functions = {.write = write_output};
+    writer->stream = fopencookie(writer, "wb", functions);
+    if (!writer->stream) {
+        fprintf(stderr, "ERROR: unable to create index stream: %s\n", strerror(errno));
+        fence_index_writer_delete(writer);
+        return NULL;
+    }
+    // Writes pass straight through to the output, which does its own buffering, if any.
+    setvbuf(writer->stream, NULL, _IONBF, 0);
+    return writer;
+}
+
+/*
+ * Gets the stream that the sorted output is to be written to.
+ */
+FILE *fence_index_writer_get_stream(struct fence_index_writer const *writer)
+{
+    assert(writer);
+    return writer->stream;
+}
+
+/*
+ * Completes the index once all of the output has been written through the writer's stream.
+ */
+bool fence_index_writer_finish(struct fence_index_writer *writer)
+{
+    assert(writer);
+    assert(!writer->finished);
+
+    if ((fflush(writer->stream) != 0) || ferror(writer->stream)) {
+        return false;
+    }
+    if ((writer->position % sizeof(uint32_t)) != 0) {
+        fprintf(stderr, "ERROR: indexed output's size must be a multiple of 4.\n");
+        return false;
+    }
+    // The output's modification time is only final once everything buffered for it has been written.
+    struct stat output_status = {0};
+    if ((fflush(writer->output_file) != 0) || (fstat(fileno(writer->output_file), &output_status) != 0)) {
+        fprintf(stderr, "ERROR: unable to write indexed output: %s\n", strerror(errno));
+        return false;
+    }
+
+    struct fence_index_header const header = {
+            .magic = INDEX_MAGIC,
+            .interval = writer->interval,
+            .num_values = writer->position / sizeof(uint32_t),
+            .num_fences = writer->num_fences,
+            .modified_seconds = (int64_t) output_status.st_mtim.tv_sec,
+            .modified_nanoseconds = (int64_t) output_status.st_mtim.tv_nsec};
+    bool success = (fseeko(writer->index_file, 0, SEEK_SET) == 0) &&
+                   (fwrite(&header, sizeof(header), 1, writer->index_file) == 1);
+    success = (fclose(writer->index_file) == 0) && success;
+    writer->index_file = NULL;
+    if (!success) {
+        fprintf(stderr, "ERROR: unable to write index file: %s\n", strerror(errno));
+        return false;
+    }
+    writer->finished = true;
+    return true;
+}
+
+/*
+ * Deletes the writer. The output file is left open. The index file is removed if the writer wasn't finished.
+ */
+void fence_index_writer_delete(struct fence_index_writer *writer)
+{
+    if (writer) {
+        if (writer->stream) {
+            fclose(writer->stream);
+        }
+        if (writer->index_file) {
+            fclose(writer->index_file);
+        }
+        if (!writer->finished) {
+            remove(writer->filename);
+        }
+        free(writer);
+    }
+}
+
+/*
+ * Opens an index file for lookups in the indexed file, which indexed_fd is open for. The fences are memory-mapped
+ * rather than read, so that a lookup only touches the pages that its binary search visits.
+ *
+ * An index is refused unless the indexed file is still the one it was written for, with as many values and the same
+ * modification time, since a stale index would send lookups to the wrong blocks.
+ */
+struct fence_index *fence_index_open(char const *filename, int indexed_fd)
+{
+    assert(filename);
+
+    int const fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: unable to open index file: %s\n", strerror(errno));
+        return NULL;
+    }
+    struct stat index_status = {0};
+    if ((fstat(fd, &index_status) != 0) || ((size_t) index_status.st_size < sizeof(struct fence_index_header))) {
+        close(fd);
+        fprintf(stderr, "ERROR: %s isn't an index file\n", filename);
+        return NULL;
+    }
+    size_t const mapping_size = (size_t) index_status.st_size;
+    void *mapping = mmap(NULL, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "ERROR: unable to map index file: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    struct fence_index_header const *header = (struct fence_index_header const *) mapping;
+    uint64_t const fences_size = (mapping_size - sizeof(*header)) / sizeof(struct fence);
+    if ((header->magic != INDEX_MAGIC) || (header->interval == 0) || (header->num_fences != fences_size) ||
+        (sizeof(*header) + (header->num_fences * sizeof(struct fence)) != mapping_size)) {
+        munmap(mapping, mapping_size);
+        fprintf(stderr, "ERROR: %s isn't an index file\n", filename);
+        return NULL;
+    }
+    struct stat indexed_status = {0};
+    if ((fstat(indexed_fd, &indexed_status) != 0) ||
+        ((uint64_t) indexed_status.st_size != header->num_values * sizeof(uint32_t)) ||
+        ((int64_t) indexed_status.st_mtim.tv_sec != header->modified_seconds) ||
+        ((int64_t) indexed_status.st_mtim.tv_nsec != header->modified_nanoseconds)) {
+        munmap(mapping, mapping_size);
+        fprintf(stderr, "ERROR: %s is an index of an earlier version of its file\n", filename);
+        return NULL;
+    }
+
+    struct fence_index *index = (struct fence_index *) malloc(sizeof(struct fence_index));
+    if (!index) {
+        munmap(mapping, mapping_size);
+        return NULL;
+    }
+    index->mapping = mapping;
+    index->mapping_size = mapping_size;
+    index->header = header;
+    index->fences = (struct fence const *) (header + 1);
+    return index;
+}
+
+uint64_t fence_index_get_interval(struct fence_index const *index)
+{
+    assert(index);
+    return index->header->interval;
+}
+
+uint64_t fence_index_get_num_values(struct fence_index const *index)
+{
+    assert(index);
+    return index->header->num_values;
+}
+
+/*
+ * Finds the part of the sorted file, from begin_offset up to end_offset, that the first value that's at least key is
+ * in. If no value in that part is, the first such value is the one at end_offset (or there's none, if that's the end
+ * of the file). The part holds at most an interval's worth of values, so it takes a single read to find the value.
+ */
+void fence_index_bracket(
+        struct fence_index const *index, uint32_t key, uint64_t *begin_offset, uint64_t *end_offset)
+{
+    assert(index);
+    assert(begin_offset);
+    assert(end_offset);
+
+    // Find the first fence that's at least the key. Everything before the fence before it is smaller than the key.
+    size_t low = 0;
+    size_t high = (size_t) index->header->num_fences;
+    while (low < high) {
+        size_t const mid = low + ((high - low) / 2);
+        if (index->fences[mid].key < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *begin_offset = (low > 0) ? index->fences[low - 1].offset : 0;
+    *end_offset = (low < index->header->num_fences) ? index->fences[low].offset
+                                                    : index->header->num_values * sizeof(uint32_t);
+}
+
+/*
+ * Finds the position of the first value in the indexed file, which fd is open for reading, that's at least key, or the
+ * number of values if there's none. The index narrows that down to a single block, which is read into block (room for
+ * an interval's worth of values) and binary-searched.
+ */
+bool fence_index_find(struct fence_index const *index, int fd, uint32_t key, uint32_t *block, uint64_t *position)
+{
+    assert(index);
+    assert(block);
+    assert(position);
+
+    uint64_t begin_offset = 0;
+    uint64_t end_offset = 0;
+    fence_index_bracket(index, key, &begin_offset, &end_offset);
+    size_t const num_values = (size_t) ((end_offset - begin_offset) / sizeof(uint32_t));
+    if (!io_pread_fully(fd, block, num_values * sizeof(uint32_t), begin_offset)) {
+        fprintf(stderr, "ERROR: unable to read indexed file: %s\n", strerror(errno));
+        return false;
+    }
+
+    size_t low = 0;
+    size_t high = num_values;
+    while (low < high) {
+        size_t const mid = low + ((high - low) / 2);
+        if (block[mid] < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *position = (begin_offset / sizeof(uint32_t)) + low;
+    return true;
+}
+
+void fence_index_close(struct fence_index *index)
+{
+    if (index) {
+        munmap(index->mapping, index->mapping_size);
+        free(index);
+    }
+}
+
+static ssize_t write_output(void *cookie, char const *buffer, size_t size)
+{
+    struct fence_index_writer *writer = (struct fence_index_writer *) cookie;
+    if (fwrite(buffer, 1, size, writer->output_file) != size) {
+        return -1;
+    }
+
+    // Pick out the keys of any fences that this write covers.
+    uint64_t const end = writer->position + size;
+    while (writer->next_fence_offset + writer->key_size < end) {
+        writer->key_bytes[writer->key_size] =
+                (uint8_t) buffer[writer->next_fence_offset + writer->key_size - writer->position];
+        writer->key_size++;
+        if (writer->key_size == sizeof(uint32_t)) {
+            struct fence fence = {.key = 0, .reserved = 0, .offset = writer->next_fence_offset};
+            memcpy(&fence.key, writer->key_bytes, sizeof(fence.key));
+            if (fwrite(&fence, sizeof(fence), 1, writer->index_file) != 1) {
+                return -1;
+            }
+            writer->num_fences++;
+            writer->key_size = 0;
+            writer->next_fence_offset += writer->interval * sizeof(uint32_t);
+        }
+    }
+    writer->position = end;
+    return (ssize_t) size;
+}
+
@@ -0,0 +1,41 @@
+#ifndef FENCE_INDEX_H
+#define FENCE_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Every interval-th value of a sorted file and where it is in the file.
+struct fence {
+    uint32_t key;
+    uint32_t reserved;
+    uint64_t offset;
+};
+
+struct fence_index_writer;
+
+struct fence_index_writer *fence_index_writer_new(char const *filename, uint64_t interval, FILE *output_file);
+
+FILE *fence_index_writer_get_stream(struct fence_index_writer const *writer);
+
+bool fence_index_writer_finish(struct fence_index_writer *writer);
+
+void fence_index_writer_delete(struct fence_index_writer *writer);
+
+struct fence_index;
+
+struct fence_index *fence_index_open(char const *filename, int indexed_fd);
+
+uint64_t fence_index_get_interval(struct fence_index const *index);
+
+uint64_t fence_index_get_num_values(struct fence_index const *index);
+
+void fence_index_bracket(
+        struct fence_index const *index, uint32_t key, uint64_t *begin_offset, uint64_t *end_offset);
+
+bool fence_index_find(struct fence_index const *index, int fd, uint32_t key, uint32_t *block, uint64_t *position);
+
+void fence_index_close(struct fence_index *index);
+
+#endif // FENCE_INDEX_H
@@ -0,0 +1,74 @@
+#include "io_util.h"
+#include <errno.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+
+/*
+ * Reads size bytes at offset into buffer, however many reads it takes. Reads that are interrupted by a signal are
+ * retried. A file that ends before size bytes have been read fails the read with errno set to EIO.
+ */
+bool io_pread_fully(int fd, void *buffer, size_t size, uint64_t offset)
+{
+    char *position = (char *) buffer;
+    while (size > 0) {
+        ssize_t const num_read = pread(fd, position, size, (off_t) offset);
+        if (num_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (num_read == 0) {
+            errno = EIO;
+            return false;
+        }
+        position += num_read;
+        offset += (uint64_t) num_read;
+        size -= (size_t) num_read;
+    }
+    return true;
+}
+
+/*
+ * Writes size bytes from buffer at offset, however many writes it takes. Writes that are interrupted by a signal are
+ * retried.
+ */
+bool io_pwrite_fully(int fd, void const *buffer, size_t size, uint64_t offset)
+{
+    char const *position = (char const *) buffer;
+    while (size > 0) {
+        ssize_t const num_written = pwrite(fd, position, size, (off_t) offset);
+        if (num_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        position += num_written;
+        offset += (uint64_t) num_written;
+        size -= (size_t) num_written;
+    }
+    return true;
+}
+
+/*
+ * Writes size bytes from buffer at the file's current position, like io_pwrite_fully(). This works for files that
+ * can't be written at an offset, such as pipes.
+ */
+bool io_write_fully(int fd, void const *buffer, size_t size)
+{
+    char const *position = (char const *) buffer;
+    while (size > 0) {
+        ssize_t const num_written = write(fd, position, size);
+        if (num_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        position += num_written;
+        size -= (size_t) num_written;
+    }
+    return true;
+}
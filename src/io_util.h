@@ -0,0 +1,12 @@
+#ifndef IO_UTIL_H
+#define IO_UTIL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+bool io_pread_fully(int fd, void *buffer, size_t size, uint64_t offset);
+bool io_pwrite_fully(int fd, void const *buffer, size_t size, uint64_t offset);
+bool io_write_fully(int fd, void const *buffer, size_t size);
+
+#endif // IO_UTIL_H
@@ -0,0 +1,569 @@
+#include "key_sort.h"
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bigsort.h"
+#include "io_util.h"
+#include "merge.h"
+#include "plan.h"
+
+// When gathering, the records between two wanted rows are read along with them instead of being skipped with a
+// separate read, as long as they take up no more than this.
+static size_t const MAX_GATHER_GAP = (size_t) 64 << 10;
+
+// A record's key and its position in the input. Runs and merges only ever move these, never the records themselves.
+struct key_row {
+    uint32_t key;
+    uint32_t row;
+};
+
+struct key_sort_context {
+    char const *output_filename;
+    char run_base_filename[PATH_MAX];
+    size_t record_size;
+    struct arena *arena;
+    struct progress *progress;
+};
+
+static size_t create_key_runs(struct key_sort_context const *context, FILE *input_file, size_t *run_size);
+
+static bool write_key_run(
+        struct key_sort_context const *context, size_t run_number,
+        struct key_row *pairs, struct key_row *scratch, size_t count);
+
+static bool merge_key_runs(
+        struct key_sort_context const *context, size_t num_runs, size_t run_size, size_t max_files,
+        size_t gather_passes, FILE *rows_file, size_t *generations);
+
+static bool merge_final_runs(
+        struct key_sort_context const *context, size_t generation, size_t num_runs, size_t block_size,
+        struct key_row *pairs, size_t block_pairs, FILE *rows_file);
+
+static bool gather_records(
+        struct key_sort_context const *context, int input_fd, FILE *rows_file, FILE *output_file);
+
+static void sort_by_key(struct key_row *pairs, struct key_row *scratch, size_t count);
+
+static bool format_run_filename(
+        char *buffer, size_t buffer_size, struct key_sort_context const *context, size_t generation, size_t run);
+
+static void remove_all_runs(struct key_sort_context const *context, size_t num_runs);
+
+
+/*
+ * Sorts fixed-size records by their key, which is the native-endian, unsigned 32-bit integer in each record's first
+ * four bytes, without moving the records through the merge.
+ *
+ * Runs hold (key, row) pairs, where row is the record's position in the input, so every merge generation moves eight
+ * bytes per record whatever the record size. The sort is stable: records with equal keys keep their input order. The
+ * final merge keeps only the rows, which makes a permutation: the row of the record that belongs at each position of
+ * the sorted output, as unsigned 32-bit integers. With KEY_SORT_OUTPUT_PERMUTATION, that's what's written to the output
+ * file. With KEY_SORT_OUTPUT_GATHER, a final pass reads the records from the input in that order and writes them out.
+ * It reads a batch of rows at a time in ascending order, so that nearby records are read together.
+ *
+ * Rows are 32 bits, so the input may hold at most 2^32 records. Gathering reads the input at random, so it must be a
+ * regular file.
+ */
+bool key_sort(
+        FILE *input_file, char const *output_filename, size_t record_size, enum key_sort_output output,
+        struct arena *arena, size_t max_files, struct progress *progress,
+        size_t *num_runs, size_t *generations)
+{
+    assert(input_file);
+    assert(output_filename);
+    assert(arena);
+    assert(num_runs);
+    assert(generations);
+
+    if (record_size < sizeof(uint32_t)) {
+        fprintf(stderr, "ERROR: records must be at least %lu bytes to hold a key\n", sizeof(uint32_t));
+        return false;
+    }
+    struct stat input_status = {0};
+    if (fstat(fileno(input_file), &input_status) != 0) {
+        fprintf(stderr, "ERROR: unable to determine input file size: %s\n", strerror(errno));
+        return false;
+    }
+    bool const input_size_known = S_ISREG(input_status.st_mode);
+    uint64_t const input_size = input_size_known ? (uint64_t) input_status.st_size : 0;
+    if ((output == KEY_SORT_OUTPUT_GATHER) && !input_size_known) {
+        fprintf(stderr, "ERROR: gathering records requires an input file that can be read at random\n");
+        return false;
+    }
+    if ((input_size % record_size) != 0) {
+        fprintf(stderr, "ERROR: input file's size must be a multiple of the record size.\n");
+        return false;
+    }
+
+    struct key_sort_context context = {
+            .output_filename = output_filename,
+            .record_size = record_size,
+            .arena = arena,
+            .progress = progress,
+    };
+    if (snprintf(context.run_base_filename, sizeof(context.run_base_filename), "%s.keys", output_filename) >=
+        (int) sizeof(context.run_base_filename)) {
+        fprintf(stderr, "ERROR: output file path is too long\n");
+        return false;
+    }
+    // The final merge writes rows only, either as the output or for the gather pass to read.
+    char rows_filename[PATH_MAX] = {0};
+    int const rows_filename_length =
+            (output == KEY_SORT_OUTPUT_GATHER)
+            ? snprintf(rows_filename, sizeof(rows_filename), "%s.rows", context.run_base_filename)
+            : snprintf(rows_filename, sizeof(rows_filename), "%s", output_filename);
+    if (rows_filename_length >= (int) sizeof(rows_filename)) {
+        fprintf(stderr, "ERROR: output file path is too long\n");
+        return false;
+    }
+    size_t const gather_passes = (output == KEY_SORT_OUTPUT_GATHER) ? 1 : 0;
+
+    // Every pass reports progress in terms of the pairs it moves, which is what the merges count, so that the passes
+    // weigh the same.
+    progress_set_pass_phases(progress, BIGSORT_PHASE_CREATE_RUNS, BIGSORT_PHASE_MERGE);
+    progress_plan_merge(progress, 1 + gather_passes);
+    progress_start(progress, (input_size / record_size) * sizeof(struct key_row), input_size_known);
+    size_t run_size = 0;
+    size_t const runs = create_key_runs(&context, input_file, &run_size);
+    if (runs == 0) {
+        return false;
+    }
+
+    FILE *rows_file = fopen(rows_filename, "wb");
+    if (!rows_file) {
+        fprintf(stderr, "ERROR: unable to create output file: %s\n", strerror(errno));
+        remove_all_runs(&context, runs);
+        return false;
+    }
+    setvbuf(rows_file, NULL, _IONBF, 0);
+    size_t merge_generations = 0;
+    bool success = merge_key_runs(&context, runs, run_size, max_files, gather_passes, rows_file, &merge_generations);
+    if ((fclose(rows_file) != 0) && success) {
+        fprintf(stderr, "ERROR: unable to write output file: %s\n", strerror(errno));
+        success = false;
+    }
+    if (!success) {
+        remove(rows_filename);
+    }
+
+    if (success && (output == KEY_SORT_OUTPUT_GATHER)) {
+        progress_begin_generation(progress, merge_generations + 1);
+        FILE *sorted_rows_file = fopen(rows_filename, "rb");
+        FILE *output_file = fopen(output_filename, "wb");
+        bool const output_created = (output_file != NULL);
+        if (!sorted_rows_file || !output_file) {
+            fprintf(stderr, "ERROR: unable to open files to gather records: %s\n", strerror(errno));
+            success = false;
+        } else {
+            // Both are read and written a batch at a time.
+            setvbuf(sorted_rows_file, NULL, _IONBF, 0);
+            setvbuf(output_file, NULL, _IONBF, 0);
+            success = gather_records(&context, fileno(input_file), sorted_rows_file, output_file);
+        }
+        if (sorted_rows_file) {
+            fclose(sorted_rows_file);
+        }
+        if (output_file && (fclose(output_file) != 0) && success) {
+            fprintf(stderr, "ERROR: unable to write output file: %s\n", strerror(errno));
+            success = false;
+        }
+        remove(rows_filename);
+        // Don't leave a partly gathered output behind.
+        if (!success && output_created) {
+            remove(output_filename);
+        }
+    }
+
+    if (success) {
+        progress_finish(progress);
+        *num_runs = runs;
+        *generations = merge_generations;
+    }
+    return success;
+}
+
+/*
+ * Reads the input a block at a time, collecting a (key, row) pair for each record. Each time the pairs fill the
+ * arena, they're sorted and written out as a run. Rows are assigned in input order, and the pairs are sorted stably,
+ * so each run is ordered by key and then by row.
+ *
+ * Returns: The number of runs created, which is at least one even for an empty input, or zero if an error occurs. The
+ *          size of a full run is stored in run_size.
+ */
+static size_t create_key_runs(struct key_sort_context const *context, FILE *input_file, size_t *run_size)
+{
+    struct arena *arena = context->arena;
+    size_t const record_size = context->record_size;
+    size_t const arena_mark_before_runs = arena_mark(arena);
+
+    // The input is read in a small block. The rest of the arena holds pairs, plus scratch to sort them with.
+    size_t read_size = arena_available(arena, ARENA_PAGE_ALIGNMENT) / 8;
+    if (read_size > PLAN_MAX_BLOCK_SIZE) {
+        read_size = PLAN_MAX_BLOCK_SIZE;
+    }
+    read_size -= read_size % record_size;
+    char *read_block = (read_size > 0) ? (char *) arena_alloc(arena, read_size, ARENA_PAGE_ALIGNMENT) : NULL;
+    size_t const capacity = arena_available(arena, ARENA_CACHE_LINE_ALIGNMENT) / (2 * sizeof(struct key_row));
+    struct key_row *pairs = (capacity > 0) ? (struct key_row *) arena_alloc(
+            arena, 2 * capacity * sizeof(struct key_row), ARENA_CACHE_LINE_ALIGNMENT) : NULL;
+    if (!read_block || !pairs) {
+        arena_release(arena, arena_mark_before_runs);
+        fprintf(stderr, "ERROR: working memory is too small for the record size\n");
+        return 0;
+    }
+    struct key_row *scratch = pairs + capacity;
+    *run_size = capacity * sizeof(struct key_row);
+
+    bool success = true;
+    uint64_t row = 0;
+    size_t fill = 0;
+    size_t runs = 0;
+    while (success) {
+        size_t const num_read = fread(read_block, 1, read_size, input_file);
+        if (ferror(input_file)) {
+            fprintf(stderr, "ERROR: unable to read input file: %s\n", strerror(errno));
+            success = false;
+            break;
+        }
+        if ((num_read % record_size) != 0) {
+            fprintf(stderr, "ERROR: input ends part way through a record\n");
+            success = false;
+            break;
+        }
+        for (size_t offset = 0; success && (offset < num_read); offset += record_size) {
+            if (row > UINT32_MAX) {
+                fprintf(stderr, "ERROR: input has more records than can be numbered with 32 bits\n");
+                success = false;
+                break;
+            }
+            memcpy(&pairs[fill].key, read_block + offset, sizeof(uint32_t));
+            pairs[fill].row = (uint32_t) row++;
+            if (++fill == capacity) {
+                success = write_key_run(context, runs++, pairs, scratch, fill);
+                fill = 0;
+            }
+        }
+        progress_update(context->progress, (num_read / record_size) * sizeof(struct key_row));
+        if (num_read < read_size) {
+            break;
+        }
+    }
+    if (success && ((fill > 0) || (runs == 0))) {
+        success = write_key_run(context, runs++, pairs, scratch, fill);
+    }
+
+    arena_release(arena, arena_mark_before_runs);
+    if (!success) {
+        remove_all_runs(context, runs);
+        return 0;
+    }
+    return runs;
+}
+
+static bool write_key_run(
+        struct key_sort_context const *context, size_t run_number,
+        struct key_row *pairs, struct key_row *scratch, size_t count)
+{
+    sort_by_key(pairs, scratch, count);
+
+    char filename[PATH_MAX] = {0};
+    if (!format_run_filename(filename, sizeof(filename), context, 0, run_number)) {
+        fprintf(stderr, "ERROR: run file name is too long\n");
+        return false;
+    }
+    FILE *run_file = fopen(filename, "wb");
+    if (!run_file) {
+        fprintf(stderr, "ERROR: unable to create run file: %s\n", strerror(errno));
+        return false;
+    }
+    setvbuf(run_file, NULL, _IONBF, 0);
+    bool success = (fwrite(pairs, sizeof(struct key_row), count, run_file) == count);
+    if ((fclose(run_file) != 0) || !success) {
+        fprintf(stderr, "ERROR: unable to write run file: %s\n", strerror(errno));
+        success = false;
+    }
+    return success;
+}
+
+/*
+ * Merges the runs into rows_file the way that the rest of bigsort merges runs: the merge is planned for runs of pairs,
+ * reduce_record_runs() merges them down to a single merge's worth, and the final merge then writes only each pair's
+ * row. The merges break ties between keys by run, so they stay stable. Every run is removed, whether or not the merge
+ * succeeds.
+ */
+static bool merge_key_runs(
+        struct key_sort_context const *context, size_t num_runs, size_t run_size, size_t max_files,
+        size_t gather_passes, FILE *rows_file, size_t *generations)
+{
+    struct arena *arena = context->arena;
+    size_t const arena_mark_before_merge = arena_mark(arena);
+
+    // The final merge pulls pairs into a block of its own to turn them into rows. The rest of the arena is planned for
+    // the merges.
+    size_t block_pairs = arena_available(arena, ARENA_PAGE_ALIGNMENT) / (8 * sizeof(struct key_row));
+    if (block_pairs > PLAN_MAX_BLOCK_SIZE / sizeof(struct key_row)) {
+        block_pairs = PLAN_MAX_BLOCK_SIZE / sizeof(struct key_row);
+    }
+    struct key_row *pairs = (block_pairs > 0) ? (struct key_row *) arena_alloc(
+            arena, block_pairs * sizeof(struct key_row), ARENA_PAGE_ALIGNMENT) : NULL;
+    struct sort_plan plan = {
+            .record_size = sizeof(struct key_row),
+            .memory_size = arena_available(arena, ARENA_PAGE_ALIGNMENT),
+            .run_size = run_size,
+    };
+    bool success = pairs && plan_merge(&plan, num_runs, max_files);
+    if (!success) {
+        fprintf(stderr, "ERROR: working memory is too small to merge keys\n");
+    }
+
+    size_t generation = 0;
+    size_t remaining_runs = 0;
+    success = success && reduce_record_runs(
+            context->run_base_filename, num_runs, sizeof(struct key_row),
+            arena, plan.fan_in, plan.block_size, plan.fan_in,
+            context->progress, &generation, &remaining_runs);
+    if (success) {
+        // The final merge is one more pass, and gathering another.
+        progress_plan_merge(context->progress, generation + 1 + gather_passes);
+        progress_begin_generation(context->progress, generation + 1);
+        success = merge_final_runs(
+                context, generation, remaining_runs, plan.block_size, pairs, block_pairs, rows_file);
+    }
+
+    remove_all_runs(context, num_runs);
+    arena_release(arena, arena_mark_before_merge);
+    *generations = generation + 1;
+    return success;
+}
+
+/*
+ * Merges the last runs of pairs and writes only each pair's row to rows_file. Rows are half the size of pairs, so each
+ * block of pairs is turned into rows in place.
+ */
+static bool merge_final_runs(
+        struct key_sort_context const *context, size_t generation, size_t num_runs, size_t block_size,
+        struct key_row *pairs, size_t block_pairs, FILE *rows_file)
+{
+    struct merge_context *merge = merge_new(context->arena, block_size, num_runs);
+    FILE **run_files = (FILE **) calloc(num_runs, sizeof(FILE *));
+    bool success = merge && run_files && (merge_get_max_input_files(merge) >= num_runs) &&
+                   merge_set_record_size(merge, sizeof(struct key_row));
+    if (!success) {
+        fprintf(stderr, "ERROR: unable to set up final merge of keys\n");
+    }
+
+    char filename[PATH_MAX] = {0};
+    size_t num_open = 0;
+    while (success && (num_open < num_runs)) {
+        if (!format_run_filename(filename, sizeof(filename), context, generation, num_open)) {
+            fprintf(stderr, "ERROR: run file name is too long\n");
+            success = false;
+            break;
+        }
+        run_files[num_open] = fopen(filename, "rb");
+        if (!run_files[num_open]) {
+            fprintf(stderr, "ERROR: unable to open run file: %s\n", strerror(errno));
+            success = false;
+            break;
+        }
+        // The merge reads whole blocks into its own buffers.
+        setvbuf(run_files[num_open++], NULL, _IONBF, 0);
+    }
+    success = success && merge_begin(merge, run_files, num_runs);
+
+    uint32_t *rows = (uint32_t *) pairs;
+    while (success) {
+        size_t count = 0;
+        if (!merge_read(merge, (uint32_t *) pairs, block_pairs, &count)) {
+            fprintf(stderr, "ERROR: unable to read run file: %s\n", strerror(errno));
+            success = false;
+            break;
+        }
+        if (count == 0) {
+            break;
+        }
+        for (size_t i = 0; i < count; i++) {
+            rows[i] = pairs[i].row;
+        }
+        if (fwrite(rows, sizeof(uint32_t), count, rows_file) != count) {
+            fprintf(stderr, "ERROR: unable to write merged keys: %s\n", strerror(errno));
+            success = false;
+            break;
+        }
+        progress_update(context->progress, count * sizeof(struct key_row));
+    }
+
+    for (size_t i = 0; i < num_open; i++) {
+        fclose(run_files[i]);
+    }
+    free(run_files);
+    merge_delete(merge);
+    return success;
+}
+
+/*
+ * Copies records from the input to the output in the order that rows_file lists them. Rows are taken a batch at a
+ * time and put in ascending order, remembering where each one goes in the batch. Wanted records that lie close
+ * together in the input are then read with a single read, and copied into their places in the batch, which is written
+ * out in one go.
+ */
+static bool gather_records(
+        struct key_sort_context const *context, int input_fd, FILE *rows_file, FILE *output_file)
+{
+    struct arena *arena = context->arena;
+    size_t const record_size = context->record_size;
+    size_t const arena_mark_before_gather = arena_mark(arena);
+
+    // A staging block for spans of the input, and then for each row in a batch: its row, a pair to sort it with plus
+    // scratch, and its record.
+    size_t staging_size = PLAN_MAX_BLOCK_SIZE;
+    if (staging_size > arena_available(arena, ARENA_PAGE_ALIGNMENT) / 4) {
+        staging_size = arena_available(arena, ARENA_PAGE_ALIGNMENT) / 4;
+    }
+    staging_size -= staging_size % record_size;
+    char *staging = (staging_size > 0) ? (char *) arena_alloc(arena, staging_size, ARENA_PAGE_ALIGNMENT) : NULL;
+    size_t const batch_memory = arena_available(arena, ARENA_PAGE_ALIGNMENT);
+    size_t const alignment_slack = 2 * ARENA_CACHE_LINE_ALIGNMENT;
+    size_t const batch = (batch_memory > alignment_slack) ?
+                         (batch_memory - alignment_slack) /
+                         (sizeof(uint32_t) + (2 * sizeof(struct key_row)) + record_size) : 0;
+    char *records = NULL;
+    uint32_t *rows = NULL;
+    struct key_row *order = NULL;
+    if (staging && (batch > 0)) {
+        records = (char *) arena_alloc(arena, batch * record_size, ARENA_PAGE_ALIGNMENT);
+        rows = (uint32_t *) arena_alloc(arena, batch * sizeof(uint32_t), ARENA_CACHE_LINE_ALIGNMENT);
+        order = (struct key_row *) arena_alloc(arena, 2 * batch * sizeof(struct key_row), ARENA_CACHE_LINE_ALIGNMENT);
+    }
+    if (!records || !rows || !order) {
+        arena_release(arena, arena_mark_before_gather);
+        fprintf(stderr, "ERROR: working memory is too small to gather records\n");
+        return false;
+    }
+    struct key_row *scratch = order + batch;
+    uint64_t const max_gap_records = MAX_GATHER_GAP / record_size;
+    uint64_t const staging_records = staging_size / record_size;
+
+    bool success = true;
+    while (success) {
+        size_t const count = fread(rows, sizeof(uint32_t), batch, rows_file);
+        if (ferror(rows_file)) {
+            fprintf(stderr, "ERROR: unable to read sorted rows: %s\n", strerror(errno));
+            success = false;
+            break;
+        }
+        if (count == 0) {
+            break;
+        }
+
+        // Sort the batch by row. A pair's key is its row here, and its row is its place in the batch.
+        for (size_t i = 0; i < count; i++) {
+            order[i].key = rows[i];
+            order[i].row = (uint32_t) i;
+        }
+        sort_by_key(order, scratch, count);
+
+        for (size_t i = 0; success && (i < count);) {
+            uint64_t const first = order[i].key;
+            size_t end = i + 1;
+            while ((end < count) &&
+                   ((uint64_t) order[end].key - first < staging_records) &&
+                   ((uint64_t) order[end].key - order[end - 1].key <= max_gap_records)) {
+                end++;
+            }
+            size_t const span = (size_t) ((uint64_t) order[end - 1].key - first + 1) * record_size;
+            if (!io_pread_fully(input_fd, staging, span, first * record_size)) {
+                fprintf(stderr, "ERROR: unable to read records from input file: %s\n", strerror(errno));
+                success = false;
+                break;
+            }
+            for (size_t j = i; j < end; j++) {
+                memcpy(records + ((size_t) order[j].row * record_size),
+                       staging + ((size_t) (order[j].key - first) * record_size), record_size);
+            }
+            i = end;
+        }
+        if (success && (fwrite(records, record_size, count, output_file) != count)) {
+            fprintf(stderr, "ERROR: unable to write output file: %s\n", strerror(errno));
+            success = false;
+        }
+        progress_update(context->progress, count * sizeof(struct key_row));
+    }
+
+    arena_release(arena, arena_mark_before_gather);
+    return success;
+}
+
+/*
+ * A least-significant-byte-first radix sort of pairs by key. Each pass is stable, so pairs with equal keys stay in the
+ * order they came in. Passes over bytes that are the same in every key are skipped.
+ */
+static void sort_by_key(struct key_row *pairs, struct key_row *scratch, size_t count)
+{
+    size_t counts[4][256] = {{0}};
+    for (size_t i = 0; i < count; i++) {
+        uint32_t const key = pairs[i].key;
+        counts[0][key & 0xFF]++;
+        counts[1][(key >> 8) & 0xFF]++;
+        counts[2][(key >> 16) & 0xFF]++;
+        counts[3][key >> 24]++;
+    }
+
+    struct key_row *source = pairs;
+    struct key_row *destination = scratch;
+    for (unsigned int pass = 0; pass < 4; pass++) {
+        unsigned int const shift = pass * 8;
+        if ((count == 0) || (counts[pass][(source[0].key >> shift) & 0xFF] == count)) {
+            continue;
+        }
+        size_t offsets[256];
+        size_t offset = 0;
+        for (size_t bucket = 0; bucket < 256; bucket++) {
+            offsets[bucket] = offset;
+            offset += counts[pass][bucket];
+        }
+        for (size_t i = 0; i < count; i++) {
+            destination[offsets[(source[i].key >> shift) & 0xFF]++] = source[i];
+        }
+        struct key_row *const swap = source;
+        source = destination;
+        destination = swap;
+    }
+    if (source != pairs) {
+        memcpy(pairs, source, count * sizeof(struct key_row));
+    }
+}
+
+/*
+ * Formats the name of a run. Returns false if the name doesn't fit in the buffer, in which case it names no run at all,
+ * and mustn't be used.
+ */
+static bool format_run_filename(
+        char *buffer, size_t buffer_size, struct key_sort_context const *context, size_t generation, size_t run)
+{
+    int const length = snprintf(buffer, buffer_size, "%s.%lu.%lu", context->run_base_filename, generation, run);
+    return (length >= 0) && ((size_t) length < buffer_size);
+}
+
+/*
+ * Removes every run that may be on disk, in any generation. With at least two runs per merge, generation g never has
+ * more than num_runs / 2^g runs (rounded up), so that bounds the files to look for.
+ */
+static void remove_all_runs(struct key_sort_context const *context, size_t num_runs)
+{
+    char filename[PATH_MAX] = {0};
+    size_t num_runs_in_generation = num_runs;
+    for (size_t generation = 0; num_runs_in_generation > 0; generation++) {
+        for (size_t i = 0; i < num_runs_in_generation; i++) {
+            if (format_run_filename(filename, sizeof(filename), context, generation, i)) {
+                remove(filename);
+            }
+        }
+        num_runs_in_generation = (num_runs_in_generation > 1) ? ((num_runs_in_generation + 1) / 2) : 0;
+    }
+}
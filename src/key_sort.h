@@ -0,0 +1,20 @@
+#ifndef KEY_SORT_H
+#define KEY_SORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "arena.h"
+#include "progress.h"
+
+enum key_sort_output {
+    KEY_SORT_OUTPUT_PERMUTATION = 0,
+    KEY_SORT_OUTPUT_GATHER
+};
+
+bool key_sort(
+        FILE *input_file, char const *output_filename, size_t record_size, enum key_sort_output output,
+        struct arena *arena, size_t max_files, struct progress *progress,
+        size_t *num_runs, size_t *generations);
+
+#endif // KEY_SORT_H
@@ -0,0 +1,230 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fence_index.h"
+#include "io_util.h"
+#include "sorted_view.h"
+
+// Answers point and range queries against a file that bigsort sorted with --index, using the index to go straight to
+// the block each end of the range is in. With --runs, queries the runs that bigsort --lazy left behind instead, as a
+// sorted view that merges just the range.
+//
+// usage: bigsort-lookup [-v] [-r] [-i index] file low [high]
+
+// How many values are merged out of a sorted view at a time.
+static size_t const VIEW_READ_VALUES = 4096;
+
+struct lookup_options {
+    char const *sorted_filename;
+    char index_filename[PATH_MAX];
+    uint32_t low;
+    uint32_t high;
+    bool print_values;
+    bool runs;
+    bool print_help;
+};
+
+static bool parse_key(char const *text, uint32_t *key);
+
+static bool parse_options(int argc, char *argv[], struct lookup_options *opts);
+
+static bool lookup_in_file(struct lookup_options const *opts);
+
+static bool lookup_in_runs(struct lookup_options const *opts);
+
+static bool print_values(int fd, uint32_t *block, size_t block_values, uint64_t begin, uint64_t end);
+
+
+static void print_usage(void)
+{
+    printf(
+            "usage: bigsort-lookup [-h] [-v] [-r] [-i index] file low [high]\n"
+            "\n"
+            "Counts the values of a sorted file that are between low and high (inclusive; high defaults to low),\n"
+            "reading only the blocks that the file's index points at.\n"
+            "\n"
+            "  -h, --help           show this help message and exit\n"
+            "  -v, --values         print the values too, one per line\n"
+            "  -r, --runs           file is the output file of a sort with --lazy, and its\n"
+            "                         runs are queried, merging only the values in range\n"
+            "  -i, --index=FILE     the index to use (default: file.idx)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct lookup_options opts = {0};
+    if (!parse_options(argc, argv, &opts)) {
+        print_usage();
+        return 1;
+    }
+    if (opts.print_help) {
+        print_usage();
+        return 0;
+    }
+    bool const success = opts.runs ? lookup_in_runs(&opts) : lookup_in_file(&opts);
+    return success ? 0 : 1;
+}
+
+/*
+ * Looks the range up in a sorted file with its index.
+ */
+static bool lookup_in_file(struct lookup_options const *opts)
+{
+    int const fd = open(opts->sorted_filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: unable to open %s: %s\n", opts->sorted_filename, strerror(errno));
+        return false;
+    }
+    struct fence_index *index = fence_index_open(opts->index_filename, fd);
+    if (!index) {
+        close(fd);
+        return false;
+    }
+
+    uint64_t const num_values = fence_index_get_num_values(index);
+    size_t const block_values = (size_t) fence_index_get_interval(index);
+    uint32_t *block = (uint32_t *) malloc(block_values * sizeof(uint32_t));
+    bool success = (block != NULL);
+    if (!success) {
+        fprintf(stderr, "ERROR: unable to allocate a block of %lu values\n", block_values);
+    }
+
+    uint64_t begin = 0;
+    uint64_t end = num_values;
+    success = success && fence_index_find(index, fd, opts->low, block, &begin);
+    if (success && (opts->high < UINT32_MAX)) {
+        success = fence_index_find(index, fd, opts->high + 1, block, &end);
+    }
+    if (success) {
+        uint64_t const count = (end > begin) ? (end - begin) : 0;
+        printf("count: %lu\n", count);
+        if (count > 0) {
+            printf("offset: %lu\n", begin * sizeof(uint32_t));
+        }
+        if (opts->print_values) {
+            success = print_values(fd, block, block_values, begin, end);
+        }
+    }
+
+    free(block);
+    close(fd);
+    fence_index_close(index);
+    return success;
+}
+
+/*
+ * Looks the range up in the runs of a lazy sort, merging only the values in it.
+ */
+static bool lookup_in_runs(struct lookup_options const *opts)
+{
+    struct sorted_view *view = sorted_view_open(opts->sorted_filename);
+    if (!view) {
+        return false;
+    }
+    struct sorted_view_range *range = sorted_view_seek(view, opts->low, opts->high);
+    uint32_t *values = (uint32_t *) malloc(VIEW_READ_VALUES * sizeof(uint32_t));
+    bool success = range && values;
+    if (success) {
+        printf("count: %lu\n", sorted_view_range_get_count(range));
+    }
+    size_t num_read = VIEW_READ_VALUES;
+    while (success && opts->print_values && (num_read == VIEW_READ_VALUES)) {
+        success = sorted_view_range_read(range, values, VIEW_READ_VALUES, &num_read);
+        for (size_t i = 0; success && (i < num_read); i++) {
+            printf("%u\n", values[i]);
+        }
+    }
+
+    free(values);
+    sorted_view_range_delete(range);
+    sorted_view_close(view);
+    return success;
+}
+
+static bool parse_key(char const *text, uint32_t *key)
+{
+    char *end = NULL;
+    errno = 0;
+    unsigned long long const value = strtoull(text, &end, 0);
+    if ((errno != 0) || (end == text) || (*end != '\0') || (text[0] == '-') || (value > UINT32_MAX)) {
+        fprintf(stderr, "ERROR: invalid key: %s\n", text);
+        return false;
+    }
+    *key = (uint32_t) value;
+    return true;
+}
+
+static bool parse_options(int argc, char *argv[], struct lookup_options *opts)
+{
+    static struct option const long_options[] = {
+            {"help", no_argument, NULL, 'h'},
+            {"values", no_argument, NULL, 'v'},
+            {"runs", no_argument, NULL, 'r'},
+            {"index", required_argument, NULL, 'i'},
+            {NULL, 0, NULL, 0}};
+
+    char const *index_filename = NULL;
+    while (true) {
+        int const opt = getopt_long(argc, argv, "hvri:", long_options, NULL);
+        if (opt == -1) {
+            break;
+        }
+        switch (opt) {
+            case 'h':
+                opts->print_help = true;
+                return true;
+            case 'v':
+                opts->print_values = true;
+                break;
+            case 'r':
+                opts->runs = true;
+                break;
+            case 'i':
+                index_filename = optarg;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    int const num_arguments = argc - optind;
+    if ((num_arguments < 2) || (num_arguments > 3)) {
+        return false;
+    }
+    opts->sorted_filename = argv[optind];
+    if (!parse_key(argv[optind + 1], &opts->low)) {
+        return false;
+    }
+    opts->high = opts->low;
+    if ((num_arguments == 3) && !parse_key(argv[optind + 2], &opts->high)) {
+        return false;
+    }
+    if (index_filename) {
+        snprintf(opts->index_filename, sizeof(opts->index_filename), "%s", index_filename);
+    } else {
+        snprintf(opts->index_filename, sizeof(opts->index_filename), "%s.idx", opts->sorted_filename);
+    }
+    return true;
+}
+
+static bool print_values(int fd, uint32_t *block, size_t block_values, uint64_t begin, uint64_t end)
+{
+    for (uint64_t position = begin; position < end; position += block_values) {
+        size_t const num_values = (size_t) (((end - position) < block_values) ? (end - position) : block_values);
+        if (!io_pread_fully(fd, block, num_values * sizeof(uint32_t), position * sizeof(uint32_t))) {
+            fprintf(stderr, "ERROR: unable to read sorted file: %s\n", strerror(errno));
+            return false;
+        }
+        for (size_t i = 0; i < num_values; i++) {
+            printf("%u\n", block[i]);
+        }
+    }
+    return true;
+}
@@ -1,76 +1,428 @@
 #include <errno.h>
 #include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "arena.h"
+#include "autotune.h"
+#include "batch.h"
 #include "bigsort.h"
+#include "cluster.h"
+#include "count_sort.h"
+#include "fence_index.h"
+#include "key_sort.h"
+#include "manifest.h"
+#include "merge_kernel.h"
+#include "partition.h"
+#include "plan.h"
+#include "progress.h"
 #include "round.h"
+#include "shard_output.h"
+#include "sort_engine.h"
+#include "sorted_view.h"
+#include "spill.h"
+#include "thread_pool.h"
+#include "util.h"
 
-static size_t const DEFAULT_RUN_SIZE = (size_t) 1 * (1 << 20); // (1<<20) is 1MB
+static size_t const DEFAULT_MEMORY_SIZE = (size_t) 1 * (1 << 20); // (1<<20) is 1MB
 static size_t const DEFAULT_MAX_FILES = (size_t) 1000;
+static double const PROGRESS_INTERVAL_SECONDS = 1.0;
+static char const *const DEFAULT_TEMP_DIRECTORY = "/tmp";
+static char const *const STANDARD_STREAM_FILENAME = "-";
+static size_t const AUTOTUNE_PROBE_SIZE = (size_t) 64 * (1 << 20);
+
+enum counting_mode {
+    COUNTING_AUTO = 0,
+    COUNTING_ALWAYS,
+    COUNTING_NEVER
+};
 
 struct options {
     bool print_help;
     char const *input_filename;
     char const *output_filename;
+    size_t memory_size;
     size_t run_size;
     size_t max_files;
+    bool huge_pages;
+    bool lock_memory;
+    char const *temp_directory;
+    bool checkpoint;
+    bool resume;
+    uint64_t limit;
+    bool partition;
+    size_t num_threads;
+    char const *worker_address;
+    char *coordinate_addresses;
+    enum sort_engine sort_engine;
+    size_t record_size;
+    bool permutation;
+    bool merge;
+    bool validate;
+    char const *add_to_filename;
+    enum counting_mode counting;
+    bool consume_input;
+    bool spill_file;
+    uint64_t index_interval;
+    uint64_t lazy_interval;
+    size_t num_output_shards;
+    bool autotune;
+    char const *batch_filename;
+    char *const *merge_filenames;
+    size_t num_merge_filenames;
     bool quiet;
 };
 
 void print_usage()
 {
     printf(
-            "usage: bigsort [-h] [-q] [-r runsize] [-max maxfiles] infile outfile\n" \
+            "usage: bigsort [-h] [-q] [-M memory] [-r runsize] [-m maxfiles] [-H] [-L]\n" \
+            "               [-T tempdir] [-c] [-R] [-l limit] [-P] [-j threads]\n" \
+            "               [-S engine] [-k recordsize] [-p] [-a sortedfile] [-V]\n" \
+            "               [-u when] [-D] [-s] [-x interval] [-z interval]\n" \
+            "               [-O shards] [-A] [-C host:port,...]\n" \
+            "               infile outfile\n" \
+            "       bigsort -g [-V] [-q] [-M memory] [-m maxfiles] [-l limit] [-x interval]\n" \
+            "               infile... outfile\n" \
+            "       bigsort -b jobfile [-q] [-M memory] [-m maxfiles] [-H] [-L] [-j threads]\n" \
+            "               [-S engine]\n" \
+            "       bigsort [-q] [-M memory] [-r runsize] [-m maxfiles] -w host:port\n" \
             "\n" \
             "Sort a large file filled with unsigned, 32-bit integers\n" \
             "\n" \
             "positional arguments:\n" \
-            "  infile                  input file name\n" \
-            "  outfile                 output file name\n" \
+            "  infile                  input file name, or - for stdin\n" \
+            "  outfile                 output file name, or - for stdout\n" \
             "\n" \
             "optional arguments:\n" \
             "  -h, --help               Show this help message and exit\n" \
             "  -q, --quiet              Do not display progress/stats/completion output\n" \
-            "  -r, --runsize=SIZE       Size of initial runs. This drives memory usage since\n" \
-            "                             a buffer of size 'SIZE' will be allocated for\n" \
-            "                             reading and sorting file data.\n" \
-            "                             Defaults to 1MB if not specified.\n" \
-            "  -m, --maxfiles=NUM       Maximum number of open files for merge phase. This\n" \
-            "                             also drives memory usage since 'NUM' buffered file\n" \
-            "                             handles will be opened simultaneously. This flag\n" \
-            "                             specifies a maximum. The actual number of open\n" \
-            "                             files will be determined by the number of file\n" \
-            "                             structures that can fit in the 'SIZE' memory\n" \
-            "                             allocated for the initial run processing.\n" \
+            "  -M, --memory=SIZE        Total working memory. This is a hard budget that is\n" \
+            "                             split between the run buffer, the merge heap and\n" \
+            "                             per-file read/write blocks. The planner picks the\n" \
+            "                             number of files to merge at once and the block\n" \
+            "                             size from it. Defaults to the run size if that is\n" \
+            "                             specified, otherwise to 1MB. SIZE may have a K, M,\n" \
+            "                             G or T suffix (powers of 1024).\n" \
+            "  -r, --runsize=SIZE       Size of initial runs. Defaults to, and is capped at,\n" \
+            "                             the memory size.\n" \
+            "  -m, --maxfiles=NUM       Maximum number of files to merge at once. The\n" \
+            "                             actual number is also limited by the memory size\n" \
+            "                             and the process's open file limit.\n" \
             "                             Defaults to 1000 if not specified. Specify 0 to\n" \
-            "                             open as many files as possible with 'SIZE' memory.\n" \
-            "                             (too large of a value may fail due to OS limits)\n" \
+            "                             merge as many files as the memory size and open\n" \
+            "                             file limit allow.\n" \
+            "  -H, --hugepages          Back working memory with huge pages to cut TLB\n" \
+            "                             misses. Uses a reserved huge page pool if there\n" \
+            "                             is one, then transparent huge pages, then normal\n" \
+            "                             pages.\n" \
+            "  -L, --lock-memory        Lock working memory so that it can't be swapped\n" \
+            "                             out. Continues unlocked if that isn't permitted.\n" \
+            "  -T, --tempdir=DIR        Directory for temporary run files when writing to\n" \
+            "                             stdout. Otherwise, runs are written next to the\n" \
+            "                             output file. Defaults to $TMPDIR, or /tmp if that\n" \
+            "                             isn't set.\n" \
+            "  -A, --autotune           Plan for the device that the runs are written to\n" \
+            "                             rather than for a typical one. A short probe\n" \
+            "                             times sequential and random reads in the runs'\n" \
+            "                             directory at several block sizes, and how fast\n" \
+            "                             the CPU sorts. It's cached per device under\n" \
+            "                             $XDG_CACHE_HOME/bigsort (or ~/.cache/bigsort);\n" \
+            "                             delete the cache to probe again. A cost model\n" \
+            "                             then picks the run size (unless -r is given), the\n" \
+            "                             files per merge, the block size and, for -P and\n" \
+            "                             -O, the threads (unless -j is given), and the\n" \
+            "                             predicted and actual times are reported.\n" \
+            "  -c, --checkpoint         Record each run and merge group in a manifest\n" \
+            "                             (outfile.manifest) as it completes, syncing it\n" \
+            "                             to disk first, so that an interrupted sort can\n" \
+            "                             be resumed. Requires named input and output files.\n" \
+            "  -R, --resume             Resume the sort that outfile.manifest records, after\n" \
+            "                             the last run or merge group that it completed.\n" \
+            "                             Use the same input and options as before. Starts\n" \
+            "                             from scratch if there's no manifest. Implies -c.\n" \
+            "  -l, --limit=NUM          Only output the NUM smallest values. Each run only\n" \
+            "                             keeps its NUM smallest values and merges stop\n" \
+            "                             after NUM values. If NUM values fit in half the\n" \
+            "                             run size, no runs are written at all, unless the\n" \
+            "                             input is consumed (-D). NUM may have a K, M, G or\n" \
+            "                             T suffix. 0 means no limit.\n" \
+            "  -P, --partition          Sort by partitioning instead of merging runs. The\n" \
+            "                             input is sampled to pick splitters, streamed once\n" \
+            "                             into bucket files, and then the buckets are sorted\n" \
+            "                             in memory in parallel and written into place in\n" \
+            "                             the output. Requires named input and output files,\n" \
+            "                             and can't be combined with -c or -l.\n" \
+            "  -j, --threads=NUM        Number of threads that sort buckets with -P, merge\n" \
+            "                             output shards with -O, or sort jobs with -b.\n" \
+            "                             Defaults to 0, which means one per processor.\n" \
+            "  -S, --sort-engine=NAME   How values are sorted in memory: qsort, radix\n" \
+            "                             (byte-wise radix sort), simd (AVX2 sorting networks\n" \
+            "                             and merges) or auto, the default, which times each\n" \
+            "                             of them on a sample of the first run and picks the\n" \
+            "                             fastest. Under auto, buckets and samples, which\n" \
+            "                             aren't timed, get the engine picked without timing.\n" \
+            "  -k, --record-size=SIZE   Sort records of SIZE bytes by their key, the\n" \
+            "                             unsigned 32-bit integer in their first 4 bytes.\n" \
+            "                             Only (key, row) pairs are sorted and merged,\n" \
+            "                             and a final pass then reads the records from\n" \
+            "                             infile in sorted order. Equal keys keep their\n" \
+            "                             input order. Requires named input and output\n" \
+            "                             files, at most 2^32 records, and can't be\n" \
+            "                             combined with -c, -l, -P or -C.\n" \
+            "  -p, --permutation        With a key-only sort, write the permutation\n" \
+            "                             instead of the records: the row of each record\n" \
+            "                             in sorted order, as unsigned 32-bit integers.\n" \
+            "                             Implies -k 4 if -k isn't given.\n" \
+            "  -g, --merge              Merge input files that are already sorted, like\n" \
+            "                             sort -m. Every file but the last is an input.\n" \
+            "                             The inputs are merged as they are, as the\n" \
+            "                             initial runs, without creating runs. They're\n" \
+            "                             left in place. Can't be combined with -c, -P,\n" \
+            "                             -k or -C.\n" \
+            "  -a, --add-to=FILE        Sort infile and merge it with FILE, which is\n" \
+            "                             already sorted, into outfile. Only infile is\n" \
+            "                             sorted into runs. FILE is read once, by the final\n" \
+            "                             merge, so the cost mostly depends on the size of\n" \
+            "                             infile. outfile may be FILE itself, which is\n" \
+            "                             replaced once the merge is done. A FILE that\n" \
+            "                             doesn't exist yet counts as empty. Can't be\n" \
+            "                             combined with -c, -P, -k or -C.\n" \
+            "  -u, --counting=WHEN      Sort by counting: stream the input once into a\n" \
+            "                             histogram of its distinct values and how often\n" \
+            "                             each occurs, then write each value out that many\n" \
+            "                             times. Histograms only go to disk, as sorted runs\n" \
+            "                             that are merged, if they outgrow memory. WHEN is\n" \
+            "                             always, never or auto, the default, which counts\n" \
+            "                             if a sample of a named input file has few\n" \
+            "                             distinct values. Can't be combined with -c, -P,\n" \
+            "                             -k, -a or -C.\n" \
+            "  -D, --consume-input      Give the input file's disk space up as it's sorted\n" \
+            "                             into runs, and leave it empty, so that sorting\n" \
+            "                             takes little more space than the input. Merges\n" \
+            "                             always release the runs they have merged. If the\n" \
+            "                             sort fails, the runs that hold the input are\n" \
+            "                             kept, and where its values are is printed.\n" \
+            "                             Requires named input and output files on a file\n" \
+            "                             system that can punch holes, and can't be\n" \
+            "                             combined with -g, -c, -P, -k, -u always, -a, -s,\n" \
+            "                             -x, -O or -C.\n" \
+            "  -s, --spill-file         Keep all runs in a single temporary file instead\n" \
+            "                             of a file per run. The file is preallocated as\n" \
+            "                             runs are added, and merges read the runs by their\n" \
+            "                             offsets in it, so the files per merge aren't\n" \
+            "                             bound by the open file limit. The final merge\n" \
+            "                             always writes outfile. Can't be combined with\n" \
+            "                             -g, -c, -P, -k, -a, -u always or -C.\n" \
+            "  -x, --index=NUM          Write a sparse index of outfile to outfile.idx as\n" \
+            "                             it's written: every NUM-th value and its offset.\n" \
+            "                             bigsort-lookup uses it to find values in outfile\n" \
+            "                             with a block read or two. NUM may have a K, M, G\n" \
+            "                             or T suffix. Requires a named output file, and\n" \
+            "                             can't be combined with -c, -P, -k or -C.\n" \
+            "  -z, --lazy=NUM           Stop once the initial runs are created, leaving\n" \
+            "                             them as outfile.0.* with a sparse index of each\n" \
+            "                             (every NUM-th value) as outfile.idx.0.*, instead\n" \
+            "                             of merging them into outfile. bigsort-lookup -r\n" \
+            "                             queries them as a sorted view that merges only\n" \
+            "                             the range asked for, and bigsort -g outfile.0.*\n" \
+            "                             FILE merges them into another file whenever it's\n" \
+            "                             convenient.\n" \
+            "                             Requires a named output file, and can't be\n" \
+            "                             combined with -c, -P, -k, -a, -s, -x, -u always\n" \
+            "                             or -C.\n" \
+            "  -O, --output-shards=NUM  Write the sorted output as NUM part files,\n" \
+            "                             outfile.part.0 and on, that split the key range\n" \
+            "                             between them in order, instead of as outfile.\n" \
+            "                             Splitters that balance the parts are picked from\n" \
+            "                             samples of the runs, and the final merge writes\n" \
+            "                             the parts in parallel, one thread per part.\n" \
+            "                             outfile.shards lists each part's file, its key\n" \
+            "                             range (from its smallest key up to, but not\n" \
+            "                             including, the next part's) and its number of\n" \
+            "                             values. Requires a named output file, and can't\n" \
+            "                             be combined with -g, -c, -l, -P, -k, -a, -s, -x,\n" \
+            "                             -z, -u always or -C.\n" \
+            "  -b, --batch=JOBFILE      Sort many files in one process. Each line of\n" \
+            "                             JOBFILE is an input file and the output file to\n" \
+            "                             sort it into, separated by whitespace. Blank lines\n" \
+            "                             and lines that start with # are skipped. The jobs\n" \
+            "                             share the working memory and the threads: inputs\n" \
+            "                             that fit in a thread's share of the memory are\n" \
+            "                             sorted in memory, several at once, and larger\n" \
+            "                             ones are then sorted one at a time by all of the\n" \
+            "                             threads with all of the memory, by partitioning.\n" \
+            "                             A job that fails doesn't stop the others. Takes\n" \
+            "                             no infile or outfile, and can't be combined with\n" \
+            "                             -r, -g, -c, -l, -P, -k, -a, -D, -s, -x, -z, -O,\n" \
+            "                             -A, -V, -u always or -C.\n" \
+            "  -V, --validate           With -g or -a, check that the sorted inputs are\n" \
+            "                             in order while merging them, and fail at the\n" \
+            "                             first value that isn't.\n" \
+            "  -C, --coordinate=ADDRS   Sort with the workers at the comma-separated\n" \
+            "                             host:port addresses. Each worker creates runs\n" \
+            "                             from a shard of the input, the workers swap\n" \
+            "                             key ranges over TCP and merge their own range\n" \
+            "                             into an output part, and the parts are then\n" \
+            "                             joined into outfile. Workers must see infile\n" \
+            "                             and outfile at the same absolute paths.\n" \
+            "  -w, --worker=ADDR        Run as a worker: listen on host:port, carry out\n" \
+            "                             one sort for a coordinator and exit. Port 0\n" \
+            "                             picks a free port, which is printed.\n" \
+            "\n" \
+            "When writing to stdout, parameters and stats are written to stderr instead.\n" \
 );
 }
 
-void get_options(int argc, char *const argv[], struct options *opts)
+/*
+ * Parses a size such as "1048576", "512K", "64MB" or "2GiB". Suffixes are powers of 1024.
+ */
+static bool parse_size(char const *text, size_t *size)
+{
+    char *end = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 0);
+    if ((errno != 0) || (end == text)) {
+        return false;
+    }
+
+    unsigned int shift = 0;
+    switch (*end) {
+        case 'k':
+        case 'K':
+            shift = 10;
+            break;
+        case 'm':
+        case 'M':
+            shift = 20;
+            break;
+        case 'g':
+        case 'G':
+            shift = 30;
+            break;
+        case 't':
+        case 'T':
+            shift = 40;
+            break;
+        default:
+            break;
+    }
+    if (shift != 0) {
+        end++;
+        // Allow "KB" and "KiB" style suffixes as well.
+        if (*end == 'i') {
+            end++;
+        }
+        if ((*end == 'b') || (*end == 'B')) {
+            end++;
+        }
+    }
+    if ((*end != '\0') || (value > (SIZE_MAX >> shift))) {
+        return false;
+    }
+    *size = (size_t) value << shift;
+    return true;
+}
+
+/*
+ * Parses a count such as a number of files or threads. Unlike a size, it's a plain decimal number without a suffix.
+ */
+static bool parse_count(char const *text, size_t *count)
+{
+    char *end = NULL;
+    errno = 0;
+    unsigned long long const value = strtoull(text, &end, 10);
+    if ((errno != 0) || (end == text) || (*end != '\0') || (text[0] == '-') || (value > SIZE_MAX)) {
+        return false;
+    }
+    *count = (size_t) value;
+    return true;
+}
+
+bool get_options(int argc, char *const argv[], struct options *opts)
 {
     static struct option const long_options[] = {
-            {"help",    no_argument,       0, 'h'},
-            {"runsize", required_argument, 0, 'r'},
-            {"quiet",   required_argument, 0, 'q'},
-            {0, 0,                         0, 0}
+            {"help",        no_argument,       0, 'h'},
+            {"memory",      required_argument, 0, 'M'},
+            {"runsize",     required_argument, 0, 'r'},
+            {"maxfiles",    required_argument, 0, 'm'},
+            {"hugepages",   no_argument,       0, 'H'},
+            {"lock-memory", no_argument,       0, 'L'},
+            {"tempdir",     required_argument, 0, 'T'},
+            {"checkpoint",  no_argument,       0, 'c'},
+            {"resume",      no_argument,       0, 'R'},
+            {"limit",       required_argument, 0, 'l'},
+            {"partition",   no_argument,       0, 'P'},
+            {"threads",     required_argument, 0, 'j'},
+            {"sort-engine", required_argument, 0, 'S'},
+            {"record-size", required_argument, 0, 'k'},
+            {"permutation", no_argument,       0, 'p'},
+            {"merge",       no_argument,       0, 'g'},
+            {"validate",    no_argument,       0, 'V'},
+            {"add-to",      required_argument, 0, 'a'},
+            {"counting",    required_argument, 0, 'u'},
+            {"consume-input", no_argument,     0, 'D'},
+            {"spill-file",  no_argument,       0, 's'},
+            {"index",       required_argument, 0, 'x'},
+            {"lazy",        required_argument, 0, 'z'},
+            {"output-shards", required_argument, 0, 'O'},
+            {"autotune",    no_argument,       0, 'A'},
+            {"batch",       required_argument, 0, 'b'},
+            {"coordinate",  required_argument, 0, 'C'},
+            {"worker",      required_argument, 0, 'w'},
+            {"quiet",       no_argument,       0, 'q'},
+            {0, 0,                             0, 0}
     };
 
     // Set default options
     opts->print_help = false;
     opts->input_filename = NULL;
     opts->output_filename = NULL;
-    opts->run_size = DEFAULT_RUN_SIZE;
+    opts->memory_size = 0;
+    opts->run_size = 0;
     opts->max_files = DEFAULT_MAX_FILES;
+    opts->huge_pages = false;
+    opts->lock_memory = false;
+    opts->temp_directory = getenv("TMPDIR");
+    if (!opts->temp_directory || (opts->temp_directory[0] == '\0')) {
+        opts->temp_directory = DEFAULT_TEMP_DIRECTORY;
+    }
+    opts->checkpoint = false;
+    opts->resume = false;
+    opts->limit = 0;
+    opts->partition = false;
+    opts->num_threads = 0;
+    opts->worker_address = NULL;
+    opts->coordinate_addresses = NULL;
+    opts->sort_engine = SORT_ENGINE_AUTO;
+    opts->record_size = 0;
+    opts->permutation = false;
+    opts->merge = false;
+    opts->validate = false;
+    opts->add_to_filename = NULL;
+    opts->counting = COUNTING_AUTO;
+    opts->consume_input = false;
+    opts->spill_file = false;
+    opts->index_interval = 0;
+    opts->lazy_interval = 0;
+    opts->num_output_shards = 0;
+    opts->autotune = false;
+    opts->batch_filename = NULL;
+    opts->merge_filenames = NULL;
+    opts->num_merge_filenames = 0;
     opts->quiet = false;
 
     // Loop over arguments, looking for any option flags. These must come before any positional arguments.
     for (;;) {
-        int opt = getopt_long(argc, argv, "hqr:", long_options, NULL);
+        int opt = getopt_long(argc, argv, "hqM:r:m:HLT:cRl:Pj:S:k:pgVa:u:Dsx:z:O:Ab:C:w:", long_options, NULL);
         if (opt == -1) {
             break;
         }
@@ -81,13 +433,148 @@ void get_options(int argc, char *const argv[], struct options *opts)
             case 'q':
                 opts->quiet = true;
                 break;
+            case 'M':
+                if (!parse_size(optarg, &opts->memory_size)) {
+                    fprintf(stderr, "ERROR: invalid memory size: %s\n", optarg);
+                    return false;
+                }
+                break;
             case 'r':
-                opts->run_size = (size_t) strtoul(optarg, NULL, 0);
+                if (!parse_size(optarg, &opts->run_size)) {
+                    fprintf(stderr, "ERROR: invalid run size: %s\n", optarg);
+                    return false;
+                }
                 break;
-            default:
+            case 'm':
+                if (!parse_count(optarg, &opts->max_files)) {
+                    fprintf(stderr, "ERROR: invalid maximum number of files: %s\n", optarg);
+                    return false;
+                }
+                break;
+            case 'H':
+                opts->huge_pages = true;
+                break;
+            case 'L':
+                opts->lock_memory = true;
+                break;
+            case 'T':
+                opts->temp_directory = optarg;
+                break;
+            case 'c':
+                opts->checkpoint = true;
+                break;
+            case 'R':
+                opts->resume = true;
+                opts->checkpoint = true;
+                break;
+            case 'l': {
+                size_t limit = 0;
+                if (!parse_size(optarg, &limit)) {
+                    fprintf(stderr, "ERROR: invalid limit: %s\n", optarg);
+                    return false;
+                }
+                opts->limit = (uint64_t) limit;
+                break;
+            }
+            case 'P':
+                opts->partition = true;
+                break;
+            case 'j':
+                if (!parse_count(optarg, &opts->num_threads)) {
+                    fprintf(stderr, "ERROR: invalid number of threads: %s\n", optarg);
+                    return false;
+                }
+                break;
+            case 'S':
+                if (!sort_engine_from_name(optarg, &opts->sort_engine)) {
+                    fprintf(stderr, "ERROR: unknown sort engine: %s\n", optarg);
+                    return false;
+                }
+                break;
+            case 'k':
+                if (!parse_size(optarg, &opts->record_size) || (opts->record_size < sizeof(uint32_t))) {
+                    fprintf(stderr, "ERROR: invalid record size: %s\n", optarg);
+                    return false;
+                }
+                break;
+            case 'p':
+                opts->permutation = true;
+                break;
+            case 'g':
+                opts->merge = true;
+                break;
+            case 'V':
+                opts->validate = true;
+                break;
+            case 'a':
+                opts->add_to_filename = optarg;
                 break;
+            case 'u':
+                if (strcmp(optarg, "auto") == 0) {
+                    opts->counting = COUNTING_AUTO;
+                } else if (strcmp(optarg, "always") == 0) {
+                    opts->counting = COUNTING_ALWAYS;
+                } else if (strcmp(optarg, "never") == 0) {
+                    opts->counting = COUNTING_NEVER;
+                } else {
+                    fprintf(stderr, "ERROR: invalid counting mode: %s\n", optarg);
+                    return false;
+                }
+                break;
+            case 'D':
+                opts->consume_input = true;
+                break;
+            case 's':
+                opts->spill_file = true;
+                break;
+            case 'x': {
+                size_t interval = 0;
+                if (!parse_size(optarg, &interval) || (interval == 0)) {
+                    fprintf(stderr, "ERROR: invalid index interval: %s\n", optarg);
+                    return false;
+                }
+                opts->index_interval = (uint64_t) interval;
+                break;
+            }
+            case 'z': {
+                size_t interval = 0;
+                if (!parse_size(optarg, &interval) || (interval == 0)) {
+                    fprintf(stderr, "ERROR: invalid lazy index interval: %s\n", optarg);
+                    return false;
+                }
+                opts->lazy_interval = (uint64_t) interval;
+                break;
+            }
+            case 'A':
+                opts->autotune = true;
+                break;
+            case 'b':
+                opts->batch_filename = optarg;
+                break;
+            case 'O':
+                if (!parse_count(optarg, &opts->num_output_shards) || (opts->num_output_shards == 0)) {
+                    fprintf(stderr, "ERROR: invalid number of output shards: %s\n", optarg);
+                    return false;
+                }
+                break;
+            case 'C':
+                opts->coordinate_addresses = optarg;
+                break;
+            case 'w':
+                opts->worker_address = optarg;
+                break;
+            default:
+                return false;
         }
     }
+    // When merging, every positional argument but the last is an input, and the last is the output.
+    if (opts->merge && (argc - optind >= 2)) {
+        opts->merge_filenames = argv + optind;
+        opts->num_merge_filenames = (size_t) (argc - optind - 1);
+        opts->input_filename = argv[optind];
+        opts->output_filename = argv[argc - 1];
+        optind = argc;
+    }
     // First positional argument is the input filename
     if (optind < argc) {
         opts->input_filename = argv[optind];
@@ -98,18 +585,610 @@ void get_options(int argc, char *const argv[], struct options *opts)
         opts->output_filename = argv[optind];
         optind++;
     }
+    // A permutation of plain values is a key-only sort of 4-byte records.
+    if (opts->permutation && (opts->record_size == 0)) {
+        opts->record_size = sizeof(uint32_t);
+    }
     // Ensure that the run size is a multiple of 4
     opts->run_size = round_up_to_multiple_of_4(opts->run_size);
+
+    // Without an explicit budget, the working memory is the run buffer, as it always has been.
+    if (opts->memory_size == 0) {
+        opts->memory_size = (opts->run_size != 0) ? opts->run_size : DEFAULT_MEMORY_SIZE;
+    }
+    return true;
+}
+
+static void format_duration(char *buffer, size_t buffer_size, double seconds)
+{
+    if (seconds < 0.0) {
+        snprintf(buffer, buffer_size, "--:--:--");
+        return;
+    }
+    unsigned long total = (unsigned long) (seconds + 0.5);
+    snprintf(buffer, buffer_size, "%02lu:%02lu:%02lu", total / 3600, (total / 60) % 60, total % 60);
+}
+
+/*
+ * Removes the index of an earlier version of the output file, if there is one, since it would no longer match the
+ * output once that's rewritten. An indexed output gets a new index as it's written.
+ */
+static void remove_output_index(char const *output_filename)
+{
+    char index_filename[PATH_MAX] = {0};
+    snprintf(index_filename, sizeof(index_filename), "%s.idx", output_filename);
+    remove(index_filename);
+}
+
+/*
+ * Starts indexing the output file as it's written, if asked to (see fence_index_writer_new()). The sorted values are
+ * to be written to *stream, which is the output file itself if there's no index.
+ */
+static bool begin_output_index(
+        struct options const *opts, FILE *output_file, struct fence_index_writer **index, FILE **stream)
+{
+    *index = NULL;
+    *stream = output_file;
+    if (opts->index_interval == 0) {
+        return true;
+    }
+    char index_filename[PATH_MAX] = {0};
+    snprintf(index_filename, sizeof(index_filename), "%s.idx", opts->output_filename);
+    *index = fence_index_writer_new(index_filename, opts->index_interval, output_file);
+    if (!*index) {
+        return false;
+    }
+    *stream = fence_index_writer_get_stream(*index);
+    return true;
+}
+
+/*
+ * Completes the output file's index, if there is one, once the sorted values have all been written. It has to be done
+ * before the output file is closed. The index is removed if writing the output didn't succeed.
+ */
+static bool finish_output_index(struct fence_index_writer *index, bool success)
+{
+    if (index) {
+        success = success && fence_index_writer_finish(index);
+        fence_index_writer_delete(index);
+    }
+    return success;
+}
+
+/*
+ * Writes the limit smallest values of the input to the output file, or to stdout, without creating any runs.
+ */
+static bool select_into_output(
+        struct options const *opts, FILE *input_file, bool output_is_stdout,
+        struct arena *arena, size_t buffer_size, struct progress *progress)
+{
+    FILE *output_file = output_is_stdout ? stdout : fopen(opts->output_filename, "wb");
+    if (!output_file) {
+        fprintf(stderr, "ERROR: unable to create output file: %s\n", strerror(errno));
+        return false;
+    }
+    // The sorted values are written with a single call.
+    setvbuf(output_file, NULL, _IONBF, 0);
+
+    struct fence_index_writer *index = NULL;
+    FILE *stream = NULL;
+    bool success = begin_output_index(opts, output_file, &index, &stream) &&
+                   select_smallest(input_file, stream, arena, buffer_size, opts->limit, progress);
+    success = finish_output_index(index, success);
+    if (!output_is_stdout && (fclose(output_file) != 0)) {
+        fprintf(stderr, "ERROR: unable to write output file: %s\n", strerror(errno));
+        success = false;
+    }
+    return success;
+}
+
+/*
+ * Sorts the input by counting its values (see count_sort()) into the output file, or to stdout. Histogram runs, if
+ * there are any, are named after run_base_filename.
+ */
+static bool count_into_output(
+        struct options const *opts, FILE *input_file, bool output_is_stdout, char const *run_base_filename,
+        struct arena *arena, struct progress *progress,
+        size_t *num_runs, size_t *generations, uint64_t *num_distinct)
+{
+    FILE *output_file = output_is_stdout ? stdout : fopen(opts->output_filename, "wb");
+    if (!output_file) {
+        fprintf(stderr, "ERROR: unable to create output file: %s\n", strerror(errno));
+        return false;
+    }
+    // Values are expanded into whole blocks before they're written.
+    setvbuf(output_file, NULL, _IONBF, 0);
+
+    struct fence_index_writer *index = NULL;
+    FILE *stream = NULL;
+    bool success = begin_output_index(opts, output_file, &index, &stream) &&
+                   count_sort(
+                           input_file, stream, run_base_filename, opts->limit, arena, opts->max_files, progress,
+                           num_runs, generations, num_distinct);
+    success = finish_output_index(index, success);
+    if (!output_is_stdout && (fclose(output_file) != 0) && success) {
+        fprintf(stderr, "ERROR: unable to write output file: %s\n", strerror(errno));
+        success = false;
+    }
+    return success;
+}
+
+/*
+ * Merges the runs into the sorted file opts->add_to_filename on their way to the output file, or to stdout. A file
+ * output is written under a temporary name and then renamed into place, since it may be the sorted file itself.
+ */
+static bool merge_into_sorted_file(
+        struct options const *opts, bool output_is_stdout, char const *run_base_filename, size_t num_runs,
+        struct arena *arena, struct sort_plan const *plan, struct progress *progress, size_t *generations)
+{
+    char partial_filename[PATH_MAX] = {0};
+    snprintf(partial_filename, sizeof(partial_filename), "%s.partial", opts->output_filename);
+    FILE *output_file = output_is_stdout ? stdout : fopen(partial_filename, "wb");
+    if (!output_file) {
+        fprintf(stderr, "ERROR: unable to create output file: %s\n", strerror(errno));
+        return false;
+    }
+    // The merge writes whole blocks.
+    setvbuf(output_file, NULL, _IONBF, 0);
+
+    struct fence_index_writer *index = NULL;
+    FILE *stream = NULL;
+    bool success = begin_output_index(opts, output_file, &index, &stream) &&
+                   merge_runs_with_sorted_file(
+                           run_base_filename, num_runs, opts->add_to_filename,
+                           arena, plan->fan_in, plan->block_size, opts->limit, opts->validate,
+                           stream, progress, generations);
+    success = finish_output_index(index, success);
+    if (output_is_stdout) {
+        return success;
+    }
+    if ((fclose(output_file) != 0) && success) {
+        fprintf(stderr, "ERROR: unable to write output file: %s\n", strerror(errno));
+        success = false;
+    }
+    if (success && (rename(partial_filename, opts->output_filename) != 0)) {
+        fprintf(stderr, "ERROR: unable to rename output file into place: %s\n", strerror(errno));
+        success = false;
+    }
+    if (!success) {
+        remove(partial_filename);
+    }
+    return success;
+}
+
+/*
+ * Merges the runs, which may be in a spill store, into the output file. Unlike merge_runs(), the last merge writes the
+ * output file itself, even if there's only a single run to copy out, rather than renaming a final run into place. That
+ * takes a spill store, which has no final run file to rename, and an index, which is written as the output is.
+ */
+static bool merge_runs_into_file(
+        struct options const *opts, struct spill_store *spill, size_t num_runs,
+        struct arena *arena, struct sort_plan const *plan, struct progress *progress, size_t *generations)
+{
+    FILE *output_file = fopen(opts->output_filename, "wb");
+    if (!output_file) {
+        fprintf(stderr, "ERROR: unable to create output file: %s\n", strerror(errno));
+        return false;
+    }
+    // The merge writes whole blocks.
+    setvbuf(output_file, NULL, _IONBF, 0);
+
+    struct fence_index_writer *index = NULL;
+    FILE *stream = NULL;
+    bool success = begin_output_index(opts, output_file, &index, &stream) &&
+                   merge_runs_to_stream(
+                           opts->output_filename, num_runs,
+                           arena, plan->fan_in, plan->block_size, opts->limit,
+                           spill, stream, progress, generations);
+    success = finish_output_index(index, success);
+    if ((fclose(output_file) != 0) && success) {
+        fprintf(stderr, "ERROR: unable to write output file: %s\n", strerror(errno));
+        success = false;
+    }
+    if (!success) {
+        remove(opts->output_filename);
+    }
+    return success;
+}
+
+/*
+ * Gets the cost model's view of the device that the runs will be written to, which is the output file's directory, or
+ * the temporary directory when writing to stdout. A cached probe of the device is used if there is one. Otherwise, the
+ * device is probed, and the probe is cached for next time.
+ */
+static bool measure_run_device(
+        struct options const *opts, bool output_is_stdout, struct plan_device *device, bool *cached)
+{
+    char directory[PATH_MAX] = {0};
+    if (output_is_stdout) {
+        snprintf(directory, sizeof(directory), "%s", opts->temp_directory);
+    } else {
+        // dirname() may modify its argument.
+        char output_path[PATH_MAX] = {0};
+        snprintf(output_path, sizeof(output_path), "%s", opts->output_filename);
+        snprintf(directory, sizeof(directory), "%s", dirname(output_path));
+    }
+
+    char cache_filename[PATH_MAX] = {0};
+    bool const can_cache = autotune_get_cache_filename(directory, cache_filename, sizeof(cache_filename));
+    *cached = can_cache && autotune_load_device(cache_filename, device);
+    if (*cached) {
+        return true;
+    }
+    if (!autotune_probe(directory, AUTOTUNE_PROBE_SIZE, device)) {
+        fprintf(stderr, "ERROR: unable to probe the device that holds %s\n", directory);
+        return false;
+    }
+    // Failing to cache the probe only means probing again next time.
+    if (can_cache) {
+        autotune_save_device(cache_filename, device);
+    }
+    return true;
+}
+
+/*
+ * Allocates memory_size bytes of working memory, backed by huge pages and locked in memory if asked to. Not getting it
+ * locked only gets a warning, since the sort works all the same.
+ */
+static struct arena *new_arena(struct options const *opts, size_t memory_size)
+{
+    unsigned int arena_flags = ARENA_FLAG_NONE;
+    if (opts->huge_pages) {
+        arena_flags |= ARENA_FLAG_HUGE_PAGES;
+    }
+    if (opts->lock_memory) {
+        arena_flags |= ARENA_FLAG_LOCK;
+    }
+    struct arena *arena = arena_new(memory_size, arena_flags);
+    if (arena && opts->lock_memory && !arena_is_locked(arena)) {
+        fprintf(stderr, "WARNING: unable to lock working memory: %s\n", strerror(arena_get_lock_error(arena)));
+    }
+    return arena;
+}
+
+/*
+ * Serves as a worker for a distributed sort. The memory budget is planned as if for a sort of unknown size, since the
+ * shard's size isn't known until a coordinator hands it over.
+ */
+static bool serve_as_worker(struct options const *opts)
+{
+    struct sort_plan plan = {0};
+    if (!plan_sort(&plan, opts->memory_size, opts->run_size, 0, opts->max_files)) {
+        fprintf(stderr, "ERROR: memory size %lu is too small to sort with.\n", opts->memory_size);
+        return false;
+    }
+    struct arena *arena = new_arena(opts, plan.memory_size);
+    if (!arena) {
+        fprintf(stderr, "ERROR: unable to allocate working memory: %s\n", strerror(errno));
+        return false;
+    }
+    struct cluster_worker *worker = cluster_worker_new(opts->worker_address);
+    if (!worker) {
+        arena_delete(arena);
+        return false;
+    }
+    if (!opts->quiet) {
+        printf("Worker listening on %s\n", cluster_worker_get_address(worker));
+        fflush(stdout);
+    }
+
+    bool const served = cluster_worker_serve(worker, arena, plan.run_size, opts->max_files);
+    cluster_worker_delete(worker);
+    arena_delete(arena);
+    if (served && !opts->quiet) {
+        printf("Completed successfully!\n");
+    }
+    return served;
+}
+
+/*
+ * Coordinates a distributed sort across the workers listed in opts->coordinate_addresses.
+ */
+static bool coordinate_workers(struct options const *opts)
+{
+    // Split the comma-separated addresses in place.
+    size_t num_workers = 1;
+    for (char const *c = opts->coordinate_addresses; *c; c++) {
+        num_workers += (*c == ',') ? 1 : 0;
+    }
+    char const **addresses = (char const **) calloc(num_workers, sizeof(char const *));
+    if (!addresses) {
+        return false;
+    }
+    char *save = NULL;
+    size_t i = 0;
+    for (char *address = strtok_r(opts->coordinate_addresses, ",", &save); address && (i < num_workers);
+         address = strtok_r(NULL, ",", &save)) {
+        addresses[i++] = address;
+    }
+    num_workers = i;
+    if (num_workers == 0) {
+        fprintf(stderr, "ERROR: no worker addresses given\n");
+        free(addresses);
+        return false;
+    }
+
+    if (!opts->quiet) {
+        printf(
+                "--[ Parameters ]-------------------------------\n" \
+                "  input file: %s\n" \
+                " output file: %s\n" \
+                "     workers: %lu\n",
+                opts->input_filename, opts->output_filename, num_workers);
+        fflush(stdout);
+    }
+    uint64_t num_values = 0;
+    bool const coordinated = cluster_coordinate(
+            opts->input_filename, opts->output_filename, addresses, num_workers, &num_values);
+    free(addresses);
+    if (!coordinated) {
+        fprintf(stderr, "ERROR: unable to sort with workers.\n");
+        return false;
+    }
+    if (!opts->quiet) {
+        printf("--[ Stats ]------------------------------------\n");
+        printf("       initial runs: 0\n");
+        printf("  merge generations: 0\n");
+        printf("             values: %lu\n", (size_t) num_values);
+        printf("-----------------------------------------------\n");
+        printf("Completed successfully!\n");
+    }
+    return true;
+}
+
+/*
+ * Renders progress reports to stderr. When stderr is a terminal, the line is redrawn in place. Otherwise, each report
+ * gets its own line so that logs remain readable.
+ */
+static void print_progress(struct bigsort_progress const *progress, void *user_data)
+{
+    bool const interactive = *(bool const *) user_data;
+
+    double percent = 100.0;
+    if (progress->bytes_total > 0) {
+        percent = 100.0 * (double) progress->bytes_processed / (double) progress->bytes_total;
+    }
+    char eta[32] = {0};
+    format_duration(eta, sizeof(eta), progress->eta_seconds);
+    char elapsed[32] = {0};
+    format_duration(elapsed, sizeof(elapsed), progress->elapsed_seconds);
+
+    char phase[64] = {0};
+    switch (progress->phase) {
+        case BIGSORT_PHASE_CREATE_RUNS:
+            snprintf(phase, sizeof(phase), "creating runs");
+            break;
+        case BIGSORT_PHASE_MERGE:
+            snprintf(phase, sizeof(phase), "merge gen %lu/%lu", progress->generation, progress->planned_generations);
+            break;
+        case BIGSORT_PHASE_PARTITION:
+            snprintf(phase, sizeof(phase), "partitioning");
+            break;
+        case BIGSORT_PHASE_SORT_BUCKETS:
+            snprintf(phase, sizeof(phase), "sorting buckets");
+            break;
+        case BIGSORT_PHASE_COUNT:
+            snprintf(phase, sizeof(phase), "counting");
+            break;
+        case BIGSORT_PHASE_DONE:
+        default:
+            snprintf(phase, sizeof(phase), "done");
+            break;
+    }
+
+    fprintf(stderr, "%s[%-16s] %5.1f%%  %8.1f MB/s  elapsed %s  eta %s%s",
+            interactive ? "\r" : "", phase, percent, progress->throughput / (double) (1 << 20), elapsed, eta,
+            (interactive && (progress->phase != BIGSORT_PHASE_DONE)) ? "" : "\n");
+    fflush(stderr);
+}
+
+/*
+ * Merges the already sorted files listed in opts->merge_filenames into the output file, or to stdout.
+ */
+static bool merge_sorted_files(struct options const *opts)
+{
+    bool const output_is_stdout = (strcmp(opts->output_filename, STANDARD_STREAM_FILENAME) == 0);
+    FILE *info = output_is_stdout ? stderr : stdout;
+
+    // The inputs are read while the output is written, so the output can't be one of them.
+    struct stat output_status = {0};
+    bool const output_exists = !output_is_stdout && (stat(opts->output_filename, &output_status) == 0);
+    uint64_t total_size = 0;
+    for (size_t i = 0; i < opts->num_merge_filenames; i++) {
+        struct stat input_status = {0};
+        if (strcmp(opts->merge_filenames[i], STANDARD_STREAM_FILENAME) == 0) {
+            fprintf(stderr, "ERROR: merging requires named input files\n");
+            return false;
+        }
+        if (stat(opts->merge_filenames[i], &input_status) != 0) {
+            fprintf(stderr, "ERROR: unable to open input file %s: %s\n", opts->merge_filenames[i], strerror(errno));
+            return false;
+        }
+        if (output_exists && (input_status.st_dev == output_status.st_dev) &&
+            (input_status.st_ino == output_status.st_ino)) {
+            fprintf(stderr, "ERROR: the output file can't also be an input when merging\n");
+            return false;
+        }
+        total_size += (uint64_t) input_status.st_size;
+    }
+
+    // Plan the merge for the inputs as the initial runs.
+    struct sort_plan plan = {0};
+    if (!plan_sort(&plan, opts->memory_size, opts->run_size, total_size, opts->max_files) ||
+        !plan_merge(&plan, opts->num_merge_filenames, opts->max_files)) {
+        fprintf(stderr, "ERROR: memory size %lu is too small to merge with.\n", opts->memory_size);
+        return false;
+    }
+
+    // The inputs are linked in as runs next to the output file, or in the temporary directory for stdout.
+    char run_base_filename[PATH_MAX] = {0};
+    if (output_is_stdout) {
+        snprintf(run_base_filename, sizeof(run_base_filename), "%s/bigsort-XXXXXX", opts->temp_directory);
+        int fd = mkstemp(run_base_filename);
+        if (fd < 0) {
+            fprintf(stderr, "ERROR: unable to create temporary file: %s\n", strerror(errno));
+            return false;
+        }
+        close(fd);
+        setvbuf(stdout, NULL, _IONBF, 0);
+        signal(SIGPIPE, SIG_IGN);
+    } else {
+        snprintf(run_base_filename, sizeof(run_base_filename), "%s", opts->output_filename);
+    }
+
+    struct arena *arena = new_arena(opts, plan.memory_size);
+    FILE *output_file = output_is_stdout ? stdout : fopen(opts->output_filename, "wb");
+    if (!arena || !output_file) {
+        fprintf(stderr, "ERROR: unable to set up the merge: %s\n", strerror(errno));
+        arena_delete(arena);
+        if (output_is_stdout) {
+            remove(run_base_filename);
+        }
+        return false;
+    }
+    // The merge writes whole blocks.
+    setvbuf(output_file, NULL, _IONBF, 0);
+
+    if (!opts->quiet) {
+        fprintf(info,
+                "--[ Parameters ]-------------------------------\n" \
+                " input files: %lu\n" \
+                " output file: %s\n" \
+                "      memory: %lu\n" \
+                "    validate: %s\n" \
+                "--[ Plan ]-------------------------------------\n" \
+                "        files per merge: %lu\n" \
+                "             block size: %lu\n" \
+                "  estimated generations: %lu\n",
+                opts->num_merge_filenames, opts->output_filename, plan.memory_size, opts->validate ? "yes" : "no",
+                plan.fan_in, plan.block_size, (plan.estimated_generations > 0) ? plan.estimated_generations : 1);
+        fflush(info);
+    }
+
+    bool progress_interactive = isatty(fileno(stderr));
+    struct progress *progress = NULL;
+    if (!opts->quiet) {
+        progress = progress_new(print_progress, &progress_interactive, PROGRESS_INTERVAL_SECONDS);
+    }
+    size_t num_generations = 0;
+    struct fence_index_writer *index = NULL;
+    FILE *stream = NULL;
+    bool merged = begin_output_index(opts, output_file, &index, &stream) &&
+                  merge_files(
+                          (char const *const *) opts->merge_filenames, opts->num_merge_filenames, run_base_filename,
+                          arena, plan.fan_in, plan.block_size, opts->limit, opts->validate,
+                          stream, progress, &num_generations);
+    merged = finish_output_index(index, merged);
+    progress_delete(progress);
+    arena_delete(arena);
+    if (output_is_stdout) {
+        remove(run_base_filename);
+    } else {
+        if (fclose(output_file) != 0) {
+            merged = false;
+        }
+        if (!merged) {
+            remove(opts->output_filename);
+        }
+    }
+    if (!merged) {
+        fprintf(stderr, "ERROR: unable to merge input files.\n");
+        return false;
+    }
+    if (!opts->quiet) {
+        fprintf(info, "--[ Stats ]------------------------------------\n");
+        fprintf(info, "       initial runs: %lu\n", opts->num_merge_filenames);
+        fprintf(info, "  merge generations: %lu\n", num_generations);
+        fprintf(info, "-----------------------------------------------\n");
+        fprintf(info, "Completed successfully!\n");
+    }
+    return true;
+}
+
+/*
+ * Sorts each job that opts->batch_filename lists into its output file, sharing one arena and one pool of threads
+ * between them all (see batch.h).
+ */
+static bool sort_batch(struct options const *opts)
+{
+    size_t num_jobs = 0;
+    struct batch_job *jobs = batch_read_jobs(opts->batch_filename, &num_jobs);
+    if (!jobs) {
+        return false;
+    }
+
+    struct arena *arena = new_arena(opts, opts->memory_size);
+    struct thread_pool *pool = arena ? thread_pool_new(opts->num_threads) : NULL;
+    if (!arena || !pool) {
+        fprintf(stderr, "ERROR: unable to set up the batch: %s\n", strerror(errno));
+        arena_delete(arena);
+        batch_free_jobs(jobs, num_jobs);
+        return false;
+    }
+
+    if (!opts->quiet) {
+        printf("--[ Parameters ]-------------------------------\n" \
+               "    job file: %s\n" \
+               "        jobs: %lu\n" \
+               "      memory: %lu\n" \
+               "     threads: %lu\n",
+               opts->batch_filename, num_jobs, arena_size(arena), thread_pool_get_num_threads(pool));
+        fflush(stdout);
+    }
+
+    for (size_t i = 0; i < num_jobs; i++) {
+        remove_output_index(jobs[i].output_filename);
+    }
+    struct batch_stats stats = {0};
+    bool const sorted = batch_run(jobs, num_jobs, arena, pool, opts->max_files, &stats);
+    thread_pool_delete(pool);
+    arena_delete(arena);
+    batch_free_jobs(jobs, num_jobs);
+    if (!opts->quiet) {
+        printf("--[ Batch ]------------------------------------\n");
+        printf("         small jobs: %lu\n", stats.num_small);
+        printf("         large jobs: %lu\n", stats.num_large);
+        printf("        failed jobs: %lu\n", stats.num_failed);
+    }
+    if (!sorted) {
+        fprintf(stderr, "ERROR: %lu of %lu jobs failed.\n", stats.num_failed, num_jobs);
+        return false;
+    }
+    if (!opts->quiet) {
+        printf("-----------------------------------------------\n");
+        printf("Completed successfully!\n");
+    }
+    return true;
 }
 
 int main(int argc, char *argv[])
 {
     struct options opts = {0};
-    get_options(argc, argv, &opts);
+    if (!get_options(argc, argv, &opts)) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
     if (opts.print_help) {
         print_usage();
         return EXIT_SUCCESS;
     }
+    sort_engine_set_default(opts.sort_engine);
+    if (opts.worker_address) {
+        return serve_as_worker(&opts) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (opts.batch_filename) {
+        if (opts.input_filename || opts.run_size || opts.merge || opts.checkpoint || opts.limit || opts.partition ||
+            opts.record_size || opts.add_to_filename || opts.consume_input || opts.spill_file || opts.index_interval ||
+            opts.lazy_interval || opts.num_output_shards || opts.autotune || opts.validate ||
+            (opts.counting == COUNTING_ALWAYS) || opts.coordinate_addresses) {
+            fprintf(stderr, "ERROR: a batch takes its files from the job file, and can't be combined with a run size, "
+                            "merging, checkpoints, a limit, partitioning, key-only sorting, adding to a sorted file, "
+                            "consuming the input, a spill file, an index, a lazy sort, output shards, autotuning, "
+                            "validating, counting or distributed sorting\n");
+            return EXIT_FAILURE;
+        }
+        return sort_batch(&opts) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     if (!opts.input_filename) {
         fprintf(stderr, "ERROR: Missing input filename\n");
         print_usage();
@@ -121,55 +1200,505 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    if (!opts.quiet) {
-        printf(
-                "--[ Parameters ]-------------------------------\n" \
-                "  input file: %s\n" \
-                " output file: %s\n" \
-                "    run size: %lu\n",
-                opts.input_filename, opts.output_filename, opts.run_size);
+    bool const input_is_stdin = (strcmp(opts.input_filename, STANDARD_STREAM_FILENAME) == 0);
+    bool const output_is_stdout = (strcmp(opts.output_filename, STANDARD_STREAM_FILENAME) == 0);
+
+    if (opts.checkpoint && (input_is_stdin || output_is_stdout)) {
+        fprintf(stderr, "ERROR: checkpoints require named input and output files\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.partition && (input_is_stdin || output_is_stdout)) {
+        fprintf(stderr, "ERROR: partitioning requires named input and output files\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.partition && (opts.checkpoint || opts.limit)) {
+        fprintf(stderr, "ERROR: partitioning can't be combined with checkpoints or a limit\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.spill_file &&
+        (opts.merge || opts.checkpoint || opts.partition || opts.record_size || opts.add_to_filename ||
+         (opts.counting == COUNTING_ALWAYS) || opts.coordinate_addresses)) {
+        fprintf(stderr, "ERROR: a spill file can't be combined with merging, checkpoints, partitioning, key-only "
+                        "sorting, adding to a sorted file, counting or distributed sorting\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.index_interval &&
+        (output_is_stdout || opts.checkpoint || opts.partition || opts.record_size || opts.coordinate_addresses)) {
+        fprintf(stderr, "ERROR: an index requires a named output file, and can't be combined with checkpoints, "
+                        "partitioning, key-only sorting or distributed sorting\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.lazy_interval &&
+        (output_is_stdout || opts.merge || opts.checkpoint || opts.partition || opts.record_size ||
+         opts.add_to_filename || opts.spill_file || opts.index_interval || (opts.counting == COUNTING_ALWAYS) ||
+         opts.coordinate_addresses)) {
+        fprintf(stderr, "ERROR: a lazy sort requires a named output file, and can't be combined with merging, "
+                        "checkpoints, partitioning, key-only sorting, adding to a sorted file, a spill file, an index, "
+                        "counting or distributed sorting\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.num_output_shards &&
+        (output_is_stdout || opts.merge || opts.checkpoint || opts.limit || opts.partition || opts.record_size ||
+         opts.add_to_filename || opts.spill_file || opts.index_interval || opts.lazy_interval ||
+         (opts.counting == COUNTING_ALWAYS) || opts.coordinate_addresses)) {
+        fprintf(stderr, "ERROR: output shards require a named output file, and can't be combined with merging, "
+                        "checkpoints, a limit, partitioning, key-only sorting, adding to a sorted file, a spill file, "
+                        "an index, a lazy sort, counting or distributed sorting\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.autotune && (opts.merge || opts.coordinate_addresses)) {
+        fprintf(stderr, "ERROR: autotuning can't be combined with merging or distributed sorting\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.merge) {
+        if (opts.checkpoint || opts.partition || opts.record_size || opts.consume_input || opts.coordinate_addresses) {
+            fprintf(stderr, "ERROR: merging can't be combined with checkpoints, partitioning, key-only sorting, "
+                            "consuming the input or distributed sorting\n");
+            return EXIT_FAILURE;
+        }
+        if (!output_is_stdout) {
+            remove_output_index(opts.output_filename);
+        }
+        return merge_sorted_files(&opts) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (opts.validate && !opts.add_to_filename) {
+        fprintf(stderr, "ERROR: validating inputs only applies to merging\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.add_to_filename &&
+        (opts.checkpoint || opts.partition || opts.record_size || opts.coordinate_addresses)) {
+        fprintf(stderr, "ERROR: adding to a sorted file can't be combined with checkpoints, partitioning, key-only "
+                        "sorting or distributed sorting\n");
+        return EXIT_FAILURE;
+    }
+    if ((opts.counting == COUNTING_ALWAYS) &&
+        (opts.checkpoint || opts.partition || opts.record_size || opts.add_to_filename || opts.coordinate_addresses)) {
+        fprintf(stderr, "ERROR: counting can't be combined with checkpoints, partitioning, key-only sorting, adding "
+                        "to a sorted file or distributed sorting\n");
+        return EXIT_FAILURE;
+    }
+    // A failed sort must leave the consumed input in its runs, which only the merge into a named output file does.
+    if (opts.consume_input &&
+        (input_is_stdin || output_is_stdout || opts.checkpoint || opts.partition || opts.record_size ||
+         (opts.counting == COUNTING_ALWAYS) || opts.add_to_filename || opts.spill_file || opts.index_interval ||
+         opts.num_output_shards || opts.coordinate_addresses)) {
+        fprintf(stderr, "ERROR: consuming the input requires named input and output files, and can't be combined "
+                        "with checkpoints, partitioning, key-only sorting, counting, adding to a sorted file, a spill "
+                        "file, an index, output shards or distributed sorting\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.record_size != 0) {
+        if (input_is_stdin || output_is_stdout || opts.checkpoint || opts.limit || opts.partition ||
+            opts.coordinate_addresses) {
+            fprintf(stderr, "ERROR: key-only sorting requires named input and output files, and can't be combined "
+                            "with checkpoints, a limit, partitioning or distributed sorting\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (opts.coordinate_addresses) {
+        if (input_is_stdin || output_is_stdout || opts.checkpoint || opts.limit || opts.partition) {
+            fprintf(stderr, "ERROR: distributed sorting requires named input and output files, and can't be "
+                            "combined with checkpoints, a limit or partitioning\n");
+            return EXIT_FAILURE;
+        }
+        remove_output_index(opts.output_filename);
+        return coordinate_workers(&opts) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    // A lazy sort leaves the output file as it is, and so its index too.
+    if (!output_is_stdout && !opts.lazy_interval) {
+        remove_output_index(opts.output_filename);
     }
 
-    // Open the input file to sort
-    FILE *input_file = fopen(opts.input_filename, "rb");
+    // Sorted data goes to stdout when it's the output, so everything else that would be printed goes to stderr.
+    FILE *info = output_is_stdout ? stderr : stdout;
+
+    // Open the input file to sort. It's only written to if it's to be consumed.
+    FILE *input_file = input_is_stdin ? stdin : fopen(opts.input_filename, opts.consume_input ? "r+b" : "rb");
     if (!input_file) {
         fprintf(stderr, "ERROR: unable to open input file: %s\n", strerror(errno));
         return EXIT_FAILURE;
     }
+    // Runs are read straight into the run buffer. A stdio buffer would only add a copy.
+    setvbuf(input_file, NULL, _IONBF, 0);
+    if (output_is_stdout) {
+        // Likewise, the final merge writes whole blocks.
+        setvbuf(stdout, NULL, _IONBF, 0);
+        // If the reader goes away, fail the write instead of dying on the spot so that temporary files get cleaned up.
+        signal(SIGPIPE, SIG_IGN);
+    }
 
-    // Allocate working memory based on the requested run size.
-    size_t const working_memory_size = opts.run_size;
-    void *working_memory = malloc(working_memory_size);
-    if (!working_memory) {
+    // Only a regular file's size is known before it's read. Anything else (e.g. a pipe) is planned as if it fits in a
+    // single run, and the merge is re-planned once the runs have been created.
+    struct stat input_status = {0};
+    if (fstat(fileno(input_file), &input_status) != 0) {
         fclose(input_file);
-        fprintf(stderr, "ERROR: unable to allocate working memory: %s\n", strerror(errno));
+        fprintf(stderr, "ERROR: unable to determine input file size: %s\n", strerror(errno));
         return EXIT_FAILURE;
     }
+    bool const input_size_known = S_ISREG(input_status.st_mode);
+    uint64_t const input_size = input_size_known ? (uint64_t) input_status.st_size : 0;
 
-    // Create the initial runs
-    size_t num_runs = create_runs(input_file, opts.output_filename, working_memory, working_memory_size);
-    fclose(input_file);
-
-    if (!num_runs) {
-        free(working_memory);
-        fprintf(stderr, "ERROR: unable to create runs.\n");
+    // Split the memory budget between the run and merge phases, for the device that the runs go to if asked to.
+    struct sort_plan plan = {0};
+    plan.runs_share_file = opts.spill_file;
+    bool device_cached = false;
+    if (opts.autotune && !measure_run_device(&opts, output_is_stdout, &plan.device, &device_cached)) {
+        fclose(input_file);
         return EXIT_FAILURE;
     }
+    bool const planned = opts.autotune
+                         ? autotune_plan(&plan, opts.memory_size, opts.run_size, input_size, opts.max_files)
+                         : plan_sort(&plan, opts.memory_size, opts.run_size, input_size, opts.max_files);
+    if (!planned) {
+        fclose(input_file);
+        fprintf(stderr, "ERROR: memory size %lu is too small to sort with.\n", opts.memory_size);
+        return EXIT_FAILURE;
+    }
+
+    // When the limit fits in half the run buffer, the smallest values can be picked out in memory as the input streams
+    // past, and no runs are needed. That doesn't apply when adding to a sorted file, which has values of its own, or
+    // when the input is to be consumed, which only creating runs does.
+    bool const select_in_memory = (opts.limit != 0) && !opts.add_to_filename && (opts.counting != COUNTING_ALWAYS) &&
+                                  !opts.lazy_interval && !opts.consume_input &&
+                                  (opts.limit <= (plan.run_size / sizeof(uint32_t)) / 2);
+
+    // Runs are normally written next to the output file. There's no such place for stdout, so reserve a unique name in
+    // the temporary directory instead.
+    char run_base_filename[PATH_MAX] = {0};
+    if (select_in_memory) {
+        // No runs
+    } else if (output_is_stdout) {
+        snprintf(run_base_filename, sizeof(run_base_filename), "%s/bigsort-XXXXXX", opts.temp_directory);
+        int fd = mkstemp(run_base_filename);
+        if (fd < 0) {
+            fclose(input_file);
+            fprintf(stderr, "ERROR: unable to create temporary file: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        close(fd);
+    } else {
+        snprintf(run_base_filename, sizeof(run_base_filename), "%s", opts.output_filename);
+    }
 
-    // Merge the initial runs into the final output file
-    size_t num_generations = merge_runs(opts.output_filename, num_runs, working_memory, working_memory_size,
-                                        opts.max_files);
-    if (!num_generations) {
-        free(working_memory);
-        fprintf(stderr, "ERROR: unable to merge runs.\n");
+    // Allocate working memory based on the planned budget. Both phases share it.
+    struct arena *arena = new_arena(&opts, plan.memory_size);
+    if (!arena) {
+        fclose(input_file);
+        if (output_is_stdout && !select_in_memory) {
+            remove(run_base_filename);
+        }
+        fprintf(stderr, "ERROR: unable to allocate working memory: %s\n", strerror(errno));
         return EXIT_FAILURE;
     }
+
+    // Count instead of sorting when asked to, or when a sample shows that the input has few distinct values. Counting
+    // has its own way of doing what the other modes do, so they're never counted.
+    bool use_counting = (opts.counting == COUNTING_ALWAYS);
+    if ((opts.counting == COUNTING_AUTO) && input_size_known && !select_in_memory && !opts.checkpoint &&
+        !opts.partition && (opts.record_size == 0) && !opts.add_to_filename && !opts.consume_input &&
+        !opts.spill_file && !opts.lazy_interval && !opts.num_output_shards) {
+        use_counting = count_sort_is_worthwhile(fileno(input_file), input_size, arena);
+    }
+
+    // Buckets are sorted, or output shards merged, by a pool of threads.
+    struct thread_pool *pool = NULL;
+    if (opts.partition || opts.num_output_shards) {
+        if (opts.autotune && (opts.num_threads == 0)) {
+            opts.num_threads = autotune_choose_threads(&plan, thread_pool_get_default_num_threads());
+        }
+        pool = thread_pool_new(opts.num_threads);
+        if (!pool) {
+            arena_delete(arena);
+            fclose(input_file);
+            fprintf(stderr, "ERROR: unable to start threads: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Open (or, when resuming, pick up) the checkpoint manifest. It's tied to the input file's size and modification
+    // time and to the run size, since the recorded runs are only valid for those.
+    char manifest_filename[PATH_MAX] = {0};
+    struct manifest *manifest = NULL;
+    if (opts.checkpoint && !select_in_memory) {
+        snprintf(manifest_filename, sizeof(manifest_filename), "%s.manifest", opts.output_filename);
+        struct manifest_input const manifest_input = {
+                .size = input_size,
+                .mtime_seconds = (int64_t) input_status.st_mtim.tv_sec,
+                .mtime_nanoseconds = input_status.st_mtim.tv_nsec,
+                .run_size = plan.run_size,
+                .limit = opts.limit,
+        };
+        manifest = manifest_new(manifest_filename, &manifest_input, opts.resume);
+        if (!manifest) {
+            arena_delete(arena);
+            fclose(input_file);
+            return EXIT_FAILURE;
+        }
+    }
+
     if (!opts.quiet) {
-        printf("--[ Stats ]------------------------------------\n");
-        printf("       initial runs: %lu\n", num_runs);
-        printf("  merge generations: %lu\n", num_generations);
-        printf("-----------------------------------------------\n");
-        printf("Completed successfully!\n");
+        static char const *const backing_names[] = {
+                [ARENA_BACKING_NORMAL_PAGES] = "normal pages",
+                [ARENA_BACKING_TRANSPARENT_HUGE_PAGES] = "transparent huge pages",
+                [ARENA_BACKING_EXPLICIT_HUGE_PAGES] = "explicit huge pages",
+        };
+        fprintf(info,
+                "--[ Parameters ]-------------------------------\n" \
+                "  input file: %s\n" \
+                " output file: %s\n" \
+                "      memory: %lu (%s%s)\n" \
+                "    run size: %lu\n" \
+                " sort engine: %s\n",
+                opts.input_filename, opts.output_filename,
+                plan.memory_size, backing_names[arena_get_backing(arena)], arena_is_locked(arena) ? ", locked" : "",
+                plan.run_size, sort_engine_get_name(opts.sort_engine));
+        if (opts.autotune) {
+            fprintf(info,
+                    "--[ Autotune ]---------------------------------\n" \
+                    "            device: %s\n" \
+                    "        sequential: %.1f MB/s\n" \
+                    "              seek: %.3f ms\n" \
+                    "              sort: %.1f MB/s\n" \
+                    "    predicted runs: %.2f s\n" \
+                    "   predicted merge: %.2f s\n",
+                    device_cached ? "cached probe" : "probed",
+                    plan.device.sequential_bytes_per_second / (double) (1 << 20), plan.device.seek_seconds * 1000.0,
+                    plan.device.sort_bytes_per_second / (double) (1 << 20),
+                    plan.estimated_run_seconds, plan.estimated_merge_seconds);
+        }
+        if (opts.partition) {
+            fprintf(info,
+                    "--[ Partition ]--------------------------------\n" \
+                    "  threads: %lu\n",
+                    thread_pool_get_num_threads(pool));
+        } else if (use_counting) {
+            fprintf(info,
+                    "--[ Counting ]---------------------------------\n" \
+                    "  chosen by: %s\n",
+                    (opts.counting == COUNTING_ALWAYS) ? "--counting=always" : "sampling the input");
+        } else if (opts.record_size != 0) {
+            fprintf(info,
+                    "--[ Keys ]-------------------------------------\n" \
+                    "  record size: %lu\n" \
+                    "       output: %s\n",
+                    opts.record_size, opts.permutation ? "permutation" : "records");
+        } else {
+            fprintf(info,
+                    "--[ Plan ]-------------------------------------\n" \
+                    "        estimated runs: %lu%s\n" \
+                    "       files per merge: %lu\n" \
+                    "            block size: %lu\n" \
+                    "          merge memory: %lu\n" \
+                    "  two-way merge kernel: %s\n" \
+                    "  estimated generations: %lu\n",
+                    plan.estimated_runs, input_size_known ? "" : " (input size unknown)",
+                    plan.fan_in, plan.block_size, plan.merge_memory_size,
+                    merge_kernel_get_name(merge_kernel_get_active()),
+                    plan.estimated_generations);
+            if (opts.num_output_shards) {
+                fprintf(info,
+                        "--[ Shards ]-----------------------------------\n" \
+                        "    parts: %lu\n" \
+                        "  threads: %lu\n",
+                        opts.num_output_shards, thread_pool_get_num_threads(pool));
+            }
+        }
+        if (manifest && manifest_was_resumed(manifest)) {
+            fprintf(info,
+                    "--[ Resume ]-----------------------------------\n" \
+                    "    completed runs: %lu%s\n" \
+                    "  completed groups: %lu\n",
+                    manifest_get_num_runs(manifest), manifest_runs_complete(manifest) ? " (all)" : "",
+                    manifest_get_num_groups(manifest));
+        }
+        fflush(info);
+    }
+
+    // Report progress unless asked to be quiet
+    bool progress_interactive = isatty(fileno(stderr));
+    struct progress *progress = NULL;
+    if (!opts.quiet) {
+        progress = progress_new(print_progress, &progress_interactive, PROGRESS_INTERVAL_SECONDS);
+        progress_plan_merge(progress, opts.lazy_interval ? 0 : plan.estimated_generations);
+    }
+
+    size_t num_runs = 0;
+    size_t num_generations = 0;
+    size_t num_buckets = 0;
+    uint64_t num_distinct = 0;
+
+    // Time the sort, and the run phase on its own when there is one, to report against the cost model's prediction.
+    double const sort_start_seconds = util_now_seconds();
+    double runs_done_seconds = 0.0;
+    if (opts.partition) {
+        // Sort by sampling, bucketing and sorting the buckets in parallel. There are no runs or merges.
+        bool const partitioned = partition_sort(
+                input_file, opts.output_filename, arena, pool, progress, &num_buckets);
+        fclose(input_file);
+        progress_delete(progress);
+        thread_pool_delete(pool);
+        arena_delete(arena);
+        if (!partitioned) {
+            fprintf(stderr, "ERROR: unable to sort by partitioning.\n");
+            return EXIT_FAILURE;
+        }
+    } else if (opts.record_size != 0) {
+        // Sort (key, row) pairs, and then write out the rows or gather the records in their order.
+        bool const sorted = key_sort(
+                input_file, opts.output_filename, opts.record_size,
+                opts.permutation ? KEY_SORT_OUTPUT_PERMUTATION : KEY_SORT_OUTPUT_GATHER,
+                arena, opts.max_files, progress, &num_runs, &num_generations);
+        fclose(input_file);
+        progress_delete(progress);
+        arena_delete(arena);
+        if (!sorted) {
+            fprintf(stderr, "ERROR: unable to sort keys.\n");
+            return EXIT_FAILURE;
+        }
+    } else if (use_counting) {
+        // Count the values into a histogram and expand it into the output.
+        bool const counted = count_into_output(
+                &opts, input_file, output_is_stdout, run_base_filename, arena, progress,
+                &num_runs, &num_generations, &num_distinct);
+        if (!input_is_stdin) {
+            fclose(input_file);
+        }
+        if (output_is_stdout) {
+            remove(run_base_filename);
+        }
+        progress_delete(progress);
+        arena_delete(arena);
+        if (!counted) {
+            fprintf(stderr, "ERROR: unable to sort by counting.\n");
+            return EXIT_FAILURE;
+        }
+    } else if (select_in_memory) {
+        // Keep the smallest values in memory while reading the input, and write them straight to the output.
+        bool const selected = select_into_output(
+                &opts, input_file, output_is_stdout, arena, plan.run_size, progress);
+        if (!input_is_stdin) {
+            fclose(input_file);
+        }
+        progress_delete(progress);
+        arena_delete(arena);
+        if (!selected) {
+            fprintf(stderr, "ERROR: unable to select the smallest values.\n");
+            return EXIT_FAILURE;
+        }
+    } else {
+        // Keep the runs in a single spill file if asked to.
+        struct spill_store *spill = opts.spill_file ? spill_new(run_base_filename) : NULL;
+
+        // Create the initial runs. A lazy sort's runs are found by their numbers, so any that an earlier one left
+        // behind go first.
+        if (opts.lazy_interval) {
+            sorted_view_remove(run_base_filename);
+        }
+        struct run_options const run_options = {
+                .limit = opts.limit,
+                .consume_input = opts.consume_input,
+                .index_interval = opts.lazy_interval,
+                .spill = spill,
+                .manifest = manifest};
+        if (!opts.spill_file || spill) {
+            num_runs = create_runs(input_file, run_base_filename, arena, plan.run_size, &run_options, progress);
+        }
+        if (!input_is_stdin) {
+            fclose(input_file);
+        }
+
+        runs_done_seconds = util_now_seconds();
+
+        // Now that the number of runs is known, plan the merge for it if it had to be guessed.
+        if (num_runs && !input_size_known && !plan_merge(&plan, num_runs, opts.max_files)) {
+            num_runs = 0;
+        }
+        if (!num_runs) {
+            spill_delete(spill);
+            progress_delete(progress);
+            thread_pool_delete(pool);
+            manifest_delete(manifest);
+            arena_delete(arena);
+            if (output_is_stdout) {
+                remove(run_base_filename);
+            }
+            fprintf(stderr, "ERROR: unable to create runs.\n");
+            return EXIT_FAILURE;
+        }
+
+        // Merge the initial runs into the final output file, or stream the final merge to stdout. A lazy sort leaves
+        // them unmerged, to be queried with their indexes.
+        bool merged = false;
+        if (opts.lazy_interval) {
+            progress_finish(progress);
+            merged = true;
+        } else if (opts.add_to_filename) {
+            merged = merge_into_sorted_file(
+                    &opts, output_is_stdout, run_base_filename, num_runs, arena, &plan, progress, &num_generations);
+            if (output_is_stdout) {
+                remove(run_base_filename);
+            }
+        } else if (output_is_stdout) {
+            merged = merge_runs_to_stream(
+                    run_base_filename, num_runs,
+                    arena, plan.fan_in, plan.block_size, opts.limit,
+                    spill, stdout, progress, &num_generations);
+            remove(run_base_filename);
+        } else if (spill || opts.index_interval) {
+            merged = merge_runs_into_file(&opts, spill, num_runs, arena, &plan, progress, &num_generations);
+        } else if (opts.num_output_shards) {
+            merged = shard_output(
+                    run_base_filename, num_runs, opts.output_filename, opts.num_output_shards,
+                    arena, plan.fan_in, plan.block_size, pool, progress, &num_generations);
+        } else {
+            merged = merge_runs(
+                    run_base_filename, num_runs,
+                    arena, plan.fan_in, plan.block_size, opts.limit, opts.consume_input,
+                    manifest, progress, &num_generations);
+        }
+        spill_delete(spill);
+        progress_delete(progress);
+        thread_pool_delete(pool);
+        manifest_delete(manifest);
+        arena_delete(arena);
+        if (!merged) {
+            fprintf(stderr, "ERROR: unable to merge runs.\n");
+            if (opts.consume_input) {
+                fprintf(stderr, "ERROR: the input was consumed, so its values are kept in the runs named "
+                                "%s.[generation].[run]\n", run_base_filename);
+            }
+            return EXIT_FAILURE;
+        }
+        // The sort is complete, so there's nothing left to resume.
+        if (manifest) {
+            remove(manifest_filename);
+        }
+    }
+    if (!opts.quiet) {
+        fprintf(info, "--[ Stats ]------------------------------------\n");
+        fprintf(info, "       initial runs: %lu\n", num_runs);
+        fprintf(info, "  merge generations: %lu\n", num_generations);
+        if (opts.partition) {
+            fprintf(info, "            buckets: %lu\n", num_buckets);
+        }
+        if (use_counting) {
+            fprintf(info, "    distinct values: %lu\n", num_distinct);
+        }
+        if (opts.autotune) {
+            double const sort_end_seconds = util_now_seconds();
+            fprintf(info, "     predicted time: %.2f s (runs %.2f s, merge %.2f s)\n",
+                    plan.estimated_run_seconds + plan.estimated_merge_seconds,
+                    plan.estimated_run_seconds, plan.estimated_merge_seconds);
+            if (runs_done_seconds > 0.0) {
+                fprintf(info, "        actual time: %.2f s (runs %.2f s, merge %.2f s)\n",
+                        sort_end_seconds - sort_start_seconds, runs_done_seconds - sort_start_seconds,
+                        sort_end_seconds - runs_done_seconds);
+            } else {
+                fprintf(info, "        actual time: %.2f s\n", sort_end_seconds - sort_start_seconds);
+            }
+        }
+        fprintf(info, "-----------------------------------------------\n");
+        fprintf(info, "Completed successfully!\n");
     }
     return EXIT_SUCCESS;
 }
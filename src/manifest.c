@@ -0,0 +1,282 @@
+#include "manifest.h"
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Bump this whenever the record format changes so that an old manifest is never misread.
+static int const MANIFEST_VERSION = 1;
+
+struct manifest {
+    FILE *file;
+    bool resumed;
+
+    // State rebuilt from, and kept in step with, the records in the file.
+    size_t num_runs;
+    bool runs_complete;
+    size_t fan_in;
+    size_t num_groups;
+};
+
+static bool create_manifest(struct manifest *manifest, char const *filename, struct manifest_input const *input);
+
+static bool load_manifest(struct manifest *manifest, struct manifest_input const *input);
+
+static bool append_record(struct manifest *manifest, char const *format, ...);
+
+
+/*
+ * Opens the checkpoint manifest for a sort.
+ *
+ * The manifest is a text file with one record per line. Each record is flushed and fsync'd before the function that
+ * appends it returns, so everything the manifest records survives the process being killed. If resume is set and the
+ * file exists, the state is rebuilt from its records, which must have been made for the same input. A torn last
+ * record (i.e. one without a newline) is dropped. Otherwise, a new manifest is created, replacing any existing one.
+ */
+struct manifest *manifest_new(char const *filename, struct manifest_input const *input, bool resume)
+{
+    assert(filename);
+    assert(input);
+
+    struct manifest *manifest = (struct manifest *) malloc(sizeof(struct manifest));
+    if (!manifest) {
+        return NULL;
+    }
+    manifest->file = NULL;
+    manifest->resumed = false;
+    manifest->num_runs = 0;
+    manifest->runs_complete = false;
+    manifest->fan_in = 0;
+    manifest->num_groups = 0;
+
+    if (resume) {
+        manifest->file = fopen(filename, "r+");
+        if (!manifest->file && (errno != ENOENT)) {
+            fprintf(stderr, "ERROR: unable to open checkpoint manifest: %s\n", strerror(errno));
+            free(manifest);
+            return NULL;
+        }
+    }
+
+    bool success = false;
+    if (manifest->file) {
+        manifest->resumed = true;
+        success = load_manifest(manifest, input);
+    } else {
+        success = create_manifest(manifest, filename, input);
+    }
+    if (!success) {
+        manifest_delete(manifest);
+        return NULL;
+    }
+    return manifest;
+}
+
+bool manifest_was_resumed(struct manifest const *manifest)
+{
+    assert(manifest);
+    return manifest->resumed;
+}
+
+size_t manifest_get_num_runs(struct manifest const *manifest)
+{
+    assert(manifest);
+    return manifest->num_runs;
+}
+
+bool manifest_runs_complete(struct manifest const *manifest)
+{
+    assert(manifest);
+    return manifest->runs_complete;
+}
+
+/*
+ * Returns the number of runs that each merge takes, or zero if the merge hasn't started yet.
+ */
+size_t manifest_get_fan_in(struct manifest const *manifest)
+{
+    assert(manifest);
+    return manifest->fan_in;
+}
+
+/*
+ * Returns the number of merge groups that have been completed, over all generations. A group either merges several
+ * runs into one or renames a lone run into the next generation. Given the number of runs and the fan-in, the sequence
+ * of groups is fixed, so this count is all it takes to know where to pick the merge back up.
+ */
+size_t manifest_get_num_groups(struct manifest const *manifest)
+{
+    assert(manifest);
+    return manifest->num_groups;
+}
+
+/*
+ * Records that the next initial run has been written and synced.
+ */
+bool manifest_add_run(struct manifest *manifest)
+{
+    assert(manifest);
+    assert(!manifest->runs_complete);
+
+    if (!append_record(manifest, "run %lu\n", manifest->num_runs)) {
+        return false;
+    }
+    manifest->num_runs++;
+    return true;
+}
+
+bool manifest_finish_runs(struct manifest *manifest)
+{
+    assert(manifest);
+
+    if (!append_record(manifest, "runs %lu\n", manifest->num_runs)) {
+        return false;
+    }
+    manifest->runs_complete = true;
+    return true;
+}
+
+bool manifest_set_fan_in(struct manifest *manifest, size_t fan_in)
+{
+    assert(manifest);
+    assert(manifest->fan_in == 0);
+
+    if (!append_record(manifest, "fan-in %lu\n", fan_in)) {
+        return false;
+    }
+    manifest->fan_in = fan_in;
+    return true;
+}
+
+/*
+ * Records that the merge group producing run run_number of generation has been written and synced. Its input runs are
+ * no longer needed once this returns.
+ */
+bool manifest_add_group(struct manifest *manifest, size_t generation, size_t run_number)
+{
+    assert(manifest);
+
+    if (!append_record(manifest, "group %lu %lu\n", generation, run_number)) {
+        return false;
+    }
+    manifest->num_groups++;
+    return true;
+}
+
+void manifest_delete(struct manifest *manifest)
+{
+    if (manifest) {
+        if (manifest->file) {
+            fclose(manifest->file);
+        }
+        free(manifest);
+    }
+}
+
+static bool create_manifest(struct manifest *manifest, char const *filename, struct manifest_input const *input)
+{
+    manifest->file = fopen(filename, "w");
+    if (!manifest->file) {
+        fprintf(stderr, "ERROR: unable to create checkpoint manifest: %s\n", strerror(errno));
+        return false;
+    }
+    return append_record(
+            manifest, "bigsort-manifest %d\ninput %" PRIu64 " %" PRId64 " %ld\nrun-size %lu\nlimit %" PRIu64 "\n",
+            MANIFEST_VERSION, input->size, input->mtime_seconds, input->mtime_nanoseconds, input->run_size,
+            input->limit);
+}
+
+static bool load_manifest(struct manifest *manifest, struct manifest_input const *input)
+{
+    char line[256] = {0};
+    long valid_length = 0;
+    size_t line_number = 0;
+    bool input_matches = false;
+    bool run_size_matches = false;
+    bool limit_matches = false;
+
+    while (fgets(line, sizeof(line), manifest->file)) {
+        size_t const length = strlen(line);
+        if ((length == 0) || (line[length - 1] != '\n')) {
+            // The process died part way through appending this record. Everything before it is intact.
+            break;
+        }
+        line_number++;
+
+        int version = 0;
+        uint64_t size = 0;
+        int64_t mtime_seconds = 0;
+        long mtime_nanoseconds = 0;
+        unsigned long first = 0;
+        unsigned long second = 0;
+        bool valid = false;
+        if (line_number == 1) {
+            valid = (sscanf(line, "bigsort-manifest %d", &version) == 1) && (version == MANIFEST_VERSION);
+        } else if (sscanf(line, "input %" SCNu64 " %" SCNd64 " %ld", &size, &mtime_seconds, &mtime_nanoseconds) == 3) {
+            input_matches = (size == input->size) && (mtime_seconds == input->mtime_seconds) &&
+                            (mtime_nanoseconds == input->mtime_nanoseconds);
+            valid = true;
+        } else if (sscanf(line, "run-size %lu", &first) == 1) {
+            run_size_matches = (first == input->run_size);
+            valid = true;
+        } else if (sscanf(line, "limit %" SCNu64, &size) == 1) {
+            limit_matches = (size == input->limit);
+            valid = true;
+        } else if (sscanf(line, "runs %lu", &first) == 1) {
+            valid = (first == manifest->num_runs);
+            manifest->runs_complete = true;
+        } else if (sscanf(line, "run %lu", &first) == 1) {
+            // Runs are recorded in order, so each one must be the next.
+            valid = !manifest->runs_complete && (first == manifest->num_runs);
+            manifest->num_runs++;
+        } else if (sscanf(line, "fan-in %lu", &first) == 1) {
+            valid = manifest->runs_complete && (manifest->fan_in == 0) && (first >= 2);
+            manifest->fan_in = first;
+        } else if (sscanf(line, "group %lu %lu", &first, &second) == 2) {
+            valid = (manifest->fan_in != 0);
+            manifest->num_groups++;
+        }
+        if (!valid) {
+            fprintf(stderr, "ERROR: checkpoint manifest is corrupt at line %lu\n", line_number);
+            return false;
+        }
+        valid_length = ftell(manifest->file);
+    }
+    if (ferror(manifest->file)) {
+        fprintf(stderr, "ERROR: unable to read checkpoint manifest: %s\n", strerror(errno));
+        return false;
+    }
+    if (!input_matches || !run_size_matches || !limit_matches) {
+        fprintf(stderr, "ERROR: checkpoint manifest was made for a different input file, run size or limit\n");
+        return false;
+    }
+
+    // Drop any torn record and append from the end of the last good one.
+    if ((ftruncate(fileno(manifest->file), valid_length) != 0) ||
+            (fseek(manifest->file, valid_length, SEEK_SET) != 0)) {
+        fprintf(stderr, "ERROR: unable to repair checkpoint manifest: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Appends a record and makes it durable before returning.
+ */
+static bool append_record(struct manifest *manifest, char const *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int const written = vfprintf(manifest->file, format, args);
+    va_end(args);
+
+    if ((written < 0) || (fflush(manifest->file) != 0) || (fsync(fileno(manifest->file)) != 0)) {
+        fprintf(stderr, "ERROR: unable to write checkpoint manifest: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
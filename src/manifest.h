@@ -0,0 +1,42 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Identifies the input and the run layout that a manifest's runs were created from. A manifest can only be resumed
+// with the same input, run size and limit.
+struct manifest_input {
+    uint64_t size;
+    int64_t mtime_seconds;
+    long mtime_nanoseconds;
+    size_t run_size;
+    uint64_t limit;
+};
+
+struct manifest;
+
+struct manifest *manifest_new(char const *filename, struct manifest_input const *input, bool resume);
+
+bool manifest_was_resumed(struct manifest const *manifest);
+
+size_t manifest_get_num_runs(struct manifest const *manifest);
+
+bool manifest_runs_complete(struct manifest const *manifest);
+
+size_t manifest_get_fan_in(struct manifest const *manifest);
+
+size_t manifest_get_num_groups(struct manifest const *manifest);
+
+bool manifest_add_run(struct manifest *manifest);
+
+bool manifest_finish_runs(struct manifest *manifest);
+
+bool manifest_set_fan_in(struct manifest *manifest, size_t fan_in);
+
+bool manifest_add_group(struct manifest *manifest, size_t generation, size_t run_number);
+
+void manifest_delete(struct manifest *manifest);
+
+#endif // MANIFEST_H
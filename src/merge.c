@@ -1,51 +1,238 @@
+// fallocate() is a GNU extension.
+#define _GNU_SOURCE
+
 #include "merge.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "io_util.h"
+#include "merge_kernel.h"
 #include "min_heap.h"
 
+// The bookkeeping and heap are each aligned to a cache line, and the blocks to a page so that reads and writes go
+// to and from page-aligned memory. This is the most that aligning those four regions can waste.
+#define MERGE_ALIGNMENT_SLACK ((2 * ARENA_CACHE_LINE_ALIGNMENT) + (2 * ARENA_PAGE_ALIGNMENT))
+
+// Consumed input is released in pieces of at least this size, so that it takes few calls and leaves few fragments.
+static off_t const MIN_RELEASE_SIZE = (off_t) 1 << 20;
+
+// Each input file gets a block of memory that values are read into. Values are consumed from the block until it is
+// empty, and then the block is refilled with a single read. An input is either a stream, or an extent of a file that
+// other inputs share, in which case there's no stream and the input ends at end_offset.
+struct merge_input {
+    FILE *file;
+    off_t end_offset;
+    uint32_t *block;
+    size_t position;
+    size_t count;
+
+    // The last value of the previous block, for checking that blocks follow on from each other.
+    uint32_t last_value;
+
+    // Where the next block starts in the file, and where the kernel was last told to read ahead from. The descriptor
+    // is negative if the file doesn't have one (e.g. a stream), in which case there's no read-ahead.
+    int fd;
+    off_t next_offset;
+    off_t advised_offset;
+
+    // How far the input's values are in the output file, as of the last block that was written to it.
+    off_t merged_offset;
+
+    // Whether the data that has been merged is released from the file, and how far it has been released up to.
+    bool releasing;
+    off_t released_offset;
+};
+
 struct merge_context {
     struct min_heap *heap;
-};
+    struct merge_input *inputs;
+    size_t max_inputs;
+    size_t num_inputs;
+    uint32_t *input_blocks;
+    uint32_t *output_block;
+    size_t block_values;
+
+    // The size of the records that the runs hold, in bytes and in values, and how many of them fill a block. A record
+    // is ordered by its first value, its key. Unless merge_set_record_size() says otherwise, a record is one value.
+    size_t record_size;
+    size_t record_values;
+    size_t block_records;
+
+    // Most values that a merge writes to its output file, or zero for no limit.
+    uint64_t output_limit;
+
+    // How many bytes the last merge wrote to its output file.
+    uint64_t output_size;
+
+    // Whether each block that's read is checked to be in order. Runs that bigsort made itself always are, but files
+    // that were handed in as runs might not be.
+    bool validate_inputs;
 
-enum read_uint32_result {
-    READ_SUCCESS = 0,
-    READ_ERROR,
-    READ_EOF
+    // Two inputs are merged block against block with the merge kernel instead of value by value through the heap.
+    // Fan-in 2 merges thus make a tree of vectorized two-way merges.
+    bool two_way;
 };
 
-static bool do_merge(struct merge_context *merge, FILE *const *input_files, size_t num_input_files, FILE *output_file);
+static size_t per_input_memory(size_t block_values);
+
+static bool do_merge(struct merge_context *merge, FILE *output_file, struct progress *progress);
+
+static bool add_input_files(struct merge_context *merge, FILE *const *input_files, size_t num_input_files);
+
+static bool add_input_file(struct merge_context *merge, FILE *file, size_t input_index);
+
+static bool add_input_extents(
+        struct merge_context *merge, int fd, int const *fds, struct merge_extent const *extents, size_t num_extents,
+        bool release);
+
+static bool start_input(struct merge_context *merge, size_t input_index);
+
+static bool refill_input(struct merge_context *merge, struct merge_input *input);
+
+static bool read_extent(struct merge_context *merge, struct merge_input *input);
+
+static bool input_is_in_order(struct merge_context const *merge, struct merge_input *input);
+
+static void forecast(struct merge_context *merge);
+
+static void release_merged(struct merge_context *merge);
+
+static bool read_two_way(struct merge_context *merge, uint32_t *values, size_t max_values, size_t *num_values);
+
+static bool read_records(struct merge_context *merge, uint32_t *records, size_t max_records, size_t *num_records);
+
+static size_t count_up_to(uint32_t const *values, size_t count, uint32_t bound);
 
-static bool add_input_file(struct merge_context *merge, FILE *file);
+static size_t gallop_up_to(uint32_t const *values, size_t count, uint32_t bound);
 
-static bool write_uint32(FILE *output_file, uint32_t val);
 
-static enum read_uint32_result read_uint32(FILE *input_file, uint32_t *val);
 
+size_t merge_memory_required(size_t num_inputs, size_t block_size)
+{
+    size_t const block_values = block_size / sizeof(uint32_t);
+    // Every input needs its bookkeeping, a heap slot and a read block. The output needs one block of its own.
+    return (num_inputs * per_input_memory(block_values)) + (block_values * sizeof(uint32_t)) + MERGE_ALIGNMENT_SLACK;
+}
 
-struct merge_context *merge_new(void *merge_data, size_t merge_data_size)
+struct merge_context *merge_new(struct arena *arena, size_t block_size, size_t max_inputs)
 {
+    assert(arena);
+
+    size_t const block_values = block_size / sizeof(uint32_t);
+    if (block_values == 0) {
+        return NULL;
+    }
+
+    // Determine how many inputs fit in what's left of the arena alongside the output block. If that's more than the
+    // caller wants, only take what's needed.
+    size_t const per_input_size = per_input_memory(block_values);
+    size_t const fixed_size = merge_memory_required(0, block_size);
+    size_t const available = arena_available(arena, ARENA_CACHE_LINE_ALIGNMENT);
+    if (available < fixed_size + per_input_size) {
+        return NULL;
+    }
+    size_t const fit_inputs = (available - fixed_size) / per_input_size;
+    if ((max_inputs == 0) || (max_inputs > fit_inputs)) {
+        max_inputs = fit_inputs;
+    }
+
     struct merge_context *merge = (struct merge_context *) malloc(sizeof(struct merge_context));
     if (!merge) {
         return NULL;
     }
-    merge->heap = min_heap_new(merge_data, merge_data_size);
+
+    // Carve the merge's sub-buffers out of the arena. These can't fail since the slack for alignment was accounted for
+    // above.
+    merge->inputs = (struct merge_input *) arena_alloc(
+            arena, max_inputs * sizeof(struct merge_input), ARENA_CACHE_LINE_ALIGNMENT);
+    size_t const heap_size = max_inputs * sizeof(struct min_heap_element);
+    void *heap_data = arena_alloc(arena, heap_size, ARENA_CACHE_LINE_ALIGNMENT);
+    merge->output_block = (uint32_t *) arena_alloc(
+            arena, block_values * sizeof(uint32_t), ARENA_PAGE_ALIGNMENT);
+    merge->input_blocks = (uint32_t *) arena_alloc(
+            arena, max_inputs * block_values * sizeof(uint32_t), ARENA_PAGE_ALIGNMENT);
+    assert(merge->inputs && heap_data && merge->output_block && merge->input_blocks);
+
+    merge->heap = min_heap_new(heap_data, heap_size);
     if (!merge->heap) {
         free(merge);
         return NULL;
     }
+
+    merge->max_inputs = max_inputs;
+    merge->num_inputs = 0;
+    merge->block_values = block_values;
+    merge->record_size = sizeof(uint32_t);
+    merge->record_values = 1;
+    merge->block_records = block_values;
+    merge->output_limit = 0;
+    merge->output_size = 0;
+    merge->validate_inputs = false;
+    merge->two_way = false;
     return merge;
 }
 
 size_t merge_get_max_input_files(struct merge_context const *merge)
 {
     assert(merge);
-    return min_heap_capacity(merge->heap);
+    return merge->max_inputs;
+}
+
+/*
+ * Makes the merge's inputs and output runs of records of record_size bytes, a multiple of four, instead of single
+ * values. Each record is ordered by the value in its first four bytes, and records with equal keys keep the order of
+ * the inputs that they came from, so a merge of runs that were numbered in input order is stable. Blocks are filled
+ * with whole records, and counts (merge_read(), the output limit) are in records.
+ *
+ * Returns: false if the record size isn't a multiple of four, or a block can't hold a record.
+ */
+bool merge_set_record_size(struct merge_context *merge, size_t record_size)
+{
+    assert(merge);
+    size_t const record_values = record_size / sizeof(uint32_t);
+    if ((record_values == 0) || ((record_size % sizeof(uint32_t)) != 0) || (merge->block_values < record_values)) {
+        return false;
+    }
+    merge->record_size = record_size;
+    merge->record_values = record_values;
+    merge->block_records = merge->block_values / record_values;
+    return true;
+}
+
+/*
+ * Limits merge_perform_merge() to writing the first output_limit values of each merge. The rest of the inputs is never
+ * read. Zero means no limit.
+ */
+void merge_set_output_limit(struct merge_context *merge, uint64_t output_limit)
+{
+    assert(merge);
+    merge->output_limit = output_limit;
+}
+
+/*
+ * Makes merges check that their inputs are sorted as they're read. A merge fails at the first value that's smaller than
+ * the one before it in the same input.
+ */
+void merge_set_validate_inputs(struct merge_context *merge, bool validate_inputs)
+{
+    assert(merge);
+    merge->validate_inputs = validate_inputs;
 }
 
+/*
+ * Merges the input files into the output file. Inputs that are open for writing are taken to be temporary runs, and
+ * the parts of them that have been merged are released from their files as the merge goes.
+ */
 bool merge_perform_merge(
         struct merge_context *merge,
         FILE *const *input_files, size_t num_input_files,
-        FILE *output_file)
+        FILE *output_file,
+        struct progress *progress)
 {
     assert(merge);
     assert(input_files);
@@ -57,7 +244,7 @@ bool merge_perform_merge(
     }
 
     // Perform the merge
-    bool success = do_merge(merge, input_files, num_input_files, output_file);
+    bool success = add_input_files(merge, input_files, num_input_files) && do_merge(merge, output_file, progress);
 
     // In the case of a failure, data may be left on the minheap.
     // Clear the heap so that it can be reused in subsequent merges.
@@ -66,6 +253,168 @@ bool merge_perform_merge(
     return success;
 }
 
+/*
+ * Merges runs that are extents of the file fd into the output file, the same way that merge_perform_merge() merges
+ * input files. The extents are read by offset, so the merge doesn't need a descriptor per input. If release is set,
+ * the parts of the extents that have been merged are released from the file as the merge goes.
+ */
+bool merge_perform_extent_merge(
+        struct merge_context *merge,
+        int fd, struct merge_extent const *extents, size_t num_extents, bool release,
+        FILE *output_file,
+        struct progress *progress)
+{
+    assert(merge);
+    assert(extents);
+    assert(output_file);
+
+    if (num_extents > merge_get_max_input_files(merge)) {
+        return false;
+    }
+
+    bool success = add_input_extents(merge, fd, NULL, extents, num_extents, release) &&
+                   do_merge(merge, output_file, progress);
+
+    // As for merge_perform_merge(), don't leave anything on the heap for the next merge.
+    min_heap_clear(merge->heap);
+    return success;
+}
+
+/*
+ * Merges ranges of files into the output file, the same way that merge_perform_extent_merge() merges extents, except
+ * that each extent is in a file of its own, fds[i]. The files are only read by offset, so several merges can read
+ * different ranges of the same files at the same time.
+ */
+bool merge_perform_range_merge(
+        struct merge_context *merge,
+        int const *fds, struct merge_extent const *extents, size_t num_extents,
+        FILE *output_file,
+        struct progress *progress)
+{
+    assert(merge);
+    assert(fds);
+    assert(extents);
+    assert(output_file);
+
+    if (num_extents > merge_get_max_input_files(merge)) {
+        return false;
+    }
+
+    bool success = add_input_extents(merge, -1, fds, extents, num_extents, false) &&
+                   do_merge(merge, output_file, progress);
+    min_heap_clear(merge->heap);
+    return success;
+}
+
+bool merge_begin(struct merge_context *merge, FILE *const *input_files, size_t num_input_files)
+{
+    assert(merge);
+    assert(input_files);
+
+    // Start from a clean slate in case a previous merge was abandoned part way through.
+    min_heap_clear(merge->heap);
+
+    if (num_input_files > merge_get_max_input_files(merge)) {
+        return false;
+    }
+    return add_input_files(merge, input_files, num_input_files);
+}
+
+/*
+ * Pulls up to max_values of the next merged values into values. The number of values that were pulled is stored in
+ * num_values. This is zero once all inputs are exhausted. For runs of records, the counts are in records, and values
+ * must have room for max_values of them.
+ */
+bool merge_read(struct merge_context *merge, uint32_t *values, size_t max_values, size_t *num_values)
+{
+    assert(merge);
+    assert(values);
+    assert(num_values);
+
+    if (merge->two_way) {
+        return read_two_way(merge, values, max_values, num_values);
+    }
+    if (merge->record_values > 1) {
+        return read_records(merge, values, max_values, num_values);
+    }
+
+    size_t count = 0;
+    uint32_t value = 0;
+    uint32_t input_index = 0;
+
+    while ((count < max_values) && min_heap_pop(merge->heap, &value, &input_index)) {
+
+        // Hand out the smallest value.
+        values[count++] = value;
+
+        // The runner-up is now on top of the heap. Until the winning input moves past it, the winner's values can be
+        // handed out without touching the heap. With the heap empty, the winner is the last input left and everything
+        // it has is handed out.
+        uint32_t bound = UINT32_MAX;
+        uint32_t runner_up = 0;
+        min_heap_peek(merge->heap, &bound, &runner_up);
+
+        struct merge_input *input = &merge->inputs[input_index];
+        input->position++;
+        for (;;) {
+            // If the input's block is used up, refill it from the file.
+            if (input->position >= input->count) {
+                if (!refill_input(merge, input)) {
+                    *num_values = count;
+                    return false;
+                }
+                if (input->count == 0) {
+                    break;
+                }
+            }
+            if ((count >= max_values) || (input->block[input->position] > bound)) {
+                break;
+            }
+            // The input still wins, so gallop through its block to the end of the winning span and copy the span out
+            // in one go.
+            size_t const available = input->count - input->position;
+            size_t const room = max_values - count;
+            size_t const span = gallop_up_to(input->block + input->position, (available < room) ? available : room,
+                    bound);
+            memcpy(values + count, input->block + input->position, span * sizeof(uint32_t));
+            count += span;
+            input->position += span;
+        }
+        if (input->count > 0) {
+            // Place the new value along with its input back on the heap.
+            if (!min_heap_add(merge->heap, input->block[input->position], input_index)) {
+                *num_values = count;
+                return false;
+            }
+        }
+        // If we are at the end of the file, do nothing. Specifically, put nothing back on the heap.
+        // Eventually the heap will be exhausted and thus the merge will be finished.
+    }
+    *num_values = count;
+    return true;
+}
+
+/*
+ * Returns how far into its file the given input of the last merge had been merged into the output when the merge
+ * stopped. Everything before that is in the output file, and everything after it is still only in the input's file,
+ * even if the merge failed. An input that the merge never got to has had nothing merged.
+ */
+off_t merge_get_merged_offset(struct merge_context const *merge, size_t input_index)
+{
+    assert(merge);
+    return (input_index < merge->num_inputs) ? merge->inputs[input_index].merged_offset : 0;
+}
+
+/*
+ * Returns how many bytes the last merge wrote to its output file in whole blocks. If the merge failed part way
+ * through a write, anything after this in the output file is what the failed write left behind.
+ */
+uint64_t merge_get_output_size(struct merge_context const *merge)
+{
+    assert(merge);
+    return merge->output_size;
+}
+
 void merge_delete(struct merge_context *merge)
 {
     if (merge) {
@@ -74,86 +423,388 @@ void merge_delete(struct merge_context *merge)
     }
 }
 
-static bool do_merge(struct merge_context *merge, FILE *const *input_files, size_t num_input_files, FILE *output_file)
+static bool do_merge(struct merge_context *merge, FILE *output_file, struct progress *progress)
 {
-    // Add all of the files to the minheap.
+    // Pull merged values into the output block and write each block out as it fills. Stop early once the output
+    // limit is reached.
+    uint64_t remaining = (merge->output_limit != 0) ? merge->output_limit : UINT64_MAX;
+    while (remaining > 0) {
+        size_t max_values = merge->block_records;
+        if (max_values > remaining) {
+            max_values = (size_t) remaining;
+        }
+        size_t num_values = 0;
+        if (!merge_read(merge, merge->output_block, max_values, &num_values)) {
+            return false;
+        }
+        if (num_values == 0) {
+            return true;
+        }
+        remaining -= num_values;
+        fwrite(merge->output_block, merge->record_size, num_values, output_file);
+        if (ferror(output_file)) {
+            return false;
+        }
+        merge->output_size += num_values * merge->record_size;
+        release_merged(merge);
+        progress_update(progress, num_values * merge->record_size);
+    }
+    return true;
+}
+
+static bool add_input_files(struct merge_context *merge, FILE *const *input_files, size_t num_input_files)
+{
+    merge->two_way = (num_input_files == 2) && (merge->record_values == 1);
+    merge->num_inputs = 0;
+    merge->output_size = 0;
     for (size_t i = 0; i < num_input_files; i++) {
         assert(input_files[i]);
-        if (!add_input_file(merge, input_files[i])) {
+        if (!add_input_file(merge, input_files[i], i)) {
             return false;
         }
+        merge->num_inputs++;
     }
+    // Every input now has a block, so the first one to run dry can be told apart from the rest.
+    forecast(merge);
+    return true;
+}
 
-    uint32_t value = 0;
-    FILE *input_file = NULL;
+static size_t per_input_memory(size_t block_values)
+{
+    return sizeof(struct merge_input) + sizeof(struct min_heap_element) + (block_values * sizeof(uint32_t));
+}
 
-    while (min_heap_pop(merge->heap, &value, &input_file)) {
+static bool add_input_file(struct merge_context *merge, FILE *file, size_t input_index)
+{
+    struct merge_input *input = &merge->inputs[input_index];
+    input->file = file;
+    input->end_offset = -1;
+    input->fd = fileno(file);
+    input->next_offset = (input->fd >= 0) ? ftello(file) : -1;
+    input->advised_offset = -1;
+    if (input->next_offset >= 0) {
+        // Runs are read from front to back, so a larger read-ahead window than usual pays off.
+        posix_fadvise(input->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    // An input that's open for writing is a temporary run that nothing will read again, so it gives up its disk space
+    // as it's merged.
+    int const flags = (input->next_offset >= 0) ? fcntl(input->fd, F_GETFL) : -1;
+    input->releasing = (flags >= 0) && ((flags & O_ACCMODE) == O_RDWR);
+    input->merged_offset = input->next_offset;
+    input->released_offset = input->next_offset;
+    return start_input(merge, input_index);
+}
 
-        // Write the smallest value to the output file.
-        if (!write_uint32(output_file, value)) {
-            return false;
-        }
+/*
+ * Sets up extents as the merge's inputs. They're all in the file fd, or, if fds isn't NULL, each is in a file of its
+ * own.
+ */
+static bool add_input_extents(
+        struct merge_context *merge, int fd, int const *fds, struct merge_extent const *extents, size_t num_extents,
+        bool release)
+{
+    // Advising sequential access to the whole of a file covers all of the extents in it.
+    if (!fds) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
 
-        // Read the next value from this input file and, if the file isn't empty, place it back on the heap
-        enum read_uint32_result read_result = read_uint32(input_file, &value);
-        if (read_result == READ_ERROR) {
-            return false;
+    merge->two_way = (num_extents == 2) && (merge->record_values == 1);
+    merge->num_inputs = 0;
+    merge->output_size = 0;
+    for (size_t i = 0; i < num_extents; i++) {
+        struct merge_input *input = &merge->inputs[i];
+        input->file = NULL;
+        input->end_offset = extents[i].offset + extents[i].size;
+        input->fd = fds ? fds[i] : fd;
+        if (fds) {
+            posix_fadvise(input->fd, extents[i].offset, extents[i].size, POSIX_FADV_SEQUENTIAL);
         }
-        if (read_result != READ_EOF) {
-            // Place the new value along with its file back on the heap.
-            if (!min_heap_add(merge->heap, value, input_file)) {
-                return false;
-            }
+        input->next_offset = extents[i].offset;
+        input->advised_offset = -1;
+        input->releasing = release;
+        input->merged_offset = extents[i].offset;
+        input->released_offset = extents[i].offset;
+        if (!start_input(merge, i)) {
+            return false;
         }
-        // If we are at the end of the file, do nothing. Specifically, put nothing back on the heap.
-        // Eventually the heap will be exhausted and thus the merge will be finished.
+        merge->num_inputs++;
     }
+    forecast(merge);
     return true;
 }
 
-static bool add_input_file(struct merge_context *merge, FILE *file)
+/*
+ * Reads an input's first block and puts the input on the heap, once where and how it's read from has been set up.
+ */
+static bool start_input(struct merge_context *merge, size_t input_index)
 {
-    uint32_t key;
-    enum read_uint32_result result = read_uint32(file, &key);
-    if (result == READ_ERROR) {
+    struct merge_input *input = &merge->inputs[input_index];
+    input->block = merge->input_blocks + (input_index * merge->block_values);
+    input->position = 0;
+    input->count = 0;
+    input->last_value = 0;
+
+    if (!refill_input(merge, input)) {
         // Couldn't read from the file. This is an error.
         return false;
     }
-    if (result == READ_EOF) {
+    if (input->count == 0) {
         // File was empty. This isn't an error, but don't add the file since there's nothing to process. Just return
         // success.
         return true;
     }
 
-    // Add the first value and its associated file to the heap.
-    if (!min_heap_add(merge->heap, key, file)) {
+    // Add the first value and its associated input to the heap. A two-way merge reads the blocks directly instead.
+    if (!merge->two_way && !min_heap_add(merge->heap, input->block[0], (uint32_t) input_index)) {
         return false;
     }
 
     return true;
 }
 
-static bool write_uint32(FILE *output_file, uint32_t val)
+/*
+ * Reads the next block of values from an input's file. At the end of the file, the input's count is set to zero.
+ */
+static bool refill_input(struct merge_context *merge, struct merge_input *input)
 {
-    fwrite(&val, sizeof(val), 1, output_file);
-    return !ferror(output_file);
+    input->position = 0;
+    if (!input->file) {
+        if (!read_extent(merge, input)) {
+            return false;
+        }
+    } else {
+        input->count = fread(input->block, merge->record_size, merge->block_records, input->file);
+        if (ferror(input->file)) {
+            return false;
+        }
+    }
+    if (input->next_offset >= 0) {
+        input->next_offset += (off_t) (input->count * merge->record_size);
+    }
+    if (merge->validate_inputs && !input_is_in_order(merge, input)) {
+        return false;
+    }
+    forecast(merge);
+    return true;
 }
 
-static enum read_uint32_result read_uint32(FILE *input_file, uint32_t *val)
+/*
+ * Reads the next block of an extent input from where it has got to in the file, up to the end of the extent.
+ */
+static bool read_extent(struct merge_context *merge, struct merge_input *input)
 {
-    assert(val);
+    size_t size = merge->block_records * merge->record_size;
+    if ((off_t) size > input->end_offset - input->next_offset) {
+        size = (size_t) (input->end_offset - input->next_offset);
+    }
+    // A cut short extent fails with EIO.
+    if (!io_pread_fully(input->fd, input->block, size, (uint64_t) input->next_offset)) {
+        return false;
+    }
+    input->count = size / merge->record_size;
+    return true;
+}
+
+/*
+ * Notes how far each input has been merged, now that a block has been written to the output, and punches what has
+ * been merged out of the files of inputs that are releasing, so that the file system can reuse their blocks while the
+ * rest of the files are still being merged. Without this, a merge needs disk space for a full copy of its inputs until
+ * it's done and they're removed. Only data that's in the output file is released, so a merge that fails loses
+ * nothing: the output holds each input up to its merged offset, and the input's file holds the rest. File systems
+ * that can't punch holes just keep the data.
+ */
+static void release_merged(struct merge_context *merge)
+{
+    for (size_t i = 0; i < merge->num_inputs; i++) {
+        struct merge_input *input = &merge->inputs[i];
+        if (input->next_offset < 0) {
+            continue;
+        }
+        input->merged_offset = input->next_offset - (off_t) ((input->count - input->position) * merge->record_size);
+        if (!input->releasing || (input->merged_offset - input->released_offset < MIN_RELEASE_SIZE)) {
+            continue;
+        }
+        if (fallocate(input->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, input->released_offset,
+                      input->merged_offset - input->released_offset) != 0) {
+            input->releasing = false;
+            continue;
+        }
+        input->released_offset = input->merged_offset;
+    }
+}
 
-    size_t num_read = fread(val, sizeof(*val), 1, input_file);
-    if (ferror(input_file)) {
-        return READ_ERROR;
+/*
+ * Knuth's forecasting: of the inputs' current blocks, the one with the smallest last value is the next one to be used
+ * up, since every other block still holds something larger. Its next block is the next read that the merge will wait
+ * for, so the kernel is asked to start reading it now. It arrives in the page cache while the merge works through the
+ * blocks it already has, and the refill then doesn't stall on the disk.
+ */
+static void forecast(struct merge_context *merge)
+{
+    struct merge_input *next = NULL;
+    for (size_t i = 0; i < merge->num_inputs; i++) {
+        struct merge_input *input = &merge->inputs[i];
+        if ((input->count == 0) || (input->next_offset < 0)) {
+            continue;
+        }
+        uint32_t const last_key = input->block[(input->count - 1) * merge->record_values];
+        if (!next || (last_key < next->block[(next->count - 1) * merge->record_values])) {
+            next = input;
+        }
     }
-    if (num_read != 1) {
-        return READ_EOF;
+    if (next && (next->advised_offset != next->next_offset)) {
+        size_t const block_size = merge->block_records * merge->record_size;
+        posix_fadvise(next->fd, next->next_offset, (off_t) block_size, POSIX_FADV_WILLNEED);
+        next->advised_offset = next->next_offset;
     }
-    return READ_SUCCESS;
 }
 
-static void on_close_file_nop(FILE *file)
+/*
+ * Checks that a freshly read block is sorted by key and carries on from the previous one.
+ */
+static bool input_is_in_order(struct merge_context const *merge, struct merge_input *input)
 {
-    assert(file);
+    uint32_t previous = input->last_value;
+    for (size_t i = 0; i < input->count; i++) {
+        uint32_t const key = input->block[i * merge->record_values];
+        if (key < previous) {
+            fprintf(stderr, "ERROR: merge input isn't sorted: %u follows %u\n", key, previous);
+            return false;
+        }
+        previous = key;
+    }
+    input->last_value = previous;
+    return true;
+}
+
+/*
+ * The two-way counterpart of merge_read(). Every value in either block up to the smaller of the blocks' last values
+ * can be merged without looking any further, since everything after them in the files is at least that large. Those
+ * prefixes are merged by the merge kernel in one go, cut off where the output is full, and then whichever block was
+ * used up is refilled.
+ */
+static bool read_two_way(struct merge_context *merge, uint32_t *values, size_t max_values, size_t *num_values)
+{
+    struct merge_input *a = &merge->inputs[0];
+    struct merge_input *b = &merge->inputs[1];
+    size_t count = 0;
+    while (count < max_values) {
+        if ((a->count > 0) && (a->position >= a->count) && !refill_input(merge, a)) {
+            *num_values = count;
+            return false;
+        }
+        if ((b->count > 0) && (b->position >= b->count) && !refill_input(merge, b)) {
+            *num_values = count;
+            return false;
+        }
+        size_t a_available = a->count - a->position;
+        size_t b_available = b->count - b->position;
+        if ((a_available == 0) && (b_available == 0)) {
+            break;
+        }
+
+        uint32_t const *a_values = a->block + a->position;
+        uint32_t const *b_values = b->block + b->position;
+        if ((a_available > 0) && (b_available > 0)) {
+            uint32_t const a_last = a_values[a_available - 1];
+            uint32_t const b_last = b_values[b_available - 1];
+            if (a_last <= b_last) {
+                b_available = count_up_to(b_values, b_available, a_last);
+            } else {
+                a_available = count_up_to(a_values, a_available, b_last);
+            }
+        }
+        size_t const room = max_values - count;
+        if (a_available + b_available > room) {
+            size_t const from_a = merge_kernel_split(a_values, a_available, b_values, b_available, room);
+            a_available = from_a;
+            b_available = room - from_a;
+        }
+
+        merge_kernel_merge(a_values, a_available, b_values, b_available, values + count);
+        a->position += a_available;
+        b->position += b_available;
+        count += a_available + b_available;
+    }
+    *num_values = count;
+    return true;
+}
+
+/*
+ * The counterpart of merge_read() for runs of records. The winning input's records are copied out whole, for as long
+ * as they still precede the runner-up: a smaller key, or an equal key from an earlier input.
+ */
+static bool read_records(struct merge_context *merge, uint32_t *records, size_t max_records, size_t *num_records)
+{
+    size_t const record_values = merge->record_values;
+    size_t count = 0;
+    uint32_t key = 0;
+    uint32_t input_index = 0;
+    while ((count < max_records) && min_heap_pop(merge->heap, &key, &input_index)) {
+        uint32_t bound = UINT32_MAX;
+        uint32_t runner_up = UINT32_MAX;
+        min_heap_peek(merge->heap, &bound, &runner_up);
+
+        struct merge_input *input = &merge->inputs[input_index];
+        for (;;) {
+            if (input->position >= input->count) {
+                if (!refill_input(merge, input)) {
+                    *num_records = count;
+                    return false;
+                }
+                if (input->count == 0) {
+                    break;
+                }
+            }
+            uint32_t const *record = input->block + (input->position * record_values);
+            if ((count >= max_records) || (*record > bound) || ((*record == bound) && (input_index > runner_up))) {
+                break;
+            }
+            memcpy(records + (count * record_values), record, merge->record_size);
+            count++;
+            input->position++;
+        }
+        if ((input->count > 0) &&
+            !min_heap_add(merge->heap, input->block[input->position * record_values], input_index)) {
+            *num_records = count;
+            return false;
+        }
+    }
+    *num_records = count;
+    return true;
+}
+
+/*
+ * Like count_up_to(), but cheaper when the answer is near the start of the values. The search strides ahead in steps
+ * that double until it overshoots, then finishes with a binary search over the last stride, so it takes about
+ * 2*log2(n) comparisons to find a span of n values, however many values there are in total.
+ */
+static size_t gallop_up_to(uint32_t const *values, size_t count, uint32_t bound)
+{
+    size_t passed = 0;
+    size_t step = 1;
+    while ((step <= count - passed) && (values[passed + step - 1] <= bound)) {
+        passed += step;
+        step *= 2;
+    }
+    size_t const remaining = count - passed;
+    return passed + count_up_to(values + passed, (step < remaining) ? step : remaining, bound);
+}
+
+/*
+ * Returns how many of the sorted values are no larger than bound.
+ */
+static size_t count_up_to(uint32_t const *values, size_t count, uint32_t bound)
+{
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t const mid = low + ((high - low) / 2);
+        if (values[mid] <= bound) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
 }
@@ -5,17 +5,55 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
+#include "arena.h"
+#include "progress.h"
 
 struct merge_context;
 
-struct merge_context *merge_new(void *merge_data, size_t merge_data_size);
+// A run that's a range of a file that other runs share (see spill.h).
+struct merge_extent {
+    off_t offset;
+    off_t size;
+};
+
+size_t merge_memory_required(size_t num_inputs, size_t block_size);
+
+struct merge_context *merge_new(struct arena *arena, size_t block_size, size_t max_inputs);
 
 size_t merge_get_max_input_files(struct merge_context const *merge);
 
+bool merge_set_record_size(struct merge_context *merge, size_t record_size);
+
+void merge_set_output_limit(struct merge_context *merge, uint64_t output_limit);
+
+void merge_set_validate_inputs(struct merge_context *merge, bool validate_inputs);
+
 bool merge_perform_merge(
         struct merge_context *merge,
         FILE *const *input_files, size_t num_input_files,
-        FILE *output_file);
+        FILE *output_file,
+        struct progress *progress);
+
+bool merge_perform_extent_merge(
+        struct merge_context *merge,
+        int fd, struct merge_extent const *extents, size_t num_extents, bool release,
+        FILE *output_file,
+        struct progress *progress);
+
+bool merge_perform_range_merge(
+        struct merge_context *merge,
+        int const *fds, struct merge_extent const *extents, size_t num_extents,
+        FILE *output_file,
+        struct progress *progress);
+
+bool merge_begin(struct merge_context *merge, FILE *const *input_files, size_t num_input_files);
+
+bool merge_read(struct merge_context *merge, uint32_t *values, size_t max_values, size_t *num_values);
+
+off_t merge_get_merged_offset(struct merge_context const *merge, size_t input_index);
+
+uint64_t merge_get_output_size(struct merge_context const *merge);
 
 void merge_delete(struct merge_context *merge);
 
@@ -0,0 +1,239 @@
+#include "merge_kernel.h"
+#include <assert.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include "bitonic_avx2.h"
+#define MERGE_KERNEL_HAVE_AVX2 1
+#else
+#define MERGE_KERNEL_HAVE_AVX2 0
+#endif
+
+// The kernel that merges use. Negative until one is chosen, at which point the best one that the CPU supports is
+// picked.
+static int active_kernel = -1;
+
+static void merge_scalar(
+        uint32_t const *a, size_t a_count,
+        uint32_t const *b, size_t b_count,
+        uint32_t *output);
+
+static void merge_three_scalar(
+        uint32_t const *a, size_t a_count,
+        uint32_t const *b, size_t b_count,
+        uint32_t const *c, size_t c_count,
+        uint32_t *output);
+
+#if MERGE_KERNEL_HAVE_AVX2
+static void merge_avx2(
+        uint32_t const *a, size_t a_count,
+        uint32_t const *b, size_t b_count,
+        uint32_t *output);
+#endif
+
+
+/*
+ * Returns the fastest kernel that the CPU supports.
+ */
+enum merge_kernel merge_kernel_get_best(void)
+{
+#if MERGE_KERNEL_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        return MERGE_KERNEL_AVX2;
+    }
+#endif
+    return MERGE_KERNEL_SCALAR;
+}
+
+enum merge_kernel merge_kernel_get_active(void)
+{
+    if (active_kernel < 0) {
+        active_kernel = (int) merge_kernel_get_best();
+    }
+    return (enum merge_kernel) active_kernel;
+}
+
+/*
+ * Makes merges use the given kernel instead of the best one, e.g. to compare them. Returns false, and leaves the
+ * active kernel alone, if the CPU doesn't support it.
+ */
+bool merge_kernel_set_active(enum merge_kernel kernel)
+{
+    if ((kernel == MERGE_KERNEL_AVX2) && (merge_kernel_get_best() != MERGE_KERNEL_AVX2)) {
+        return false;
+    }
+    active_kernel = (int) kernel;
+    return true;
+}
+
+char const *merge_kernel_get_name(enum merge_kernel kernel)
+{
+    switch (kernel) {
+        case MERGE_KERNEL_AVX2:
+            return "avx2";
+        case MERGE_KERNEL_SCALAR:
+        default:
+            return "scalar";
+    }
+}
+
+/*
+ * Merges two sorted arrays into output, which must have room for all a_count + b_count values.
+ */
+void merge_kernel_merge(
+        uint32_t const *a, size_t a_count,
+        uint32_t const *b, size_t b_count,
+        uint32_t *output)
+{
+    assert(a || (a_count == 0));
+    assert(b || (b_count == 0));
+    assert(output || (a_count + b_count == 0));
+
+#if MERGE_KERNEL_HAVE_AVX2
+    if (merge_kernel_get_active() == MERGE_KERNEL_AVX2) {
+        merge_avx2(a, a_count, b, b_count, output);
+        return;
+    }
+#endif
+    merge_scalar(a, a_count, b, b_count, output);
+}
+
+/*
+ * Finds how many of the first output_count values of the merge of two sorted arrays come from a. The rest come from b.
+ * This lets a merge be cut off at any output size, e.g. to fill a block exactly.
+ */
+size_t merge_kernel_split(
+        uint32_t const *a, size_t a_count,
+        uint32_t const *b, size_t b_count,
+        size_t output_count)
+{
+    assert(output_count <= a_count + b_count);
+
+    // Find the smallest i for which the (output_count - i)th value of b is no larger than the (i + 1)th value of a.
+    // Taking i values from a and the rest from b then gives the output_count smallest values.
+    size_t low = (output_count > b_count) ? output_count - b_count : 0;
+    size_t high = (output_count < a_count) ? output_count : a_count;
+    while (low < high) {
+        size_t const i = low + ((high - low) / 2);
+        if (b[output_count - i - 1] <= a[i]) {
+            high = i;
+        } else {
+            low = i + 1;
+        }
+    }
+    return low;
+}
+
+static void merge_scalar(
+        uint32_t const *a, size_t a_count,
+        uint32_t const *b, size_t b_count,
+        uint32_t *output)
+{
+    size_t i = 0;
+    size_t j = 0;
+    while ((i < a_count) && (j < b_count)) {
+        // Written without a data-dependent branch so that mispredictions don't dominate on random data.
+        uint32_t const x = a[i];
+        uint32_t const y = b[j];
+        bool const take_a = (x <= y);
+        *output++ = take_a ? x : y;
+        i += take_a;
+        j += !take_a;
+    }
+    while (i < a_count) {
+        *output++ = a[i++];
+    }
+    while (j < b_count) {
+        *output++ = b[j++];
+    }
+}
+
+static void merge_three_scalar(
+        uint32_t const *a, size_t a_count,
+        uint32_t const *b, size_t b_count,
+        uint32_t const *c, size_t c_count,
+        uint32_t *output)
+{
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+    while ((i < a_count) && (j < b_count) && (k < c_count)) {
+        if ((a[i] <= b[j]) && (a[i] <= c[k])) {
+            *output++ = a[i++];
+        } else if (b[j] <= c[k]) {
+            *output++ = b[j++];
+        } else {
+            *output++ = c[k++];
+        }
+    }
+    // At least one of them has run out. Merge whatever is left of the other two.
+    if (i == a_count) {
+        merge_scalar(b + j, b_count - j, c + k, c_count - k, output);
+    } else if (j == b_count) {
+        merge_scalar(a + i, a_count - i, c + k, c_count - k, output);
+    } else {
+        merge_scalar(a + i, a_count - i, b + j, b_count - j, output);
+    }
+}
+
+#if MERGE_KERNEL_HAVE_AVX2
+
+/*
+ * Merges eight values at a time with a bitonic network. The larger half of each merge is held in a register and
+ * merged with the next eight values from whichever input has the smaller next value, which keeps the output in order.
+ * Once the input that's due runs short of a full register, the held values and whatever's left are merged as scalars.
+ */
+__attribute__((target("avx2")))
+static void merge_avx2(
+        uint32_t const *a, size_t a_count,
+        uint32_t const *b, size_t b_count,
+        uint32_t *output)
+{
+    if ((a_count < AVX2_VALUES) || (b_count < AVX2_VALUES)) {
+        merge_scalar(a, a_count, b, b_count, output);
+        return;
+    }
+
+    __m256i low;
+    __m256i held;
+    bitonic_merge_8x8(
+            _mm256_loadu_si256((__m256i const *) a), _mm256_loadu_si256((__m256i const *) b), &low, &held);
+    _mm256_storeu_si256((__m256i *) output, low);
+    output += AVX2_VALUES;
+    size_t i = AVX2_VALUES;
+    size_t j = AVX2_VALUES;
+
+    for (;;) {
+        bool take_a = false;
+        if ((i < a_count) && (j < b_count)) {
+            take_a = (a[i] <= b[j]);
+        } else if (i < a_count) {
+            take_a = true;
+        } else if (j >= b_count) {
+            break;
+        }
+
+        __m256i next;
+        if (take_a) {
+            if (i + AVX2_VALUES > a_count) {
+                break;
+            }
+            next = _mm256_loadu_si256((__m256i const *) (a + i));
+            i += AVX2_VALUES;
+        } else {
+            if (j + AVX2_VALUES > b_count) {
+                break;
+            }
+            next = _mm256_loadu_si256((__m256i const *) (b + j));
+            j += AVX2_VALUES;
+        }
+        bitonic_merge_8x8(held, next, &low, &held);
+        _mm256_storeu_si256((__m256i *) output, low);
+        output += AVX2_VALUES;
+    }
+
+    uint32_t held_values[AVX2_VALUES];
+    _mm256_storeu_si256((__m256i *) held_values, held);
+    merge_three_scalar(held_values, AVX2_VALUES, a + i, a_count - i, b + j, b_count - j, output);
+}
+
+#endif
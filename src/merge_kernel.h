@@ -0,0 +1,31 @@
+#ifndef MERGE_KERNEL_H
+#define MERGE_KERNEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum merge_kernel {
+    MERGE_KERNEL_SCALAR = 0,
+    MERGE_KERNEL_AVX2
+};
+
+enum merge_kernel merge_kernel_get_best(void);
+
+enum merge_kernel merge_kernel_get_active(void);
+
+bool merge_kernel_set_active(enum merge_kernel kernel);
+
+char const *merge_kernel_get_name(enum merge_kernel kernel);
+
+void merge_kernel_merge(
+        uint32_t const *a, size_t a_count,
+        uint32_t const *b, size_t b_count,
+        uint32_t *output);
+
+size_t merge_kernel_split(
+        uint32_t const *a, size_t a_count,
+        uint32_t const *b, size_t b_count,
+        size_t output_count);
+
+#endif // MERGE_KERNEL_H
@@ -21,6 +21,8 @@ struct min_heap {
 
 static void heapify(struct min_heap *heap);
 
+static bool precedes(struct min_heap_element const *a, struct min_heap_element const *b);
+
 static void swap_elements(struct min_heap *heap, size_t first_element, size_t second_element);
 
 struct min_heap *min_heap_new(void *data, size_t data_size)
@@ -60,7 +62,7 @@ bool min_heap_is_full(struct min_heap const *heap)
     return heap->element_count >= heap->element_capacity;
 }
 
-bool min_heap_add(struct min_heap *heap, uint32_t key, FILE *value)
+bool min_heap_add(struct min_heap *heap, uint32_t key, uint32_t value)
 {
     assert(heap);
     if (heap->element_count >= heap->element_capacity) {
@@ -79,7 +81,7 @@ bool min_heap_add(struct min_heap *heap, uint32_t key, FILE *value)
     // As long as the current element is smaller than its parent
     // Bubble it upwards until we hit the top of the tree
     while ((current_element != 0) &&
-           (heap->data[current_element].key < heap->data[PARENT_ELEMENT(current_element)].key)) {
+           precedes(&heap->data[current_element], &heap->data[PARENT_ELEMENT(current_element)])) {
         // If the current element is smaller than its parent, swap it and keep moving upwards.
         size_t parent_element = PARENT_ELEMENT(current_element);
         swap_elements(heap, current_element, parent_element);
@@ -88,7 +90,7 @@ bool min_heap_add(struct min_heap *heap, uint32_t key, FILE *value)
     return true;
 }
 
-bool min_heap_pop(struct min_heap *heap, uint32_t *key, FILE **value)
+bool min_heap_pop(struct min_heap *heap, uint32_t *key, uint32_t *value)
 {
     assert(heap);
     assert(key);
@@ -110,6 +112,22 @@ bool min_heap_pop(struct min_heap *heap, uint32_t *key, FILE **value)
     return true;
 }
 
+bool min_heap_peek(struct min_heap const *heap, uint32_t *key, uint32_t *value)
+{
+    assert(heap);
+    assert(key);
+    assert(value);
+
+    if (heap->element_count <= 0) {
+        return false;
+    }
+
+    // Retrieve the top element without removing it.
+    *key = heap->data[0].key;
+    *value = heap->data[0].value;
+    return true;
+}
+
 void min_heap_clear(struct min_heap *heap)
 {
     // Set the number of elements to zero. This effectively clears the heap.
@@ -142,12 +160,12 @@ static void heapify(struct min_heap *heap)
 
         // If there's a left child element, and if it's smaller than the current element, capture the left child element
         // as the minimum.
-        if ((left_element < heap->element_count) && (heap->data[left_element].key < heap->data[current_element].key)) {
+        if ((left_element < heap->element_count) && precedes(&heap->data[left_element], &heap->data[current_element])) {
             min_element = left_element;
         }
         // If there's a right child element, and if it's smaller than both the current element and the left child
         // element, capture the right child element as the minimum.
-        if ((right_element < heap->element_count) && (heap->data[right_element].key < heap->data[min_element].key)) {
+        if ((right_element < heap->element_count) && precedes(&heap->data[right_element], &heap->data[min_element])) {
             min_element = right_element;
         }
 
@@ -165,6 +183,15 @@ static void heapify(struct min_heap *heap)
     }
 }
 
+/*
+ * Elements are ordered by key. Equal keys are ordered by value, so that a merge whose values are its inputs' indexes
+ * hands out equal keys in input order.
+ */
+static bool precedes(struct min_heap_element const *a, struct min_heap_element const *b)
+{
+    return (a->key < b->key) || ((a->key == b->key) && (a->value < b->value));
+}
+
 static void swap_elements(struct min_heap *heap, size_t first_element, size_t second_element)
 {
     struct min_heap_element const temp_element = heap->data[first_element];
@@ -4,13 +4,12 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
-#include <stdio.h>
 
 struct min_heap;
 
 struct min_heap_element {
     uint32_t key;
-    FILE *value;
+    uint32_t value;
 };
 
 struct min_heap *min_heap_new(void *data, size_t data_size);
@@ -21,9 +20,11 @@ size_t min_heap_count(struct min_heap const *heap);
 
 bool min_heap_is_full(struct min_heap const *heap);
 
-bool min_heap_add(struct min_heap *heap, uint32_t key, FILE *value);
+bool min_heap_add(struct min_heap *heap, uint32_t key, uint32_t value);
 
-bool min_heap_pop(struct min_heap *heap, uint32_t *key, FILE **value);
+bool min_heap_pop(struct min_heap *heap, uint32_t *key, uint32_t *value);
+
+bool min_heap_peek(struct min_heap const *heap, uint32_t *key, uint32_t *value);
 
 void min_heap_clear(struct min_heap *heap);
 
@@ -0,0 +1,489 @@
+#include "partition.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bigsort.h"
+#include "io_util.h"
+#include "plan.h"
+#include "run.h"
+#include "util.h"
+
+// Buckets are planned to fill this fraction of a sort buffer. The rest absorbs the error in estimating the splitters
+// from a sample.
+static double const BUCKET_FILL_FACTOR = 0.75;
+
+// Samples taken per bucket. More samples give more evenly sized buckets.
+static size_t const SAMPLES_PER_BUCKET = 64;
+
+// Samples are read in clumps of consecutive values to keep the number of reads down.
+static size_t const SAMPLE_CLUMP_VALUES = 16;
+
+struct partition_context {
+    char const *output_filename;
+    int output_fd;
+
+    // Bucket b holds the values v with splitters[b - 1] <= v < splitters[b].
+    size_t num_buckets;
+    uint32_t *splitters;
+    uint64_t *bucket_counts;
+    uint64_t *bucket_offsets;
+    bool *oversized;
+
+    // Each thread sorts whole buckets in its own sort buffer. Buckets that don't fit are sorted externally afterwards.
+    uint32_t *sort_buffers;
+    size_t sort_capacity;
+    atomic_size_t next_bucket;
+    atomic_bool failed;
+
+    struct progress *progress;
+    pthread_mutex_t progress_lock;
+};
+
+static bool choose_splitters(
+        struct partition_context *partition, int input_fd, uint64_t num_values, struct arena *arena);
+
+static bool distribute(struct partition_context *partition, FILE *input_file, struct arena *arena);
+
+static size_t find_bucket(uint32_t const *splitters, size_t num_splitters, uint32_t value);
+
+static void sort_buckets(void *context, size_t thread_index);
+
+static bool sort_bucket(struct partition_context *partition, size_t bucket, uint32_t *buffer);
+
+static bool sort_oversized_bucket(struct partition_context *partition, size_t bucket, struct arena *arena);
+
+static void format_bucket_filename(
+        char *buffer, size_t buffer_size, struct partition_context const *partition, size_t bucket);
+
+
+/*
+ * Sorts the input into the output file by partitioning it instead of creating and merging runs (i.e. a sample sort).
+ *
+ * First, a sample of the input picks splitters that divide the value range into buckets that each fit in one thread's
+ * share of the arena. Then the input is streamed once into a file per bucket. Then the pool's threads sort whole
+ * buckets in memory and write each one straight to its place in the output, which is known from the bucket sizes. The
+ * data is read and written twice, whatever its size, and there's no merge heap. It only works in one pass if a block
+ * per bucket fits in the arena, which limits the input to roughly (memory^2 / block size) / threads. A bucket that
+ * comes out too big to sort in memory (e.g. due to many equal values) is sorted with runs and merges instead.
+ *
+ * The input must be a regular file so that it can be sampled, and the output must be a file so that the buckets can
+ * be written to it in any order.
+ */
+bool partition_sort(
+        FILE *input_file, char const *output_filename,
+        struct arena *arena, struct thread_pool *pool,
+        struct progress *progress, size_t *num_buckets)
+{
+    assert(input_file);
+    assert(output_filename);
+    assert(arena);
+    assert(pool);
+    assert(num_buckets);
+
+    struct stat input_status = {0};
+    if ((fstat(fileno(input_file), &input_status) != 0) || !S_ISREG(input_status.st_mode)) {
+        fprintf(stderr, "ERROR: partitioning requires an input file that can be sampled\n");
+        return false;
+    }
+    uint64_t const input_size = (uint64_t) input_status.st_size;
+    if ((input_size & 0x03) != 0) {
+        fprintf(stderr, "ERROR: input file's size must be a multiple of 4.\n");
+        return false;
+    }
+    uint64_t const num_values = input_size / sizeof(uint32_t);
+
+    // Give each thread an equal, page-aligned share of the arena to sort buckets in, and plan the buckets to fit.
+    size_t const num_threads = thread_pool_get_num_threads(pool);
+    size_t const sort_buffer_size = (arena_available(arena, ARENA_PAGE_ALIGNMENT) / num_threads) &
+                                    ~(ARENA_PAGE_ALIGNMENT - 1);
+    struct partition_context partition = {0};
+    partition.output_filename = output_filename;
+    partition.output_fd = -1;
+    partition.sort_capacity = sort_buffer_size / sizeof(uint32_t);
+    partition.progress = progress;
+    if (partition.sort_capacity < 2) {
+        fprintf(stderr, "ERROR: working memory is too small to sort buckets with %lu threads\n", num_threads);
+        return false;
+    }
+    uint64_t const bucket_target = (uint64_t) ((double) partition.sort_capacity * BUCKET_FILL_FACTOR);
+    partition.num_buckets = (size_t) ((num_values + bucket_target - 1) / bucket_target);
+    if (partition.num_buckets < 1) {
+        partition.num_buckets = 1;
+    }
+    if (partition.num_buckets > plan_get_open_file_limit()) {
+        fprintf(stderr, "ERROR: partitioning needs %lu bucket files, which is more than can be open at once\n",
+                partition.num_buckets);
+        return false;
+    }
+
+    partition.splitters = (uint32_t *) calloc(partition.num_buckets, sizeof(uint32_t));
+    partition.bucket_counts = (uint64_t *) calloc(partition.num_buckets, sizeof(uint64_t));
+    partition.bucket_offsets = (uint64_t *) calloc(partition.num_buckets, sizeof(uint64_t));
+    partition.oversized = (bool *) calloc(partition.num_buckets, sizeof(bool));
+    pthread_mutex_init(&partition.progress_lock, NULL);
+    atomic_init(&partition.next_bucket, 0);
+    atomic_init(&partition.failed, false);
+
+    bool success = partition.splitters && partition.bucket_counts && partition.bucket_offsets && partition.oversized;
+    if (!success) {
+        fprintf(stderr, "ERROR: unable to allocate bucket tables\n");
+    }
+
+    // Pass 1: sample, then distribute the input into bucket files.
+    progress_set_pass_phases(progress, BIGSORT_PHASE_PARTITION, BIGSORT_PHASE_SORT_BUCKETS);
+    progress_plan_merge(progress, 1);
+    progress_start(progress, input_size, true);
+    success = success && choose_splitters(&partition, fileno(input_file), num_values, arena);
+    success = success && distribute(&partition, input_file, arena);
+
+    // Each bucket's place in the output follows from the sizes of the buckets before it.
+    if (success) {
+        uint64_t offset = 0;
+        for (size_t i = 0; i < partition.num_buckets; i++) {
+            partition.bucket_offsets[i] = offset;
+            offset += partition.bucket_counts[i];
+        }
+        partition.output_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (partition.output_fd < 0) {
+            fprintf(stderr, "ERROR: unable to create output file: %s\n", strerror(errno));
+            success = false;
+        }
+    }
+
+    // Pass 2: sort the buckets in parallel, and then any that were too big to sort in memory.
+    if (success) {
+        progress_begin_generation(progress, 1);
+
+        size_t const arena_mark_before_sort = arena_mark(arena);
+        partition.sort_buffers = (uint32_t *) arena_alloc(
+                arena, sort_buffer_size * num_threads, ARENA_PAGE_ALIGNMENT);
+        if (partition.sort_buffers) {
+            thread_pool_run(pool, sort_buckets, &partition);
+            success = !atomic_load(&partition.failed);
+        } else {
+            fprintf(stderr, "ERROR: unable to allocate bucket sort buffers\n");
+            success = false;
+        }
+        arena_release(arena, arena_mark_before_sort);
+
+        for (size_t i = 0; success && (i < partition.num_buckets); i++) {
+            if (partition.oversized[i]) {
+                success = sort_oversized_bucket(&partition, i, arena);
+            }
+        }
+    }
+    if (success && (close(partition.output_fd) != 0)) {
+        fprintf(stderr, "ERROR: unable to write output file: %s\n", strerror(errno));
+        success = false;
+    } else if (!success && (partition.output_fd >= 0)) {
+        close(partition.output_fd);
+    }
+
+    // Buckets are removed as soon as they're sorted. Anything left over is from a failure.
+    if (!success && partition.bucket_counts) {
+        char filename[PATH_MAX] = {0};
+        for (size_t i = 0; i < partition.num_buckets; i++) {
+            format_bucket_filename(filename, sizeof(filename), &partition, i);
+            remove(filename);
+        }
+    }
+    if (success) {
+        progress_finish(progress);
+        *num_buckets = partition.num_buckets;
+    }
+
+    pthread_mutex_destroy(&partition.progress_lock);
+    free(partition.oversized);
+    free(partition.bucket_offsets);
+    free(partition.bucket_counts);
+    free(partition.splitters);
+    return success;
+}
+
+/*
+ * Reads clumps of values from random places in the input, sorts them and picks evenly spaced splitters from them.
+ */
+static bool choose_splitters(
+        struct partition_context *partition, int input_fd, uint64_t num_values, struct arena *arena)
+{
+    size_t const num_buckets = partition->num_buckets;
+    if (num_buckets == 1) {
+        return true;
+    }
+
+    // Small inputs are sampled in full.
+    size_t num_samples = num_buckets * SAMPLES_PER_BUCKET;
+    bool const sample_everything = (num_values <= num_samples);
+    if (sample_everything) {
+        num_samples = (size_t) num_values;
+    }
+    size_t const arena_mark_before_samples = arena_mark(arena);
+    uint32_t *samples = (uint32_t *) arena_alloc(arena, num_samples * sizeof(uint32_t), ARENA_CACHE_LINE_ALIGNMENT);
+    if (!samples) {
+        fprintf(stderr, "ERROR: working memory is too small to sample the input\n");
+        return false;
+    }
+
+    // A fixed seed keeps the buckets, and thus the sort's behavior, reproducible.
+    uint64_t random_state = 0x9e3779b97f4a7c15ULL;
+    uint64_t const num_clump_positions = sample_everything ? 1 : (num_values - SAMPLE_CLUMP_VALUES + 1);
+    size_t const clump_values = sample_everything ? num_samples : SAMPLE_CLUMP_VALUES;
+    for (size_t i = 0; i < num_samples; i += clump_values) {
+        uint64_t const position = util_next_random(&random_state) % num_clump_positions;
+        if (!io_pread_fully(input_fd, samples + i, clump_values * sizeof(uint32_t), position * sizeof(uint32_t))) {
+            fprintf(stderr, "ERROR: unable to sample input file: %s\n", strerror(errno));
+            arena_release(arena, arena_mark_before_samples);
+            return false;
+        }
+    }
+
+    run_sort(samples, num_samples);
+    for (size_t i = 0; i + 1 < num_buckets; i++) {
+        partition->splitters[i] = samples[((i + 1) * num_samples) / num_buckets];
+    }
+    arena_release(arena, arena_mark_before_samples);
+    return true;
+}
+
+/*
+ * Streams the input once, appending each value to its bucket's block and writing blocks out to the bucket files as
+ * they fill up.
+ */
+static bool distribute(struct partition_context *partition, FILE *input_file, struct arena *arena)
+{
+    size_t const num_buckets = partition->num_buckets;
+
+    // One block for reading the input, plus one per bucket.
+    size_t block_size = arena_available(arena, ARENA_PAGE_ALIGNMENT) / (num_buckets + 1);
+    if (block_size > PLAN_MAX_BLOCK_SIZE) {
+        block_size = PLAN_MAX_BLOCK_SIZE;
+    }
+    block_size &= ~(PLAN_MIN_BLOCK_SIZE - 1);
+    if (block_size < PLAN_MIN_BLOCK_SIZE) {
+        fprintf(stderr, "ERROR: working memory is too small to partition into %lu buckets. Use more memory, fewer "
+                        "threads or sort without partitioning.\n", num_buckets);
+        return false;
+    }
+    size_t const block_values = block_size / sizeof(uint32_t);
+
+    size_t const arena_mark_before_distribute = arena_mark(arena);
+    uint32_t *input_block = (uint32_t *) arena_alloc(arena, block_size, ARENA_PAGE_ALIGNMENT);
+    uint32_t *bucket_blocks = (uint32_t *) arena_alloc(arena, num_buckets * block_size, ARENA_PAGE_ALIGNMENT);
+    size_t *bucket_fill = (size_t *) calloc(num_buckets, sizeof(size_t));
+    FILE **bucket_files = (FILE **) calloc(num_buckets, sizeof(FILE *));
+    bool success = input_block && bucket_blocks && bucket_fill && bucket_files;
+    if (!success) {
+        fprintf(stderr, "ERROR: unable to allocate bucket blocks\n");
+    }
+
+    char filename[PATH_MAX] = {0};
+    for (size_t i = 0; success && (i < num_buckets); i++) {
+        format_bucket_filename(filename, sizeof(filename), partition, i);
+        bucket_files[i] = fopen(filename, "wb");
+        if (!bucket_files[i]) {
+            fprintf(stderr, "ERROR: unable to create bucket file: %s\n", strerror(errno));
+            success = false;
+        } else {
+            // Buckets are written a whole block at a time.
+            setvbuf(bucket_files[i], NULL, _IONBF, 0);
+        }
+    }
+
+    while (success) {
+        size_t const num_read = fread(input_block, sizeof(uint32_t), block_values, input_file);
+        if (ferror(input_file)) {
+            fprintf(stderr, "ERROR: unable to read input file: %s\n", strerror(errno));
+            success = false;
+            break;
+        }
+        for (size_t i = 0; i < num_read; i++) {
+            uint32_t const value = input_block[i];
+            size_t const bucket = find_bucket(partition->splitters, num_buckets - 1, value);
+            uint32_t *block = bucket_blocks + (bucket * block_values);
+            block[bucket_fill[bucket]++] = value;
+            if (bucket_fill[bucket] == block_values) {
+                if (fwrite(block, sizeof(uint32_t), block_values, bucket_files[bucket]) != block_values) {
+                    fprintf(stderr, "ERROR: unable to write bucket file: %s\n", strerror(errno));
+                    success = false;
+                    break;
+                }
+                partition->bucket_counts[bucket] += block_values;
+                bucket_fill[bucket] = 0;
+            }
+        }
+        progress_update(partition->progress, num_read * sizeof(uint32_t));
+        if (num_read < block_values) {
+            break;
+        }
+    }
+
+    // Write out the partial blocks that are left, and close the bucket files.
+    for (size_t i = 0; bucket_files && (i < num_buckets); i++) {
+        if (!bucket_files[i]) {
+            continue;
+        }
+        if (success && (bucket_fill[i] > 0)) {
+            uint32_t const *block = bucket_blocks + (i * block_values);
+            if (fwrite(block, sizeof(uint32_t), bucket_fill[i], bucket_files[i]) != bucket_fill[i]) {
+                fprintf(stderr, "ERROR: unable to write bucket file: %s\n", strerror(errno));
+                success = false;
+            }
+            partition->bucket_counts[i] += bucket_fill[i];
+        }
+        if ((fclose(bucket_files[i]) != 0) && success) {
+            fprintf(stderr, "ERROR: unable to write bucket file: %s\n", strerror(errno));
+            success = false;
+        }
+    }
+
+    free(bucket_files);
+    free(bucket_fill);
+    arena_release(arena, arena_mark_before_distribute);
+    return success;
+}
+
+/*
+ * Returns the number of splitters that are no greater than value, which is the index of value's bucket.
+ */
+static size_t find_bucket(uint32_t const *splitters, size_t num_splitters, uint32_t value)
+{
+    size_t low = 0;
+    size_t high = num_splitters;
+    while (low < high) {
+        size_t const mid = low + ((high - low) / 2);
+        if (splitters[mid] <= value) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/*
+ * Runs on every thread in the pool. Each thread takes the next unsorted bucket until there are none left.
+ */
+static void sort_buckets(void *context, size_t thread_index)
+{
+    struct partition_context *partition = (struct partition_context *) context;
+    uint32_t *buffer = partition->sort_buffers + (thread_index * partition->sort_capacity);
+
+    while (!atomic_load(&partition->failed)) {
+        size_t const bucket = atomic_fetch_add(&partition->next_bucket, 1);
+        if (bucket >= partition->num_buckets) {
+            break;
+        }
+        if (partition->bucket_counts[bucket] > partition->sort_capacity) {
+            // Only this thread looks at this bucket until the pool is done.
+            partition->oversized[bucket] = true;
+            continue;
+        }
+        if (!sort_bucket(partition, bucket, buffer)) {
+            atomic_store(&partition->failed, true);
+        }
+    }
+}
+
+static bool sort_bucket(struct partition_context *partition, size_t bucket, uint32_t *buffer)
+{
+    char filename[PATH_MAX] = {0};
+    format_bucket_filename(filename, sizeof(filename), partition, bucket);
+
+    size_t const count = (size_t) partition->bucket_counts[bucket];
+    size_t const size = count * sizeof(uint32_t);
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: unable to open bucket file: %s\n", strerror(errno));
+        return false;
+    }
+    bool const read = io_pread_fully(fd, buffer, size, 0);
+    close(fd);
+    if (!read) {
+        fprintf(stderr, "ERROR: unable to read bucket file: %s\n", strerror(errno));
+        return false;
+    }
+    remove(filename);
+
+    run_sort(buffer, count);
+    if (!io_pwrite_fully(partition->output_fd, buffer, size, partition->bucket_offsets[bucket] * sizeof(uint32_t))) {
+        fprintf(stderr, "ERROR: unable to write output file: %s\n", strerror(errno));
+        return false;
+    }
+
+    pthread_mutex_lock(&partition->progress_lock);
+    progress_update(partition->progress, size);
+    pthread_mutex_unlock(&partition->progress_lock);
+    return true;
+}
+
+/*
+ * Sorts a bucket that doesn't fit in a sort buffer with runs and merges in the whole arena, and then copies the result
+ * into place in the output.
+ */
+static bool sort_oversized_bucket(struct partition_context *partition, size_t bucket, struct arena *arena)
+{
+    char filename[PATH_MAX] = {0};
+    format_bucket_filename(filename, sizeof(filename), partition, bucket);
+    uint64_t const size = partition->bucket_counts[bucket] * sizeof(uint32_t);
+
+    struct sort_plan plan = {0};
+    if (!plan_sort(&plan, arena_available(arena, ARENA_PAGE_ALIGNMENT), 0, size, 0)) {
+        fprintf(stderr, "ERROR: working memory is too small to sort an oversized bucket\n");
+        return false;
+    }
+
+    // The bucket file is the input for its runs, and the merged result then takes its name.
+    FILE *bucket_file = fopen(filename, "rb");
+    if (!bucket_file) {
+        fprintf(stderr, "ERROR: unable to open bucket file: %s\n", strerror(errno));
+        return false;
+    }
+    setvbuf(bucket_file, NULL, _IONBF, 0);
+    size_t const num_runs = create_runs(bucket_file, filename, arena, plan.run_size, NULL, NULL);
+    fclose(bucket_file);
+    if (num_runs == 0) {
+        return false;
+    }
+    remove(filename);
+    size_t generations = 0;
+    if (!merge_runs(filename, num_runs, arena, plan.fan_in, plan.block_size, 0, false, NULL, NULL, &generations)) {
+        return false;
+    }
+
+    // Copy the sorted bucket into place a block at a time.
+    size_t const arena_mark_before_copy = arena_mark(arena);
+    size_t const block_size = plan.block_size;
+    void *block = arena_alloc(arena, block_size, ARENA_PAGE_ALIGNMENT);
+    int fd = open(filename, O_RDONLY);
+    bool success = block && (fd >= 0);
+    for (uint64_t copied = 0; success && (copied < size); copied += block_size) {
+        size_t const chunk = ((size - copied) < block_size) ? (size_t) (size - copied) : block_size;
+        success = io_pread_fully(fd, block, chunk, copied) &&
+                  io_pwrite_fully(partition->output_fd, block, chunk,
+                              (partition->bucket_offsets[bucket] * sizeof(uint32_t)) + copied);
+        progress_update(partition->progress, chunk);
+    }
+    if (!success) {
+        fprintf(stderr, "ERROR: unable to copy oversized bucket to output: %s\n", strerror(errno));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    remove(filename);
+    arena_release(arena, arena_mark_before_copy);
+    return success;
+}
+
+static void format_bucket_filename(
+        char *buffer, size_t buffer_size, struct partition_context const *partition, size_t bucket)
+{
+    snprintf(buffer, buffer_size, "%s.bucket.%lu", partition->output_filename, bucket);
+}
@@ -0,0 +1,16 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "arena.h"
+#include "progress.h"
+#include "thread_pool.h"
+
+bool partition_sort(
+        FILE *input_file, char const *output_filename,
+        struct arena *arena, struct thread_pool *pool,
+        struct progress *progress, size_t *num_buckets);
+
+#endif // PARTITION_H
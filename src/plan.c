@@ -0,0 +1,237 @@
+#include "plan.h"
+#include <assert.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include "merge.h"
+
+// File descriptors that are needed for things other than merge inputs: stdin/stdout/stderr, the input file, the merge
+// output file and a little slack.
+static size_t const RESERVED_FILE_DESCRIPTORS = 8;
+
+// The cost model used to compare merge plans. A merge generation reads and writes all the data sequentially, and pays
+// a seek each time it switches to a different run's block. These defaults, used unless the plan has a measured device,
+// sit between a SATA SSD and a hard drive.
+static double const SEQUENTIAL_BYTES_PER_SECOND = 250.0 * (1 << 20);
+static double const SEEK_SECONDS = 0.001;
+static double const SORT_BYTES_PER_SECOND = 200.0 * (1 << 20);
+
+static size_t smallest_fan_in(size_t num_runs, size_t generations);
+
+static size_t largest_block_size(size_t memory_size, size_t fan_in, size_t record_size);
+
+static struct plan_device device_or_defaults(struct plan_device const *device);
+
+static double run_cost(struct plan_device const *device, uint64_t input_size);
+
+static double merge_cost(struct plan_device const *device, uint64_t input_size, size_t generations, size_t block_size);
+
+static void estimate_seconds(struct sort_plan *plan, uint64_t input_size);
+
+
+size_t plan_get_open_file_limit(void)
+{
+    struct rlimit limit = {0};
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return 2;
+    }
+    if (limit.rlim_cur == RLIM_INFINITY) {
+        return SIZE_MAX;
+    }
+    if (limit.rlim_cur < RESERVED_FILE_DESCRIPTORS + 2) {
+        return 2;
+    }
+    return (size_t) limit.rlim_cur - RESERVED_FILE_DESCRIPTORS;
+}
+
+/*
+ * Splits a memory budget between the run phase and the merge phase.
+ *
+ * Run creation uses the whole budget (or the requested run size, if smaller) as a single run buffer since each run is
+ * read, sorted and written in one go. The merge reuses the same memory and is planned by plan_merge() for the number
+ * of runs that the input size works out to.
+ */
+bool plan_sort(
+        struct sort_plan *plan,
+        size_t memory_size, size_t run_size, uint64_t input_size,
+        size_t max_files)
+{
+    assert(plan);
+
+    if ((run_size == 0) || (run_size > memory_size)) {
+        run_size = memory_size;
+    }
+    // Runs are made of whole uint32_t values. Round down so the run buffer stays within the budget.
+    run_size &= ~(size_t) 0x3;
+    if (run_size < sizeof(uint32_t) * 2) {
+        return false;
+    }
+
+    size_t estimated_runs = (size_t) ((input_size + run_size - 1) / run_size);
+    if (estimated_runs < 1) {
+        estimated_runs = 1;
+    }
+
+    plan->memory_size = memory_size;
+    plan->run_size = run_size;
+    if (!plan_merge(plan, estimated_runs, max_files)) {
+        return false;
+    }
+    // The last run is usually only partly full, so the input's own size gives the better estimate.
+    if (input_size > 0) {
+        estimate_seconds(plan, input_size);
+    }
+    return true;
+}
+
+/*
+ * Plans the merge phase of plan->memory_size bytes for num_runs runs of plan->run_size bytes. This is called by
+ * plan_sort(), and can be called again once the actual number of runs is known, e.g. when the input size wasn't known
+ * up front.
+ *
+ * The merge memory is split between a heap slot, bookkeeping and a read block for each of k inputs, plus one output
+ * block. Larger k means fewer passes over the data, but smaller blocks and thus more seeks per pass. For each possible
+ * number of passes, this finds the smallest k that achieves it (which leaves the largest blocks), and then picks the
+ * cheapest of those according to a simple cost model.
+ */
+bool plan_merge(struct sort_plan *plan, size_t num_runs, size_t max_files)
+{
+    assert(plan);
+
+    size_t const memory_size = plan->memory_size;
+    size_t const record_size = (plan->record_size != 0) ? plan->record_size : sizeof(uint32_t);
+    uint64_t const input_size = (uint64_t) num_runs * plan->run_size;
+    struct plan_device const device = device_or_defaults(&plan->device);
+
+    // A merge holds each of its input files open, unless the runs share a spill file that's read by offset.
+    size_t max_fan_in = plan->runs_share_file ? SIZE_MAX : plan_get_open_file_limit();
+    if ((max_files != 0) && (max_files < max_fan_in)) {
+        max_fan_in = max_files;
+    }
+    if (max_fan_in < 2) {
+        max_fan_in = 2;
+    }
+
+    // If everything fits in a single run, there's nothing to merge. Still plan a two-way merge so that the merge phase
+    // has valid parameters should the input turn out to be larger than expected.
+    size_t best_generations = 0;
+    size_t best_fan_in = 2;
+    size_t best_block_size = largest_block_size(memory_size, best_fan_in, record_size);
+    if (num_runs > 1) {
+        double best_cost = -1.0;
+        for (size_t generations = 1; generations < 64; generations++) {
+            size_t const fan_in = smallest_fan_in(num_runs, generations);
+            if (fan_in > max_fan_in) {
+                continue;
+            }
+            size_t const block_size = largest_block_size(memory_size, fan_in, record_size);
+            if (block_size < record_size) {
+                continue;
+            }
+            double const cost = merge_cost(&device, input_size, generations, block_size);
+            if ((best_cost < 0.0) || (cost < best_cost)) {
+                best_cost = cost;
+                best_generations = generations;
+                best_fan_in = fan_in;
+                best_block_size = block_size;
+            }
+            if (fan_in == 2) {
+                // Fewer inputs per merge isn't possible, so more generations can only cost more.
+                break;
+            }
+        }
+    }
+    if (best_block_size < record_size) {
+        return false;
+    }
+
+    plan->fan_in = best_fan_in;
+    plan->block_size = best_block_size;
+    plan->merge_memory_size = merge_memory_required(best_fan_in, best_block_size);
+    plan->estimated_runs = num_runs;
+    plan->estimated_generations = best_generations;
+    estimate_seconds(plan, input_size);
+    return true;
+}
+
+/*
+ * Finds the smallest fan-in k for which k^generations >= num_runs.
+ */
+static size_t smallest_fan_in(size_t num_runs, size_t generations)
+{
+    size_t low = 2;
+    size_t high = (num_runs < 2) ? 2 : num_runs;
+    while (low < high) {
+        size_t const mid = low + ((high - low) / 2);
+        // Compute mid^generations, saturating once it reaches num_runs.
+        size_t power = 1;
+        for (size_t i = 0; (i < generations) && (power < num_runs); i++) {
+            power = (power > (SIZE_MAX / mid)) ? SIZE_MAX : power * mid;
+        }
+        if (power >= num_runs) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    return low;
+}
+
+/*
+ * Finds the largest block size such that fan_in inputs and one output fit in memory_size. Returns zero if not even a
+ * single record per block fits.
+ */
+static size_t largest_block_size(size_t memory_size, size_t fan_in, size_t record_size)
+{
+    size_t const overhead = merge_memory_required(fan_in, 0);
+    if (memory_size <= overhead) {
+        return 0;
+    }
+    size_t block_size = (memory_size - overhead) / (fan_in + 1);
+    if (block_size > PLAN_MAX_MERGE_BLOCK_SIZE) {
+        block_size = PLAN_MAX_MERGE_BLOCK_SIZE;
+    }
+    // Blocks are rounded down to whole pages once they're at least a page.
+    if (block_size >= PLAN_MIN_BLOCK_SIZE) {
+        block_size -= block_size % PLAN_MIN_BLOCK_SIZE;
+    }
+    // Blocks are made of whole records.
+    return block_size - (block_size % record_size);
+}
+
+static struct plan_device device_or_defaults(struct plan_device const *device)
+{
+    struct plan_device filled = *device;
+    if (filled.sequential_bytes_per_second <= 0.0) {
+        filled.sequential_bytes_per_second = SEQUENTIAL_BYTES_PER_SECOND;
+    }
+    if (filled.seek_seconds <= 0.0) {
+        filled.seek_seconds = SEEK_SECONDS;
+    }
+    if (filled.sort_bytes_per_second <= 0.0) {
+        filled.sort_bytes_per_second = SORT_BYTES_PER_SECOND;
+    }
+    return filled;
+}
+
+static double run_cost(struct plan_device const *device, uint64_t input_size)
+{
+    // The input is read and the runs written sequentially, and each run is sorted in between.
+    double const bytes = (double) input_size;
+    return (bytes * 2.0 / device->sequential_bytes_per_second) + (bytes / device->sort_bytes_per_second);
+}
+
+static double merge_cost(struct plan_device const *device, uint64_t input_size, size_t generations, size_t block_size)
+{
+    // Each generation reads and writes everything once. Every block that is read or written costs a seek since the
+    // merge hops between inputs and the output.
+    double const bytes = (double) input_size * 2.0;
+    double const seeks = bytes / (double) block_size;
+    return (double) generations * ((bytes / device->sequential_bytes_per_second) + (seeks * device->seek_seconds));
+}
+
+static void estimate_seconds(struct sort_plan *plan, uint64_t input_size)
+{
+    struct plan_device const device = device_or_defaults(&plan->device);
+    plan->estimated_run_seconds = run_cost(&device, input_size);
+    plan->estimated_merge_seconds = merge_cost(&device, input_size, plan->estimated_generations, plan->block_size);
+}
@@ -0,0 +1,56 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// How fast the device that holds the runs is, and how fast the CPU sorts, for the cost model that plans are compared
+// with. Fields that are zero fall back to defaults.
+struct plan_device {
+    double sequential_bytes_per_second;
+    double seek_seconds;
+    double sort_bytes_per_second;
+};
+
+struct sort_plan {
+    // Set before planning if the runs share a spill file (see spill.h) rather than each being a file of its own.
+    bool runs_share_file;
+
+    // Set before planning to plan for a measured device (see autotune.h) rather than the defaults.
+    struct plan_device device;
+
+    // Set before planning if the runs hold records of this many bytes (see merge_set_record_size()) rather than
+    // uint32_t values, so that blocks are made of whole records.
+    size_t record_size;
+
+    size_t memory_size;
+    size_t run_size;
+    size_t fan_in;
+    size_t block_size;
+    size_t merge_memory_size;
+    size_t estimated_runs;
+    size_t estimated_generations;
+
+    // How long the cost model expects creating the runs and merging them to take.
+    double estimated_run_seconds;
+    double estimated_merge_seconds;
+};
+
+// Bounds for the blocks that data is read and written in. Below the minimum, a page, transfers are too small to be
+// efficient. Blocks streamed alongside other work stop at PLAN_MAX_BLOCK_SIZE; merge blocks, each of which costs a seek
+// to switch to, may grow to PLAN_MAX_MERGE_BLOCK_SIZE, which amortizes even a slow disk's seek.
+#define PLAN_MIN_BLOCK_SIZE ((size_t) 4096)
+#define PLAN_MAX_BLOCK_SIZE ((size_t) 1 << 20)
+#define PLAN_MAX_MERGE_BLOCK_SIZE ((size_t) 16 << 20)
+
+size_t plan_get_open_file_limit(void);
+
+bool plan_sort(
+        struct sort_plan *plan,
+        size_t memory_size, size_t run_size, uint64_t input_size,
+        size_t max_files);
+
+bool plan_merge(struct sort_plan *plan, size_t num_runs, size_t max_files);
+
+#endif // PLAN_H
@@ -0,0 +1,247 @@
+#include "progress.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "util.h"
+
+struct progress {
+    bigsort_progress_callback callback;
+    void *user_data;
+    double interval_seconds;
+
+    // The report that is handed to the callback. It is kept up to date as bytes are processed.
+    struct bigsort_progress report;
+
+    // Size of the input. Every pass over the data (run creation plus each merge generation) processes this much. When
+    // the input is a pipe, this isn't known until run creation has read all of it.
+    uint64_t input_size;
+    bool input_size_known;
+
+    // How the first pass and the passes after it are labeled in reports.
+    enum bigsort_phase first_pass_phase;
+    enum bigsort_phase later_pass_phase;
+
+    // Work on top of the passes over the input, e.g. a sorted file that the final merge reads as well.
+    uint64_t extra_bytes;
+
+    // Whether there's a first pass before the merge generations at all. A merge of files that are already runs starts
+    // with its first generation.
+    bool has_first_pass;
+
+    // Bytes that were actually read or written. Renaming a lone run into the next generation counts towards
+    // report.bytes_processed but not towards this, so it is what throughput is calculated from.
+    uint64_t io_bytes;
+
+    // Clock is only consulted once this many I/O bytes have accumulated since the last check.
+    uint64_t check_bytes;
+    uint64_t next_check_io_bytes;
+
+    double start_time;
+    double last_report_time;
+    uint64_t last_report_io_bytes;
+};
+
+// Don't look at the clock more often than every 1MB of processed data.
+static uint64_t const PROGRESS_CHECK_BYTES = (uint64_t) 1 << 20;
+
+static void update_total(struct progress *progress);
+
+static void report(struct progress *progress, double now);
+
+
+struct progress *progress_new(bigsort_progress_callback callback, void *user_data, double interval_seconds)
+{
+    assert(callback);
+
+    struct progress *progress = (struct progress *) malloc(sizeof(struct progress));
+    if (!progress) {
+        return NULL;
+    }
+    progress->callback = callback;
+    progress->user_data = user_data;
+    progress->interval_seconds = interval_seconds;
+    progress->report = (struct bigsort_progress) {0};
+    progress->report.eta_seconds = -1.0;
+    progress->input_size = 0;
+    progress->input_size_known = true;
+    progress->first_pass_phase = BIGSORT_PHASE_CREATE_RUNS;
+    progress->later_pass_phase = BIGSORT_PHASE_MERGE;
+    progress->has_first_pass = true;
+    progress->extra_bytes = 0;
+    progress->io_bytes = 0;
+    progress->check_bytes = PROGRESS_CHECK_BYTES;
+    progress->next_check_io_bytes = PROGRESS_CHECK_BYTES;
+    progress->start_time = util_now_seconds();
+    progress->last_report_time = progress->start_time;
+    progress->last_report_io_bytes = 0;
+    return progress;
+}
+
+void progress_start(struct progress *progress, uint64_t input_size, bool input_size_known)
+{
+    if (!progress) {
+        return;
+    }
+    // Any number of generations that was planned up front by progress_plan_merge() is kept.
+    progress->input_size = input_size_known ? input_size : 0;
+    progress->input_size_known = input_size_known;
+    if (progress->has_first_pass) {
+        progress->report.phase = progress->first_pass_phase;
+        progress->report.generation = 0;
+    } else {
+        progress->report.phase = progress->later_pass_phase;
+        progress->report.generation = 1;
+    }
+    update_total(progress);
+    report(progress, util_now_seconds());
+}
+
+void progress_plan_merge(struct progress *progress, size_t planned_generations)
+{
+    if (!progress) {
+        return;
+    }
+    progress->report.planned_generations = planned_generations;
+    update_total(progress);
+}
+
+void progress_begin_generation(struct progress *progress, size_t generation)
+{
+    if (!progress) {
+        return;
+    }
+    progress->report.phase = progress->later_pass_phase;
+    progress->report.generation = generation;
+
+    // Run creation has read everything by now, so the size of an input of unknown size is known too.
+    progress->input_size_known = true;
+
+    // Generation N starts once run creation and N-1 merge passes are complete. Runs that were simply renamed into a
+    // generation were never rewritten, so catch the processed count up to where the pass boundary says it is.
+    size_t const passes_before = progress->has_first_pass ? generation : generation - 1;
+    uint64_t const pass_start = progress->input_size * (uint64_t) passes_before;
+    if (progress->report.bytes_processed < pass_start) {
+        progress->report.bytes_processed = pass_start;
+    }
+    if (progress->report.planned_generations < generation) {
+        progress->report.planned_generations = generation;
+        update_total(progress);
+    }
+    report(progress, util_now_seconds());
+}
+
+/*
+ * Changes how passes are labeled in reports. Sorts that don't create and merge runs use this to relabel their passes,
+ * which are otherwise counted like run creation and merge generations. Takes effect from the next progress_start() or
+ * progress_begin_generation().
+ */
+void progress_set_pass_phases(
+        struct progress *progress, enum bigsort_phase first_pass_phase, enum bigsort_phase later_pass_phase)
+{
+    if (!progress) {
+        return;
+    }
+    progress->first_pass_phase = first_pass_phase;
+    progress->later_pass_phase = later_pass_phase;
+}
+
+/*
+ * Leaves out the first pass, so that the merge generations are the only passes over the data. Takes effect from the
+ * next progress_start().
+ */
+void progress_skip_first_pass(struct progress *progress)
+{
+    if (!progress) {
+        return;
+    }
+    progress->has_first_pass = false;
+}
+
+/*
+ * Adds bytes to the total that aren't part of any pass over the input. They count towards the last pass.
+ */
+void progress_add_bytes(struct progress *progress, uint64_t bytes)
+{
+    if (!progress) {
+        return;
+    }
+    progress->extra_bytes += bytes;
+    update_total(progress);
+}
+
+void progress_update(struct progress *progress, uint64_t bytes)
+{
+    if (!progress) {
+        return;
+    }
+    progress->report.bytes_processed += bytes;
+    progress->io_bytes += bytes;
+    if (!progress->input_size_known) {
+        // Run creation reads the input exactly once, so what it has read so far is the input size so far.
+        progress->input_size += bytes;
+        update_total(progress);
+    }
+
+    // Keep the common case to a couple of additions and a compare. Only look at the clock every check_bytes bytes,
+    // and only call back once the reporting interval has elapsed.
+    if (progress->io_bytes < progress->next_check_io_bytes) {
+        return;
+    }
+    progress->next_check_io_bytes = progress->io_bytes + progress->check_bytes;
+
+    double const now = util_now_seconds();
+    if ((now - progress->last_report_time) >= progress->interval_seconds) {
+        report(progress, now);
+    }
+}
+
+void progress_finish(struct progress *progress)
+{
+    if (!progress) {
+        return;
+    }
+    progress->report.phase = BIGSORT_PHASE_DONE;
+    progress->report.bytes_processed = progress->report.bytes_total;
+    report(progress, util_now_seconds());
+}
+
+void progress_delete(struct progress *progress)
+{
+    free(progress);
+}
+
+static void update_total(struct progress *progress)
+{
+    // One pass to create the runs (unless it's skipped) plus one pass per planned merge generation.
+    size_t const passes = (progress->has_first_pass ? 1 : 0) + progress->report.planned_generations;
+    progress->report.bytes_total = (progress->input_size * (uint64_t) passes) + progress->extra_bytes;
+}
+
+static void report(struct progress *progress, double now)
+{
+    struct bigsort_progress *r = &progress->report;
+
+    double const elapsed = now - progress->start_time;
+    double const interval = now - progress->last_report_time;
+
+    r->elapsed_seconds = elapsed;
+    if (interval > 0.0) {
+        r->throughput = (double) (progress->io_bytes - progress->last_report_io_bytes) / interval;
+    }
+
+    // Base the ETA on the average rate so far. This is much steadier than the instantaneous rate, which swings
+    // between the read-heavy run creation and the seek-heavy merges.
+    // An input of unknown size gives no basis for an estimate until it has been read.
+    if (progress->input_size_known && (elapsed > 0.0) && (r->bytes_processed > 0) &&
+        (r->bytes_total >= r->bytes_processed)) {
+        double const average_rate = (double) r->bytes_processed / elapsed;
+        r->eta_seconds = (double) (r->bytes_total - r->bytes_processed) / average_rate;
+    } else {
+        r->eta_seconds = -1.0;
+    }
+
+    progress->last_report_time = now;
+    progress->last_report_io_bytes = progress->io_bytes;
+
+    progress->callback(r, progress->user_data);
+}
@@ -0,0 +1,32 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "bigsort.h"
+
+struct progress;
+
+struct progress *progress_new(bigsort_progress_callback callback, void *user_data, double interval_seconds);
+
+void progress_start(struct progress *progress, uint64_t input_size, bool input_size_known);
+
+void progress_plan_merge(struct progress *progress, size_t planned_generations);
+
+void progress_begin_generation(struct progress *progress, size_t generation);
+
+void progress_set_pass_phases(
+        struct progress *progress, enum bigsort_phase first_pass_phase, enum bigsort_phase later_pass_phase);
+
+void progress_skip_first_pass(struct progress *progress);
+
+void progress_add_bytes(struct progress *progress, uint64_t bytes);
+
+void progress_update(struct progress *progress, uint64_t bytes);
+
+void progress_finish(struct progress *progress);
+
+void progress_delete(struct progress *progress);
+
+#endif // PROGRESS_H
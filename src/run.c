@@ -1,20 +1,23 @@
 #include "run.h"
 #include <assert.h>
 #include <stdlib.h>
+#include "io_util.h"
 
 struct run_context {
     FILE *input_file;
     size_t nelements;
+    uint64_t bytes_read;
     uint32_t *data;
     bool finished;
-};
 
-static int compare_uint32_t(void const *left, void const *right)
-{
-    int64_t left_int = *(uint32_t const *) left;
-    int64_t right_int = *(uint32_t const *) right;
-    return (int) (left_int - right_int);
-}
+    // Most values that a run keeps, or zero to keep them all.
+    size_t limit;
+
+    // How runs are sorted. SORT_ENGINE_AUTO is resolved with the first run, and the choice then sticks for the rest
+    // since they come from the same input. Scratch, if not NULL, has room for a whole run.
+    enum sort_engine engine;
+    uint32_t *scratch;
+};
 
 struct run_context *run_new(FILE *input_file, void *run_data, size_t run_data_size)
 {
@@ -29,15 +32,45 @@ struct run_context *run_new(FILE *input_file, void *run_data, size_t run_data_si
 
     run->input_file = input_file;
     run->nelements = run_data_size / sizeof(uint32_t);
+    run->bytes_read = 0;
     run->data = (uint32_t *) run_data;
     if (!run->data) {
         free(run);
         return NULL;
     }
     run->finished = false;
+    run->limit = 0;
+    run->engine = sort_engine_get_default();
+    run->scratch = NULL;
     return run;
 }
 
+/*
+ * Makes each run keep only its limit smallest values. Zero keeps them all.
+ */
+void run_set_limit(struct run_context *run, size_t limit)
+{
+    assert(run);
+    run->limit = limit;
+}
+
+/*
+ * Sets the engine that runs are sorted with, and optionally scratch memory with room for a whole run that lets the
+ * engine sort out of place.
+ */
+void run_set_sort_engine(struct run_context *run, enum sort_engine engine, uint32_t *scratch)
+{
+    assert(run);
+    run->engine = engine;
+    run->scratch = scratch;
+}
+
+enum sort_engine run_get_sort_engine(struct run_context const *run)
+{
+    assert(run);
+    return run->engine;
+}
+
 bool run_finished(struct run_context *run)
 {
     assert(run);
@@ -49,16 +82,33 @@ bool run_create_run(struct run_context *run, FILE *output_file)
     assert(run);
     assert(output_file);
 
-    // Read a run's worth of uint32_t
-    size_t num_read = fread(run->data, sizeof(uint32_t), run->nelements, run->input_file);
+    // Read a run's worth of uint32_t. Read bytes rather than whole values so that a trailing partial value isn't
+    // silently dropped. The input may be a pipe, so its size can't be checked up front.
+    size_t const num_bytes = fread(run->data, 1, run->nelements * sizeof(uint32_t), run->input_file);
     if (ferror(run->input_file)) {
         return false;
     }
+    if ((num_bytes % sizeof(uint32_t)) != 0) {
+        fprintf(stderr, "ERROR: input size must be a multiple of 4.\n");
+        return false;
+    }
+    size_t const num_read = num_bytes / sizeof(uint32_t);
+    run->bytes_read += num_bytes;
+
+    // With a limit, only the smallest values are kept. Selecting them first means only those need sorting.
+    size_t num_kept = num_read;
+    if ((run->limit != 0) && (num_kept > run->limit)) {
+        run_select(run->data, num_kept, run->limit);
+        num_kept = run->limit;
+    }
 
     // If we read any data, sort it and write it to the run file
-    if (num_read > 0) {
-        qsort(run->data, num_read, sizeof(uint32_t), compare_uint32_t);
-        fwrite(run->data, sizeof(uint32_t), num_read, output_file);
+    if (num_kept > 0) {
+        if (run->engine == SORT_ENGINE_AUTO) {
+            run->engine = sort_engine_choose(run->data, num_kept, run->scratch);
+        }
+        sort_engine_sort(run->engine, run->data, num_kept, run->scratch);
+        fwrite(run->data, sizeof(uint32_t), num_kept, output_file);
         if (ferror(output_file)) {
             return false;
         }
@@ -71,6 +121,130 @@ bool run_create_run(struct run_context *run, FILE *output_file)
     return true;
 }
 
+/*
+ * Sorts values in place with the default sort engine (see sort_engine_set_default()), for the sorts that aren't runs,
+ * such as samples and buckets. Without scratch, an automatic choice can't probe, so it falls back on the engine that
+ * sort_engine_choose() would pick without probing.
+ */
+void run_sort(uint32_t *values, size_t count)
+{
+    assert(values || (count == 0));
+    sort_engine_sort(sort_engine_get_default(), values, count, NULL);
+}
+
+/*
+ * Partially orders values so that the k smallest end up, in no particular order, in the first k positions. This is
+ * quickselect with a median-of-three pivot and a three-way partition, so runs of equal values don't degrade it.
+ */
+void run_select(uint32_t *values, size_t count, size_t k)
+{
+    assert(values || (count == 0));
+
+    // Invariant: everything before left is no larger than anything from left on, and everything from right on is no
+    // smaller than anything before right. The boundary at k lies within [left, right).
+    size_t left = 0;
+    size_t right = count;
+    while ((k > left) && (k < right) && (right - left > 1)) {
+        uint32_t const first = values[left];
+        uint32_t const middle = values[left + ((right - left) / 2)];
+        uint32_t const last = values[right - 1];
+        uint32_t pivot = middle;
+        if ((first <= middle) == (middle <= last)) {
+            pivot = middle;
+        } else if ((middle <= first) == (first <= last)) {
+            pivot = first;
+        } else {
+            pivot = last;
+        }
+
+        // Partition into [left, less) < pivot, [less, greater) == pivot and [greater, right) > pivot.
+        size_t less = left;
+        size_t i = left;
+        size_t greater = right;
+        while (i < greater) {
+            uint32_t const value = values[i];
+            if (value < pivot) {
+                values[i++] = values[less];
+                values[less++] = value;
+            } else if (value > pivot) {
+                values[i] = values[--greater];
+                values[greater] = value;
+            } else {
+                i++;
+            }
+        }
+
+        if (k < less) {
+            right = less;
+        } else if (k > greater) {
+            left = greater;
+        } else {
+            // The boundary falls within the run of pivot values, so it's in place.
+            return;
+        }
+    }
+}
+
+/*
+ * Samples a sorted run of num_values values in fd, which is one of a set of runs that hold total_values between them.
+ * The run gets its share of total_samples in proportion to its size, rounded up, read from evenly spaced positions.
+ * Since the run is sorted, these approximate its quantiles. Samples needs room for the share, which is at most one more
+ * than total_samples * num_values / total_values, and num_samples is set to how many were read.
+ */
+bool run_sample_file(
+        int fd, uint64_t num_values, uint64_t total_values, size_t total_samples, uint32_t *samples,
+        size_t *num_samples)
+{
+    assert(samples);
+    assert(num_samples);
+    assert(num_values <= total_values);
+
+    *num_samples = 0;
+    if (num_values == 0) {
+        return true;
+    }
+    size_t const run_samples = (size_t) ((total_samples * num_values + total_values - 1) / total_values);
+    for (size_t j = 0; j < run_samples; j++) {
+        uint64_t const position = ((2 * j + 1) * num_values) / (2 * run_samples);
+        if (!io_pread_fully(fd, samples + j, sizeof(uint32_t), position * sizeof(uint32_t))) {
+            return false;
+        }
+    }
+    *num_samples = run_samples;
+    return true;
+}
+
+/*
+ * Finds the position of the first value that's at least value among positions [low, high) of a sorted run in fd, or
+ * high if there's none, by a binary search that reads single values.
+ */
+bool run_find_lower_bound(int fd, uint64_t low, uint64_t high, uint32_t value, uint64_t *bound)
+{
+    assert(low <= high);
+    assert(bound);
+
+    while (low < high) {
+        uint64_t const mid = low + ((high - low) / 2);
+        uint32_t mid_value = 0;
+        if (!io_pread_fully(fd, &mid_value, sizeof(mid_value), mid * sizeof(uint32_t))) {
+            return false;
+        }
+        if (mid_value < value) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *bound = low;
+    return true;
+}
+
+uint64_t run_bytes_read(struct run_context const *run)
+{
+    assert(run);
+    return run->bytes_read;
+}
+
 void run_delete(struct run_context *run)
 {
     free(run);
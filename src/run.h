@@ -5,13 +5,26 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include "sort_engine.h"
 
+// Values sampled per part when sorted runs are split into parts by key. More samples give more evenly sized parts.
+#define RUN_SAMPLES_PER_PART ((size_t) 1024)
 
 struct run_context;
 
 struct run_context *run_new(FILE *input_file, void *run_data, size_t run_data_size);
+void run_set_limit(struct run_context *run, size_t limit);
+void run_set_sort_engine(struct run_context *run, enum sort_engine engine, uint32_t *scratch);
+enum sort_engine run_get_sort_engine(struct run_context const *run);
 bool run_finished(struct run_context *run);
 bool run_create_run(struct run_context *run, FILE *output_file);
+uint64_t run_bytes_read(struct run_context const *run);
+void run_sort(uint32_t *values, size_t count);
+void run_select(uint32_t *values, size_t count, size_t k);
+bool run_sample_file(
+        int fd, uint64_t num_values, uint64_t total_values, size_t total_samples, uint32_t *samples,
+        size_t *num_samples);
+bool run_find_lower_bound(int fd, uint64_t low, uint64_t high, uint32_t value, uint64_t *bound);
 void run_delete(struct run_context *run);
 
 #endif // RUN_H
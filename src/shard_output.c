@@ -0,0 +1,353 @@
+#include "shard_output.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bigsort.h"
+#include "merge.h"
+#include "run.h"
+
+struct shard_context {
+    char const *output_filename;
+    size_t num_shards;
+    size_t num_runs;
+
+    // The runs that the shards are merged from, and where each shard's range is in each of them. Shard s's range of
+    // run r is [bounds[r * (num_shards + 1) + s], bounds[r * (num_shards + 1) + s + 1]).
+    int *run_fds;
+    uint64_t *bounds;
+
+    // A merge, and room for a shard's extents, per thread that merges.
+    size_t num_mergers;
+    struct merge_context **merges;
+    struct merge_extent *extents;
+    int *extent_fds;
+
+    atomic_size_t next_shard;
+    atomic_bool failed;
+};
+
+static bool open_runs(struct shard_context *shards, char const *base_filename, size_t generation);
+
+static bool choose_splitters(struct shard_context const *shards, uint32_t *splitters);
+
+static bool find_shard_bounds(struct shard_context *shards, uint32_t const *splitters);
+
+static void merge_shards(void *context, size_t thread_index);
+
+static bool merge_shard(struct shard_context *shards, size_t shard, size_t thread_index);
+
+static bool write_shard_manifest(struct shard_context const *shards, uint32_t const *splitters);
+
+static void remove_runs(char const *base_filename, size_t generation, size_t num_runs);
+
+static void format_part_filename(char *buffer, size_t buffer_size, char const *output_filename, size_t shard);
+
+
+/*
+ * Merges the runs into num_shards part files, "[output_filename].part.[shard]", instead of a single output file. The
+ * parts split the key range between them: every value in a part is smaller than every value in the next one, so
+ * reading the parts in order reads the sorted output, and a consumer can take a part without coordinating offsets.
+ *
+ * The runs are first merged down to as many as the pool's threads can all merge at once in their share of the arena.
+ * The remaining runs are then sampled to pick splitters that balance the parts, every run is binary-searched for them,
+ * and the pool merges each part from its range of every run, one writer per part. Finally, a manifest of the parts,
+ * "[output_filename].shards", lists each part's file, key range and number of values, one part per line.
+ *
+ * The pool's thread count bounds the memory per merge, so fewer threads leave more memory for each.
+ */
+bool shard_output(
+        char const *base_filename, size_t num_runs, char const *output_filename, size_t num_shards,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, struct thread_pool *pool,
+        struct progress *progress, size_t *generations)
+{
+    assert(base_filename);
+    assert(output_filename);
+    assert(num_shards > 0);
+    assert(arena);
+    assert(pool);
+    assert(generations);
+
+    // Each thread that merges a part at the same time needs a merge of its own, which takes an input per run.
+    size_t const num_threads = thread_pool_get_num_threads(pool);
+    size_t const num_mergers = (num_threads < num_shards) ? num_threads : num_shards;
+    size_t const per_input_size = merge_memory_required(1, block_size) - merge_memory_required(0, block_size);
+    size_t const share_size = arena_available(arena, ARENA_CACHE_LINE_ALIGNMENT) / num_mergers;
+    size_t max_inputs = (share_size > merge_memory_required(0, block_size))
+                        ? (share_size - merge_memory_required(0, block_size)) / per_input_size : 0;
+    if ((max_files_per_merge != 0) && (max_inputs > max_files_per_merge)) {
+        max_inputs = max_files_per_merge;
+    }
+    if (max_inputs < 2) {
+        fprintf(stderr, "ERROR: working memory is too small to merge %lu shards at once.\n", num_mergers);
+        remove_runs(base_filename, 0, num_runs);
+        return false;
+    }
+
+    size_t generation = 0;
+    size_t remaining_runs = 0;
+    if (!reduce_runs(
+            base_filename, num_runs, arena, max_files_per_merge, block_size, max_inputs, 0,
+            NULL, progress, &generation, &remaining_runs)) {
+        return false;
+    }
+    *generations = generation + 1;
+    progress_plan_merge(progress, *generations);
+    progress_begin_generation(progress, *generations);
+
+    struct shard_context shards = {
+            .output_filename = output_filename,
+            .num_shards = num_shards,
+            .num_runs = remaining_runs,
+            .num_mergers = num_mergers};
+    atomic_init(&shards.next_shard, 0);
+    atomic_init(&shards.failed, false);
+    shards.run_fds = (int *) malloc(remaining_runs * sizeof(int));
+    shards.bounds = (uint64_t *) calloc(remaining_runs * (num_shards + 1), sizeof(uint64_t));
+    shards.merges = (struct merge_context **) calloc(num_mergers, sizeof(struct merge_context *));
+    shards.extents = (struct merge_extent *) malloc(num_mergers * remaining_runs * sizeof(struct merge_extent));
+    shards.extent_fds = (int *) malloc(num_mergers * remaining_runs * sizeof(int));
+    uint32_t *splitters = (uint32_t *) calloc(num_shards, sizeof(uint32_t));
+    for (size_t r = 0; shards.run_fds && (r < remaining_runs); r++) {
+        shards.run_fds[r] = -1;
+    }
+    bool success = shards.run_fds && shards.bounds && shards.merges && shards.extents && shards.extent_fds &&
+                   splitters && open_runs(&shards, base_filename, generation);
+
+    // Pick the splitters and find each part's range in every run.
+    success = success && choose_splitters(&shards, splitters) && find_shard_bounds(&shards, splitters);
+
+    // Merge the parts in parallel. The merges are carved out of the arena up front, since it isn't shared safely.
+    size_t const arena_mark_before_merges = arena_mark(arena);
+    for (size_t i = 0; success && (i < num_mergers); i++) {
+        shards.merges[i] = merge_new(arena, block_size, remaining_runs);
+        success = (shards.merges[i] != NULL) && (merge_get_max_input_files(shards.merges[i]) >= remaining_runs);
+        if (!success) {
+            fprintf(stderr, "ERROR: working memory is too small to merge %lu shards at once.\n", num_mergers);
+        }
+    }
+    if (success) {
+        thread_pool_run(pool, merge_shards, &shards);
+        success = !atomic_load(&shards.failed);
+    }
+    for (size_t i = 0; shards.merges && (i < num_mergers); i++) {
+        merge_delete(shards.merges[i]);
+    }
+    arena_release(arena, arena_mark_before_merges);
+
+    success = success && write_shard_manifest(&shards, splitters);
+    if (success) {
+        uint64_t total_values = 0;
+        for (size_t r = 0; r < remaining_runs; r++) {
+            total_values += shards.bounds[(r * (num_shards + 1)) + num_shards];
+        }
+        progress_update(progress, total_values * sizeof(uint32_t));
+        progress_finish(progress);
+    } else {
+        char filename[PATH_MAX] = {0};
+        for (size_t s = 0; s < num_shards; s++) {
+            format_part_filename(filename, sizeof(filename), output_filename, s);
+            remove(filename);
+        }
+    }
+
+    // The runs are only read by the part merges, so they're removed once all of those are done.
+    for (size_t r = 0; shards.run_fds && (r < remaining_runs); r++) {
+        if (shards.run_fds[r] >= 0) {
+            close(shards.run_fds[r]);
+        }
+    }
+    remove_runs(base_filename, generation, remaining_runs);
+    free(splitters);
+    free(shards.extent_fds);
+    free(shards.extents);
+    free(shards.merges);
+    free(shards.bounds);
+    free(shards.run_fds);
+    return success;
+}
+
+static bool open_runs(struct shard_context *shards, char const *base_filename, size_t generation)
+{
+    char run_filename[PATH_MAX] = {0};
+    for (size_t r = 0; r < shards->num_runs; r++) {
+        snprintf(run_filename, sizeof(run_filename), "%s.%lu.%lu", base_filename, generation, r);
+        shards->run_fds[r] = open(run_filename, O_RDONLY);
+        struct stat run_status = {0};
+        if ((shards->run_fds[r] < 0) || (fstat(shards->run_fds[r], &run_status) != 0)) {
+            fprintf(stderr, "ERROR: unable to open run file: %s\n", strerror(errno));
+            return false;
+        }
+        // Every part's range starts at the beginning of the run and ends at its end until the splitters are known.
+        shards->bounds[(r * (shards->num_shards + 1)) + shards->num_shards] =
+                (uint64_t) run_status.st_size / sizeof(uint32_t);
+    }
+    return true;
+}
+
+/*
+ * Samples the runs (see run_sample_file()) and picks the splitters between the parts from the sample. Part s gets the
+ * values v with splitters[s - 1] <= v < splitters[s].
+ */
+static bool choose_splitters(struct shard_context const *shards, uint32_t *splitters)
+{
+    size_t const num_shards = shards->num_shards;
+    uint64_t total_values = 0;
+    for (size_t r = 0; r < shards->num_runs; r++) {
+        total_values += shards->bounds[(r * (num_shards + 1)) + num_shards];
+    }
+    if ((num_shards == 1) || (total_values == 0)) {
+        return true;
+    }
+
+    size_t const target_samples = RUN_SAMPLES_PER_PART * num_shards;
+    uint32_t *samples = (uint32_t *) malloc((target_samples + shards->num_runs) * sizeof(uint32_t));
+    if (!samples) {
+        return false;
+    }
+    size_t num_samples = 0;
+    bool success = true;
+    for (size_t r = 0; success && (r < shards->num_runs); r++) {
+        uint64_t const run_values = shards->bounds[(r * (num_shards + 1)) + num_shards];
+        size_t run_samples = 0;
+        success = run_sample_file(
+                shards->run_fds[r], run_values, total_values, target_samples, samples + num_samples, &run_samples);
+        num_samples += run_samples;
+    }
+    if (success) {
+        run_sort(samples, num_samples);
+        for (size_t s = 1; s < num_shards; s++) {
+            splitters[s - 1] = samples[(s * num_samples) / num_shards];
+        }
+    } else {
+        fprintf(stderr, "ERROR: unable to sample run file: %s\n", strerror(errno));
+    }
+    free(samples);
+    return success;
+}
+
+/*
+ * Finds each part's range in every run. Each bound is the first value that's at least the splitter.
+ */
+static bool find_shard_bounds(struct shard_context *shards, uint32_t const *splitters)
+{
+    size_t const num_shards = shards->num_shards;
+    bool success = true;
+    for (size_t r = 0; success && (r < shards->num_runs); r++) {
+        uint64_t *bounds = shards->bounds + (r * (num_shards + 1));
+        bounds[0] = 0;
+        for (size_t s = 1; success && (s < num_shards); s++) {
+            success = run_find_lower_bound(
+                    shards->run_fds[r], bounds[s - 1], bounds[num_shards], splitters[s - 1], bounds + s);
+        }
+    }
+    if (!success) {
+        fprintf(stderr, "ERROR: unable to read run file: %s\n", strerror(errno));
+    }
+    return success;
+}
+
+static void merge_shards(void *context, size_t thread_index)
+{
+    struct shard_context *shards = (struct shard_context *) context;
+    // With fewer parts than threads, the threads without a merge have nothing to do.
+    if (thread_index >= shards->num_mergers) {
+        return;
+    }
+    while (!atomic_load(&shards->failed)) {
+        size_t const shard = atomic_fetch_add(&shards->next_shard, 1);
+        if (shard >= shards->num_shards) {
+            break;
+        }
+        if (!merge_shard(shards, shard, thread_index)) {
+            atomic_store(&shards->failed, true);
+        }
+    }
+}
+
+/*
+ * Merges a part's range of every run into the part's file.
+ */
+static bool merge_shard(struct shard_context *shards, size_t shard, size_t thread_index)
+{
+    struct merge_extent *extents = shards->extents + (thread_index * shards->num_runs);
+    int *fds = shards->extent_fds + (thread_index * shards->num_runs);
+    size_t num_extents = 0;
+    for (size_t r = 0; r < shards->num_runs; r++) {
+        uint64_t const *bounds = shards->bounds + (r * (shards->num_shards + 1));
+        if (bounds[shard + 1] > bounds[shard]) {
+            extents[num_extents].offset = (off_t) (bounds[shard] * sizeof(uint32_t));
+            extents[num_extents].size = (off_t) ((bounds[shard + 1] - bounds[shard]) * sizeof(uint32_t));
+            fds[num_extents] = shards->run_fds[r];
+            num_extents++;
+        }
+    }
+
+    char filename[PATH_MAX] = {0};
+    format_part_filename(filename, sizeof(filename), shards->output_filename, shard);
+    FILE *part_file = fopen(filename, "wb");
+    if (!part_file) {
+        fprintf(stderr, "ERROR: unable to create part file: %s\n", strerror(errno));
+        return false;
+    }
+    // The merge writes whole blocks.
+    setvbuf(part_file, NULL, _IONBF, 0);
+    bool success = (num_extents == 0) ||
+                   merge_perform_range_merge(shards->merges[thread_index], fds, extents, num_extents, part_file, NULL);
+    success = (fclose(part_file) == 0) && success;
+    if (!success) {
+        fprintf(stderr, "ERROR: unable to write part file: %s\n", strerror(errno));
+    }
+    return success;
+}
+
+static bool write_shard_manifest(struct shard_context const *shards, uint32_t const *splitters)
+{
+    char filename[PATH_MAX] = {0};
+    snprintf(filename, sizeof(filename), "%s.shards", shards->output_filename);
+    FILE *manifest_file = fopen(filename, "w");
+    if (!manifest_file) {
+        fprintf(stderr, "ERROR: unable to create shard manifest: %s\n", strerror(errno));
+        return false;
+    }
+
+    // Each line is a part's file, its key range (from the smallest key that it may hold up to, but not including, the
+    // next part's smallest key) and how many values it holds.
+    for (size_t s = 0; s < shards->num_shards; s++) {
+        uint64_t count = 0;
+        for (size_t r = 0; r < shards->num_runs; r++) {
+            uint64_t const *bounds = shards->bounds + (r * (shards->num_shards + 1));
+            count += bounds[s + 1] - bounds[s];
+        }
+        uint64_t const low = (s > 0) ? splitters[s - 1] : 0;
+        uint64_t const end = (s + 1 < shards->num_shards) ? splitters[s] : ((uint64_t) UINT32_MAX + 1);
+        format_part_filename(filename, sizeof(filename), shards->output_filename, s);
+        fprintf(manifest_file, "%s %lu %lu %lu\n", filename, low, end, count);
+    }
+    if (fclose(manifest_file) != 0) {
+        fprintf(stderr, "ERROR: unable to write shard manifest: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void remove_runs(char const *base_filename, size_t generation, size_t num_runs)
+{
+    char run_filename[PATH_MAX] = {0};
+    for (size_t r = 0; r < num_runs; r++) {
+        snprintf(run_filename, sizeof(run_filename), "%s.%lu.%lu", base_filename, generation, r);
+        remove(run_filename);
+    }
+}
+
+static void format_part_filename(char *buffer, size_t buffer_size, char const *output_filename, size_t shard)
+{
+    snprintf(buffer, buffer_size, "%s.part.%lu", output_filename, shard);
+}
+
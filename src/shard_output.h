@@ -0,0 +1,15 @@
+#ifndef SHARD_OUTPUT_H
+#define SHARD_OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "arena.h"
+#include "progress.h"
+#include "thread_pool.h"
+
+bool shard_output(
+        char const *base_filename, size_t num_runs, char const *output_filename, size_t num_shards,
+        struct arena *arena, size_t max_files_per_merge, size_t block_size, struct thread_pool *pool,
+        struct progress *progress, size_t *generations);
+
+#endif // SHARD_OUTPUT_H
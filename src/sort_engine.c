@@ -0,0 +1,497 @@
+#include "sort_engine.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "merge_kernel.h"
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include "bitonic_avx2.h"
+#define SORT_ENGINE_HAVE_AVX2 1
+#else
+#define SORT_ENGINE_HAVE_AVX2 0
+#endif
+
+// The SIMD engine sorts blocks of this many values with a sorting network, i.e. eight AVX2 registers' worth.
+#define SMALL_SORT_VALUES 64
+
+// Radix sorts go a byte at a time.
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+// Choosing an engine times each one on a sample of up to this many values, taking the best of a few tries. Fewer values
+// than this aren't worth timing, and are sorted with the fallback engine, as are values without scratch to probe in.
+static size_t const PROBE_VALUES = (size_t) 1 << 18;
+static int const PROBE_REPETITIONS = 3;
+static enum sort_engine const FALLBACK_ENGINE = SORT_ENGINE_SIMD;
+
+static enum sort_engine default_engine = SORT_ENGINE_AUTO;
+
+static char const *const engine_names[] = {
+        [SORT_ENGINE_AUTO] = "auto",
+        [SORT_ENGINE_QSORT] = "qsort",
+        [SORT_ENGINE_RADIX] = "radix",
+        [SORT_ENGINE_SIMD] = "simd",
+};
+
+static int compare_uint32_t(void const *a, void const *b);
+
+static void radix_sort(uint32_t *values, size_t count, uint32_t *scratch);
+
+static void radix_sort_in_place(uint32_t *values, size_t count, unsigned int shift);
+
+static void simd_sort(uint32_t *values, size_t count, uint32_t *scratch);
+
+static void simd_quicksort(uint32_t *values, size_t count, size_t depth_limit);
+
+static void small_sort(uint32_t *values, size_t count);
+
+static void insertion_sort(uint32_t *values, size_t count);
+
+#if SORT_ENGINE_HAVE_AVX2
+static void sort_64_avx2(uint32_t *values, size_t count);
+#endif
+
+
+char const *sort_engine_get_name(enum sort_engine engine)
+{
+    if ((size_t) engine >= sizeof(engine_names) / sizeof(engine_names[0])) {
+        return "unknown";
+    }
+    return engine_names[engine];
+}
+
+bool sort_engine_from_name(char const *name, enum sort_engine *engine)
+{
+    assert(name);
+    assert(engine);
+    for (size_t i = 0; i < sizeof(engine_names) / sizeof(engine_names[0]); i++) {
+        if (strcmp(name, engine_names[i]) == 0) {
+            *engine = (enum sort_engine) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * The engine that runs are sorted with unless told otherwise. This is SORT_ENGINE_AUTO to begin with.
+ */
+enum sort_engine sort_engine_get_default(void)
+{
+    return default_engine;
+}
+
+void sort_engine_set_default(enum sort_engine engine)
+{
+    default_engine = engine;
+}
+
+/*
+ * Sorts values with the given engine. Scratch, if not NULL, must have room for count values. The radix and SIMD
+ * engines then sort out of place, which is faster. Without it, they sort in place. SORT_ENGINE_AUTO picks an engine
+ * for these particular values with sort_engine_choose() first.
+ *
+ * - qsort: the C library's comparison sort. Never the fastest, but predictable.
+ * - radix: a byte-wise radix sort. Skips bytes that all values share, so it suffers less from a narrow key range, but
+ *   skewed and few-unique data still make its passes unbalanced.
+ * - simd: sorts blocks of 64 values with an AVX2 sorting network (or insertion sort without AVX2), then merges them
+ *   with the merge kernel. Without scratch, it partitions down to blocks with quicksort instead of merging up.
+ */
+void sort_engine_sort(enum sort_engine engine, uint32_t *values, size_t count, uint32_t *scratch)
+{
+    assert(values || (count == 0));
+
+    if (engine == SORT_ENGINE_AUTO) {
+        engine = sort_engine_choose(values, count, scratch);
+    }
+    switch (engine) {
+        case SORT_ENGINE_RADIX:
+            radix_sort(values, count, scratch);
+            break;
+        case SORT_ENGINE_SIMD:
+            simd_sort(values, count, scratch);
+            break;
+        case SORT_ENGINE_QSORT:
+        case SORT_ENGINE_AUTO:
+        default:
+            qsort(values, count, sizeof(uint32_t), compare_uint32_t);
+            break;
+    }
+}
+
+/*
+ * Picks the engine that sorts a sample of the values the fastest. The sample is taken at evenly spaced positions so
+ * that it has the same distribution of keys, and sorted out of place, as the values will be. The sample, a copy of it
+ * to sort, and scratch to sort that with all fit in scratch, which must have room for count values. Its contents are
+ * overwritten. Without scratch, or with fewer than PROBE_VALUES values, this is FALLBACK_ENGINE without probing.
+ */
+enum sort_engine sort_engine_choose(uint32_t const *values, size_t count, uint32_t *scratch)
+{
+    assert(values || (count == 0));
+
+    if (!scratch || (count < PROBE_VALUES)) {
+        return FALLBACK_ENGINE;
+    }
+    size_t const sample_count = (count / 3 < PROBE_VALUES) ? count / 3 : PROBE_VALUES;
+    uint32_t *sample = scratch;
+    uint32_t *work = sample + sample_count;
+    uint32_t *work_scratch = work + sample_count;
+    for (size_t i = 0; i < sample_count; i++) {
+        sample[i] = values[(i * count) / sample_count];
+    }
+
+    enum sort_engine const candidates[] = {SORT_ENGINE_RADIX, SORT_ENGINE_SIMD, SORT_ENGINE_QSORT};
+    enum sort_engine best = SORT_ENGINE_RADIX;
+    double best_seconds = -1.0;
+    for (size_t c = 0; c < sizeof(candidates) / sizeof(candidates[0]); c++) {
+        for (int repetition = 0; repetition < PROBE_REPETITIONS; repetition++) {
+            memcpy(work, sample, sample_count * sizeof(uint32_t));
+            double const start = util_now_seconds();
+            sort_engine_sort(candidates[c], work, sample_count, work_scratch);
+            double const seconds = util_now_seconds() - start;
+            if ((best_seconds < 0.0) || (seconds < best_seconds)) {
+                best_seconds = seconds;
+                best = candidates[c];
+            } else if (seconds > 2.0 * best_seconds) {
+                // Far behind; another try won't change the outcome.
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+static int compare_uint32_t(void const *a, void const *b)
+{
+    uint32_t const value_a = *(uint32_t const *) a;
+    uint32_t const value_b = *(uint32_t const *) b;
+    return (value_a > value_b) - (value_a < value_b);
+}
+
+/*
+ * Least significant byte first, ping-ponging between values and scratch. All four byte histograms are gathered in one
+ * pass up front, which also shows which bytes all values share so that their passes can be skipped.
+ */
+static void radix_sort(uint32_t *values, size_t count, uint32_t *scratch)
+{
+    if (!scratch) {
+        radix_sort_in_place(values, count, 32 - RADIX_BITS);
+        return;
+    }
+    if (count < 2) {
+        return;
+    }
+
+    size_t counts[sizeof(uint32_t)][RADIX_BUCKETS];
+    memset(counts, 0, sizeof(counts));
+    for (size_t i = 0; i < count; i++) {
+        uint32_t const value = values[i];
+        for (size_t pass = 0; pass < sizeof(uint32_t); pass++) {
+            counts[pass][(value >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1)]++;
+        }
+    }
+
+    uint32_t *source = values;
+    uint32_t *destination = scratch;
+    for (size_t pass = 0; pass < sizeof(uint32_t); pass++) {
+        unsigned int const shift = (unsigned int) (pass * RADIX_BITS);
+        if (counts[pass][(values[0] >> shift) & (RADIX_BUCKETS - 1)] == count) {
+            continue;
+        }
+        size_t offsets[RADIX_BUCKETS];
+        size_t offset = 0;
+        for (size_t bucket = 0; bucket < RADIX_BUCKETS; bucket++) {
+            offsets[bucket] = offset;
+            offset += counts[pass][bucket];
+        }
+        for (size_t i = 0; i < count; i++) {
+            uint32_t const value = source[i];
+            destination[offsets[(value >> shift) & (RADIX_BUCKETS - 1)]++] = value;
+        }
+        uint32_t *const swap = source;
+        source = destination;
+        destination = swap;
+    }
+    if (source != values) {
+        memcpy(values, source, count * sizeof(uint32_t));
+    }
+}
+
+/*
+ * Most significant byte first, permuting values into their buckets in place by following cycles (American flag sort),
+ * and then sorting each bucket by the next byte.
+ */
+static void radix_sort_in_place(uint32_t *values, size_t count, unsigned int shift)
+{
+    if (count <= SMALL_SORT_VALUES) {
+        insertion_sort(values, count);
+        return;
+    }
+
+    size_t counts[RADIX_BUCKETS] = {0};
+    for (size_t i = 0; i < count; i++) {
+        counts[(values[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+    }
+
+    size_t heads[RADIX_BUCKETS];
+    size_t tails[RADIX_BUCKETS];
+    size_t offset = 0;
+    for (size_t bucket = 0; bucket < RADIX_BUCKETS; bucket++) {
+        heads[bucket] = offset;
+        offset += counts[bucket];
+        tails[bucket] = offset;
+    }
+    for (size_t bucket = 0; bucket < RADIX_BUCKETS; bucket++) {
+        while (heads[bucket] < tails[bucket]) {
+            uint32_t value = values[heads[bucket]];
+            size_t digit = (value >> shift) & (RADIX_BUCKETS - 1);
+            while (digit != bucket) {
+                uint32_t const displaced = values[heads[digit]];
+                values[heads[digit]++] = value;
+                value = displaced;
+                digit = (value >> shift) & (RADIX_BUCKETS - 1);
+            }
+            values[heads[bucket]++] = value;
+        }
+    }
+
+    if (shift == 0) {
+        return;
+    }
+    size_t start = 0;
+    for (size_t bucket = 0; bucket < RADIX_BUCKETS; bucket++) {
+        if (counts[bucket] > 1) {
+            radix_sort_in_place(values + start, counts[bucket], shift - RADIX_BITS);
+        }
+        start += counts[bucket];
+    }
+}
+
+static void simd_sort(uint32_t *values, size_t count, uint32_t *scratch)
+{
+    if (!scratch) {
+        // Quicksort's recursion is allowed twice the ideal depth before the rest is handed to the radix sort.
+        size_t depth_limit = 0;
+        for (size_t n = count; n > 1; n >>= 1) {
+            depth_limit += 2;
+        }
+        simd_quicksort(values, count, depth_limit);
+        return;
+    }
+
+    // Sort small blocks, and then merge them into ever larger ones, alternating between values and scratch.
+    for (size_t start = 0; start < count; start += SMALL_SORT_VALUES) {
+        size_t const block_count = (count - start < SMALL_SORT_VALUES) ? count - start : SMALL_SORT_VALUES;
+        small_sort(values + start, block_count);
+    }
+    uint32_t *source = values;
+    uint32_t *destination = scratch;
+    for (size_t width = SMALL_SORT_VALUES; width < count; width *= 2) {
+        for (size_t start = 0; start < count; start += 2 * width) {
+            size_t const middle = (count - start < width) ? count : start + width;
+            size_t const end = (count - middle < width) ? count : middle + width;
+            merge_kernel_merge(source + start, middle - start, source + middle, end - middle, destination + start);
+        }
+        uint32_t *const swap = source;
+        source = destination;
+        destination = swap;
+    }
+    if (source != values) {
+        memcpy(values, source, count * sizeof(uint32_t));
+    }
+}
+
+static void simd_quicksort(uint32_t *values, size_t count, size_t depth_limit)
+{
+    while (count > SMALL_SORT_VALUES) {
+        if (depth_limit == 0) {
+            radix_sort_in_place(values, count, 32 - RADIX_BITS);
+            return;
+        }
+        depth_limit--;
+
+        // Hoare partition around the median of the first, middle and last values.
+        uint32_t const first = values[0];
+        uint32_t const middle = values[count / 2];
+        uint32_t const last = values[count - 1];
+        uint32_t pivot = middle;
+        if ((first <= middle) == (middle <= last)) {
+            pivot = middle;
+        } else if ((middle <= first) == (first <= last)) {
+            pivot = first;
+        } else {
+            pivot = last;
+        }
+        size_t i = 0;
+        size_t j = count - 1;
+        for (;;) {
+            while (values[i] < pivot) {
+                i++;
+            }
+            while (values[j] > pivot) {
+                j--;
+            }
+            if (i >= j) {
+                break;
+            }
+            uint32_t const swap = values[i];
+            values[i++] = values[j];
+            values[j--] = swap;
+        }
+
+        // [0, j] and [j + 1, count). Recurse into the smaller side and loop on the larger one to bound the stack.
+        size_t const left_count = j + 1;
+        if (left_count < count - left_count) {
+            simd_quicksort(values, left_count, depth_limit);
+            values += left_count;
+            count -= left_count;
+        } else {
+            simd_quicksort(values + left_count, count - left_count, depth_limit);
+            count = left_count;
+        }
+    }
+    small_sort(values, count);
+}
+
+static void small_sort(uint32_t *values, size_t count)
+{
+    assert(count <= SMALL_SORT_VALUES);
+#if SORT_ENGINE_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        sort_64_avx2(values, count);
+        return;
+    }
+#endif
+    insertion_sort(values, count);
+}
+
+static void insertion_sort(uint32_t *values, size_t count)
+{
+    for (size_t i = 1; i < count; i++) {
+        uint32_t const value = values[i];
+        size_t j = i;
+        while ((j > 0) && (values[j - 1] > value)) {
+            values[j] = values[j - 1];
+            j--;
+        }
+        values[j] = value;
+    }
+}
+
+#if SORT_ENGINE_HAVE_AVX2
+
+__attribute__((target("avx2")))
+static inline void compare_exchange(__m256i *a, __m256i *b)
+{
+    __m256i const low = _mm256_min_epu32(*a, *b);
+    *b = _mm256_max_epu32(*a, *b);
+    *a = low;
+}
+
+/*
+ * Sorts a bitonic sequence that spans count registers, where count is a power of two. Registers are compare-exchanged
+ * at halving distances, and then each register is sorted within itself.
+ */
+__attribute__((target("avx2")))
+static inline void bitonic_sort_registers(__m256i *registers, size_t count)
+{
+    for (size_t distance = count / 2; distance > 0; distance /= 2) {
+        for (size_t i = 0; i < count; i++) {
+            if ((i & distance) == 0) {
+                compare_exchange(&registers[i], &registers[i + distance]);
+            }
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        registers[i] = bitonic_sort_8(registers[i]);
+    }
+}
+
+/*
+ * Merges two sorted sequences of count registers each, which lie next to each other in registers.
+ */
+__attribute__((target("avx2")))
+static inline void bitonic_merge_registers(__m256i *registers, size_t count)
+{
+    __m256i *const a = registers;
+    __m256i *const b = registers + count;
+    __m256i reversed[4];
+    for (size_t i = 0; i < count; i++) {
+        reversed[i] = bitonic_reverse_8(b[count - 1 - i]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        b[i] = _mm256_max_epu32(a[i], reversed[i]);
+        a[i] = _mm256_min_epu32(a[i], reversed[i]);
+    }
+    bitonic_sort_registers(a, count);
+    bitonic_sort_registers(b, count);
+}
+
+/*
+ * Sorts up to 64 values in eight registers. Sorting down the columns with an optimal 19-comparator network and then
+ * transposing leaves each register sorted. Bitonic merges then combine them, two registers at a time, then four, then
+ * all eight. Missing values are padded with the largest possible value so that they sort to the end.
+ */
+__attribute__((target("avx2")))
+static void sort_64_avx2(uint32_t *values, size_t count)
+{
+    uint32_t padded[SMALL_SORT_VALUES];
+    memcpy(padded, values, count * sizeof(uint32_t));
+    for (size_t i = count; i < SMALL_SORT_VALUES; i++) {
+        padded[i] = UINT32_MAX;
+    }
+    __m256i r[8];
+    for (size_t i = 0; i < 8; i++) {
+        r[i] = _mm256_loadu_si256((__m256i const *) (padded + (i * AVX2_VALUES)));
+    }
+
+    static unsigned char const network[19][2] = {
+            {0, 2}, {1, 3}, {4, 6}, {5, 7},
+            {0, 4}, {1, 5}, {2, 6}, {3, 7},
+            {0, 1}, {2, 3}, {4, 5}, {6, 7},
+            {2, 4}, {3, 5},
+            {1, 4}, {3, 6},
+            {1, 2}, {3, 4}, {5, 6}};
+    for (size_t i = 0; i < 19; i++) {
+        compare_exchange(&r[network[i][0]], &r[network[i][1]]);
+    }
+
+    __m256i const t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i const t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i const t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i const t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i const t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    __m256i const t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i const t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    __m256i const t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+    __m256i const u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i const u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i const u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i const u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i const u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i const u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i const u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i const u7 = _mm256_unpackhi_epi64(t5, t7);
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+
+    for (size_t width = 1; width < 8; width *= 2) {
+        for (size_t i = 0; i < 8; i += 2 * width) {
+            bitonic_merge_registers(r + i, width);
+        }
+    }
+
+    for (size_t i = 0; i < 8; i++) {
+        _mm256_storeu_si256((__m256i *) (padded + (i * AVX2_VALUES)), r[i]);
+    }
+    memcpy(values, padded, count * sizeof(uint32_t));
+}
+
+#endif
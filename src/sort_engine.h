@@ -0,0 +1,27 @@
+#ifndef SORT_ENGINE_H
+#define SORT_ENGINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum sort_engine {
+    SORT_ENGINE_AUTO = 0,
+    SORT_ENGINE_QSORT,
+    SORT_ENGINE_RADIX,
+    SORT_ENGINE_SIMD
+};
+
+char const *sort_engine_get_name(enum sort_engine engine);
+
+bool sort_engine_from_name(char const *name, enum sort_engine *engine);
+
+enum sort_engine sort_engine_get_default(void);
+
+void sort_engine_set_default(enum sort_engine engine);
+
+void sort_engine_sort(enum sort_engine engine, uint32_t *values, size_t count, uint32_t *scratch);
+
+enum sort_engine sort_engine_choose(uint32_t const *values, size_t count, uint32_t *scratch);
+
+#endif // SORT_ENGINE_H
@@ -0,0 +1,308 @@
+#include "sorted_view.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fence_index.h"
+#include "io_util.h"
+#include "min_heap.h"
+
+struct view_run {
+    int fd;
+    struct fence_index *index;
+};
+
+struct sorted_view {
+    struct view_run *runs;
+    size_t num_runs;
+    uint64_t num_values;
+
+    // The largest index interval of any run, which is a block's worth of values, and a block to seek with.
+    size_t block_values;
+    uint32_t *block;
+};
+
+// Where a range is up to in a single run: the values in [position, end) are still to be read, and the ones in the
+// block from next on have been read but not merged.
+struct range_cursor {
+    int fd;
+    uint64_t position;
+    uint64_t end;
+    uint32_t *block;
+    size_t block_size;
+    size_t next;
+};
+
+struct sorted_view_range {
+    struct range_cursor *cursors;
+    size_t num_cursors;
+    uint32_t *blocks;
+    void *heap_data;
+    struct min_heap *heap;
+    uint64_t count;
+};
+
+static bool open_run(struct view_run *run, char const *base_filename, size_t run_number, bool *found);
+
+static bool refill_cursor(struct range_cursor *cursor, size_t block_values);
+
+
+/*
+ * Opens the initial runs that create_runs() left behind under base_filename, along with the sparse index that it
+ * wrote for each of them (see struct run_options' index_interval), as a single sorted view of their values. Nothing is
+ * merged up front. Each range that's asked for is found in every run with its index, and only that range is merged.
+ */
+struct sorted_view *sorted_view_open(char const *base_filename)
+{
+    assert(base_filename);
+
+    struct sorted_view *view = (struct sorted_view *) calloc(1, sizeof(struct sorted_view));
+    if (!view) {
+        return NULL;
+    }
+
+    // The runs are numbered from zero, so they're found by counting up until one is missing.
+    size_t capacity = 0;
+    while (true) {
+        if (view->num_runs == capacity) {
+            capacity = (capacity > 0) ? (capacity * 2) : 16;
+            struct view_run *runs = (struct view_run *) realloc(view->runs, capacity * sizeof(struct view_run));
+            if (!runs) {
+                sorted_view_close(view);
+                return NULL;
+            }
+            view->runs = runs;
+        }
+        bool found = false;
+        if (!open_run(&view->runs[view->num_runs], base_filename, view->num_runs, &found)) {
+            sorted_view_close(view);
+            return NULL;
+        }
+        if (!found) {
+            break;
+        }
+        struct view_run const *run = &view->runs[view->num_runs];
+        view->num_values += fence_index_get_num_values(run->index);
+        uint64_t const interval = fence_index_get_interval(run->index);
+        if (interval > view->block_values) {
+            view->block_values = (size_t) interval;
+        }
+        view->num_runs++;
+    }
+    if (view->num_runs == 0) {
+        fprintf(stderr, "ERROR: there are no runs named %s.0.*\n", base_filename);
+        sorted_view_close(view);
+        return NULL;
+    }
+
+    view->block = (uint32_t *) malloc(view->block_values * sizeof(uint32_t));
+    if (!view->block) {
+        sorted_view_close(view);
+        return NULL;
+    }
+    return view;
+}
+
+size_t sorted_view_get_num_runs(struct sorted_view const *view)
+{
+    assert(view);
+    return view->num_runs;
+}
+
+uint64_t sorted_view_get_num_values(struct sorted_view const *view)
+{
+    assert(view);
+    return view->num_values;
+}
+
+/*
+ * Starts reading the values from low to high, inclusive, in order. Each run is searched for both ends of the range,
+ * which takes a block read per end, and the range is then merged from the runs a block at a time as it's read (see
+ * sorted_view_range_read()). The range holds a block of memory per run that has values in it until it's deleted.
+ */
+struct sorted_view_range *sorted_view_seek(struct sorted_view *view, uint32_t low, uint32_t high)
+{
+    assert(view);
+
+    struct sorted_view_range *range = (struct sorted_view_range *) calloc(1, sizeof(struct sorted_view_range));
+    if (!range) {
+        return NULL;
+    }
+    range->cursors = (struct range_cursor *) calloc(view->num_runs, sizeof(struct range_cursor));
+    if (!range->cursors) {
+        sorted_view_range_delete(range);
+        return NULL;
+    }
+
+    // Find where the range starts and ends in each run. Runs that have none of it are left out.
+    for (size_t i = 0; (i < view->num_runs) && (low <= high); i++) {
+        struct view_run const *run = &view->runs[i];
+        uint64_t begin = 0;
+        uint64_t end = fence_index_get_num_values(run->index);
+        if (!fence_index_find(run->index, run->fd, low, view->block, &begin) ||
+            ((high < UINT32_MAX) && !fence_index_find(run->index, run->fd, high + 1, view->block, &end))) {
+            sorted_view_range_delete(range);
+            return NULL;
+        }
+        if (end > begin) {
+            struct range_cursor *cursor = &range->cursors[range->num_cursors];
+            cursor->fd = run->fd;
+            cursor->position = begin;
+            cursor->end = end;
+            range->num_cursors++;
+            range->count += end - begin;
+        }
+    }
+
+    // Fill each cursor's block, and start the merge with the first value of each.
+    size_t const heap_data_size = range->num_cursors * sizeof(struct min_heap_element);
+    range->blocks = (uint32_t *) malloc(range->num_cursors * view->block_values * sizeof(uint32_t));
+    range->heap_data = malloc(heap_data_size);
+    range->heap = range->heap_data ? min_heap_new(range->heap_data, heap_data_size) : NULL;
+    if ((range->num_cursors > 0) && (!range->blocks || !range->heap)) {
+        sorted_view_range_delete(range);
+        return NULL;
+    }
+    for (size_t i = 0; i < range->num_cursors; i++) {
+        struct range_cursor *cursor = &range->cursors[i];
+        cursor->block = range->blocks + (i * view->block_values);
+        if (!refill_cursor(cursor, view->block_values)) {
+            sorted_view_range_delete(range);
+            return NULL;
+        }
+        min_heap_add(range->heap, cursor->block[0], (uint32_t) i);
+    }
+    return range;
+}
+
+/*
+ * Gets the number of values in the range, which is known as soon as it has been sought.
+ */
+uint64_t sorted_view_range_get_count(struct sorted_view_range const *range)
+{
+    assert(range);
+    return range->count;
+}
+
+/*
+ * Reads the next values of the range, in order, into values. num_read is set to how many were read, which is only less
+ * than max_values once the range runs out.
+ */
+bool sorted_view_range_read(
+        struct sorted_view_range *range, uint32_t *values, size_t max_values, size_t *num_read)
+{
+    assert(range);
+    assert(values);
+    assert(num_read);
+
+    *num_read = 0;
+    uint32_t key = 0;
+    uint32_t cursor_index = 0;
+    while ((*num_read < max_values) && range->heap && min_heap_pop(range->heap, &key, &cursor_index)) {
+        values[(*num_read)++] = key;
+        struct range_cursor *cursor = &range->cursors[cursor_index];
+        cursor->next++;
+        if ((cursor->next == cursor->block_size) && (cursor->position < cursor->end)) {
+            if (!refill_cursor(cursor, cursor->block_size)) {
+                return false;
+            }
+        }
+        if (cursor->next < cursor->block_size) {
+            min_heap_add(range->heap, cursor->block[cursor->next], cursor_index);
+        }
+    }
+    return true;
+}
+
+void sorted_view_range_delete(struct sorted_view_range *range)
+{
+    if (range) {
+        min_heap_delete(range->heap);
+        free(range->heap_data);
+        free(range->blocks);
+        free(range->cursors);
+        free(range);
+    }
+}
+
+void sorted_view_close(struct sorted_view *view)
+{
+    if (view) {
+        for (size_t i = 0; i < view->num_runs; i++) {
+            close(view->runs[i].fd);
+            fence_index_close(view->runs[i].index);
+        }
+        free(view->runs);
+        free(view->block);
+        free(view);
+    }
+}
+
+/*
+ * Removes the runs under base_filename and their indexes, which create_runs() left behind for sorted_view_open() to
+ * find, so that a new set of runs doesn't get mixed up with the remains of an earlier one.
+ */
+void sorted_view_remove(char const *base_filename)
+{
+    assert(base_filename);
+
+    char filename[PATH_MAX] = {0};
+    for (size_t run_number = 0;; run_number++) {
+        snprintf(filename, sizeof(filename), "%s.0.%lu", base_filename, run_number);
+        bool removed = (remove(filename) == 0);
+        snprintf(filename, sizeof(filename), "%s.idx.0.%lu", base_filename, run_number);
+        removed = (remove(filename) == 0) || removed;
+        if (!removed) {
+            break;
+        }
+    }
+}
+
+/*
+ * Opens a run and its index. found is cleared, and true is returned, if there's no such run.
+ */
+static bool open_run(struct view_run *run, char const *base_filename, size_t run_number, bool *found)
+{
+    char filename[PATH_MAX] = {0};
+    snprintf(filename, sizeof(filename), "%s.0.%lu", base_filename, run_number);
+    run->fd = open(filename, O_RDONLY);
+    if (run->fd < 0) {
+        *found = false;
+        if (errno == ENOENT) {
+            return true;
+        }
+        fprintf(stderr, "ERROR: unable to open run %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+
+    snprintf(filename, sizeof(filename), "%s.idx.0.%lu", base_filename, run_number);
+    run->index = fence_index_open(filename, run->fd);
+    if (!run->index) {
+        close(run->fd);
+        return false;
+    }
+    *found = true;
+    return true;
+}
+
+/*
+ * Reads the cursor's next block of the range.
+ */
+static bool refill_cursor(struct range_cursor *cursor, size_t block_values)
+{
+    uint64_t const remaining = cursor->end - cursor->position;
+    size_t const num_values = (remaining < block_values) ? (size_t) remaining : block_values;
+    uint64_t const offset = cursor->position * sizeof(uint32_t);
+    if (!io_pread_fully(cursor->fd, cursor->block, num_values * sizeof(uint32_t), offset)) {
+        fprintf(stderr, "ERROR: unable to read run: %s\n", strerror(errno));
+        return false;
+    }
+    cursor->position += num_values;
+    cursor->block_size = num_values;
+    cursor->next = 0;
+    return true;
+}
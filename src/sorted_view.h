@@ -0,0 +1,31 @@
+#ifndef SORTED_VIEW_H
+#define SORTED_VIEW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct sorted_view;
+
+struct sorted_view_range;
+
+struct sorted_view *sorted_view_open(char const *base_filename);
+
+size_t sorted_view_get_num_runs(struct sorted_view const *view);
+
+uint64_t sorted_view_get_num_values(struct sorted_view const *view);
+
+struct sorted_view_range *sorted_view_seek(struct sorted_view *view, uint32_t low, uint32_t high);
+
+uint64_t sorted_view_range_get_count(struct sorted_view_range const *range);
+
+bool sorted_view_range_read(
+        struct sorted_view_range *range, uint32_t *values, size_t max_values, size_t *num_read);
+
+void sorted_view_range_delete(struct sorted_view_range *range);
+
+void sorted_view_close(struct sorted_view *view);
+
+void sorted_view_remove(char const *base_filename);
+
+#endif // SORTED_VIEW_H
@@ -0,0 +1,354 @@
+#include "sorter.h"
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bigsort.h"
+#include "merge.h"
+#include "run.h"
+
+enum sorter_state {
+    SORTER_PUSHING = 0,
+    SORTER_IN_MEMORY,
+    SORTER_MERGING,
+    SORTER_FAILED
+};
+
+struct sorter {
+    enum sorter_state state;
+
+    struct arena *arena;
+    size_t arena_mark;
+    size_t fan_in;
+    size_t block_size;
+
+    // Unique base name for temporary run files. The empty file with this name reserves it until the sorter is deleted.
+    char base_filename[PATH_MAX];
+    bool base_file_created;
+
+    // Values collect here until they're spilled or, if they all fit, sorted in place and handed out.
+    uint32_t *run_data;
+    size_t run_capacity;
+    size_t run_count;
+    size_t run_position;
+
+    // Runs that have been spilled to disk, and the generation and number of runs that are left once they've been
+    // merged down to a single merge's worth.
+    size_t num_runs;
+    size_t final_generation;
+    size_t num_final_runs;
+
+    // The final merge. The run files are unlinked once they're open so they disappear along with the sorter.
+    struct merge_context *merge;
+    FILE **merge_files;
+    size_t num_merge_files;
+};
+
+static bool spill_run(struct sorter *sorter);
+
+static bool begin_final_merge(struct sorter *sorter);
+
+static void close_merge_files(struct sorter *sorter);
+
+static void remove_all_runs(struct sorter const *sorter);
+
+static bool format_run_filename(
+        char *buffer, size_t buffer_size, struct sorter const *sorter, size_t generation, size_t run_number);
+
+
+struct sorter *sorter_new(struct arena *arena, struct sort_plan const *plan, char const *temp_directory)
+{
+    assert(arena);
+    assert(plan);
+    assert(temp_directory);
+
+    struct sorter *sorter = (struct sorter *) malloc(sizeof(struct sorter));
+    if (!sorter) {
+        return NULL;
+    }
+    sorter->state = SORTER_PUSHING;
+    sorter->arena = arena;
+    sorter->arena_mark = arena_mark(arena);
+    sorter->fan_in = plan->fan_in;
+    sorter->block_size = plan->block_size;
+    sorter->run_capacity = plan->run_size / sizeof(uint32_t);
+    sorter->run_count = 0;
+    sorter->run_position = 0;
+    sorter->num_runs = 0;
+    sorter->final_generation = 0;
+    sorter->num_final_runs = 0;
+    sorter->merge = NULL;
+    sorter->merge_files = NULL;
+    sorter->num_merge_files = 0;
+    sorter->base_file_created = false;
+
+    sorter->run_data = (uint32_t *) arena_alloc(arena, sorter->run_capacity * sizeof(uint32_t), ARENA_PAGE_ALIGNMENT);
+    if (!sorter->run_data || (sorter->run_capacity == 0)) {
+        fprintf(stderr, "ERROR: working memory is too small for the run size\n");
+        sorter_delete(sorter);
+        return NULL;
+    }
+
+    // Reserve a unique base name for this sorter's run files.
+    snprintf(sorter->base_filename, sizeof(sorter->base_filename), "%s/bigsort-XXXXXX", temp_directory);
+    int fd = mkstemp(sorter->base_filename);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: unable to create temporary file: %s\n", strerror(errno));
+        sorter_delete(sorter);
+        return NULL;
+    }
+    close(fd);
+    sorter->base_file_created = true;
+
+    return sorter;
+}
+
+bool sorter_push(struct sorter *sorter, uint32_t const *values, size_t count)
+{
+    assert(sorter);
+    assert(values || (count == 0));
+
+    if (sorter->state != SORTER_PUSHING) {
+        return false;
+    }
+
+    while (count > 0) {
+        // Copy as much as fits in the run buffer.
+        size_t to_copy = sorter->run_capacity - sorter->run_count;
+        if (to_copy > count) {
+            to_copy = count;
+        }
+        memcpy(sorter->run_data + sorter->run_count, values, to_copy * sizeof(uint32_t));
+        sorter->run_count += to_copy;
+        values += to_copy;
+        count -= to_copy;
+
+        // Only spill once there's more to come. The last run can stay in memory until we know whether it's the only
+        // one.
+        if ((sorter->run_count == sorter->run_capacity) && (count > 0)) {
+            if (!spill_run(sorter)) {
+                sorter->state = SORTER_FAILED;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool sorter_finish(struct sorter *sorter)
+{
+    assert(sorter);
+
+    if (sorter->state != SORTER_PUSHING) {
+        return false;
+    }
+
+    // If nothing was spilled, everything is in the run buffer. Sort it and hand it out from there.
+    if (sorter->num_runs == 0) {
+        run_sort(sorter->run_data, sorter->run_count);
+        sorter->run_position = 0;
+        sorter->state = SORTER_IN_MEMORY;
+        return true;
+    }
+
+    // Otherwise, spill what's left and merge.
+    if ((sorter->run_count > 0) && !spill_run(sorter)) {
+        sorter->state = SORTER_FAILED;
+        return false;
+    }
+    if (!begin_final_merge(sorter)) {
+        sorter->state = SORTER_FAILED;
+        return false;
+    }
+    sorter->state = SORTER_MERGING;
+    return true;
+}
+
+bool sorter_next(struct sorter *sorter, uint32_t *values, size_t max_values, size_t *num_values)
+{
+    assert(sorter);
+    assert(values);
+    assert(num_values);
+
+    *num_values = 0;
+    switch (sorter->state) {
+        case SORTER_IN_MEMORY: {
+            size_t count = sorter->run_count - sorter->run_position;
+            if (count > max_values) {
+                count = max_values;
+            }
+            memcpy(values, sorter->run_data + sorter->run_position, count * sizeof(uint32_t));
+            sorter->run_position += count;
+            *num_values = count;
+            return true;
+        }
+        case SORTER_MERGING:
+            if (!merge_read(sorter->merge, values, max_values, num_values)) {
+                sorter->state = SORTER_FAILED;
+                return false;
+            }
+            return true;
+        case SORTER_PUSHING:
+        case SORTER_FAILED:
+        default:
+            return false;
+    }
+}
+
+void sorter_delete(struct sorter *sorter)
+{
+    if (!sorter) {
+        return;
+    }
+
+    // Runs that never made it into the final merge may still be on disk. Removing a run that's already gone is
+    // harmless. A merge that failed may have left runs behind in any generation that it got to.
+    char filename[PATH_MAX] = {0};
+    if (sorter->state == SORTER_FAILED) {
+        remove_all_runs(sorter);
+    } else if (sorter->num_final_runs == 0) {
+        for (size_t i = 0; i < sorter->num_runs; i++) {
+            if (format_run_filename(filename, sizeof(filename), sorter, 0, i)) {
+                remove(filename);
+            }
+        }
+    }
+    for (size_t i = sorter->num_merge_files; i < sorter->num_final_runs; i++) {
+        if (format_run_filename(filename, sizeof(filename), sorter, sorter->final_generation, i)) {
+            remove(filename);
+        }
+    }
+    if (sorter->base_file_created) {
+        remove(sorter->base_filename);
+    }
+
+    close_merge_files(sorter);
+    merge_delete(sorter->merge);
+    arena_release(sorter->arena, sorter->arena_mark);
+    free(sorter);
+}
+
+/*
+ * Sorts the run buffer and writes it out as the next generation-0 run file.
+ */
+static bool spill_run(struct sorter *sorter)
+{
+    char filename[PATH_MAX] = {0};
+    if (!format_run_filename(filename, sizeof(filename), sorter, 0, sorter->num_runs)) {
+        fprintf(stderr, "ERROR: run file name is too long\n");
+        return false;
+    }
+
+    FILE *run_file = fopen(filename, "wb");
+    if (!run_file) {
+        fprintf(stderr, "ERROR: unable to create run file: %s\n", strerror(errno));
+        return false;
+    }
+    // The whole run is written with a single call.
+    setvbuf(run_file, NULL, _IONBF, 0);
+    // Count the run as soon as it exists so that it gets cleaned up if anything goes wrong.
+    sorter->num_runs++;
+
+    run_sort(sorter->run_data, sorter->run_count);
+    fwrite(sorter->run_data, sizeof(uint32_t), sorter->run_count, run_file);
+    bool const success = !ferror(run_file);
+    if ((fclose(run_file) != 0) || !success) {
+        fprintf(stderr, "ERROR: unable to write run file: %s\n", strerror(errno));
+        return false;
+    }
+
+    sorter->run_count = 0;
+    return true;
+}
+
+/*
+ * Merges the spilled runs down to no more than one merge's worth, and then starts the final merge over those. The run
+ * buffer isn't needed anymore, so its memory goes to the merge.
+ */
+static bool begin_final_merge(struct sorter *sorter)
+{
+    arena_release(sorter->arena, sorter->arena_mark);
+    sorter->run_data = NULL;
+
+    size_t generation = 0;
+    size_t remaining_runs = 0;
+    if (!reduce_runs(
+            sorter->base_filename, sorter->num_runs,
+            sorter->arena, sorter->fan_in, sorter->block_size, sorter->fan_in, 0,
+            NULL, NULL, &generation, &remaining_runs)) {
+        return false;
+    }
+    sorter->final_generation = generation;
+    sorter->num_final_runs = remaining_runs;
+
+    sorter->merge = merge_new(sorter->arena, sorter->block_size, remaining_runs);
+    sorter->merge_files = (FILE **) calloc(remaining_runs, sizeof(FILE *));
+    if (!sorter->merge || !sorter->merge_files || (merge_get_max_input_files(sorter->merge) < remaining_runs)) {
+        fprintf(stderr, "ERROR: unable to set up final merge\n");
+        return false;
+    }
+
+    char filename[PATH_MAX] = {0};
+    for (size_t i = 0; i < remaining_runs; i++) {
+        if (!format_run_filename(filename, sizeof(filename), sorter, generation, i)) {
+            fprintf(stderr, "ERROR: run file name is too long\n");
+            return false;
+        }
+        FILE *run_file = fopen(filename, "rb");
+        if (!run_file) {
+            fprintf(stderr, "ERROR: unable to open run file: %s\n", strerror(errno));
+            return false;
+        }
+        // The merge reads whole blocks into its own buffers.
+        setvbuf(run_file, NULL, _IONBF, 0);
+        sorter->merge_files[sorter->num_merge_files++] = run_file;
+        // Nobody else needs the file. Unlinking it now means the space is reclaimed as soon as it's closed, however
+        // the sorter ends up being torn down.
+        remove(filename);
+    }
+
+    return merge_begin(sorter->merge, sorter->merge_files, sorter->num_merge_files);
+}
+
+static void close_merge_files(struct sorter *sorter)
+{
+    for (size_t i = 0; i < sorter->num_merge_files; i++) {
+        fclose(sorter->merge_files[i]);
+    }
+    free(sorter->merge_files);
+    sorter->merge_files = NULL;
+    sorter->num_merge_files = 0;
+}
+
+/*
+ * Removes every run that the sorter may have on disk, in any generation. The merge doesn't say how far it got before
+ * failing, but with at least two runs per merge, generation g never has more than num_runs / 2^g runs (rounded up), so
+ * that bounds the files to look for.
+ */
+static void remove_all_runs(struct sorter const *sorter)
+{
+    char filename[PATH_MAX] = {0};
+    size_t num_runs_in_generation = sorter->num_runs;
+    for (size_t generation = 0; num_runs_in_generation > 0; generation++) {
+        for (size_t i = 0; i < num_runs_in_generation; i++) {
+            if (format_run_filename(filename, sizeof(filename), sorter, generation, i)) {
+                remove(filename);
+            }
+        }
+        num_runs_in_generation = (num_runs_in_generation > 1) ? ((num_runs_in_generation + 1) / 2) : 0;
+    }
+}
+
+/*
+ * Formats the name of one of the sorter's run files. Returns false if the name doesn't fit in the buffer, in which case
+ * it names no run at all, and mustn't be used.
+ */
+static bool format_run_filename(
+        char *buffer, size_t buffer_size, struct sorter const *sorter, size_t generation, size_t run_number)
+{
+    int const length = snprintf(buffer, buffer_size, "%s.%lu.%lu", sorter->base_filename, generation, run_number);
+    return (length >= 0) && ((size_t) length < buffer_size);
+}
@@ -0,0 +1,69 @@
+#ifndef SORTER_H
+#define SORTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+#include "plan.h"
+
+/*
+ * An in-process sorter for embedding bigsort in another program. Values are pushed in from memory, in batches, and
+ * sorted values are pulled back out, in batches, without an output file ever being written.
+ *
+ * While pushing, values collect in a run buffer of plan->run_size bytes taken from the arena. Whenever it fills up, it
+ * is sorted and spilled to a temporary run file. If everything fits in the run buffer, nothing touches the disk. When
+ * pushing is finished, spilled runs are merged down until they fit in a single merge, and that last merge is then
+ * streamed out through sorter_next() instead of being written to a file.
+ *
+ * Typical use:
+ *
+ *     struct sort_plan plan;
+ *     plan_sort(&plan, memory_size, 0, expected_input_size, 0);
+ *     struct arena *arena = arena_new(plan.memory_size, ARENA_FLAG_NONE);
+ *     struct sorter *sorter = sorter_new(arena, &plan, "/tmp");
+ *     while (...) { sorter_push(sorter, batch, batch_count); }
+ *     sorter_finish(sorter);
+ *     while (sorter_next(sorter, batch, batch_capacity, &batch_count) && batch_count) { ... }
+ *     sorter_delete(sorter);
+ *     arena_delete(arena);
+ */
+struct sorter;
+
+/*
+ * Creates a sorter that works within the arena's memory according to the plan. Temporary run files are created in
+ * temp_directory under a unique name.
+ *
+ * Returns: The new sorter, or NULL if an error occurs.
+ */
+struct sorter *sorter_new(struct arena *arena, struct sort_plan const *plan, char const *temp_directory);
+
+/*
+ * Adds count values to the sorter. May only be called before sorter_finish().
+ *
+ * Returns: true on success, false if an error occurs (e.g. a run could not be spilled).
+ */
+bool sorter_push(struct sorter *sorter, uint32_t const *values, size_t count);
+
+/*
+ * Marks the end of the input and prepares the sorted output for sorter_next(). This is where any spilled runs are
+ * merged, so it may take a while.
+ *
+ * Returns: true on success, false if an error occurs.
+ */
+bool sorter_finish(struct sorter *sorter);
+
+/*
+ * Pulls up to max_values of the next sorted values into values. The number of values pulled is stored in num_values,
+ * which is zero once all values have been pulled.
+ *
+ * Returns: true on success, false if an error occurs.
+ */
+bool sorter_next(struct sorter *sorter, uint32_t *values, size_t max_values, size_t *num_values);
+
+/*
+ * Deletes the sorter and any temporary files it still has, and returns its memory to the arena.
+ */
+void sorter_delete(struct sorter *sorter);
+
+#endif // SORTER_H
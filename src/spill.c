@@ -0,0 +1,323 @@
+// fallocate() and fopencookie() are GNU extensions.
+#define _GNU_SOURCE
+
+#include "spill.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "io_util.h"
+
+// Runs start on a page boundary, so that reading or releasing one never touches a page of its neighbours.
+static off_t const RUN_ALIGNMENT = 4096;
+
+// The file is preallocated this far at a time ahead of the run that's being written. That lays the runs out in large
+// contiguous pieces of the disk, and a full disk is noticed before the data that doesn't fit has been produced.
+static off_t const PREALLOCATION_SIZE = (off_t) 16 << 20;
+
+// Runs in a generation that the extent table makes room for at first.
+static size_t const INITIAL_RUN_CAPACITY = 16;
+
+// Where a run lives in the spill file.
+struct spill_extent {
+    off_t offset;
+    off_t size;
+    bool present;
+};
+
+// The runs of one generation, indexed by run number.
+struct spill_generation {
+    struct spill_extent *extents;
+    size_t capacity;
+};
+
+struct spill_store {
+    int fd;
+
+    // Runs are appended to the file. This is where the last one ends, and how far the file has been preallocated.
+    off_t end;
+    off_t allocated_end;
+    bool preallocating;
+
+    // The extent table, indexed by generation.
+    struct spill_generation *generations;
+    size_t num_generations;
+
+    // The run that's being written, if any, and where it starts and has got up to.
+    FILE *writer;
+    size_t writer_generation;
+    size_t writer_run_number;
+    off_t writer_offset;
+    off_t writer_position;
+};
+
+static struct spill_extent const *find_extent(
+        struct spill_store const *spill, size_t generation, size_t run_number);
+
+static struct spill_extent *make_extent(struct spill_store *spill, size_t generation, size_t run_number);
+
+static ssize_t write_run(void *cookie, char const *buffer, size_t size);
+
+static bool preallocate(struct spill_store *spill, off_t end);
+
+
+/*
+ * Creates a spill store: a single temporary file, "[base_filename].spill", that holds every run as an extent, along
+ * with a table of where each run is. Runs are named by generation and run number, like run files are. The file is
+ * unlinked as soon as it's open, so it never outlives the process, however that ends.
+ *
+ * Runs are appended one at a time. Space is never reused within the file. Instead, runs that are removed, and the parts
+ * of runs that a merge has consumed, are punched out of it, which gives their blocks back to the file system.
+ */
+struct spill_store *spill_new(char const *base_filename)
+{
+    assert(base_filename);
+
+    char filename[PATH_MAX] = {0};
+    snprintf(filename, sizeof(filename), "%s.spill", base_filename);
+    int const fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: unable to create spill file: %s\n", strerror(errno));
+        return NULL;
+    }
+    unlink(filename);
+
+    struct spill_store *spill = (struct spill_store *) malloc(sizeof(struct spill_store));
+    if (!spill) {
+        close(fd);
+        return NULL;
+    }
+    spill->fd = fd;
+    spill->end = 0;
+    spill->allocated_end = 0;
+    spill->preallocating = true;
+    spill->generations = NULL;
+    spill->num_generations = 0;
+    spill->writer = NULL;
+    spill->writer_generation = 0;
+    spill->writer_run_number = 0;
+    spill->writer_offset = 0;
+    spill->writer_position = 0;
+    return spill;
+}
+
+/*
+ * Gets the spill file's descriptor, which the runs are read from at the offsets that spill_find_run() gives.
+ */
+int spill_get_fd(struct spill_store const *spill)
+{
+    assert(spill);
+    return spill->fd;
+}
+
+/*
+ * Starts a run at the end of the spill file, replacing any run of the same name. The returned stream writes the run,
+ * and is handed back to spill_finish_run() once the run is complete. Only one run can be written at a time.
+ */
+FILE *spill_create_run(struct spill_store *spill, size_t generation, size_t run_number)
+{
+    assert(spill);
+    assert(!spill->writer);
+
+    spill_remove_run(spill, generation, run_number);
+    spill->writer_generation = generation;
+    spill->writer_run_number = run_number;
+    spill->writer_offset = (spill->end + RUN_ALIGNMENT - 1) & ~(RUN_ALIGNMENT - 1);
+    spill->writer_position = spill->writer_offset;
+
+    cookie_io_functions_t const functions = {.write = write_run};
+    spill->writer = fopencookie(spill, "wb", functions);
+    if (spill->writer) {
+        // Runs and merges write whole blocks of their own.
+        setvbuf(spill->writer, NULL, _IONBF, 0);
+    }
+    return spill->writer;
+}
+
+/*
+ * Closes the stream of the run that's being written and records the run in the extent table.
+ */
+bool spill_finish_run(struct spill_store *spill, FILE *run_file)
+{
+    assert(spill);
+    assert(run_file && (run_file == spill->writer));
+
+    bool success = (fclose(run_file) == 0);
+    spill->writer = NULL;
+    spill->end = spill->writer_position;
+
+    struct spill_extent *extent = make_extent(spill, spill->writer_generation, spill->writer_run_number);
+    if (!extent) {
+        return false;
+    }
+    extent->offset = spill->writer_offset;
+    extent->size = spill->writer_position - spill->writer_offset;
+    extent->present = success;
+    return success;
+}
+
+bool spill_sync(struct spill_store *spill)
+{
+    assert(spill);
+    return fdatasync(spill->fd) == 0;
+}
+
+/*
+ * Looks a run up in the extent table. Returns false if there's no such run.
+ */
+bool spill_find_run(
+        struct spill_store const *spill, size_t generation, size_t run_number, off_t *offset, off_t *size)
+{
+    assert(spill);
+    assert(offset);
+    assert(size);
+
+    struct spill_extent const *extent = find_extent(spill, generation, run_number);
+    if (!extent) {
+        return false;
+    }
+    *offset = extent->offset;
+    *size = extent->size;
+    return true;
+}
+
+/*
+ * Gives a run a new name without touching its data.
+ */
+bool spill_rename_run(
+        struct spill_store *spill,
+        size_t generation, size_t run_number,
+        size_t new_generation, size_t new_run_number)
+{
+    assert(spill);
+
+    struct spill_extent const *extent = find_extent(spill, generation, run_number);
+    if (!extent) {
+        return false;
+    }
+    // Making room for the new name may move the table, so take a copy first.
+    struct spill_extent const moved = *extent;
+    struct spill_extent *new_extent = make_extent(spill, new_generation, new_run_number);
+    if (!new_extent) {
+        return false;
+    }
+    *new_extent = moved;
+    spill->generations[generation].extents[run_number].present = false;
+    return true;
+}
+
+/*
+ * Forgets a run and punches its extent out of the spill file. File systems that can't punch holes keep the data until
+ * the store is deleted. Removing a run that doesn't exist does nothing.
+ */
+void spill_remove_run(struct spill_store *spill, size_t generation, size_t run_number)
+{
+    assert(spill);
+
+    struct spill_extent const *extent = find_extent(spill, generation, run_number);
+    if (!extent) {
+        return;
+    }
+    if (extent->size > 0) {
+        fallocate(spill->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, extent->offset, extent->size);
+    }
+    spill->generations[generation].extents[run_number].present = false;
+}
+
+void spill_delete(struct spill_store *spill)
+{
+    if (spill) {
+        if (spill->writer) {
+            fclose(spill->writer);
+        }
+        for (size_t i = 0; i < spill->num_generations; i++) {
+            free(spill->generations[i].extents);
+        }
+        free(spill->generations);
+        close(spill->fd);
+        free(spill);
+    }
+}
+
+static struct spill_extent const *find_extent(
+        struct spill_store const *spill, size_t generation, size_t run_number)
+{
+    if ((generation >= spill->num_generations) || (run_number >= spill->generations[generation].capacity)) {
+        return NULL;
+    }
+    struct spill_extent const *extent = &spill->generations[generation].extents[run_number];
+    return extent->present ? extent : NULL;
+}
+
+/*
+ * Gets a run's entry in the extent table, growing the table to make room for it if need be.
+ */
+static struct spill_extent *make_extent(struct spill_store *spill, size_t generation, size_t run_number)
+{
+    if (generation >= spill->num_generations) {
+        struct spill_generation *generations = (struct spill_generation *) realloc(
+                spill->generations, (generation + 1) * sizeof(struct spill_generation));
+        if (!generations) {
+            return NULL;
+        }
+        memset(generations + spill->num_generations, 0,
+               (generation + 1 - spill->num_generations) * sizeof(struct spill_generation));
+        spill->generations = generations;
+        spill->num_generations = generation + 1;
+    }
+
+    struct spill_generation *runs = &spill->generations[generation];
+    if (run_number >= runs->capacity) {
+        size_t capacity = (runs->capacity != 0) ? runs->capacity : INITIAL_RUN_CAPACITY;
+        while (capacity <= run_number) {
+            capacity *= 2;
+        }
+        struct spill_extent *extents = (struct spill_extent *) realloc(
+                runs->extents, capacity * sizeof(struct spill_extent));
+        if (!extents) {
+            return NULL;
+        }
+        memset(extents + runs->capacity, 0, (capacity - runs->capacity) * sizeof(struct spill_extent));
+        runs->extents = extents;
+        runs->capacity = capacity;
+    }
+    return &runs->extents[run_number];
+}
+
+static ssize_t write_run(void *cookie, char const *buffer, size_t size)
+{
+    struct spill_store *spill = (struct spill_store *) cookie;
+    if (!preallocate(spill, spill->writer_position + (off_t) size)) {
+        return -1;
+    }
+    if (!io_pwrite_fully(spill->fd, buffer, size, (uint64_t) spill->writer_position)) {
+        return -1;
+    }
+    spill->writer_position += (off_t) size;
+    return (ssize_t) size;
+}
+
+/*
+ * Makes sure the file is allocated up to end, a chunk at a time. Only a full disk is an error. A file system that can't
+ * preallocate just has the file grow as it's written.
+ */
+static bool preallocate(struct spill_store *spill, off_t end)
+{
+    if (!spill->preallocating || (end <= spill->allocated_end)) {
+        return true;
+    }
+    off_t const new_end = ((end + PREALLOCATION_SIZE - 1) / PREALLOCATION_SIZE) * PREALLOCATION_SIZE;
+    if (fallocate(spill->fd, 0, spill->allocated_end, new_end - spill->allocated_end) != 0) {
+        if (errno == ENOSPC) {
+            return false;
+        }
+        spill->preallocating = false;
+        return true;
+    }
+    spill->allocated_end = new_end;
+    return true;
+}
@@ -0,0 +1,33 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+struct spill_store;
+
+struct spill_store *spill_new(char const *base_filename);
+
+int spill_get_fd(struct spill_store const *spill);
+
+FILE *spill_create_run(struct spill_store *spill, size_t generation, size_t run_number);
+
+bool spill_finish_run(struct spill_store *spill, FILE *run_file);
+
+bool spill_sync(struct spill_store *spill);
+
+bool spill_find_run(
+        struct spill_store const *spill, size_t generation, size_t run_number, off_t *offset, off_t *size);
+
+bool spill_rename_run(
+        struct spill_store *spill,
+        size_t generation, size_t run_number,
+        size_t new_generation, size_t new_run_number);
+
+void spill_remove_run(struct spill_store *spill, size_t generation, size_t run_number);
+
+void spill_delete(struct spill_store *spill);
+
+#endif // SPILL_H
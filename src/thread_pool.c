@@ -0,0 +1,169 @@
+#include "thread_pool.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct worker {
+    struct thread_pool *pool;
+    size_t thread_index;
+    pthread_t thread;
+};
+
+struct thread_pool {
+    // The calling thread is thread 0, so there's one worker fewer than threads.
+    size_t num_threads;
+    struct worker *workers;
+    size_t num_started;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+
+    // The function that workers run. Each call to thread_pool_run() bumps the round so that workers know there's new
+    // work, and num_busy counts down as they finish it.
+    thread_pool_function function;
+    void *context;
+    size_t round;
+    size_t num_busy;
+    bool stopping;
+};
+
+static void *worker_main(void *arg);
+
+
+/*
+ * Returns the number of online processors, which is what a pool is sized to by default.
+ */
+size_t thread_pool_get_default_num_threads(void)
+{
+    long const processors = sysconf(_SC_NPROCESSORS_ONLN);
+    return (processors > 0) ? (size_t) processors : 1;
+}
+
+/*
+ * Creates a pool of num_threads threads, including the caller's. Zero means one per online processor. The workers
+ * sleep until thread_pool_run() gives them something to do.
+ */
+struct thread_pool *thread_pool_new(size_t num_threads)
+{
+    if (num_threads == 0) {
+        num_threads = thread_pool_get_default_num_threads();
+    }
+
+    struct thread_pool *pool = (struct thread_pool *) malloc(sizeof(struct thread_pool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->num_threads = num_threads;
+    pool->num_started = 0;
+    pool->function = NULL;
+    pool->context = NULL;
+    pool->round = 0;
+    pool->num_busy = 0;
+    pool->stopping = false;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+
+    pool->workers = (struct worker *) calloc(num_threads, sizeof(struct worker));
+    if (!pool->workers) {
+        thread_pool_delete(pool);
+        return NULL;
+    }
+    for (size_t i = 1; i < num_threads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].thread_index = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0) {
+            thread_pool_delete(pool);
+            return NULL;
+        }
+        pool->num_started++;
+    }
+    return pool;
+}
+
+size_t thread_pool_get_num_threads(struct thread_pool const *pool)
+{
+    assert(pool);
+    return pool->num_threads;
+}
+
+/*
+ * Calls function(context, thread_index) once on every thread in the pool, with thread indices from zero to
+ * num_threads - 1, and returns once all of them have returned. The calling thread runs index zero. Work is usually
+ * shared out by having each call pull items from the context until there are none left, with the thread index
+ * selecting per-thread resources.
+ */
+void thread_pool_run(struct thread_pool *pool, thread_pool_function function, void *context)
+{
+    assert(pool);
+    assert(function);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->function = function;
+    pool->context = context;
+    pool->num_busy = pool->num_started;
+    pool->round++;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    function(context, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->num_busy > 0) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_delete(struct thread_pool *pool)
+{
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 1; i <= pool->num_started; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    pthread_cond_destroy(&pool->work_done);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *worker = (struct worker *) arg;
+    struct thread_pool *pool = worker->pool;
+    size_t round = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stopping && (pool->round == round)) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        round = pool->round;
+        thread_pool_function const function = pool->function;
+        void *const context = pool->context;
+        pthread_mutex_unlock(&pool->lock);
+
+        function(context, worker->thread_index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->num_busy == 0) {
+            pthread_cond_signal(&pool->work_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+
+typedef void (*thread_pool_function)(void *context, size_t thread_index);
+
+struct thread_pool;
+
+size_t thread_pool_get_default_num_threads(void);
+
+struct thread_pool *thread_pool_new(size_t num_threads);
+
+size_t thread_pool_get_num_threads(struct thread_pool const *pool);
+
+void thread_pool_run(struct thread_pool *pool, thread_pool_function function, void *context);
+
+void thread_pool_delete(struct thread_pool *pool);
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,30 @@
+#include "util.h"
+#include <assert.h>
+#include <time.h>
+
+
+/*
+ * Returns the time in seconds on a monotonic clock, for measuring how long something takes.
+ */
+double util_now_seconds(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ((double) ts.tv_nsec / 1e9);
+}
+
+/*
+ * Advances a xorshift64* generator, whose state must start out nonzero, and returns its next value. It's fast and good
+ * enough for picking positions to sample or read and for filling buffers, but not for anything that needs to be
+ * unpredictable.
+ */
+uint64_t util_next_random(uint64_t *state)
+{
+    assert(state && (*state != 0));
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
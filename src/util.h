@@ -0,0 +1,9 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stdint.h>
+
+double util_now_seconds(void);
+uint64_t util_next_random(uint64_t *state);
+
+#endif // UTIL_H
@@ -0,0 +1,184 @@
+#include "verifier.h"
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include "bitonic_avx2.h"
+#define VERIFIER_HAVE_AVX2 1
+#else
+#define VERIFIER_HAVE_AVX2 0
+#endif
+
+// Values per chunk that a thread claims at a time. Chunks are big enough to stream through, and small enough that the
+// threads finish at about the same time.
+static size_t const CHUNK_VALUES = 1024 * 1024;
+
+// Keys for the two mixes that are summed into the hash.
+static uint64_t const HASH_KEYS[2] = {0x9e3779b97f4a7c15u, 0xd1b54a32d192ed03u};
+
+struct scan_context {
+    uint32_t const *values;
+    size_t num_values;
+    bool check_order;
+    atomic_size_t next_chunk;
+
+    // A partial summary per thread, which the chunks that the thread scans are added to.
+    struct verifier_summary *partials;
+};
+
+static void scan_chunks(void *context, size_t thread_index);
+
+static size_t find_unsorted(uint32_t const *values, size_t begin, size_t end);
+
+static size_t find_unsorted_scalar(uint32_t const *values, size_t begin, size_t end);
+
+static inline uint64_t mix(uint64_t value);
+
+#if VERIFIER_HAVE_AVX2
+static size_t find_unsorted_avx2(uint32_t const *values, size_t begin, size_t end);
+#endif
+
+
+/*
+ * Scans values with the pool's threads, counting and hashing them, and, if check_order is set, checking that they're
+ * in ascending order. Each thread claims chunks of the values in turn. A chunk's order is checked from the value
+ * before it, so that the boundaries between chunks are checked too.
+ */
+bool verifier_scan(
+        uint32_t const *values, size_t num_values, bool check_order, struct thread_pool *pool,
+        struct verifier_summary *summary)
+{
+    assert(values || (num_values == 0));
+    assert(pool);
+    assert(summary);
+
+    size_t const num_threads = thread_pool_get_num_threads(pool);
+    struct scan_context scan = {
+            .values = values,
+            .num_values = num_values,
+            .check_order = check_order,
+            .partials = (struct verifier_summary *) calloc(num_threads, sizeof(struct verifier_summary))};
+    if (!scan.partials) {
+        return false;
+    }
+    atomic_init(&scan.next_chunk, 0);
+    thread_pool_run(pool, scan_chunks, &scan);
+
+    *summary = (struct verifier_summary) {.num_values = num_values, .sorted = true};
+    for (size_t i = 0; i < num_threads; i++) {
+        struct verifier_summary const *partial = &scan.partials[i];
+        summary->hash[0] += partial->hash[0];
+        summary->hash[1] += partial->hash[1];
+        if (!partial->sorted && (summary->sorted || (partial->first_unsorted < summary->first_unsorted))) {
+            summary->sorted = false;
+            summary->first_unsorted = partial->first_unsorted;
+        }
+    }
+    free(scan.partials);
+    return true;
+}
+
+/*
+ * Returns whether two scans found the same values, in any order.
+ */
+bool verifier_same_values(struct verifier_summary const *a, struct verifier_summary const *b)
+{
+    assert(a);
+    assert(b);
+    return (a->num_values == b->num_values) && (a->hash[0] == b->hash[0]) && (a->hash[1] == b->hash[1]);
+}
+
+static void scan_chunks(void *context, size_t thread_index)
+{
+    struct scan_context *scan = (struct scan_context *) context;
+    struct verifier_summary *partial = &scan->partials[thread_index];
+    partial->sorted = true;
+
+    while (true) {
+        size_t const chunk = atomic_fetch_add(&scan->next_chunk, 1);
+        size_t const begin = chunk * CHUNK_VALUES;
+        if (begin >= scan->num_values) {
+            break;
+        }
+        size_t const end = (scan->num_values - begin > CHUNK_VALUES) ? (begin + CHUNK_VALUES) : scan->num_values;
+
+        // The hash is a sum of mixes of every value, which comes out the same in any order. Two sums with different
+        // keys make it far less likely that different values happen to sum to the same.
+        uint64_t hash0 = 0;
+        uint64_t hash1 = 0;
+        for (size_t i = begin; i < end; i++) {
+            hash0 += mix(scan->values[i] ^ HASH_KEYS[0]);
+            hash1 += mix(scan->values[i] ^ HASH_KEYS[1]);
+        }
+        partial->hash[0] += hash0;
+        partial->hash[1] += hash1;
+
+        // A thread claims its chunks in ascending order, so once it has found an unsorted value, the rest of its
+        // chunks can't hold an earlier one.
+        if (scan->check_order && partial->sorted) {
+            size_t const unsorted = find_unsorted(scan->values, (begin > 0) ? begin : 1, end);
+            if (unsorted < end) {
+                partial->sorted = false;
+                partial->first_unsorted = unsorted;
+            }
+        }
+    }
+}
+
+/*
+ * Returns the first position in [begin, end) that holds a smaller value than the position before it, or end if
+ * there's none. begin must be at least 1.
+ */
+static size_t find_unsorted(uint32_t const *values, size_t begin, size_t end)
+{
+#if VERIFIER_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        return find_unsorted_avx2(values, begin, end);
+    }
+#endif
+    return find_unsorted_scalar(values, begin, end);
+}
+
+static size_t find_unsorted_scalar(uint32_t const *values, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; i++) {
+        if (values[i] < values[i - 1]) {
+            return i;
+        }
+    }
+    return end;
+}
+
+/*
+ * The 64-bit finalizer of SplitMix64, which spreads every bit of the value over the whole result.
+ */
+static inline uint64_t mix(uint64_t value)
+{
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9u;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebu;
+    return value ^ (value >> 31);
+}
+
+#if VERIFIER_HAVE_AVX2
+
+/*
+ * Compares eight values at a time with the eight values one position before them, which are in order if each is the
+ * larger of its pair. The first register that's out of order is searched one value at a time.
+ */
+__attribute__((target("avx2")))
+static size_t find_unsorted_avx2(uint32_t const *values, size_t begin, size_t end)
+{
+    size_t i = begin;
+    for (; i + AVX2_VALUES <= end; i += AVX2_VALUES) {
+        __m256i const previous = _mm256_loadu_si256((__m256i const *) (values + i - 1));
+        __m256i const current = _mm256_loadu_si256((__m256i const *) (values + i));
+        __m256i const ordered = _mm256_cmpeq_epi32(_mm256_max_epu32(previous, current), current);
+        if (_mm256_movemask_epi8(ordered) != -1) {
+            break;
+        }
+    }
+    return find_unsorted_scalar(values, i, end);
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "thread_pool.h"
+
+// What a scan of a file's values found.
+struct verifier_summary {
+    uint64_t num_values;
+
+    // An order-independent hash of the values, which is the same for any two files that hold the same values however
+    // they're ordered.
+    uint64_t hash[2];
+
+    // Whether every value is at least as big as the one before it, and if not, the position of the first one that's
+    // smaller. Only known if the scan checked the order.
+    bool sorted;
+    uint64_t first_unsorted;
+};
+
+bool verifier_scan(
+        uint32_t const *values, size_t num_values, bool check_order, struct thread_pool *pool,
+        struct verifier_summary *summary);
+
+bool verifier_same_values(struct verifier_summary const *a, struct verifier_summary const *b);
+
+#endif // VERIFIER_H
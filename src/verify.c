@@ -0,0 +1,220 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "thread_pool.h"
+#include "verifier.h"
+
+// Checks that a file that bigsort wrote is sorted, and, given the file that it sorted, that it holds exactly the same
+// values. Both files are memory-mapped and scanned by a thread per processor, so a check runs at about the speed that
+// the files can be read.
+//
+// usage: bigsort-verify [-q] [-j threads] sortedfile [infile]
+
+// Exit statuses. A file that fails a check is told apart from one that couldn't be checked at all.
+enum {
+    VERIFY_PASSED = 0,
+    VERIFY_FAILED = 1,
+    VERIFY_ERROR = 2
+};
+
+struct verify_options {
+    char const *sorted_filename;
+    char const *input_filename;
+    size_t num_threads;
+    bool quiet;
+    bool print_help;
+};
+
+// A file of values, memory-mapped.
+struct mapped_values {
+    uint32_t const *values;
+    size_t num_values;
+};
+
+static bool parse_options(int argc, char *argv[], struct verify_options *opts);
+
+static bool map_values(char const *filename, struct mapped_values *mapped);
+
+static void unmap_values(struct mapped_values *mapped);
+
+static bool scan_file(
+        char const *filename, bool check_order, struct thread_pool *pool, struct verifier_summary *summary);
+
+
+static void print_usage(void)
+{
+    printf(
+            "usage: bigsort-verify [-h] [-q] [-j threads] sortedfile [infile]\n"
+            "\n"
+            "Checks that sortedfile, a file of unsigned, 32-bit integers, is in ascending order. Given the infile\n"
+            "that was sorted into it, also checks that sortedfile holds exactly the same values, by comparing their\n"
+            "counts and order-independent hashes.\n"
+            "\n"
+            "Exits with 0 if every check passes, 1 if one fails, and 2 if the files can't be checked.\n"
+            "\n"
+            "  -h, --help           show this help message and exit\n"
+            "  -q, --quiet          only report through the exit status\n"
+            "  -j, --threads=NUM    number of threads that scan the files (default: one\n"
+            "                         per online processor)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct verify_options opts = {0};
+    if (!parse_options(argc, argv, &opts)) {
+        print_usage();
+        return VERIFY_ERROR;
+    }
+    if (opts.print_help) {
+        print_usage();
+        return VERIFY_PASSED;
+    }
+
+    struct thread_pool *pool = thread_pool_new(opts.num_threads);
+    if (!pool) {
+        fprintf(stderr, "ERROR: unable to start threads\n");
+        return VERIFY_ERROR;
+    }
+
+    // The sorted file is checked for order while it's hashed, so that it's only read once.
+    struct verifier_summary sorted = {0};
+    struct verifier_summary input = {0};
+    bool const scanned = scan_file(opts.sorted_filename, true, pool, &sorted) &&
+                         (!opts.input_filename || scan_file(opts.input_filename, false, pool, &input));
+    thread_pool_delete(pool);
+    if (!scanned) {
+        return VERIFY_ERROR;
+    }
+
+    bool const same_values = !opts.input_filename || verifier_same_values(&sorted, &input);
+    if (!opts.quiet) {
+        printf("values: %lu\n", sorted.num_values);
+        if (sorted.sorted) {
+            printf("sorted: yes\n");
+        } else {
+            printf("sorted: no (offset %lu)\n", sorted.first_unsorted * sizeof(uint32_t));
+        }
+        if (opts.input_filename) {
+            printf("input values: %lu\n", input.num_values);
+            printf("same values: %s\n", same_values ? "yes" : "no");
+        }
+    }
+    return (sorted.sorted && same_values) ? VERIFY_PASSED : VERIFY_FAILED;
+}
+
+static bool parse_options(int argc, char *argv[], struct verify_options *opts)
+{
+    static struct option const long_options[] = {
+            {"help", no_argument, NULL, 'h'},
+            {"quiet", no_argument, NULL, 'q'},
+            {"threads", required_argument, NULL, 'j'},
+            {NULL, 0, NULL, 0}};
+
+    while (true) {
+        int const opt = getopt_long(argc, argv, "hqj:", long_options, NULL);
+        if (opt == -1) {
+            break;
+        }
+        switch (opt) {
+            case 'h':
+                opts->print_help = true;
+                return true;
+            case 'q':
+                opts->quiet = true;
+                break;
+            case 'j': {
+                char *end = NULL;
+                errno = 0;
+                unsigned long long const num_threads = strtoull(optarg, &end, 10);
+                if ((errno != 0) || (end == optarg) || (*end != '\0') || (optarg[0] == '-') || (num_threads == 0)) {
+                    fprintf(stderr, "ERROR: invalid number of threads: %s\n", optarg);
+                    return false;
+                }
+                opts->num_threads = (size_t) num_threads;
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+
+    int const num_arguments = argc - optind;
+    if ((num_arguments < 1) || (num_arguments > 2)) {
+        return false;
+    }
+    opts->sorted_filename = argv[optind];
+    opts->input_filename = (num_arguments == 2) ? argv[optind + 1] : NULL;
+    return true;
+}
+
+/*
+ * Memory-maps a file of values. An empty file maps to no values.
+ */
+static bool map_values(char const *filename, struct mapped_values *mapped)
+{
+    *mapped = (struct mapped_values) {0};
+    int const fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: unable to open %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    struct stat status = {0};
+    if (fstat(fd, &status) != 0) {
+        fprintf(stderr, "ERROR: unable to get the size of %s: %s\n", filename, strerror(errno));
+        close(fd);
+        return false;
+    }
+    if ((status.st_size % (off_t) sizeof(uint32_t)) != 0) {
+        fprintf(stderr, "ERROR: %s isn't a whole number of 32-bit values\n", filename);
+        close(fd);
+        return false;
+    }
+
+    size_t const size = (size_t) status.st_size;
+    if (size > 0) {
+        void *address = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED) {
+            fprintf(stderr, "ERROR: unable to map %s: %s\n", filename, strerror(errno));
+            close(fd);
+            return false;
+        }
+        // Each thread streams through its chunks, so read ahead of them.
+        madvise(address, size, MADV_SEQUENTIAL);
+        mapped->values = (uint32_t const *) address;
+        mapped->num_values = size / sizeof(uint32_t);
+    }
+    // The mapping keeps the file open.
+    close(fd);
+    return true;
+}
+
+static void unmap_values(struct mapped_values *mapped)
+{
+    if (mapped->num_values > 0) {
+        munmap((void *) mapped->values, mapped->num_values * sizeof(uint32_t));
+    }
+    *mapped = (struct mapped_values) {0};
+}
+
+static bool scan_file(
+        char const *filename, bool check_order, struct thread_pool *pool, struct verifier_summary *summary)
+{
+    struct mapped_values mapped = {0};
+    if (!map_values(filename, &mapped)) {
+        return false;
+    }
+    bool const scanned = verifier_scan(mapped.values, mapped.num_values, check_order, pool, summary);
+    if (!scanned) {
+        fprintf(stderr, "ERROR: unable to scan %s\n", filename);
+    }
+    unmap_values(&mapped);
+    return scanned;
+}
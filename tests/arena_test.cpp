@@ -0,0 +1,113 @@
+#include "gtest/gtest.h"
+#include <cstdint>
+#include <cstring>
+
+extern "C" {
+#include "arena.h"
+}
+
+static size_t const TEST_ARENA_SIZE = 1 << 20;
+
+class ArenaTest : public ::testing::Test {
+protected:
+    void SetUp() override
+    {
+        arena = arena_new(TEST_ARENA_SIZE, ARENA_FLAG_NONE);
+        EXPECT_TRUE(arena != nullptr);
+    }
+
+    void TearDown() override
+    {
+        arena_delete(arena);
+        arena = nullptr;
+    }
+
+    struct arena *arena{nullptr};
+};
+
+TEST_F(ArenaTest, NewArenaHasRequestedSize)
+{
+    EXPECT_EQ(arena_size(arena), TEST_ARENA_SIZE);
+    EXPECT_EQ(arena_available(arena, 1), TEST_ARENA_SIZE);
+    EXPECT_EQ(arena_mark(arena), 0);
+}
+
+TEST_F(ArenaTest, AllocationsAreAligned)
+{
+    void *first = arena_alloc(arena, 1, 1);
+    EXPECT_TRUE(first != nullptr);
+    void *second = arena_alloc(arena, 100, ARENA_CACHE_LINE_ALIGNMENT);
+    EXPECT_EQ((uintptr_t) second % ARENA_CACHE_LINE_ALIGNMENT, 0);
+    void *third = arena_alloc(arena, 100, ARENA_PAGE_ALIGNMENT);
+    EXPECT_EQ((uintptr_t) third % ARENA_PAGE_ALIGNMENT, 0);
+}
+
+TEST_F(ArenaTest, CannotAllocateMoreThanArenaSize)
+{
+    EXPECT_TRUE(arena_alloc(arena, TEST_ARENA_SIZE, 1) != nullptr);
+    EXPECT_EQ(arena_available(arena, 1), 0);
+    EXPECT_TRUE(arena_alloc(arena, 1, 1) == nullptr);
+}
+
+TEST_F(ArenaTest, ReleaseReturnsMemoryAllocatedSinceMark)
+{
+    void *first = arena_alloc(arena, 64, 1);
+    size_t mark = arena_mark(arena);
+    void *second = arena_alloc(arena, TEST_ARENA_SIZE - 64, 1);
+    EXPECT_TRUE(second != nullptr);
+    EXPECT_TRUE(arena_alloc(arena, 1, 1) == nullptr);
+
+    arena_release(arena, mark);
+    EXPECT_EQ(arena_alloc(arena, TEST_ARENA_SIZE - 64, 1), second);
+    EXPECT_TRUE(first != nullptr);
+}
+
+TEST_F(ArenaTest, ArenasWithinTakeTheirMemoryFromTheParent)
+{
+    size_t const mark = arena_mark(arena);
+    struct arena *first = arena_new_within(arena, TEST_ARENA_SIZE / 4);
+    struct arena *second = arena_new_within(arena, TEST_ARENA_SIZE / 4);
+    ASSERT_TRUE(first != nullptr);
+    ASSERT_TRUE(second != nullptr);
+    EXPECT_EQ(arena_size(first), TEST_ARENA_SIZE / 4);
+    EXPECT_LE(arena_available(arena, 1), TEST_ARENA_SIZE / 2);
+    EXPECT_TRUE(arena_new_within(arena, TEST_ARENA_SIZE) == nullptr);
+
+    // The children don't overlap, and each holds exactly its share.
+    char *first_data = (char *) arena_alloc(first, TEST_ARENA_SIZE / 4, 1);
+    char *second_data = (char *) arena_alloc(second, TEST_ARENA_SIZE / 4, 1);
+    ASSERT_TRUE(first_data != nullptr);
+    ASSERT_TRUE(second_data != nullptr);
+    EXPECT_TRUE((first_data + (TEST_ARENA_SIZE / 4) <= second_data) ||
+                (second_data + (TEST_ARENA_SIZE / 4) <= first_data));
+    EXPECT_TRUE(arena_alloc(first, 1, 1) == nullptr);
+    memset(first_data, 1, TEST_ARENA_SIZE / 4);
+    memset(second_data, 2, TEST_ARENA_SIZE / 4);
+
+    // Deleting the children leaves the parent's memory usable.
+    arena_delete(first);
+    arena_delete(second);
+    arena_release(arena, mark);
+    char *data = (char *) arena_alloc(arena, TEST_ARENA_SIZE, 1);
+    ASSERT_TRUE(data != nullptr);
+    data[TEST_ARENA_SIZE - 1] = 3;
+}
+
+TEST(ArenaHugePagesTest, HugePageRequestAlwaysYieldsUsableMemory)
+{
+    // Whether huge pages are available depends on the machine. Either way, the arena must work.
+    struct arena *arena = arena_new(TEST_ARENA_SIZE, ARENA_FLAG_HUGE_PAGES | ARENA_FLAG_LOCK);
+    EXPECT_TRUE(arena != nullptr);
+    char *data = (char *) arena_alloc(arena, TEST_ARENA_SIZE, ARENA_PAGE_ALIGNMENT);
+    EXPECT_TRUE(data != nullptr);
+    data[0] = 1;
+    data[TEST_ARENA_SIZE - 1] = 1;
+    EXPECT_EQ(arena_get_lock_error(arena) == 0, arena_is_locked(arena));
+    arena_delete(arena);
+}
+
+TEST_F(ArenaTest, UnlockedArenasHaveNoLockError)
+{
+    EXPECT_FALSE(arena_is_locked(arena));
+    EXPECT_EQ(arena_get_lock_error(arena), 0);
+}
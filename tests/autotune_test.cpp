@@ -0,0 +1,110 @@
+#include "gtest/gtest.h"
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <string>
+
+extern "C" {
+#include "autotune.h"
+}
+
+static size_t count_probe_files(std::string const &directory)
+{
+    size_t count = 0;
+    DIR *dir = opendir(directory.c_str());
+    EXPECT_TRUE(dir != nullptr);
+    while (struct dirent const *entry = dir ? readdir(dir) : nullptr) {
+        if (std::string(entry->d_name).rfind("bigsort-probe-", 0) == 0) {
+            count++;
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    return count;
+}
+
+TEST(AutotuneTest, ProbeMeasuresTheDeviceAndLeavesNothingBehind)
+{
+    std::string const directory = ::testing::TempDir();
+    size_t const probe_files_before = count_probe_files(directory);
+    struct plan_device device = {};
+    ASSERT_TRUE(autotune_probe(directory.c_str(), 4 << 20, &device));
+    EXPECT_GT(device.sequential_bytes_per_second, 0.0);
+    EXPECT_GT(device.seek_seconds, 0.0);
+    EXPECT_GT(device.sort_bytes_per_second, 0.0);
+    EXPECT_EQ(count_probe_files(directory), probe_files_before);
+}
+
+TEST(AutotuneTest, ProbeOfMissingDirectoryFails)
+{
+    struct plan_device device = {};
+    EXPECT_FALSE(autotune_probe((::testing::TempDir() + "autotune_test_missing").c_str(), 4 << 20, &device));
+}
+
+TEST(AutotuneTest, CachedDeviceIsLoadedBack)
+{
+    std::string const cache_home = ::testing::TempDir() + "autotune_test_cache";
+    std::string const cache_filename = cache_home + "/bigsort/device-1";
+    struct plan_device const saved = {.sequential_bytes_per_second = 123456789.0, .seek_seconds = 0.000125,
+                                      .sort_bytes_per_second = 987654321.0};
+    ASSERT_TRUE(autotune_save_device(cache_filename.c_str(), &saved));
+
+    struct plan_device loaded = {};
+    ASSERT_TRUE(autotune_load_device(cache_filename.c_str(), &loaded));
+    EXPECT_DOUBLE_EQ(loaded.sequential_bytes_per_second, saved.sequential_bytes_per_second);
+    EXPECT_DOUBLE_EQ(loaded.seek_seconds, saved.seek_seconds);
+    EXPECT_DOUBLE_EQ(loaded.sort_bytes_per_second, saved.sort_bytes_per_second);
+
+    // Anything else isn't taken for a probe.
+    FILE *file = fopen(cache_filename.c_str(), "w");
+    ASSERT_TRUE(file != nullptr);
+    fputs("bigsort device 1\nsequential_bytes_per_second 0\n", file);
+    fclose(file);
+    EXPECT_FALSE(autotune_load_device(cache_filename.c_str(), &loaded));
+    remove(cache_filename.c_str());
+    EXPECT_FALSE(autotune_load_device(cache_filename.c_str(), &loaded));
+    remove((cache_home + "/bigsort").c_str());
+    remove(cache_home.c_str());
+}
+
+TEST(AutotuneTest, CacheIsKeptUnderXdgCacheHome)
+{
+    char const *original = getenv("XDG_CACHE_HOME");
+    std::string const saved_original = original ? original : "";
+    setenv("XDG_CACHE_HOME", "/somewhere/cache", 1);
+    char filename[4096] = {};
+    EXPECT_TRUE(autotune_get_cache_filename(::testing::TempDir().c_str(), filename, sizeof(filename)));
+    EXPECT_EQ(std::string(filename).rfind("/somewhere/cache/bigsort/device-", 0), 0);
+    EXPECT_FALSE(autotune_get_cache_filename("/no/such/directory", filename, sizeof(filename)));
+    if (original) {
+        setenv("XDG_CACHE_HOME", saved_original.c_str(), 1);
+    } else {
+        unsetenv("XDG_CACHE_HOME");
+    }
+}
+
+TEST(AutotuneTest, RunSizeIsPickedUnlessGiven)
+{
+    struct sort_plan plan = {};
+    plan.device = {.sequential_bytes_per_second = 500.0 * (1 << 20), .seek_seconds = 0.0001,
+                   .sort_bytes_per_second = 200.0 * (1 << 20)};
+    ASSERT_TRUE(autotune_plan(&plan, 1 << 20, 0, (uint64_t) 1 << 30, 0));
+    // Smaller runs only mean more of them to merge.
+    EXPECT_EQ(plan.run_size, 1 << 20);
+    EXPECT_GT(plan.estimated_run_seconds, 0.0);
+    EXPECT_GT(plan.estimated_merge_seconds, 0.0);
+
+    ASSERT_TRUE(autotune_plan(&plan, 1 << 20, 1 << 16, (uint64_t) 1 << 30, 0));
+    EXPECT_EQ(plan.run_size, 1 << 16);
+}
+
+TEST(AutotuneTest, ThreadsKeepUpWithTheDevice)
+{
+    struct sort_plan plan = {};
+    plan.device = {.sequential_bytes_per_second = 1000.0, .seek_seconds = 0.0001, .sort_bytes_per_second = 300.0};
+    EXPECT_EQ(autotune_choose_threads(&plan, 16), 4);
+    EXPECT_EQ(autotune_choose_threads(&plan, 2), 2);
+    plan.device.sort_bytes_per_second = 5000.0;
+    EXPECT_EQ(autotune_choose_threads(&plan, 16), 1);
+}
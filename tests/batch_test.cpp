@@ -0,0 +1,150 @@
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "batch.h"
+}
+
+static size_t const ARENA_SIZE = (size_t) 1 << 20;
+
+class BatchTest : public ::testing::Test {
+protected:
+    void SetUp() override
+    {
+        job_filename = ::testing::TempDir() + "batch_test.jobs";
+        // Jobs point into these names, so they mustn't move.
+        filenames.reserve(64);
+        arena = arena_new(ARENA_SIZE, ARENA_FLAG_NONE);
+        ASSERT_TRUE(arena != nullptr);
+        pool = thread_pool_new(2);
+        ASSERT_TRUE(pool != nullptr);
+    }
+
+    void TearDown() override
+    {
+        for (std::string const &filename : filenames) {
+            remove(filename.c_str());
+        }
+        remove(job_filename.c_str());
+        thread_pool_delete(pool);
+        arena_delete(arena);
+    }
+
+    void write_job_file(std::string const &contents) const
+    {
+        std::ofstream(job_filename) << contents;
+    }
+
+    // Writes an input of count shuffled values, and returns the job that sorts it.
+    struct batch_job add_job(size_t count)
+    {
+        std::string const input_filename = ::testing::TempDir() + "batch_test.in." + std::to_string(filenames.size());
+        std::string const output_filename = input_filename + ".out";
+        std::vector<uint32_t> values(count);
+        for (size_t i = 0; i < count; i++) {
+            values[i] = (uint32_t) ((i * 7) % (count + 3));
+        }
+        std::shuffle(values.begin(), values.end(), std::minstd_rand(count));
+        FILE *input_file = fopen(input_filename.c_str(), "wb");
+        EXPECT_TRUE(input_file != nullptr);
+        EXPECT_EQ(fwrite(values.data(), sizeof(uint32_t), count, input_file), count);
+        fclose(input_file);
+        filenames.push_back(input_filename);
+        filenames.push_back(output_filename);
+        std::sort(values.begin(), values.end());
+        expected.push_back(values);
+        return {(char *) filenames[filenames.size() - 2].c_str(), (char *) filenames.back().c_str()};
+    }
+
+    static std::vector<uint32_t> read_values(char const *filename)
+    {
+        std::vector<uint32_t> values;
+        FILE *file = fopen(filename, "rb");
+        EXPECT_TRUE(file != nullptr);
+        uint32_t value = 0;
+        while (file && (fread(&value, sizeof(value), 1, file) == 1)) {
+            values.push_back(value);
+        }
+        if (file) {
+            fclose(file);
+        }
+        return values;
+    }
+
+    std::string job_filename;
+    struct arena *arena{nullptr};
+    struct thread_pool *pool{nullptr};
+    std::vector<std::string> filenames;
+    std::vector<std::vector<uint32_t>> expected;
+};
+
+TEST_F(BatchTest, JobFilesSkipCommentsAndBlankLines)
+{
+    write_job_file("# input output\n\na.in a.out\n  b.in\tb.out  \n#c.in c.out\nd.in d.out");
+    size_t num_jobs = 0;
+    struct batch_job *jobs = batch_read_jobs(job_filename.c_str(), &num_jobs);
+    ASSERT_TRUE(jobs != nullptr);
+    ASSERT_EQ(num_jobs, 3);
+    EXPECT_STREQ(jobs[0].input_filename, "a.in");
+    EXPECT_STREQ(jobs[0].output_filename, "a.out");
+    EXPECT_STREQ(jobs[1].input_filename, "b.in");
+    EXPECT_STREQ(jobs[1].output_filename, "b.out");
+    EXPECT_STREQ(jobs[2].input_filename, "d.in");
+    EXPECT_STREQ(jobs[2].output_filename, "d.out");
+    batch_free_jobs(jobs, num_jobs);
+}
+
+TEST_F(BatchTest, BadJobFilesAreRejected)
+{
+    size_t num_jobs = 0;
+    for (char const *contents : {"a.in\n", "a.in a.out extra\n", "a.in a.out\nb.in a.out\n", "# nothing\n"}) {
+        write_job_file(contents);
+        EXPECT_EQ(batch_read_jobs(job_filename.c_str(), &num_jobs), nullptr) << contents;
+        EXPECT_EQ(num_jobs, 0);
+    }
+    remove(job_filename.c_str());
+    EXPECT_EQ(batch_read_jobs(job_filename.c_str(), &num_jobs), nullptr);
+}
+
+TEST_F(BatchTest, SmallJobsShareTheThreadsAndLargeJobsUseEverything)
+{
+    // Each thread gets half of the arena, so the last two jobs are too big to sort in a share of it.
+    std::vector<struct batch_job> jobs;
+    for (size_t count : {0, 1, 1000, 40000, 100000, 20000, 200000, 600000}) {
+        jobs.push_back(add_job(count));
+    }
+
+    struct batch_stats stats = {};
+    EXPECT_TRUE(batch_run(jobs.data(), jobs.size(), arena, pool, 0, &stats));
+    EXPECT_EQ(stats.num_small, 6);
+    EXPECT_EQ(stats.num_large, 2);
+    EXPECT_EQ(stats.num_failed, 0);
+    for (size_t i = 0; i < jobs.size(); i++) {
+        EXPECT_EQ(read_values(jobs[i].output_filename), expected[i]) << "job " << i;
+    }
+
+    // The arena is whole again afterwards.
+    EXPECT_EQ(arena_available(arena, 1), ARENA_SIZE);
+}
+
+TEST_F(BatchTest, FailedJobsDontStopTheOthers)
+{
+    std::vector<struct batch_job> jobs;
+    jobs.push_back(add_job(5000));
+    std::string const missing_filename = ::testing::TempDir() + "batch_test.missing";
+    std::string const missing_output_filename = missing_filename + ".out";
+    jobs.push_back({(char *) missing_filename.c_str(), (char *) missing_output_filename.c_str()});
+    jobs.push_back(add_job(300000));
+
+    struct batch_stats stats = {};
+    EXPECT_FALSE(batch_run(jobs.data(), jobs.size(), arena, pool, 0, &stats));
+    EXPECT_EQ(stats.num_failed, 1);
+    EXPECT_EQ(read_values(jobs[0].output_filename), expected[0]);
+    EXPECT_EQ(read_values(jobs[2].output_filename), expected[1]);
+}
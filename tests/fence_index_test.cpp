@@ -0,0 +1,158 @@
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include "fence_index.h"
+}
+
+class FenceIndexTest : public ::testing::Test {
+protected:
+    void SetUp() override
+    {
+        output_filename = ::testing::TempDir() + "fence_index_test";
+        index_filename = output_filename + ".idx";
+    }
+
+    void TearDown() override
+    {
+        remove(output_filename.c_str());
+        remove(index_filename.c_str());
+    }
+
+    // Writes the values through an index writer, in writes of write_size bytes so that values may be split across them.
+    bool write_indexed(std::vector<uint32_t> const &values, uint64_t interval, size_t write_size)
+    {
+        FILE *output_file = fopen(output_filename.c_str(), "wb");
+        if (!output_file) {
+            return false;
+        }
+        struct fence_index_writer *writer = fence_index_writer_new(index_filename.c_str(), interval, output_file);
+        if (!writer) {
+            fclose(output_file);
+            return false;
+        }
+        FILE *stream = fence_index_writer_get_stream(writer);
+        char const *bytes = reinterpret_cast<char const *>(values.data());
+        size_t const size = values.size() * sizeof(uint32_t);
+        bool success = true;
+        for (size_t offset = 0; success && (offset < size); offset += write_size) {
+            size_t const chunk = std::min(write_size, size - offset);
+            success = (fwrite(bytes + offset, 1, chunk, stream) == chunk);
+        }
+        success = success && fence_index_writer_finish(writer);
+        fence_index_writer_delete(writer);
+        return (fclose(output_file) == 0) && success;
+    }
+
+    // Opens the index for lookups in the output file.
+    struct fence_index *open_index()
+    {
+        int const fd = open(output_filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct fence_index *index = fence_index_open(index_filename.c_str(), fd);
+        close(fd);
+        return index;
+    }
+
+    std::string output_filename;
+    std::string index_filename;
+};
+
+TEST_F(FenceIndexTest, OutputIsPassedThroughAndIndexed)
+{
+    std::vector<uint32_t> values;
+    for (uint32_t i = 0; i < 1000; i++) {
+        values.push_back(i * 3);
+    }
+    ASSERT_TRUE(write_indexed(values, 100, 7));
+
+    std::vector<uint32_t> written(values.size());
+    FILE *output_file = fopen(output_filename.c_str(), "rb");
+    ASSERT_TRUE(output_file != nullptr);
+    EXPECT_EQ(fread(written.data(), sizeof(uint32_t), written.size() + 1, output_file), values.size());
+    fclose(output_file);
+    EXPECT_EQ(written, values);
+
+    struct fence_index *index = open_index();
+    ASSERT_TRUE(index != nullptr);
+    EXPECT_EQ(fence_index_get_interval(index), 100);
+    EXPECT_EQ(fence_index_get_num_values(index), 1000);
+    fence_index_close(index);
+}
+
+TEST_F(FenceIndexTest, BracketHoldsTheFirstValueThatIsAtLeastTheKey)
+{
+    std::vector<uint32_t> values;
+    for (uint32_t i = 0; i < 1050; i++) {
+        values.push_back(10 + (i / 2) * 2);
+    }
+    uint64_t const interval = 64;
+    ASSERT_TRUE(write_indexed(values, interval, 4096));
+
+    struct fence_index *index = open_index();
+    ASSERT_TRUE(index != nullptr);
+    for (uint32_t key : {0u, 10u, 11u, 12u, 500u, 501u, 1058u, 1059u, 5000u}) {
+        uint64_t const expected =
+                std::lower_bound(values.begin(), values.end(), key) - values.begin();
+        uint64_t begin_offset = 0;
+        uint64_t end_offset = 0;
+        fence_index_bracket(index, key, &begin_offset, &end_offset);
+        EXPECT_LE(begin_offset / sizeof(uint32_t), expected) << key;
+        EXPECT_GE(end_offset / sizeof(uint32_t), expected) << key;
+        EXPECT_LE(end_offset - begin_offset, interval * sizeof(uint32_t)) << key;
+    }
+    fence_index_close(index);
+}
+
+TEST_F(FenceIndexTest, UnfinishedIndexIsRemoved)
+{
+    FILE *output_file = fopen(output_filename.c_str(), "wb");
+    ASSERT_TRUE(output_file != nullptr);
+    struct fence_index_writer *writer = fence_index_writer_new(index_filename.c_str(), 10, output_file);
+    ASSERT_TRUE(writer != nullptr);
+    uint32_t const value = 1;
+    fwrite(&value, sizeof(value), 1, fence_index_writer_get_stream(writer));
+    fence_index_writer_delete(writer);
+    fclose(output_file);
+
+    EXPECT_NE(access(index_filename.c_str(), F_OK), 0);
+}
+
+TEST_F(FenceIndexTest, OtherFilesAreNotOpenedAsIndexes)
+{
+    FILE *file = fopen(index_filename.c_str(), "wb");
+    ASSERT_TRUE(file != nullptr);
+    fputs("not an index, but long enough to have a header", file);
+    fclose(file);
+
+    EXPECT_EQ(open_index(), nullptr);
+}
+
+TEST_F(FenceIndexTest, IndexOfAnEarlierVersionOfTheFileIsRefused)
+{
+    std::vector<uint32_t> values(500, 7);
+    ASSERT_TRUE(write_indexed(values, 50, 4096));
+
+    // Rewrite the file with as many values. Its modification time is moved on explicitly, as a rewrite may well land
+    // within the file system's timestamp granularity.
+    std::vector<uint32_t> const other_values(values.size(), 9);
+    FILE *output_file = fopen(output_filename.c_str(), "wb");
+    ASSERT_TRUE(output_file != nullptr);
+    EXPECT_EQ(fwrite(other_values.data(), sizeof(uint32_t), other_values.size(), output_file), other_values.size());
+    fclose(output_file);
+    struct stat output_status = {};
+    ASSERT_EQ(stat(output_filename.c_str(), &output_status), 0);
+    struct timespec const times[2] = {output_status.st_atim, {output_status.st_mtim.tv_sec + 1, 0}};
+    ASSERT_EQ(utimensat(AT_FDCWD, output_filename.c_str(), times, 0), 0);
+
+    EXPECT_EQ(open_index(), nullptr);
+}
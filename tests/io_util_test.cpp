@@ -0,0 +1,58 @@
+#include "gtest/gtest.h"
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include "io_util.h"
+}
+
+class IoUtilTest : public ::testing::Test {
+protected:
+    void SetUp() override
+    {
+        filename = ::testing::TempDir() + "io_util_test";
+        fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ASSERT_GE(fd, 0);
+    }
+
+    void TearDown() override
+    {
+        close(fd);
+        remove(filename.c_str());
+    }
+
+    std::string filename;
+    int fd = -1;
+};
+
+TEST_F(IoUtilTest, WritesAndReadsAtOffsets)
+{
+    std::vector<uint32_t> values(100000);
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i] = (uint32_t) (i * 3);
+    }
+    size_t const size = values.size() * sizeof(uint32_t);
+    ASSERT_TRUE(io_write_fully(fd, values.data(), size));
+    ASSERT_TRUE(io_pwrite_fully(fd, values.data(), size, size));
+
+    std::vector<uint32_t> read(values.size());
+    ASSERT_TRUE(io_pread_fully(fd, read.data(), size, size));
+    EXPECT_EQ(read, values);
+    ASSERT_TRUE(io_pread_fully(fd, read.data(), sizeof(uint32_t), 5 * sizeof(uint32_t)));
+    EXPECT_EQ(read[0], 15);
+}
+
+TEST_F(IoUtilTest, ReadingPastTheEndFails)
+{
+    uint32_t const value = 7;
+    ASSERT_TRUE(io_write_fully(fd, &value, sizeof(value)));
+    uint32_t read[2] = {0, 0};
+    errno = 0;
+    EXPECT_FALSE(io_pread_fully(fd, read, sizeof(read), 0));
+    EXPECT_EQ(errno, EIO);
+    EXPECT_TRUE(io_pread_fully(fd, read, 0, 100));
+}
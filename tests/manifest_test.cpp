@@ -0,0 +1,111 @@
+#include "gtest/gtest.h"
+#include <cstdio>
+#include <string>
+
+extern "C" {
+#include "manifest.h"
+}
+
+class ManifestTest : public ::testing::Test {
+protected:
+    void SetUp() override
+    {
+        filename = ::testing::TempDir() + "manifest_test.manifest";
+        std::remove(filename.c_str());
+    }
+
+    void TearDown() override
+    {
+        std::remove(filename.c_str());
+    }
+
+    std::string filename;
+    struct manifest_input const input = {4096, 1700000000, 123, 1024, 0};
+};
+
+TEST_F(ManifestTest, NewManifestStartsEmpty)
+{
+    struct manifest *manifest = manifest_new(filename.c_str(), &input, true);
+    ASSERT_TRUE(manifest != nullptr);
+    EXPECT_FALSE(manifest_was_resumed(manifest));
+    EXPECT_EQ(manifest_get_num_runs(manifest), 0);
+    EXPECT_FALSE(manifest_runs_complete(manifest));
+    EXPECT_EQ(manifest_get_fan_in(manifest), 0);
+    EXPECT_EQ(manifest_get_num_groups(manifest), 0);
+    manifest_delete(manifest);
+}
+
+TEST_F(ManifestTest, ResumeRestoresRecordedState)
+{
+    struct manifest *manifest = manifest_new(filename.c_str(), &input, false);
+    ASSERT_TRUE(manifest != nullptr);
+    EXPECT_TRUE(manifest_add_run(manifest));
+    EXPECT_TRUE(manifest_add_run(manifest));
+    EXPECT_TRUE(manifest_add_run(manifest));
+    EXPECT_TRUE(manifest_finish_runs(manifest));
+    EXPECT_TRUE(manifest_set_fan_in(manifest, 2));
+    EXPECT_TRUE(manifest_add_group(manifest, 1, 0));
+    manifest_delete(manifest);
+
+    manifest = manifest_new(filename.c_str(), &input, true);
+    ASSERT_TRUE(manifest != nullptr);
+    EXPECT_TRUE(manifest_was_resumed(manifest));
+    EXPECT_EQ(manifest_get_num_runs(manifest), 3);
+    EXPECT_TRUE(manifest_runs_complete(manifest));
+    EXPECT_EQ(manifest_get_fan_in(manifest), 2);
+    EXPECT_EQ(manifest_get_num_groups(manifest), 1);
+
+    // Records appended after resuming are kept too.
+    EXPECT_TRUE(manifest_add_group(manifest, 1, 1));
+    manifest_delete(manifest);
+
+    manifest = manifest_new(filename.c_str(), &input, true);
+    ASSERT_TRUE(manifest != nullptr);
+    EXPECT_EQ(manifest_get_num_groups(manifest), 2);
+    manifest_delete(manifest);
+}
+
+TEST_F(ManifestTest, TornRecordIsDropped)
+{
+    struct manifest *manifest = manifest_new(filename.c_str(), &input, false);
+    ASSERT_TRUE(manifest != nullptr);
+    EXPECT_TRUE(manifest_add_run(manifest));
+    manifest_delete(manifest);
+
+    // Simulate dying part way through appending a record.
+    FILE *file = std::fopen(filename.c_str(), "a");
+    ASSERT_TRUE(file != nullptr);
+    std::fputs("run 1", file);
+    std::fclose(file);
+
+    manifest = manifest_new(filename.c_str(), &input, true);
+    ASSERT_TRUE(manifest != nullptr);
+    EXPECT_EQ(manifest_get_num_runs(manifest), 1);
+    EXPECT_TRUE(manifest_add_run(manifest));
+    manifest_delete(manifest);
+
+    manifest = manifest_new(filename.c_str(), &input, true);
+    ASSERT_TRUE(manifest != nullptr);
+    EXPECT_EQ(manifest_get_num_runs(manifest), 2);
+    manifest_delete(manifest);
+}
+
+TEST_F(ManifestTest, DifferentInputCannotBeResumed)
+{
+    struct manifest *manifest = manifest_new(filename.c_str(), &input, false);
+    ASSERT_TRUE(manifest != nullptr);
+    EXPECT_TRUE(manifest_add_run(manifest));
+    manifest_delete(manifest);
+
+    struct manifest_input other_input = input;
+    other_input.mtime_seconds++;
+    EXPECT_TRUE(manifest_new(filename.c_str(), &other_input, true) == nullptr);
+
+    other_input = input;
+    other_input.run_size *= 2;
+    EXPECT_TRUE(manifest_new(filename.c_str(), &other_input, true) == nullptr);
+
+    other_input = input;
+    other_input.limit = 10;
+    EXPECT_TRUE(manifest_new(filename.c_str(), &other_input, true) == nullptr);
+}
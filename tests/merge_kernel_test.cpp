@@ -0,0 +1,92 @@
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <random>
+#include <vector>
+
+extern "C" {
+#include "merge_kernel.h"
+}
+
+class MergeKernelTest : public ::testing::TestWithParam<enum merge_kernel> {
+protected:
+    void SetUp() override
+    {
+        if (!merge_kernel_set_active(GetParam())) {
+            GTEST_SKIP() << "CPU doesn't support the " << merge_kernel_get_name(GetParam()) << " kernel";
+        }
+    }
+
+    void TearDown() override
+    {
+        merge_kernel_set_active(merge_kernel_get_best());
+    }
+
+    static std::vector<uint32_t> sorted_values(std::mt19937 &random, size_t count, uint32_t max_value)
+    {
+        std::uniform_int_distribution<uint32_t> distribution(0, max_value);
+        std::vector<uint32_t> values(count);
+        std::generate(values.begin(), values.end(), [&]() { return distribution(random); });
+        std::sort(values.begin(), values.end());
+        return values;
+    }
+};
+
+TEST_P(MergeKernelTest, MergesLikeStdMerge)
+{
+    std::mt19937 random(1234);
+    size_t const sizes[] = {0, 1, 7, 8, 9, 15, 16, 17, 100, 1000};
+    uint32_t const max_values[] = {3, 1000, UINT32_MAX};
+    for (size_t a_count : sizes) {
+        for (size_t b_count : sizes) {
+            for (uint32_t max_value : max_values) {
+                std::vector<uint32_t> a = sorted_values(random, a_count, max_value);
+                std::vector<uint32_t> b = sorted_values(random, b_count, max_value);
+                std::vector<uint32_t> expected(a_count + b_count);
+                std::merge(a.begin(), a.end(), b.begin(), b.end(), expected.begin());
+
+                std::vector<uint32_t> output(a_count + b_count);
+                merge_kernel_merge(a.data(), a_count, b.data(), b_count, output.data());
+                EXPECT_EQ(output, expected) << a_count << " + " << b_count << " values up to " << max_value;
+            }
+        }
+    }
+}
+
+TEST_P(MergeKernelTest, MergesDisjointRanges)
+{
+    // All of one input sorts before all of the other, so one input is used up long before the other.
+    std::vector<uint32_t> low(100);
+    std::vector<uint32_t> high(100);
+    for (size_t i = 0; i < 100; i++) {
+        low[i] = (uint32_t) i;
+        high[i] = (uint32_t) (i + 100);
+    }
+    std::vector<uint32_t> output(200);
+    merge_kernel_merge(high.data(), high.size(), low.data(), low.size(), output.data());
+    for (size_t i = 0; i < output.size(); i++) {
+        EXPECT_EQ(output[i], i);
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+        Kernels, MergeKernelTest, ::testing::Values(MERGE_KERNEL_SCALAR, MERGE_KERNEL_AVX2),
+        [](::testing::TestParamInfo<enum merge_kernel> const &info) {
+            return std::string(merge_kernel_get_name(info.param));
+        });
+
+TEST(MergeKernelSplitTest, SplitGivesSmallestValues)
+{
+    std::vector<uint32_t> const a = {1, 3, 5, 5, 7, 9};
+    std::vector<uint32_t> const b = {2, 4, 5, 6, 8};
+    std::vector<uint32_t> merged(a.size() + b.size());
+    std::merge(a.begin(), a.end(), b.begin(), b.end(), merged.begin());
+
+    for (size_t k = 0; k <= merged.size(); k++) {
+        size_t const from_a = merge_kernel_split(a.data(), a.size(), b.data(), b.size(), k);
+        ASSERT_LE(from_a, a.size());
+        ASSERT_LE(k - from_a, b.size());
+        std::vector<uint32_t> prefix(k);
+        std::merge(a.begin(), a.begin() + (long) from_a, b.begin(), b.begin() + (long) (k - from_a), prefix.begin());
+        EXPECT_TRUE(std::equal(prefix.begin(), prefix.end(), merged.begin())) << k;
+    }
+}
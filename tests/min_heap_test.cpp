@@ -50,52 +50,78 @@ TEST_F(MinHeapTest, CannotAddMoreElementsThanHeapCapacity)
 
     size_t capacity = min_heap_capacity(heap);
     for (size_t i = 0; i < capacity; i++) {
-        EXPECT_TRUE(min_heap_add(heap, (uint32_t) i, nullptr));
+        EXPECT_TRUE(min_heap_add(heap, (uint32_t) i, 0));
     }
     EXPECT_TRUE(min_heap_is_full(heap));
-    EXPECT_FALSE(min_heap_add(heap, (uint32_t) capacity, nullptr));
+    EXPECT_FALSE(min_heap_add(heap, (uint32_t) capacity, 0));
 }
 
 TEST_F(MinHeapTest, CannotPopFromEmptyHeap)
 {
     uint32_t key = 0;
-    FILE *value = nullptr;
+    uint32_t value = 0;
     EXPECT_FALSE(min_heap_pop(heap, &key, &value));
 }
 
 TEST_F(MinHeapTest, CanPopAddedElement)
 {
     uint32_t key = 0;
-    FILE *value = nullptr;
-    EXPECT_TRUE(min_heap_add(heap, 42, (FILE *) 0x12345678));
+    uint32_t value = 0;
+    EXPECT_TRUE(min_heap_add(heap, 42, 0x12345678));
     EXPECT_TRUE(min_heap_pop(heap, &key, &value));
     EXPECT_EQ(key, 42);
-    EXPECT_EQ(value, (FILE *) 0x12345678);
+    EXPECT_EQ(value, 0x12345678);
 }
 
 TEST_F(MinHeapTest, CannotPopMoreElementsThanAdded)
 {
     uint32_t key = 0;
-    FILE *value = nullptr;
-    EXPECT_TRUE(min_heap_add(heap, 42, (FILE *) 0x12345678));
+    uint32_t value = 0;
+    EXPECT_TRUE(min_heap_add(heap, 42, 0x12345678));
     EXPECT_TRUE(min_heap_pop(heap, &key, &value));
     EXPECT_EQ(key, 42);
-    EXPECT_EQ(value, (FILE *) 0x12345678);
+    EXPECT_EQ(value, 0x12345678);
     EXPECT_FALSE(min_heap_pop(heap, &key, &value));
 }
 
+TEST_F(MinHeapTest, CannotPeekAtEmptyHeap)
+{
+    uint32_t key = 0;
+    uint32_t value = 0;
+    EXPECT_FALSE(min_heap_peek(heap, &key, &value));
+}
+
+TEST_F(MinHeapTest, PeekReturnsTopElementWithoutRemovingIt)
+{
+    uint32_t key = 0;
+    uint32_t value = 0;
+    EXPECT_TRUE(min_heap_add(heap, 42, 0x00000001));
+    EXPECT_TRUE(min_heap_add(heap, 7, 0x00000002));
+
+    EXPECT_TRUE(min_heap_peek(heap, &key, &value));
+    EXPECT_EQ(key, 7);
+    EXPECT_EQ(value, 0x00000002);
+    EXPECT_EQ(min_heap_count(heap), 2);
+
+    // Popping returns the same element that was peeked at.
+    EXPECT_TRUE(min_heap_pop(heap, &key, &value));
+    EXPECT_EQ(key, 7);
+    EXPECT_TRUE(min_heap_peek(heap, &key, &value));
+    EXPECT_EQ(key, 42);
+}
+
 TEST_F(MinHeapTest, SmallestElementInsertedLastMovesToTopOfHeap)
 {
     uint32_t key = 0;
-    FILE *value = nullptr;
+    uint32_t value = 0;
 
     // The heap has 0 elements
     EXPECT_EQ(min_heap_count(heap), 0);
 
     // 42 is added to the end of the heap and it becomes the top of heap since it's the only element.
-    EXPECT_TRUE(min_heap_add(heap, 42, (FILE *) 0x00000001));
+    EXPECT_TRUE(min_heap_add(heap, 42, 0x00000001));
     // 0 is added to the end of the heap and it becomes the top of heap since it's smaller than 42.
-    EXPECT_TRUE(min_heap_add(heap, 0, (FILE *) 0x00000002));
+    EXPECT_TRUE(min_heap_add(heap, 0, 0x00000002));
 
     // The heap now has 2 elements
     EXPECT_EQ(min_heap_count(heap), 2);
@@ -103,12 +129,12 @@ TEST_F(MinHeapTest, SmallestElementInsertedLastMovesToTopOfHeap)
     // 0 is popped from the heap and 42 becomes the new top of heap.
     EXPECT_TRUE(min_heap_pop(heap, &key, &value));
     EXPECT_EQ(key, 0);
-    EXPECT_EQ(value, (FILE *) 0x00000002);
+    EXPECT_EQ(value, 0x00000002);
 
     // 42 is popped from the heap and the heap is now empty
     EXPECT_TRUE(min_heap_pop(heap, &key, &value));
     EXPECT_EQ(key, 42);
-    EXPECT_EQ(value, (FILE *) 0x00000001);
+    EXPECT_EQ(value, 0x00000001);
 
     // The heap is now empty
     EXPECT_EQ(min_heap_count(heap), 0);
@@ -117,7 +143,7 @@ TEST_F(MinHeapTest, SmallestElementInsertedLastMovesToTopOfHeap)
 TEST_F(MinHeapTest, HeapIsMaintainedAsElementsAreAddedAndRemoved)
 {
     uint32_t key = 0;
-    FILE *value = nullptr;
+    uint32_t value = 0;
 
     // The heap has 0 elements
     EXPECT_EQ(min_heap_count(heap), 0);
@@ -126,7 +152,7 @@ TEST_F(MinHeapTest, HeapIsMaintainedAsElementsAreAddedAndRemoved)
     /* Heap:
              100
     */
-    EXPECT_TRUE(min_heap_add(heap, 100, (FILE *) 0x00000001));
+    EXPECT_TRUE(min_heap_add(heap, 100, 0x00000001));
 
     // 50 is added to the end of the heap and, because it is smaller than the 100 at the top, it is swapped with 100.
     /* Heap:
@@ -134,7 +160,7 @@ TEST_F(MinHeapTest, HeapIsMaintainedAsElementsAreAddedAndRemoved)
             /         ->      /
           50                100
     */
-    EXPECT_TRUE(min_heap_add(heap, 50, (FILE *) 0x00000002));
+    EXPECT_TRUE(min_heap_add(heap, 50, 0x00000002));
 
     // 200 is added to the end of the heap and, because it is larger than the 50 above it, it stays at the end.
     /* Heap:
@@ -142,7 +168,7 @@ TEST_F(MinHeapTest, HeapIsMaintainedAsElementsAreAddedAndRemoved)
             /   \     ->    /   \
           100   200       100   200
     */
-    EXPECT_TRUE(min_heap_add(heap, 200, (FILE *) 0x00000003));
+    EXPECT_TRUE(min_heap_add(heap, 200, 0x00000003));
 
     // 0 is added to the end of the heap and it moves upwards to become the top of the heap.
     /* Heap:
@@ -152,7 +178,7 @@ TEST_F(MinHeapTest, HeapIsMaintainedAsElementsAreAddedAndRemoved)
          /               /              /
         0              100            100
     */
-    EXPECT_TRUE(min_heap_add(heap, 0, (FILE *) 0x00000004));
+    EXPECT_TRUE(min_heap_add(heap, 0, 0x00000004));
 
     // 150 is added to the end of the heap and, because it is larger than the 50 above it, it stays at the end.
     /* Heap:
@@ -162,7 +188,7 @@ TEST_F(MinHeapTest, HeapIsMaintainedAsElementsAreAddedAndRemoved)
          /   \           /   \
        100   150       100   150
     */
-    EXPECT_TRUE(min_heap_add(heap, 150, (FILE *) 0x00000005));
+    EXPECT_TRUE(min_heap_add(heap, 150, 0x00000005));
 
     // 160 is added to the end of the heap and, because it is smaller than the 200 above it, is swapped with 200.
     /* Heap:
@@ -172,7 +198,7 @@ TEST_F(MinHeapTest, HeapIsMaintainedAsElementsAreAddedAndRemoved)
          /   \      /         /   \      /
        100   150  160       100   150  200
     */
-    EXPECT_TRUE(min_heap_add(heap, 160, (FILE *) 0x00000006));
+    EXPECT_TRUE(min_heap_add(heap, 160, 0x00000006));
 
     // The heap now has 6 elements
     EXPECT_EQ(min_heap_count(heap), 6);
@@ -187,7 +213,7 @@ TEST_F(MinHeapTest, HeapIsMaintainedAsElementsAreAddedAndRemoved)
     */
     EXPECT_TRUE(min_heap_pop(heap, &key, &value));
     EXPECT_EQ(key, 0);
-    EXPECT_EQ(value, (FILE *) 0x00000004);
+    EXPECT_EQ(value, 0x00000004);
 
     // 50 is popped and 150, which is the end of the heap, moves to the top and then downwards.
     /* Heap:
@@ -199,7 +225,7 @@ TEST_F(MinHeapTest, HeapIsMaintainedAsElementsAreAddedAndRemoved)
     */
     EXPECT_TRUE(min_heap_pop(heap, &key, &value));
     EXPECT_EQ(key, 50);
-    EXPECT_EQ(value, (FILE *) 0x00000002);
+    EXPECT_EQ(value, 0x00000002);
 
     // 100 is popped and 200, which is the end of the heap, moves to the top and then downwards.
     /* Heap:
@@ -211,7 +237,7 @@ TEST_F(MinHeapTest, HeapIsMaintainedAsElementsAreAddedAndRemoved)
     */
     EXPECT_TRUE(min_heap_pop(heap, &key, &value));
     EXPECT_EQ(key, 100);
-    EXPECT_EQ(value, (FILE *) 0x00000001);
+    EXPECT_EQ(value, 0x00000001);
 
     // 150 is popped and 160, which is the end of the heap, moves to the top and stays there.
     /* Heap:
@@ -221,7 +247,7 @@ TEST_F(MinHeapTest, HeapIsMaintainedAsElementsAreAddedAndRemoved)
     */
     EXPECT_TRUE(min_heap_pop(heap, &key, &value));
     EXPECT_EQ(key, 150);
-    EXPECT_EQ(value, (FILE *) 0x00000005);
+    EXPECT_EQ(value, 0x00000005);
 
     // 160 is popped and 200, which is the end of the heap, moves to the top and stays there.
     /* Heap:
@@ -231,12 +257,12 @@ TEST_F(MinHeapTest, HeapIsMaintainedAsElementsAreAddedAndRemoved)
     */
     EXPECT_TRUE(min_heap_pop(heap, &key, &value));
     EXPECT_EQ(key, 160);
-    EXPECT_EQ(value, (FILE *) 0x00000006);
+    EXPECT_EQ(value, 0x00000006);
 
     // 200 is popped from the heap and the heap is now empty
     EXPECT_TRUE(min_heap_pop(heap, &key, &value));
     EXPECT_EQ(key, 200);
-    EXPECT_EQ(value, (FILE *) 0x00000003);
+    EXPECT_EQ(value, 0x00000003);
 
     // The heap is now empty
     EXPECT_EQ(min_heap_count(heap), 0);
@@ -246,14 +272,31 @@ TEST_F(MinHeapTest, CanClearHeap)
 {
     size_t capacity = min_heap_capacity(heap);
     for (size_t i = 0; i < capacity; i++) {
-        EXPECT_TRUE(min_heap_add(heap, (uint32_t) i, nullptr));
+        EXPECT_TRUE(min_heap_add(heap, (uint32_t) i, 0));
     }
     // Heap is full. Cannot add another element.
-    EXPECT_FALSE(min_heap_add(heap, (uint32_t) capacity, nullptr));
+    EXPECT_FALSE(min_heap_add(heap, (uint32_t) capacity, 0));
 
     // Clear heap
     min_heap_clear(heap);
 
     // Can now add another element.
-    EXPECT_TRUE(min_heap_add(heap, (uint32_t) capacity, nullptr));
+    EXPECT_TRUE(min_heap_add(heap, (uint32_t) capacity, 0));
+}
+
+TEST_F(MinHeapTest, EqualKeysArePoppedInValueOrder)
+{
+    uint32_t key = 0;
+    uint32_t value = 0;
+    for (uint32_t v : {5, 2, 7, 0, 3}) {
+        EXPECT_TRUE(min_heap_add(heap, 9, v));
+    }
+    EXPECT_TRUE(min_heap_add(heap, 4, 6));
+    EXPECT_TRUE(min_heap_pop(heap, &key, &value));
+    EXPECT_EQ(key, 4);
+    for (uint32_t expected_value : {0, 2, 3, 5, 7}) {
+        EXPECT_TRUE(min_heap_pop(heap, &key, &value));
+        EXPECT_EQ(key, 9);
+        EXPECT_EQ(value, expected_value);
+    }
 }
@@ -0,0 +1,123 @@
+#include "gtest/gtest.h"
+#include <sys/resource.h>
+
+extern "C" {
+#include "plan.h"
+}
+
+TEST(PlanTest, MergeMemoryFitsWithinBudget)
+{
+    struct sort_plan plan = {};
+    size_t const memory_size = (size_t) 64 << 20;
+    EXPECT_TRUE(plan_sort(&plan, memory_size, 0, (uint64_t) 100 << 30, 0));
+    EXPECT_EQ(plan.run_size, memory_size);
+    EXPECT_GE(plan.fan_in, 2);
+    EXPECT_LE(plan.merge_memory_size, memory_size);
+    EXPECT_EQ(plan.block_size % 4, 0);
+}
+
+TEST(PlanTest, InputThatFitsInOneRunNeedsNoMerge)
+{
+    struct sort_plan plan = {};
+    EXPECT_TRUE(plan_sort(&plan, 1 << 20, 0, 1000, 0));
+    EXPECT_EQ(plan.estimated_runs, 1);
+    EXPECT_EQ(plan.estimated_generations, 0);
+}
+
+TEST(PlanTest, FanInIsCappedAtMaxFiles)
+{
+    struct sort_plan plan = {};
+    EXPECT_TRUE(plan_sort(&plan, 1 << 20, 1024, 1 << 20, 2));
+    EXPECT_EQ(plan.run_size, 1024);
+    EXPECT_EQ(plan.estimated_runs, 1024);
+    EXPECT_EQ(plan.fan_in, 2);
+    EXPECT_EQ(plan.estimated_generations, 10);
+}
+
+TEST(PlanTest, RunSizeIsCappedAtMemorySize)
+{
+    struct sort_plan plan = {};
+    EXPECT_TRUE(plan_sort(&plan, 1 << 16, 1 << 17, 1 << 20, 0));
+    EXPECT_EQ(plan.run_size, 1 << 16);
+}
+
+TEST(PlanTest, TooLittleMemoryFails)
+{
+    struct sort_plan plan = {};
+    EXPECT_FALSE(plan_sort(&plan, 4, 0, 1 << 20, 0));
+}
+
+TEST(PlanTest, MergeCanBeReplannedForActualRuns)
+{
+    // An input of unknown size is planned as if it fits in one run...
+    struct sort_plan plan = {};
+    EXPECT_TRUE(plan_sort(&plan, 1 << 20, 1024, 0, 0));
+    EXPECT_EQ(plan.estimated_runs, 1);
+    EXPECT_EQ(plan.estimated_generations, 0);
+
+    // ...and re-planned once the runs have been created.
+    EXPECT_TRUE(plan_merge(&plan, 1024, 2));
+    EXPECT_EQ(plan.run_size, 1024);
+    EXPECT_EQ(plan.estimated_runs, 1024);
+    EXPECT_EQ(plan.fan_in, 2);
+    EXPECT_EQ(plan.estimated_generations, 10);
+}
+
+TEST(PlanTest, RunsThatShareAFileAreNotBoundByTheOpenFileLimit)
+{
+    // Lower the open file limit for the duration of the test so that it's small enough to plan past.
+    struct rlimit original = {};
+    ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &original), 0);
+    struct rlimit lowered = original;
+    lowered.rlim_cur = 256;
+    ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &lowered), 0);
+    size_t const open_file_limit = plan_get_open_file_limit();
+    size_t const num_runs = open_file_limit * 2;
+
+    struct sort_plan plan = {};
+    EXPECT_TRUE(plan_sort(&plan, (size_t) 1 << 30, 1 << 20, (uint64_t) num_runs << 20, num_runs));
+    EXPECT_LE(plan.fan_in, open_file_limit);
+
+    plan.runs_share_file = true;
+    EXPECT_TRUE(plan_merge(&plan, num_runs, num_runs));
+    EXPECT_EQ(plan.fan_in, num_runs);
+    EXPECT_EQ(plan.estimated_generations, 1);
+
+    setrlimit(RLIMIT_NOFILE, &original);
+}
+
+TEST(PlanTest, SlowSeeksFavorFewerLargerBlocks)
+{
+    // A hard drive, where a seek costs as much as reading a megabyte, and an NVMe drive, where it hardly costs at all.
+    struct sort_plan hard_drive = {};
+    hard_drive.device = {.sequential_bytes_per_second = 150.0 * (1 << 20), .seek_seconds = 0.008,
+                         .sort_bytes_per_second = 200.0 * (1 << 20)};
+    struct sort_plan nvme = {};
+    nvme.device = {.sequential_bytes_per_second = 3000.0 * (1 << 20), .seek_seconds = 0.00002,
+                   .sort_bytes_per_second = 200.0 * (1 << 20)};
+    size_t const memory_size = (size_t) 64 << 20;
+    uint64_t const input_size = (uint64_t) 10 << 30;
+    ASSERT_TRUE(plan_sort(&hard_drive, memory_size, 0, input_size, 0));
+    ASSERT_TRUE(plan_sort(&nvme, memory_size, 0, input_size, 0));
+
+    EXPECT_LT(hard_drive.fan_in, nvme.fan_in);
+    EXPECT_GT(hard_drive.block_size, nvme.block_size);
+    EXPECT_LT(nvme.estimated_generations, hard_drive.estimated_generations);
+    EXPECT_GT(hard_drive.estimated_merge_seconds, nvme.estimated_merge_seconds);
+}
+
+TEST(PlanTest, BlocksHoldWholeRecords)
+{
+    // Blocks that are smaller than a page are cut down to whole records rather than whole values.
+    struct sort_plan plan = {};
+    plan.record_size = 12;
+    plan.memory_size = 10000;
+    plan.run_size = 1 << 20;
+    EXPECT_TRUE(plan_merge(&plan, 2, 0));
+    EXPECT_GT(plan.block_size, 0);
+    EXPECT_LT(plan.block_size, 4096);
+    EXPECT_EQ(plan.block_size % 12, 0);
+
+    plan.memory_size = 8000;
+    EXPECT_FALSE(plan_merge(&plan, 2, 0));
+}
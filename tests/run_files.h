@@ -0,0 +1,70 @@
+#ifndef RUN_FILES_H
+#define RUN_FILES_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "fence_index.h"
+}
+
+// Helpers for tests that work on the initial runs that create_runs() leaves behind, named
+// "[base_filename].0.[run_number]", with "[base_filename].idx.0.[run_number]" as a run's index if it has one.
+
+inline std::string run_filename(std::string const &base_filename, size_t run_number)
+{
+    return base_filename + ".0." + std::to_string(run_number);
+}
+
+inline std::string run_index_filename(std::string const &base_filename, size_t run_number)
+{
+    return base_filename + ".idx.0." + std::to_string(run_number);
+}
+
+// Sorts the values and writes them as a run, along with an index of every index_interval-th value unless that's zero.
+inline bool write_run(
+        std::string const &base_filename, size_t run_number, std::vector<uint32_t> &values, uint64_t index_interval)
+{
+    std::sort(values.begin(), values.end());
+    FILE *run_file = fopen(run_filename(base_filename, run_number).c_str(), "wb");
+    if (!run_file) {
+        return false;
+    }
+    struct fence_index_writer *writer = nullptr;
+    if (index_interval > 0) {
+        writer = fence_index_writer_new(
+                run_index_filename(base_filename, run_number).c_str(), index_interval, run_file);
+        if (!writer) {
+            fclose(run_file);
+            return false;
+        }
+    }
+    FILE *stream = writer ? fence_index_writer_get_stream(writer) : run_file;
+    bool success = (fwrite(values.data(), sizeof(uint32_t), values.size(), stream) == values.size());
+    if (writer) {
+        success = success && fence_index_writer_finish(writer);
+        fence_index_writer_delete(writer);
+    }
+    return (fclose(run_file) == 0) && success;
+}
+
+// Reads all of the values in a file, or none if it can't be opened.
+inline std::vector<uint32_t> read_values(std::string const &filename)
+{
+    std::vector<uint32_t> values;
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (!file) {
+        return values;
+    }
+    uint32_t value = 0;
+    while (fread(&value, sizeof(value), 1, file) == 1) {
+        values.push_back(value);
+    }
+    fclose(file);
+    return values;
+}
+
+#endif // RUN_FILES_H
@@ -0,0 +1,139 @@
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include "run.h"
+}
+
+static void expect_smallest_selected(std::vector<uint32_t> values, size_t k)
+{
+    std::vector<uint32_t> expected = values;
+    std::sort(expected.begin(), expected.end());
+    expected.resize(k);
+
+    run_select(values.data(), values.size(), k);
+    std::vector<uint32_t> selected(values.begin(), values.begin() + (long) k);
+    std::sort(selected.begin(), selected.end());
+    EXPECT_EQ(selected, expected);
+}
+
+TEST(RunTest, SelectFindsSmallestValues)
+{
+    std::mt19937 generator(1234);
+    std::vector<uint32_t> values(10000);
+    for (auto &value: values) {
+        value = (uint32_t) generator();
+    }
+    for (size_t k: {0, 1, 2, 100, 5000, 9999, 10000}) {
+        expect_smallest_selected(values, k);
+    }
+}
+
+TEST(RunTest, SelectHandlesDuplicatesAndOrderedInput)
+{
+    std::vector<uint32_t> values(1000);
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i] = (uint32_t) (i % 3);
+    }
+    expect_smallest_selected(values, 500);
+
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i] = (uint32_t) (values.size() - i);
+    }
+    expect_smallest_selected(values, 10);
+    std::reverse(values.begin(), values.end());
+    expect_smallest_selected(values, 990);
+}
+
+TEST(RunTest, SortUsesTheDefaultEngine)
+{
+    std::mt19937 generator(4321);
+    std::vector<uint32_t> values(5000);
+    for (auto &value: values) {
+        value = (uint32_t) generator();
+    }
+    std::vector<uint32_t> expected = values;
+    std::sort(expected.begin(), expected.end());
+
+    enum sort_engine const original = sort_engine_get_default();
+    for (enum sort_engine engine: {SORT_ENGINE_AUTO, SORT_ENGINE_QSORT, SORT_ENGINE_RADIX, SORT_ENGINE_SIMD}) {
+        sort_engine_set_default(engine);
+        std::vector<uint32_t> sorted = values;
+        run_sort(sorted.data(), sorted.size());
+        EXPECT_EQ(sorted, expected) << sort_engine_get_name(engine);
+    }
+    sort_engine_set_default(original);
+}
+
+// Writes values to a temporary file and returns it open for reading, or -1.
+static int open_values_file(std::string const &filename, std::vector<uint32_t> const &values)
+{
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        return -1;
+    }
+    bool const written = (fwrite(values.data(), sizeof(uint32_t), values.size(), file) == values.size());
+    if ((fclose(file) != 0) || !written) {
+        return -1;
+    }
+    return open(filename.c_str(), O_RDONLY);
+}
+
+TEST(RunTest, SampleFileTakesItsShareFromEvenlySpacedPositions)
+{
+    std::vector<uint32_t> values(1000);
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i] = (uint32_t) i;
+    }
+    std::string const filename = ::testing::TempDir() + "run_test.sample";
+    int const fd = open_values_file(filename, values);
+    ASSERT_GE(fd, 0);
+
+    // A quarter of the values get a quarter of the samples, each from the middle of its stretch of the run.
+    std::vector<uint32_t> samples(11);
+    size_t num_samples = 0;
+    EXPECT_TRUE(run_sample_file(fd, values.size(), 4 * values.size(), 40, samples.data(), &num_samples));
+    EXPECT_EQ(num_samples, 10);
+    for (size_t j = 0; j < num_samples; j++) {
+        EXPECT_EQ(samples[j], (2 * j + 1) * 50) << j;
+    }
+
+    // Shares are rounded up, so a small run still gets a sample.
+    EXPECT_TRUE(run_sample_file(fd, values.size(), 1000 * values.size(), 4, samples.data(), &num_samples));
+    EXPECT_EQ(num_samples, 1);
+    EXPECT_EQ(samples[0], 500);
+
+    EXPECT_TRUE(run_sample_file(fd, 0, values.size(), 40, samples.data(), &num_samples));
+    EXPECT_EQ(num_samples, 0);
+    close(fd);
+    remove(filename.c_str());
+}
+
+TEST(RunTest, FindLowerBoundFindsTheFirstValueThatIsAtLeastTheKey)
+{
+    std::vector<uint32_t> const values = {1, 3, 3, 3, 5, 8, 8, 13};
+    std::string const filename = ::testing::TempDir() + "run_test.lower_bound";
+    int const fd = open_values_file(filename, values);
+    ASSERT_GE(fd, 0);
+
+    for (uint32_t key: {0u, 1u, 2u, 3u, 4u, 8u, 13u, 14u}) {
+        uint64_t bound = UINT64_MAX;
+        EXPECT_TRUE(run_find_lower_bound(fd, 0, values.size(), key, &bound));
+        EXPECT_EQ(bound, (uint64_t) (std::lower_bound(values.begin(), values.end(), key) - values.begin())) << key;
+    }
+
+    // The search stays within the range it's given.
+    uint64_t bound = 0;
+    EXPECT_TRUE(run_find_lower_bound(fd, 5, values.size(), 3, &bound));
+    EXPECT_EQ(bound, 5);
+    EXPECT_TRUE(run_find_lower_bound(fd, 0, 2, 13, &bound));
+    EXPECT_EQ(bound, 2);
+    close(fd);
+    remove(filename.c_str());
+}
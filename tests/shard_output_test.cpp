@@ -0,0 +1,159 @@
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "run_files.h"
+
+extern "C" {
+#include "shard_output.h"
+}
+
+class ShardOutputTest : public ::testing::Test {
+protected:
+    void SetUp() override
+    {
+        base_filename = ::testing::TempDir() + "shard_output_test.runs";
+        output_filename = ::testing::TempDir() + "shard_output_test";
+        arena = arena_new(ARENA_SIZE, ARENA_FLAG_NONE);
+        ASSERT_TRUE(arena != nullptr);
+        pool = thread_pool_new(3);
+        ASSERT_TRUE(pool != nullptr);
+    }
+
+    void TearDown() override
+    {
+        for (size_t i = 0; i < MAX_SHARDS; i++) {
+            remove(part_filename(i).c_str());
+        }
+        remove((output_filename + ".shards").c_str());
+        thread_pool_delete(pool);
+        arena_delete(arena);
+    }
+
+    std::string part_filename(size_t shard) const
+    {
+        return output_filename + ".part." + std::to_string(shard);
+    }
+
+    void add_run(std::vector<uint32_t> values)
+    {
+        ASSERT_TRUE(write_run(base_filename, num_runs, values, 0));
+        all_values.insert(all_values.end(), values.begin(), values.end());
+        num_runs++;
+    }
+
+    std::vector<uint32_t> read_part(size_t shard) const
+    {
+        EXPECT_EQ(access(part_filename(shard).c_str(), F_OK), 0) << shard;
+        return read_values(part_filename(shard));
+    }
+
+    // Shards the runs, and checks that the parts hold the sorted values in order and that the manifest describes
+    // them.
+    void expect_sharded(size_t num_shards, size_t max_files_per_merge)
+    {
+        size_t generations = 0;
+        ASSERT_TRUE(shard_output(
+                base_filename.c_str(), num_runs, output_filename.c_str(), num_shards, arena, max_files_per_merge,
+                BLOCK_SIZE, pool, nullptr, &generations));
+        EXPECT_GE(generations, 1);
+
+        std::ifstream manifest(output_filename + ".shards");
+        std::vector<uint32_t> merged;
+        uint64_t expected_low = 0;
+        for (size_t s = 0; s < num_shards; s++) {
+            std::string filename;
+            uint64_t low = 0;
+            uint64_t end = 0;
+            uint64_t count = 0;
+            ASSERT_TRUE(manifest >> filename >> low >> end >> count);
+            EXPECT_EQ(filename, part_filename(s));
+            EXPECT_EQ(low, expected_low);
+            EXPECT_LE(low, end);
+            std::vector<uint32_t> const part = read_part(s);
+            EXPECT_EQ(part.size(), count);
+            for (uint32_t value : part) {
+                EXPECT_TRUE((value >= low) && (value < end));
+            }
+            merged.insert(merged.end(), part.begin(), part.end());
+            expected_low = end;
+        }
+        EXPECT_EQ(expected_low, (uint64_t) UINT32_MAX + 1);
+        std::string extra;
+        EXPECT_FALSE(manifest >> extra);
+
+        std::sort(all_values.begin(), all_values.end());
+        EXPECT_EQ(merged, all_values);
+
+        // The runs are gone once they've been merged.
+        EXPECT_NE(access(run_filename(base_filename, 0).c_str(), F_OK), 0);
+    }
+
+    static constexpr size_t ARENA_SIZE = 1024 * 1024;
+    static constexpr size_t BLOCK_SIZE = 4096;
+    static constexpr size_t MAX_SHARDS = 8;
+
+    std::string base_filename;
+    std::string output_filename;
+    struct arena *arena = nullptr;
+    struct thread_pool *pool = nullptr;
+    size_t num_runs = 0;
+    std::vector<uint32_t> all_values;
+};
+
+TEST_F(ShardOutputTest, PartsSplitTheKeyRangeEvenly)
+{
+    std::mt19937 generator(1234);
+    for (size_t run = 0; run < 6; run++) {
+        std::vector<uint32_t> values(20000 + (run * 1000));
+        for (auto &value : values) {
+            value = (uint32_t) generator();
+        }
+        add_run(values);
+    }
+    expect_sharded(5, 0);
+
+    // Sampling keeps the parts close to the same size.
+    for (size_t s = 0; s < 5; s++) {
+        size_t const size = read_part(s).size();
+        EXPECT_GT(size, all_values.size() / 5 * 9 / 10);
+        EXPECT_LT(size, all_values.size() / 5 * 11 / 10);
+    }
+}
+
+TEST_F(ShardOutputTest, RunsAreMergedDownFirstWhenThereAreTooManyForEveryThread)
+{
+    std::mt19937 generator(4321);
+    for (size_t run = 0; run < 20; run++) {
+        std::vector<uint32_t> values(3000);
+        for (auto &value : values) {
+            value = (uint32_t) (generator() % 1000);
+        }
+        add_run(values);
+    }
+    expect_sharded(MAX_SHARDS, 4);
+}
+
+TEST_F(ShardOutputTest, DuplicateKeysLeaveSomePartsEmpty)
+{
+    add_run(std::vector<uint32_t>(5000, 7));
+    add_run(std::vector<uint32_t>(3000, 7));
+    expect_sharded(4, 0);
+}
+
+TEST_F(ShardOutputTest, RunsAreRemovedWhenTheyCanNotBeMerged)
+{
+    add_run(std::vector<uint32_t>(1000, 1));
+    add_run(std::vector<uint32_t>(1000, 2));
+    size_t generations = 0;
+    EXPECT_FALSE(shard_output(
+            base_filename.c_str(), num_runs, output_filename.c_str(), 2, arena, 1, BLOCK_SIZE, pool, nullptr,
+            &generations));
+    EXPECT_NE(access(run_filename(base_filename, 0).c_str(), F_OK), 0);
+    EXPECT_NE(access(run_filename(base_filename, 1).c_str(), F_OK), 0);
+}
@@ -0,0 +1,98 @@
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+extern "C" {
+#include "sort_engine.h"
+}
+
+class SortEngineTest : public ::testing::TestWithParam<std::tuple<enum sort_engine, bool>> {
+protected:
+    void check_sorts(std::vector<uint32_t> values)
+    {
+        std::vector<uint32_t> expected = values;
+        std::sort(expected.begin(), expected.end());
+        std::vector<uint32_t> scratch(values.size());
+        sort_engine_sort(
+                std::get<0>(GetParam()), values.data(), values.size(), std::get<1>(GetParam()) ? scratch.data() : nullptr);
+        EXPECT_EQ(values, expected);
+    }
+};
+
+TEST_P(SortEngineTest, SortsRandomValuesOfAnySize)
+{
+    std::mt19937 random(42);
+    for (size_t count : {0, 1, 2, 7, 63, 64, 65, 100, 1000, 4097, 100000}) {
+        std::vector<uint32_t> values(count);
+        std::generate(values.begin(), values.end(), [&]() { return (uint32_t) random(); });
+        check_sorts(values);
+    }
+}
+
+TEST_P(SortEngineTest, SortsFewUniqueValues)
+{
+    std::mt19937 random(42);
+    std::vector<uint32_t> values(50000);
+    std::generate(values.begin(), values.end(), [&]() { return (uint32_t) (random() % 3) * 0x40000000u; });
+    check_sorts(values);
+}
+
+TEST_P(SortEngineTest, SortsSortedAndReversedValues)
+{
+    std::vector<uint32_t> values(10000);
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i] = (uint32_t) i;
+    }
+    check_sorts(values);
+    std::reverse(values.begin(), values.end());
+    check_sorts(values);
+}
+
+TEST_P(SortEngineTest, SortsExtremeValues)
+{
+    std::vector<uint32_t> values;
+    for (size_t i = 0; i < 1000; i++) {
+        values.push_back((i % 2) ? UINT32_MAX : 0);
+    }
+    check_sorts(values);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+        Engines, SortEngineTest,
+        ::testing::Combine(
+                ::testing::Values(SORT_ENGINE_AUTO, SORT_ENGINE_QSORT, SORT_ENGINE_RADIX, SORT_ENGINE_SIMD),
+                ::testing::Bool()),
+        [](::testing::TestParamInfo<std::tuple<enum sort_engine, bool>> const &info) {
+            return std::string(sort_engine_get_name(std::get<0>(info.param))) +
+                   (std::get<1>(info.param) ? "_scratch" : "_in_place");
+        });
+
+TEST(SortEngineNameTest, NamesRoundTrip)
+{
+    for (enum sort_engine engine : {SORT_ENGINE_AUTO, SORT_ENGINE_QSORT, SORT_ENGINE_RADIX, SORT_ENGINE_SIMD}) {
+        enum sort_engine parsed = SORT_ENGINE_AUTO;
+        EXPECT_TRUE(sort_engine_from_name(sort_engine_get_name(engine), &parsed));
+        EXPECT_EQ(parsed, engine);
+    }
+    enum sort_engine parsed = SORT_ENGINE_AUTO;
+    EXPECT_FALSE(sort_engine_from_name("bogosort", &parsed));
+}
+
+TEST(SortEngineChooseTest, SmallOrUnscratchedValuesAreNotProbed)
+{
+    std::vector<uint32_t> values(1 << 20);
+    std::mt19937 random(42);
+    std::generate(values.begin(), values.end(), [&]() { return (uint32_t) random(); });
+    std::vector<uint32_t> scratch(values.size());
+    EXPECT_EQ(sort_engine_choose(values.data(), values.size(), nullptr), SORT_ENGINE_SIMD);
+    EXPECT_EQ(sort_engine_choose(values.data(), 1000, scratch.data()), SORT_ENGINE_SIMD);
+
+    // Probing only uses scratch, and leaves the values alone.
+    std::vector<uint32_t> const original = values;
+    enum sort_engine const engine = sort_engine_choose(values.data(), values.size(), scratch.data());
+    EXPECT_NE(engine, SORT_ENGINE_AUTO);
+    EXPECT_EQ(values, original);
+}
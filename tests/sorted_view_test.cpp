@@ -0,0 +1,127 @@
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "run_files.h"
+
+extern "C" {
+#include "sorted_view.h"
+}
+
+class SortedViewTest : public ::testing::Test {
+protected:
+    void SetUp() override
+    {
+        base_filename = ::testing::TempDir() + "sorted_view_test";
+    }
+
+    void TearDown() override
+    {
+        for (size_t i = 0; i < num_runs; i++) {
+            remove(run_filename(base_filename, i).c_str());
+            remove(run_index_filename(base_filename, i).c_str());
+        }
+    }
+
+    void add_run(std::vector<uint32_t> values, uint64_t interval)
+    {
+        ASSERT_TRUE(write_run(base_filename, num_runs, values, interval));
+        all_values.insert(all_values.end(), values.begin(), values.end());
+        num_runs++;
+    }
+
+    // Reads a range in small pieces so that the merge has to pick up where it left off.
+    std::vector<uint32_t> read_range(struct sorted_view *view, uint32_t low, uint32_t high)
+    {
+        struct sorted_view_range *range = sorted_view_seek(view, low, high);
+        EXPECT_TRUE(range != nullptr);
+        std::vector<uint32_t> values;
+        uint32_t buffer[7];
+        size_t num_read = 0;
+        do {
+            EXPECT_TRUE(sorted_view_range_read(range, buffer, 7, &num_read));
+            values.insert(values.end(), buffer, buffer + num_read);
+        } while (num_read == 7);
+        EXPECT_EQ(sorted_view_range_get_count(range), values.size());
+        sorted_view_range_delete(range);
+        return values;
+    }
+
+    std::vector<uint32_t> expected_range(uint32_t low, uint32_t high) const
+    {
+        std::vector<uint32_t> values;
+        for (uint32_t value : all_values) {
+            if ((value >= low) && (value <= high)) {
+                values.push_back(value);
+            }
+        }
+        std::sort(values.begin(), values.end());
+        return values;
+    }
+
+    std::string base_filename;
+    size_t num_runs = 0;
+    std::vector<uint32_t> all_values;
+};
+
+TEST_F(SortedViewTest, RangesAreMergedFromEveryRun)
+{
+    uint32_t state = 12345;
+    for (size_t run = 0; run < 5; run++) {
+        std::vector<uint32_t> values;
+        for (size_t i = 0; i < 1000 + (run * 37); i++) {
+            state = (state * 1103515245u) + 12345u;
+            values.push_back(state % 20000);
+        }
+        add_run(values, 16 + run);
+    }
+
+    struct sorted_view *view = sorted_view_open(base_filename.c_str());
+    ASSERT_TRUE(view != nullptr);
+    EXPECT_EQ(sorted_view_get_num_runs(view), 5);
+    EXPECT_EQ(sorted_view_get_num_values(view), all_values.size());
+    EXPECT_EQ(read_range(view, 0, UINT32_MAX), expected_range(0, UINT32_MAX));
+    EXPECT_EQ(read_range(view, 5000, 5100), expected_range(5000, 5100));
+    EXPECT_EQ(read_range(view, 19990, 30000), expected_range(19990, 30000));
+    EXPECT_EQ(read_range(view, 777, 777), expected_range(777, 777));
+    EXPECT_TRUE(read_range(view, 30000, 40000).empty());
+    EXPECT_TRUE(read_range(view, 10, 5).empty());
+    sorted_view_close(view);
+}
+
+TEST_F(SortedViewTest, EmptyRunsAreSkipped)
+{
+    add_run({}, 4);
+    add_run({3, 1, 2}, 4);
+
+    struct sorted_view *view = sorted_view_open(base_filename.c_str());
+    ASSERT_TRUE(view != nullptr);
+    EXPECT_EQ(read_range(view, 0, 2), (std::vector<uint32_t>{1, 2}));
+    sorted_view_close(view);
+}
+
+TEST_F(SortedViewTest, MissingRunsFailToOpen)
+{
+    EXPECT_EQ(sorted_view_open(base_filename.c_str()), nullptr);
+}
+
+TEST_F(SortedViewTest, RemovingTheRunsTakesTheirIndexesAndStrayIndexes)
+{
+    add_run({5, 4}, 4);
+    add_run({3, 1, 2}, 4);
+    // An index whose run is already gone.
+    FILE *stray_file = fopen(run_index_filename(base_filename, num_runs).c_str(), "wb");
+    ASSERT_TRUE(stray_file != nullptr);
+    fclose(stray_file);
+    num_runs++;
+
+    sorted_view_remove(base_filename.c_str());
+    for (size_t i = 0; i < num_runs; i++) {
+        EXPECT_NE(access(run_filename(base_filename, i).c_str(), F_OK), 0) << i;
+        EXPECT_NE(access(run_index_filename(base_filename, i).c_str(), F_OK), 0) << i;
+    }
+    EXPECT_EQ(sorted_view_open(base_filename.c_str()), nullptr);
+}
@@ -0,0 +1,139 @@
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <cstdio>
+#include <dirent.h>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include "sorter.h"
+}
+
+class SorterTest : public ::testing::Test {
+protected:
+    void SetUp() override
+    {
+        // Plan for a small amount of memory so that a modest number of values forces spilling and several merge
+        // generations.
+        EXPECT_TRUE(plan_sort(&plan, MEMORY_SIZE, RUN_SIZE, 0, 4));
+        arena = arena_new(plan.memory_size, ARENA_FLAG_NONE);
+        EXPECT_TRUE(arena != nullptr);
+    }
+
+    void TearDown() override
+    {
+        arena_delete(arena);
+        arena = nullptr;
+    }
+
+    static std::vector<uint32_t> random_values(size_t count)
+    {
+        std::mt19937 generator(1234);
+        std::vector<uint32_t> values(count);
+        for (auto &value: values) {
+            value = (uint32_t) generator();
+        }
+        return values;
+    }
+
+    std::vector<uint32_t> sort(std::vector<uint32_t> const &values, size_t push_batch, size_t pull_batch)
+    {
+        struct sorter *sorter = sorter_new(arena, &plan, ::testing::TempDir().c_str());
+        EXPECT_TRUE(sorter != nullptr);
+        for (size_t i = 0; i < values.size(); i += push_batch) {
+            size_t count = std::min(push_batch, values.size() - i);
+            EXPECT_TRUE(sorter_push(sorter, values.data() + i, count));
+        }
+        EXPECT_TRUE(sorter_finish(sorter));
+
+        std::vector<uint32_t> sorted;
+        std::vector<uint32_t> batch(pull_batch);
+        size_t count = 0;
+        while (sorter_next(sorter, batch.data(), batch.size(), &count) && (count > 0)) {
+            sorted.insert(sorted.end(), batch.begin(), batch.begin() + (long) count);
+        }
+        sorter_delete(sorter);
+        return sorted;
+    }
+
+    static size_t const MEMORY_SIZE = 64 * 1024;
+    static size_t const RUN_SIZE = 16 * 1024;
+    struct sort_plan plan{};
+    struct arena *arena{nullptr};
+};
+
+TEST_F(SorterTest, SortsValuesThatFitInMemory)
+{
+    std::vector<uint32_t> values = random_values(1000);
+    std::vector<uint32_t> sorted = sort(values, 100, 64);
+    std::sort(values.begin(), values.end());
+    EXPECT_EQ(sorted, values);
+}
+
+TEST_F(SorterTest, SortsValuesThatSpillToDisk)
+{
+    // 100000 values at 4096 values per run is 25 runs, which takes more than one generation with four runs per merge.
+    std::vector<uint32_t> values = random_values(100000);
+    std::vector<uint32_t> sorted = sort(values, 777, 1000);
+    std::sort(values.begin(), values.end());
+    EXPECT_EQ(sorted, values);
+}
+
+TEST_F(SorterTest, SortsNothing)
+{
+    std::vector<uint32_t> sorted = sort({}, 1, 1);
+    EXPECT_TRUE(sorted.empty());
+}
+
+TEST_F(SorterTest, CannotPushAfterFinish)
+{
+    struct sorter *sorter = sorter_new(arena, &plan, ::testing::TempDir().c_str());
+    uint32_t value = 42;
+    EXPECT_TRUE(sorter_finish(sorter));
+    EXPECT_FALSE(sorter_push(sorter, &value, 1));
+    sorter_delete(sorter);
+}
+
+TEST_F(SorterTest, ReturnsMemoryToArena)
+{
+    size_t mark = arena_mark(arena);
+    std::vector<uint32_t> values = random_values(10000);
+    sort(values, 1000, 1000);
+    EXPECT_EQ(arena_mark(arena), mark);
+}
+
+TEST_F(SorterTest, FailedMergeLeavesNoRunsBehind)
+{
+    std::string directory = ::testing::TempDir() + "sorter_test.XXXXXX";
+    ASSERT_TRUE(mkdtemp(&directory[0]) != nullptr);
+    auto list_directory = [&directory]() {
+        std::vector<std::string> names;
+        DIR *dir = opendir(directory.c_str());
+        for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+            std::string const name = entry->d_name;
+            if ((name != ".") && (name != "..")) {
+                names.push_back(name);
+            }
+        }
+        closedir(dir);
+        return names;
+    };
+
+    // 25 runs are merged four at a time. Losing the tenth run fails the third merge, after two have been written.
+    struct sorter *sorter = sorter_new(arena, &plan, directory.c_str());
+    ASSERT_TRUE(sorter != nullptr);
+    std::vector<uint32_t> const values = random_values(100000);
+    EXPECT_TRUE(sorter_push(sorter, values.data(), values.size()));
+    for (std::string const &name : list_directory()) {
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".0.9") == 0) {
+            EXPECT_EQ(remove((directory + "/" + name).c_str()), 0);
+        }
+    }
+    EXPECT_FALSE(sorter_finish(sorter));
+    sorter_delete(sorter);
+
+    EXPECT_EQ(list_directory(), std::vector<std::string>{});
+    EXPECT_EQ(rmdir(directory.c_str()), 0);
+}
@@ -0,0 +1,94 @@
+#include "gtest/gtest.h"
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include "spill.h"
+}
+
+class SpillTest : public ::testing::Test {
+protected:
+    void SetUp() override
+    {
+        base_filename = ::testing::TempDir() + "spill_test";
+        spill = spill_new(base_filename.c_str());
+        ASSERT_TRUE(spill != nullptr);
+    }
+
+    void TearDown() override
+    {
+        spill_delete(spill);
+    }
+
+    void write_run(size_t generation, size_t run_number, std::vector<uint32_t> const &values)
+    {
+        FILE *run_file = spill_create_run(spill, generation, run_number);
+        ASSERT_TRUE(run_file != nullptr);
+        EXPECT_EQ(fwrite(values.data(), sizeof(uint32_t), values.size(), run_file), values.size());
+        EXPECT_TRUE(spill_finish_run(spill, run_file));
+    }
+
+    std::vector<uint32_t> read_run(size_t generation, size_t run_number)
+    {
+        off_t offset = 0;
+        off_t size = 0;
+        if (!spill_find_run(spill, generation, run_number, &offset, &size)) {
+            return {};
+        }
+        std::vector<uint32_t> values((size_t) size / sizeof(uint32_t));
+        EXPECT_EQ(pread(spill_get_fd(spill), values.data(), (size_t) size, offset), (ssize_t) size);
+        return values;
+    }
+
+    std::string base_filename;
+    struct spill_store *spill = nullptr;
+};
+
+TEST_F(SpillTest, SpillFileIsUnlinkedRightAway)
+{
+    EXPECT_NE(access((base_filename + ".spill").c_str(), F_OK), 0);
+}
+
+TEST_F(SpillTest, RunsAreReadBackFromTheirExtents)
+{
+    write_run(0, 0, {1, 2, 3});
+    write_run(0, 1, {4, 5});
+    write_run(0, 2, {});
+    EXPECT_EQ(read_run(0, 0), (std::vector<uint32_t>{1, 2, 3}));
+    EXPECT_EQ(read_run(0, 1), (std::vector<uint32_t>{4, 5}));
+
+    off_t offset = 0;
+    off_t size = -1;
+    EXPECT_TRUE(spill_find_run(spill, 0, 2, &offset, &size));
+    EXPECT_EQ(size, 0);
+    EXPECT_FALSE(spill_find_run(spill, 0, 3, &offset, &size));
+    EXPECT_FALSE(spill_find_run(spill, 1, 0, &offset, &size));
+}
+
+TEST_F(SpillTest, RenamedRunKeepsItsData)
+{
+    write_run(0, 0, {7, 8, 9});
+    EXPECT_TRUE(spill_rename_run(spill, 0, 0, 3, 100));
+    EXPECT_EQ(read_run(3, 100), (std::vector<uint32_t>{7, 8, 9}));
+
+    off_t offset = 0;
+    off_t size = 0;
+    EXPECT_FALSE(spill_find_run(spill, 0, 0, &offset, &size));
+    EXPECT_FALSE(spill_rename_run(spill, 0, 0, 1, 0));
+}
+
+TEST_F(SpillTest, RemovedRunIsForgotten)
+{
+    write_run(0, 0, {1});
+    write_run(0, 1, {2});
+    spill_remove_run(spill, 0, 0);
+    spill_remove_run(spill, 5, 5);
+
+    off_t offset = 0;
+    off_t size = 0;
+    EXPECT_FALSE(spill_find_run(spill, 0, 0, &offset, &size));
+    EXPECT_EQ(read_run(0, 1), (std::vector<uint32_t>{2}));
+}
@@ -0,0 +1,54 @@
+#include "gtest/gtest.h"
+#include <atomic>
+#include <vector>
+
+extern "C" {
+#include "thread_pool.h"
+}
+
+struct counts {
+    std::vector<std::atomic<int>> calls_per_thread;
+    explicit counts(size_t num_threads) : calls_per_thread(num_threads) {}
+};
+
+static void count_call(void *context, size_t thread_index)
+{
+    static_cast<counts *>(context)->calls_per_thread.at(thread_index)++;
+}
+
+TEST(ThreadPoolTest, RunsOncePerThread)
+{
+    struct thread_pool *pool = thread_pool_new(4);
+    ASSERT_TRUE(pool != nullptr);
+    EXPECT_EQ(thread_pool_get_num_threads(pool), 4);
+
+    counts counts(4);
+    thread_pool_run(pool, count_call, &counts);
+    for (auto const &calls : counts.calls_per_thread) {
+        EXPECT_EQ(calls.load(), 1);
+    }
+    thread_pool_delete(pool);
+}
+
+TEST(ThreadPoolTest, CanBeRunRepeatedly)
+{
+    struct thread_pool *pool = thread_pool_new(3);
+    ASSERT_TRUE(pool != nullptr);
+
+    counts counts(3);
+    for (int i = 0; i < 100; i++) {
+        thread_pool_run(pool, count_call, &counts);
+    }
+    for (auto const &calls : counts.calls_per_thread) {
+        EXPECT_EQ(calls.load(), 100);
+    }
+    thread_pool_delete(pool);
+}
+
+TEST(ThreadPoolTest, ZeroThreadsMeansOnePerProcessor)
+{
+    struct thread_pool *pool = thread_pool_new(0);
+    ASSERT_TRUE(pool != nullptr);
+    EXPECT_EQ(thread_pool_get_num_threads(pool), thread_pool_get_default_num_threads());
+    thread_pool_delete(pool);
+}
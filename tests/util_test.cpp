@@ -0,0 +1,29 @@
+#include "gtest/gtest.h"
+#include <cstdint>
+#include <set>
+
+extern "C" {
+#include "util.h"
+}
+
+TEST(UtilTest, NowSecondsNeverGoesBackwards)
+{
+    double const before = util_now_seconds();
+    double const after = util_now_seconds();
+    EXPECT_GT(before, 0.0);
+    EXPECT_GE(after, before);
+}
+
+TEST(UtilTest, NextRandomRepeatsForTheSameState)
+{
+    uint64_t state = 0x9e3779b97f4a7c15u;
+    uint64_t same_state = state;
+    std::set<uint64_t> seen;
+    for (int i = 0; i < 1000; i++) {
+        uint64_t const value = util_next_random(&state);
+        EXPECT_EQ(value, util_next_random(&same_state));
+        seen.insert(value);
+    }
+    EXPECT_EQ(seen.size(), 1000);
+    EXPECT_NE(state, 0);
+}
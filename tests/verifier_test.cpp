@@ -0,0 +1,111 @@
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <random>
+#include <vector>
+
+extern "C" {
+#include "verifier.h"
+}
+
+class VerifierTest : public ::testing::Test {
+protected:
+    void SetUp() override
+    {
+        pool = thread_pool_new(4);
+        ASSERT_TRUE(pool != nullptr);
+    }
+
+    void TearDown() override
+    {
+        thread_pool_delete(pool);
+    }
+
+    struct verifier_summary scan(std::vector<uint32_t> const &values, bool check_order = true)
+    {
+        struct verifier_summary summary = {};
+        EXPECT_TRUE(verifier_scan(values.data(), values.size(), check_order, pool, &summary));
+        return summary;
+    }
+
+    // Distinct, ascending values with random gaps, and enough of them for several chunks per thread.
+    static std::vector<uint32_t> sorted_values(size_t count = (3 * 1024 * 1024) + 3)
+    {
+        std::mt19937 generator(1234);
+        std::vector<uint32_t> values(count);
+        uint32_t value = 1;
+        for (auto &next: values) {
+            value += 1 + (generator() % 3);
+            next = value;
+        }
+        return values;
+    }
+
+    static std::vector<uint32_t> shuffled(std::vector<uint32_t> values)
+    {
+        std::shuffle(values.begin(), values.end(), std::mt19937(4321));
+        return values;
+    }
+
+    struct thread_pool *pool = nullptr;
+};
+
+TEST_F(VerifierTest, SortedValuesPass)
+{
+    std::vector<uint32_t> const values = sorted_values();
+    struct verifier_summary const summary = scan(values);
+    EXPECT_EQ(summary.num_values, values.size());
+    EXPECT_TRUE(summary.sorted);
+
+    EXPECT_TRUE(scan({}).sorted);
+    EXPECT_TRUE(scan({7}).sorted);
+    EXPECT_TRUE(scan(std::vector<uint32_t>(100, 3)).sorted);
+}
+
+TEST_F(VerifierTest, FindsTheFirstUnsortedValue)
+{
+    std::vector<uint32_t> const values = sorted_values();
+
+    // Out of order values inside a chunk, at the boundary between two chunks, and right at the end.
+    for (size_t position: {(size_t) 1, (size_t) 12345, (size_t) 1024 * 1024, (size_t) 2 * 1024 * 1024 + 5,
+                           values.size() - 1}) {
+        std::vector<uint32_t> unsorted = values;
+        unsorted[position] = unsorted[position - 1] - 1;
+        // A later unsorted value, in another thread's chunk, doesn't hide it.
+        if (position < values.size() - 1) {
+            unsorted[values.size() - 1] = 0;
+        }
+        struct verifier_summary const summary = scan(unsorted);
+        EXPECT_FALSE(summary.sorted);
+        EXPECT_EQ(summary.first_unsorted, position);
+    }
+}
+
+TEST_F(VerifierTest, OrderIsOnlyCheckedWhenAskedTo)
+{
+    std::vector<uint32_t> const values = shuffled(sorted_values(1000));
+    EXPECT_FALSE(scan(values).sorted);
+    EXPECT_TRUE(scan(values, false).sorted);
+}
+
+TEST_F(VerifierTest, SameValuesMatchInAnyOrder)
+{
+    std::vector<uint32_t> const sorted = sorted_values();
+    struct verifier_summary const input = scan(shuffled(sorted), false);
+    struct verifier_summary const output = scan(sorted);
+    EXPECT_TRUE(verifier_same_values(&input, &output));
+
+    // A changed value, a missing value, or a value that's there twice instead of another is caught.
+    std::vector<uint32_t> changed = sorted;
+    changed[1000]++;
+    struct verifier_summary summary = scan(changed);
+    EXPECT_FALSE(verifier_same_values(&input, &summary));
+
+    std::vector<uint32_t> missing(sorted.begin(), sorted.end() - 1);
+    summary = scan(missing);
+    EXPECT_FALSE(verifier_same_values(&input, &summary));
+
+    std::vector<uint32_t> duplicated = sorted;
+    duplicated[2000] = duplicated[2001];
+    summary = scan(duplicated);
+    EXPECT_FALSE(verifier_same_values(&input, &summary));
+}
@@ -1,32 +1,118 @@
+import os
 import re
 import subprocess
 
 
 class BigSortRunResults:
-    def __init__(self, return_code, num_runs, num_generations, stderr):
+    def __init__(self, return_code, num_runs, num_generations, stderr, stdout=''):
         self.return_code = return_code
         self.num_runs = num_runs
         self.num_generations = num_generations
         self.stderr = stderr
+        self.stdout = stdout
 
 
 class BigSort:
     def __init__(self, bigsort_path):
         self._bigsort_path = bigsort_path
 
-    def run(self, input_filename, output_filename, run_size=1000000, quiet=False) -> BigSortRunResults:
+    def run(self, input_filename, output_filename, run_size=1000000, quiet=False, max_files=None,
+            memory=None, extra_args=None, preexec_fn=None) -> BigSortRunResults:
+        cmd = [self._bigsort_path]
         if quiet:
-            cmd = [self._bigsort_path, '--quiet', f'--runsize={run_size}', input_filename, output_filename]
-        else:
-            cmd = [self._bigsort_path, f'--runsize={run_size}', input_filename, output_filename]
-        result = subprocess.run(cmd, capture_output=True, encoding='utf-8')
+            cmd.append('--quiet')
+        if run_size is not None:
+            cmd.append(f'--runsize={run_size}')
+        if max_files is not None:
+            cmd.append(f'--maxfiles={max_files}')
+        if memory is not None:
+            cmd.append(f'--memory={memory}')
+        if extra_args is not None:
+            cmd += extra_args
+        cmd += [input_filename, output_filename]
+        result = subprocess.run(cmd, capture_output=True, encoding='utf-8', preexec_fn=preexec_fn)
         num_runs, num_generations = BigSort._extract_stats(result.stdout)
 
         return BigSortRunResults(
             return_code=result.returncode,
             num_runs=num_runs,
             num_generations=num_generations,
-            stderr=result.stderr)
+            stderr=result.stderr,
+            stdout=result.stdout)
+
+    def start(self, input_filename, output_filename, run_size=1000000, max_files=None, extra_args=None,
+              preexec_fn=None) -> subprocess.Popen:
+        """Starts bigsort without waiting for it, e.g. to interrupt it. preexec_fn runs in the child before bigsort."""
+        cmd = [self._bigsort_path, '--quiet', f'--runsize={run_size}']
+        if max_files is not None:
+            cmd.append(f'--maxfiles={max_files}')
+        if extra_args is not None:
+            cmd += extra_args
+        cmd += [str(input_filename), str(output_filename)]
+        return subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, preexec_fn=preexec_fn)
+
+    def run_streaming(self, input_filename, output_filename, run_size=1000000, max_files=None,
+                      memory=None) -> BigSortRunResults:
+        """Pipes input_filename through bigsort's stdin and its stdout into output_filename."""
+        cmd = [self._bigsort_path, f'--runsize={run_size}']
+        if max_files is not None:
+            cmd.append(f'--maxfiles={max_files}')
+        if memory is not None:
+            cmd.append(f'--memory={memory}')
+        cmd += ['-', '-']
+        with open(input_filename, 'rb') as input_file:
+            input_data = input_file.read()
+        result = subprocess.run(cmd, input=input_data, capture_output=True)
+        with open(output_filename, 'wb') as output_file:
+            output_file.write(result.stdout)
+        # With the sorted data on stdout, the stats are on stderr.
+        stderr = result.stderr.decode('utf-8')
+        num_runs, num_generations = BigSort._extract_stats(stderr)
+
+        return BigSortRunResults(
+            return_code=result.returncode,
+            num_runs=num_runs,
+            num_generations=num_generations,
+            stderr=stderr)
+
+    def start_worker(self, run_size=1000000, memory=None) -> (subprocess.Popen, str):
+        """Starts a worker on a free port on localhost. Returns the process and the address it's listening on."""
+        cmd = [self._bigsort_path, f'--runsize={run_size}']
+        if memory is not None:
+            cmd.append(f'--memory={memory}')
+        cmd.append('--worker=127.0.0.1:0')
+        process = subprocess.Popen(cmd, stdout=subprocess.PIPE, encoding='utf-8')
+        result = re.search(r'listening on (\S+)', process.stdout.readline())
+        return process, result[1] if result else ''
+
+    def lookup(self, sorted_filename, low, high=None, values=False, runs=False) -> subprocess.CompletedProcess:
+        """Runs bigsort-lookup, which is built next to bigsort, against a sorted file and its index."""
+        cmd = [os.path.join(os.path.dirname(self._bigsort_path), 'bigsort-lookup')]
+        if values:
+            cmd.append('--values')
+        if runs:
+            cmd.append('--runs')
+        cmd += [sorted_filename, str(low)]
+        if high is not None:
+            cmd.append(str(high))
+        return subprocess.run(cmd, capture_output=True, encoding='utf-8')
+
+    def verify(self, sorted_filename, input_filename=None) -> subprocess.CompletedProcess:
+        """Runs bigsort-verify, which is built next to bigsort, against a sorted file and, optionally, its input."""
+        cmd = [os.path.join(os.path.dirname(self._bigsort_path), 'bigsort-verify'), str(sorted_filename)]
+        if input_filename is not None:
+            cmd.append(str(input_filename))
+        return subprocess.run(cmd, capture_output=True, encoding='utf-8')
+
+    def run_batch(self, job_filename, memory=None, threads=None) -> subprocess.CompletedProcess:
+        """Sorts each job that job_filename lists in a single bigsort."""
+        cmd = [self._bigsort_path]
+        if memory is not None:
+            cmd.append(f'--memory={memory}')
+        if threads is not None:
+            cmd.append(f'--threads={threads}')
+        cmd.append(f'--batch={job_filename}')
+        return subprocess.run(cmd, capture_output=True, encoding='utf-8')
 
     @staticmethod
     def _extract_stats(stdout_string) -> (int, int):
@@ -35,7 +121,7 @@ class BigSort:
             num_runs = int(result[1])
             result = re.search(r'.*merge generations: (\d+)\n', stdout_string, re.MULTILINE)
             num_generations = int(result[1])
-        except IndexError:
+        except (IndexError, TypeError):
             num_runs = 0
             num_generations = 0
         return num_runs, num_generations
@@ -21,6 +21,71 @@ class DataFiles:
             for number in numbers:
                 file.write(struct.pack('=L', number))
 
+    @staticmethod
+    def create_file_with_keyed_records(file_path, num_records, record_size, num_keys):
+        """
+        Writes num_records records of record_size bytes, each a random key below num_keys followed by its row number and
+        padding. Returns the records.
+        """
+        rng = random.Random(7)
+        records = [struct.pack('=LQ', rng.randrange(num_keys), row).ljust(record_size, b'.')
+                   for row in range(num_records)]
+        with open(file_path, 'wb') as file:
+            file.write(b''.join(records))
+        return records
+
+    @staticmethod
+    def create_file_with_few_distinct_values(file_path, num_values, num_distinct):
+        """
+        Writes num_values random picks from num_distinct random, unsigned, 32-bit integers to file_path. Returns the bytes
+        of the values sorted.
+        """
+        rng = random.Random(13)
+        distinct = [rng.randrange(2 ** 32) for _ in range(num_distinct)]
+        values = [rng.choice(distinct) for _ in range(num_values)]
+        with open(file_path, 'wb') as file:
+            file.write(struct.pack(f'={num_values}L', *values))
+        return struct.pack(f'={num_values}L', *sorted(values))
+
+    @staticmethod
+    def create_sorted_shards(directory, num_shards, max_values_per_shard):
+        """
+        Writes num_shards files named shard.N to directory, each holding up to max_values_per_shard sorted, random,
+        unsigned, 32-bit integers. Returns the files' paths and the bytes of all of their values merged.
+        """
+        rng = random.Random(11)
+        paths = []
+        all_values = []
+        for i in range(num_shards):
+            values = sorted(rng.randrange(2 ** 32) for _ in range(rng.randrange(max_values_per_shard)))
+            path = directory / f'shard.{i}'
+            with open(path, 'wb') as file:
+                file.write(struct.pack(f'={len(values)}L', *values))
+            paths.append(str(path))
+            all_values += values
+        return paths, struct.pack(f'={len(all_values)}L', *sorted(all_values))
+
+    @staticmethod
+    def create_clustered_shards(directory, num_shards, cluster_size, clusters_per_shard):
+        """
+        Writes num_shards sorted files named shard.N to directory, taking turns at covering consecutive ranges of
+        values, like time-ordered feeds from several sources. Each range of cluster_size values shares its first value
+        with the end of the previous range. Returns the files' paths and the bytes of all of their values merged.
+        """
+        paths = []
+        all_values = []
+        for i in range(num_shards):
+            values = []
+            for cluster in range(clusters_per_shard):
+                start = ((cluster * num_shards) + i) * (cluster_size - 1)
+                values += range(start, start + cluster_size)
+            path = directory / f'shard.{i}'
+            with open(path, 'wb') as file:
+                file.write(struct.pack(f'={len(values)}L', *values))
+            paths.append(str(path))
+            all_values += values
+        return paths, struct.pack(f'={len(all_values)}L', *sorted(all_values))
+
     @staticmethod
     def find_first_unsorted_value(file_path):
         """
@@ -1,5 +1,11 @@
 import os
 import pytest
+import random
+import re
+import resource
+import signal
+import struct
+import time
 from pathlib import Path
 from .bigsort import BigSort
 from .data_files import DataFiles
@@ -36,15 +42,127 @@ def test_run_size_smaller_than_data_size(in_file_path, out_file_path, bigsort):
     result = bigsort.run(
         input_filename=in_file_path,
         output_filename=out_file_path,
-        run_size=100000)
+        run_size=100000,
+        max_files=2)
     assert result.return_code == 0
-    assert result.num_runs == 11
+    assert result.num_runs == 10
     assert result.num_generations == 4
 
     result = DataFiles.find_first_incorrect_ascending_value(out_file_path)
     assert result == ()
 
 
+def test_consume_input_leaves_input_empty(in_file_path, out_file_path, bigsort):
+    # Runs of 1MB merged three at a time are big enough for the merges to release the runs as they go, too.
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 8000000)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=1000000,
+        max_files=3,
+        extra_args=['--consume-input'])
+    assert result.return_code == 0
+    assert result.num_runs == 8
+    assert os.path.getsize(in_file_path) == 0
+    assert os.path.getsize(out_file_path) == 8000000
+    assert DataFiles.find_first_incorrect_ascending_value(out_file_path) == ()
+
+
+def test_consume_input_with_a_small_limit_still_consumes(in_file_path, out_file_path, bigsort):
+    # The limit would fit in memory, but only creating runs consumes the input.
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=100000,
+        extra_args=['--consume-input', '--limit=1000'])
+    assert result.return_code == 0
+    assert os.path.getsize(in_file_path) == 0
+    assert os.path.getsize(out_file_path) == 4000
+    assert DataFiles.find_first_incorrect_ascending_value(out_file_path) == ()
+
+
+def test_merge_rejects_consuming_the_input(make_cache_path, out_file_path, bigsort):
+    paths, _ = DataFiles.create_sorted_shards(make_cache_path(), 2, 1000)
+    sizes = [os.path.getsize(path) for path in paths]
+    result = bigsort.run(
+        input_filename=paths[0],
+        output_filename=out_file_path,
+        extra_args=['--merge', '--consume-input'] + paths[1:])
+    assert result.return_code != 0
+    assert 'consuming the input' in result.stderr
+    assert [os.path.getsize(path) for path in paths] == sizes
+
+
+def test_failed_sort_keeps_the_consumed_input(in_file_path, out_file_path, bigsort):
+    # Four runs of 2MB are merged two at a time. Capping files at 3.5MB fails the first merge part way through, after
+    # it has released more than 1MB of each of its inputs.
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 8000000)
+
+    def limit_file_size():
+        signal.signal(signal.SIGXFSZ, signal.SIG_IGN)
+        resource.setrlimit(resource.RLIMIT_FSIZE, (3500000, 3500000))
+
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=2000000,
+        max_files=2,
+        extra_args=['--consume-input'],
+        preexec_fn=limit_file_size)
+    assert result.return_code != 0
+    assert os.path.getsize(in_file_path) == 0
+
+    # The failed merge says where the values it didn't get to start in its inputs. Everything else is in whole runs.
+    starts = {}
+    for line in result.stderr.splitlines():
+        match = re.match(r'ERROR: (\S+) holds the rest of its values from byte (\d+) on', line)
+        if match:
+            starts[match.group(1)] = int(match.group(2))
+    assert len(starts) == 2
+    assert all(start > 1000000 for start in starts.values())
+    runs = list(Path(out_file_path).parent.glob(Path(out_file_path).name + '.*'))
+    values = []
+    for run in runs:
+        data = run.read_bytes()[starts.get(str(run), 0):]
+        values += struct.unpack(f'={len(data) // 4}L', data)
+        run.unlink()
+    assert sorted(values) == list(range(2000000))
+
+
+@pytest.mark.parametrize('extra_args', [['--spill-file'], ['--index=1000'], ['--output-shards=2']])
+def test_consume_input_rejects_runs_that_dont_outlive_a_failure(in_file_path, out_file_path, bigsort, extra_args):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 100000)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        extra_args=['--consume-input'] + extra_args)
+    assert result.return_code != 0
+    assert 'consuming the input' in result.stderr
+    assert os.path.getsize(in_file_path) == 100000
+
+
+@pytest.mark.parametrize('extra_args, expected_size', [
+    ([], 4000000),
+    (['--limit=50000'], 200000)])
+def test_spill_file_holds_all_runs(in_file_path, out_file_path, bigsort, extra_args, expected_size):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 4000000)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=100000,
+        max_files=3,
+        extra_args=['--spill-file'] + extra_args)
+    assert result.return_code == 0
+    assert result.num_runs == 40
+    # Three generations merge the 40 runs down to two, and a fourth merges those into the output.
+    assert result.num_generations == 4
+    assert os.path.getsize(out_file_path) == expected_size
+    assert DataFiles.find_first_incorrect_ascending_value(out_file_path) == ()
+    # No run files are ever created, and the spill file is gone.
+    assert not list(Path(out_file_path).parent.glob(Path(out_file_path).name + '.*'))
+
+
 def test_run_size_same_as_data_size(in_file_path, out_file_path, bigsort):
     DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
     result = bigsort.run(
@@ -52,8 +170,699 @@ def test_run_size_same_as_data_size(in_file_path, out_file_path, bigsort):
         output_filename=out_file_path,
         run_size=1000000)
     assert result.return_code == 0
-    assert result.num_runs == 2
-    assert result.num_generations == 1
+    assert result.num_runs == 1
+    assert result.num_generations == 0
+
+    result = DataFiles.find_first_incorrect_ascending_value(out_file_path)
+    assert result == ()
+
+
+def test_memory_budget_is_split_between_runs_and_merge(in_file_path, out_file_path, bigsort):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=40000,
+        memory=100000,
+        max_files=0)
+    assert result.return_code == 0
+    assert result.num_runs == 25
+    assert result.num_generations >= 1
+
+    result = DataFiles.find_first_incorrect_ascending_value(out_file_path)
+    assert result == ()
+
+
+@pytest.mark.parametrize('max_files', ['2K', '1.5', '-1', 'x'])
+def test_max_files_must_be_a_plain_count(in_file_path, out_file_path, bigsort, max_files):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 4000)
+    result = bigsort.run(input_filename=in_file_path, output_filename=out_file_path, max_files=max_files)
+    assert result.return_code != 0
+    assert 'invalid maximum number of files' in result.stderr
+
+
+def test_progress_is_reported_unless_quiet(in_file_path, out_file_path, bigsort):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=100000)
+    assert result.return_code == 0
+    assert '[creating runs' in result.stderr
+    assert '[done' in result.stderr
+
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=100000,
+        quiet=True)
+    assert result.return_code == 0
+    assert result.stderr == ''
+
+
+def test_stdin_to_stdout(in_file_path, out_file_path, bigsort):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    result = bigsort.run_streaming(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=100000,
+        max_files=2)
+    assert result.return_code == 0
+    assert result.num_runs == 10
+    # The same number of passes as for an output file. The last one streams to stdout instead of writing a run.
+    assert result.num_generations == 4
+    assert os.path.getsize(out_file_path) == os.path.getsize(in_file_path)
 
     result = DataFiles.find_first_incorrect_ascending_value(out_file_path)
     assert result == ()
+
+
+def test_checkpoint_is_removed_once_sort_completes(in_file_path, out_file_path, bigsort):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    manifest_path = Path(str(out_file_path) + '.manifest')
+
+    # Resuming without a checkpoint starts from scratch.
+    for args in (['--checkpoint'], ['--resume']):
+        result = bigsort.run(
+            input_filename=in_file_path,
+            output_filename=out_file_path,
+            run_size=100000,
+            max_files=2,
+            extra_args=args)
+        assert result.return_code == 0
+        assert result.num_runs == 10
+        assert result.num_generations == 4
+        assert not manifest_path.exists()
+
+        result = DataFiles.find_first_incorrect_ascending_value(out_file_path)
+        assert result == ()
+
+
+def test_checkpointed_sort_resumes_after_being_killed_while_creating_runs(in_file_path, out_file_path, bigsort):
+    # 160 runs, each synced to disk before the manifest records it, leave plenty of time to kill the sort part way.
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 16000000)
+    manifest_path = Path(str(out_file_path) + '.manifest')
+    if manifest_path.exists():
+        os.remove(manifest_path)
+    process = bigsort.start(in_file_path, out_file_path, run_size=100000, extra_args=['--checkpoint'])
+    deadline = time.monotonic() + 60
+    while (time.monotonic() < deadline) and (process.poll() is None):
+        if manifest_path.exists() and manifest_path.read_text().count('\nrun ') >= 3:
+            break
+        time.sleep(0.001)
+    process.send_signal(signal.SIGKILL)
+    assert process.wait() == -signal.SIGKILL
+    assert '\nruns ' not in manifest_path.read_text()
+
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=100000,
+        extra_args=['--resume'])
+    assert result.return_code == 0
+    assert 'completed runs: ' in result.stdout
+    assert 'completed runs: 0' not in result.stdout
+    assert '(all)' not in result.stdout
+    assert result.num_runs == 160
+    assert not manifest_path.exists()
+    assert bigsort.verify(out_file_path, in_file_path).returncode == 0
+
+
+def test_checkpointed_sort_resumes_after_being_killed_while_merging(in_file_path, out_file_path, bigsort):
+    # Ten runs of 100000 bytes are merged two at a time. Capping files at 350000 bytes lets the first generation of
+    # 200000 byte runs through, and kills the sort with SIGXFSZ when it writes the second.
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    manifest_path = Path(str(out_file_path) + '.manifest')
+
+    def limit_file_size():
+        resource.setrlimit(resource.RLIMIT_FSIZE, (350000, 350000))
+
+    process = bigsort.start(
+        in_file_path, out_file_path, run_size=100000, max_files=2, extra_args=['--checkpoint'],
+        preexec_fn=limit_file_size)
+    assert process.wait() == -signal.SIGXFSZ
+    assert '\nruns 10\n' in manifest_path.read_text()
+
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=100000,
+        max_files=2,
+        extra_args=['--resume'])
+    assert result.return_code == 0
+    assert 'completed runs: 10 (all)' in result.stdout
+    assert 'completed groups: 5' in result.stdout
+    assert result.num_generations == 4
+    assert not manifest_path.exists()
+    assert bigsort.verify(out_file_path, in_file_path).returncode == 0
+
+
+@pytest.mark.parametrize('limit, expected_runs', [(1000, 0), (20000, 10)])
+def test_limit_outputs_smallest_values(in_file_path, out_file_path, bigsort, limit, expected_runs):
+    # A limit that fits in half the run buffer is selected in memory without any runs. A bigger one goes through runs
+    # and merges that stop early.
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=100000,
+        extra_args=[f'--limit={limit}'])
+    assert result.return_code == 0
+    assert result.num_runs == expected_runs
+    assert os.path.getsize(out_file_path) == limit * 4
+
+    result = DataFiles.find_first_incorrect_ascending_value(out_file_path)
+    assert result == ()
+
+
+@pytest.mark.parametrize('threads', [1, 2])
+def test_partition_sorts_in_buckets(in_file_path, out_file_path, bigsort, threads):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        memory='1M',
+        extra_args=['--partition', f'--threads={threads}'])
+    assert result.return_code == 0
+    assert result.num_runs == 0
+    assert os.path.getsize(out_file_path) == os.path.getsize(in_file_path)
+    # Bucket files are removed as they're sorted.
+    assert not list(Path(out_file_path).parent.glob(Path(out_file_path).name + '.bucket.*'))
+
+    result = DataFiles.find_first_incorrect_ascending_value(out_file_path)
+    assert result == ()
+
+
+def test_partition_handles_bucket_too_big_for_memory(in_file_path, out_file_path, bigsort):
+    # Most values are equal, so they all land in one bucket that has to be sorted with runs and merges instead.
+    values = [7] * 900000 + list(range(100000))
+    random.shuffle(values)
+    with open(in_file_path, 'wb') as file:
+        file.write(struct.pack(f'={len(values)}L', *values))
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        memory='1M',
+        extra_args=['--partition', '--threads=2'])
+    assert result.return_code == 0
+    assert os.path.getsize(out_file_path) == os.path.getsize(in_file_path)
+
+    result = DataFiles.find_first_unsorted_value(out_file_path)
+    assert result == ()
+
+
+def test_coordinator_sorts_with_local_workers(in_file_path, out_file_path, bigsort):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    workers = [bigsort.start_worker(run_size=100000) for _ in range(3)]
+    addresses = ','.join(address for _, address in workers)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        extra_args=[f'--coordinate={addresses}'])
+    for process, _ in workers:
+        assert process.wait(timeout=60) == 0
+        process.stdout.close()
+    assert result.return_code == 0
+    assert os.path.getsize(out_file_path) == os.path.getsize(in_file_path)
+    # The workers' parts are removed once they've been joined into the output.
+    assert not list(Path(out_file_path).parent.glob(Path(out_file_path).name + '.part.*'))
+
+    result = DataFiles.find_first_incorrect_ascending_value(out_file_path)
+    assert result == ()
+
+
+def test_workers_dont_wait_forever_for_a_failed_worker(in_file_path, out_file_path, bigsort):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    # The middle worker can't create any of its slice runs, so it fails part way through swapping slices. The last
+    # worker has to hear from it all the same.
+    for i in range(10):
+        os.makedirs(f'{out_file_path}.part.1.0.{i}', exist_ok=True)
+    workers = [bigsort.start_worker(run_size=100000) for _ in range(3)]
+    addresses = ','.join(address for _, address in workers)
+    coordinator = bigsort.start(in_file_path, out_file_path, run_size=100000,
+                                extra_args=[f'--coordinate={addresses}'])
+    assert coordinator.wait(timeout=60) != 0
+    return_codes = [process.wait(timeout=60) for process, _ in workers]
+    for process, _ in workers:
+        process.stdout.close()
+    # The first worker might get its slices through before the failed one stops reading, but the last is told that it's
+    # missing the failed worker's slices.
+    assert return_codes[1] != 0
+    assert return_codes[2] != 0
+    parts = list(Path(out_file_path).parent.glob(Path(out_file_path).name + '.part.*'))
+    assert all(path.is_dir() for path in parts)
+    for path in parts:
+        path.rmdir()
+
+
+@pytest.mark.parametrize('engine', ['auto', 'qsort', 'radix', 'simd'])
+@pytest.mark.parametrize('memory', ['1M', '4M'])
+def test_sort_engines_sort(in_file_path, out_file_path, bigsort, engine, memory):
+    # With 4M of memory there's room for scratch beside the run buffer. With 1M there isn't, so runs are sorted in place.
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=1000000,
+        memory=memory,
+        extra_args=[f'--sort-engine={engine}'])
+    assert result.return_code == 0
+    assert os.path.getsize(out_file_path) == os.path.getsize(in_file_path)
+
+    result = DataFiles.find_first_incorrect_ascending_value(out_file_path)
+    assert result == ()
+
+
+@pytest.mark.parametrize('max_files', [0, 4])
+def test_key_only_sort_gathers_records_stably(in_file_path, out_file_path, bigsort, max_files):
+    records = DataFiles.create_file_with_keyed_records(in_file_path, 200000, 24, 1000)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        memory='256K',
+        max_files=max_files,
+        extra_args=['--record-size=24'])
+    assert result.return_code == 0
+    expected = sorted(records, key=lambda record: struct.unpack_from('=L', record)[0])
+    assert Path(out_file_path).read_bytes() == b''.join(expected)
+    assert not list(Path(out_file_path).parent.glob(Path(out_file_path).name + '.keys.*'))
+
+
+def test_key_only_sort_writes_permutation(in_file_path, out_file_path, bigsort):
+    records = DataFiles.create_file_with_keyed_records(in_file_path, 100000, 16, 50)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        memory='256K',
+        extra_args=['--record-size=16', '--permutation'])
+    assert result.return_code == 0
+    data = Path(out_file_path).read_bytes()
+    permutation = struct.unpack(f'={len(data) // 4}L', data)
+    expected = sorted(range(len(records)), key=lambda row: struct.unpack_from('=L', records[row])[0])
+    assert list(permutation) == expected
+
+
+def test_counting_is_chosen_for_few_distinct_values(in_file_path, out_file_path, bigsort):
+    expected = DataFiles.create_file_with_few_distinct_values(in_file_path, 500000, 3000)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        memory='4M')
+    assert result.return_code == 0
+    # The histogram fits in memory, so there are no runs, just the pass that expands it.
+    assert result.num_runs == 0
+    assert result.num_generations == 1
+    assert Path(out_file_path).read_bytes() == expected
+
+
+def test_counting_stops_at_limit(in_file_path, out_file_path, bigsort):
+    expected = DataFiles.create_file_with_few_distinct_values(in_file_path, 500000, 3000)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        memory='4M',
+        extra_args=['--counting=always', '--limit=1000'])
+    assert result.return_code == 0
+    assert Path(out_file_path).read_bytes() == expected[:4000]
+
+
+@pytest.mark.parametrize('max_files', [0, 3])
+def test_counting_merges_histogram_runs_that_outgrow_memory(in_file_path, out_file_path, bigsort, max_files):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 400000)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        memory='64K',
+        max_files=max_files,
+        extra_args=['--counting=always'])
+    assert result.return_code == 0
+    assert result.num_runs > 1
+    assert os.path.getsize(out_file_path) == os.path.getsize(in_file_path)
+    assert DataFiles.find_first_incorrect_ascending_value(out_file_path) == ()
+    assert not list(Path(out_file_path).parent.glob(Path(out_file_path).name + '.*'))
+
+
+@pytest.mark.parametrize('max_files', [0, 3])
+def test_merge_combines_sorted_files(make_cache_path, out_file_path, bigsort, max_files):
+    paths, expected = DataFiles.create_sorted_shards(make_cache_path(), 10, 50000)
+    originals = [Path(path).read_bytes() for path in paths]
+    result = bigsort.run(
+        input_filename=paths[0],
+        output_filename=out_file_path,
+        memory='256K',
+        max_files=max_files,
+        extra_args=['--merge', '--validate'] + paths[1:])
+    assert result.return_code == 0
+    assert result.num_runs == 10
+    assert Path(out_file_path).read_bytes() == expected
+    # The inputs are left alone, and no runs are left behind.
+    assert [Path(path).read_bytes() for path in paths] == originals
+    assert not list(Path(out_file_path).parent.glob(Path(out_file_path).name + '.*'))
+
+
+@pytest.mark.parametrize('cluster_size', [2, 1000, 100000])
+def test_merge_combines_clustered_files(make_cache_path, out_file_path, bigsort, cluster_size):
+    paths, expected = DataFiles.create_clustered_shards(make_cache_path(), 5, cluster_size, 200000 // cluster_size)
+    result = bigsort.run(
+        input_filename=paths[0],
+        output_filename=out_file_path,
+        memory='256K',
+        extra_args=['--merge', '--validate'] + paths[1:])
+    assert result.return_code == 0
+    assert Path(out_file_path).read_bytes() == expected
+
+
+def test_merge_validation_rejects_unsorted_input(make_cache_path, out_file_path, bigsort):
+    paths, _ = DataFiles.create_sorted_shards(make_cache_path(), 3, 50000)
+    unsorted = make_cache_path('unsorted')
+    unsorted.write_bytes(struct.pack('=3L', 3, 1, 2))
+    result = bigsort.run(
+        input_filename=paths[0],
+        output_filename=out_file_path,
+        extra_args=['--merge', '--validate'] + paths[1:] + [str(unsorted)])
+    assert result.return_code != 0
+    assert 'isn\'t sorted' in result.stderr
+    assert not os.path.exists(out_file_path)
+
+
+def test_failed_merge_leaves_no_runs_behind(make_cache_path, out_file_path, bigsort):
+    # With two files per merge, the first pair is merged into a run before the pair with the unsorted input fails.
+    paths, _ = DataFiles.create_sorted_shards(make_cache_path(), 3, 50000)
+    unsorted = make_cache_path('unsorted')
+    unsorted.write_bytes(struct.pack('=3L', 3, 1, 2))
+    result = bigsort.run(
+        input_filename=paths[0],
+        output_filename=out_file_path,
+        max_files=2,
+        extra_args=['--merge', '--validate'] + paths[1:] + [str(unsorted)])
+    assert result.return_code != 0
+    assert 'isn\'t sorted' in result.stderr
+    assert not list(Path(out_file_path).parent.glob(Path(out_file_path).name + '.*'))
+
+
+@pytest.mark.parametrize('max_files', [0, 3])
+def test_add_to_sorted_file_in_batches(make_cache_path, in_file_path, bigsort, max_files):
+    sorted_path = make_cache_path('test.sorted')
+    if sorted_path.exists():
+        sorted_path.unlink()
+    all_values = []
+    for batch in range(3):
+        DataFiles.create_file_with_random_data(in_file_path, 400000)
+        all_values += struct.unpack('=100000L', Path(in_file_path).read_bytes())
+        result = bigsort.run(
+            input_filename=in_file_path,
+            output_filename=str(sorted_path),
+            memory='256K',
+            max_files=max_files,
+            extra_args=[f'--add-to={sorted_path}', '--validate'])
+        assert result.return_code == 0
+        assert sorted_path.read_bytes() == struct.pack(f'={len(all_values)}L', *sorted(all_values))
+    assert not list(sorted_path.parent.glob(sorted_path.name + '.*'))
+
+
+def test_add_to_rejects_unsorted_file_with_validation(make_cache_path, in_file_path, out_file_path, bigsort):
+    unsorted_path = make_cache_path('unsorted')
+    unsorted_path.write_bytes(struct.pack('=3L', 3, 1, 2))
+    DataFiles.create_file_with_random_data(in_file_path, 40000)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        extra_args=[f'--add-to={unsorted_path}', '--validate'])
+    assert result.return_code != 0
+    assert unsorted_path.read_bytes() == struct.pack('=3L', 3, 1, 2)
+
+
+@pytest.mark.parametrize('extra_args', [[], ['--spill-file'], ['--limit=200000'], ['--limit=2000']])
+def test_index_finds_values_with_lookup(in_file_path, out_file_path, bigsort, extra_args):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    index_path = str(out_file_path) + '.idx'
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=40000,
+        extra_args=['--index=1000'] + extra_args)
+    assert result.return_code == 0
+    assert DataFiles.find_first_incorrect_ascending_value(out_file_path) == ()
+    num_values = os.path.getsize(out_file_path) // 4
+    # A header and a fence for every 1000th value.
+    assert os.path.getsize(index_path) == 48 + 16 * ((num_values + 999) // 1000)
+
+    # The values are 0, 1, 2, ..., so each one is at the offset of its own index.
+    lookup = bigsort.lookup(out_file_path, 12345)
+    assert lookup.returncode == 0
+    assert lookup.stdout == ('count: 1\noffset: 49380\n' if num_values > 12345 else 'count: 0\n')
+    lookup = bigsort.lookup(out_file_path, 999, 1003, values=True)
+    assert lookup.returncode == 0
+    assert lookup.stdout == 'count: 5\noffset: 3996\n999\n1000\n1001\n1002\n1003\n'
+    lookup = bigsort.lookup(out_file_path, 100, 4294967295)
+    assert lookup.stdout == f'count: {num_values - 100}\noffset: 400\n'
+    os.remove(index_path)
+
+
+def test_rewriting_the_output_removes_its_earlier_index(in_file_path, out_file_path, bigsort):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 100000)
+    index_path = str(out_file_path) + '.idx'
+    result = bigsort.run(input_filename=in_file_path, output_filename=out_file_path, extra_args=['--index=1000'])
+    assert result.return_code == 0
+    assert os.path.exists(index_path)
+
+    # As many values as before, but not the same ones, which the earlier index would have pointed lookups past.
+    DataFiles.create_file_with_random_data(in_file_path, 100000)
+    result = bigsort.run(input_filename=in_file_path, output_filename=out_file_path)
+    assert result.return_code == 0
+    assert not os.path.exists(index_path)
+    assert bigsort.lookup(out_file_path, 12345).returncode != 0
+
+
+def test_lookup_refuses_an_index_of_an_earlier_output(in_file_path, out_file_path, bigsort):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 100000)
+    index_path = str(out_file_path) + '.idx'
+    result = bigsort.run(input_filename=in_file_path, output_filename=out_file_path, extra_args=['--index=1000'])
+    assert result.return_code == 0
+    earlier_index = Path(index_path).read_bytes()
+    result = bigsort.run(input_filename=in_file_path, output_filename=out_file_path, extra_args=['--index=1000'])
+    assert result.return_code == 0
+
+    # An index left over from the earlier sort, say restored from a backup, doesn't match the output any more.
+    Path(index_path).write_bytes(earlier_index)
+    lookup = bigsort.lookup(out_file_path, 12345)
+    assert lookup.returncode != 0
+    assert 'earlier version' in lookup.stderr
+    os.remove(index_path)
+
+
+def test_index_requires_named_output(in_file_path, bigsort):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 4000)
+    result = bigsort.run(input_filename=in_file_path, output_filename='-', extra_args=['--index=100'])
+    assert result.return_code != 0
+    assert 'index' in result.stderr
+
+
+def test_lazy_sort_leaves_indexed_runs_to_query_and_merge_later(in_file_path, out_file_path, bigsort):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    if os.path.exists(out_file_path):
+        os.remove(out_file_path)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=40000,
+        extra_args=['--lazy=500'])
+    assert result.return_code == 0
+    assert result.num_runs == 25
+    assert result.num_generations == 0
+    assert not os.path.exists(out_file_path)
+    out_path = Path(out_file_path)
+    run_paths = [str(path) for path in out_path.parent.glob(out_path.name + '.0.*')]
+    index_paths = list(out_path.parent.glob(out_path.name + '.idx.0.*'))
+    assert len(run_paths) == 25
+    assert len(index_paths) == 25
+
+    lookup = bigsort.lookup(out_file_path, 123456, 123460, values=True, runs=True)
+    assert lookup.returncode == 0
+    assert lookup.stdout == 'count: 5\n123456\n123457\n123458\n123459\n123460\n'
+    lookup = bigsort.lookup(out_file_path, 1000, 4294967295, runs=True)
+    assert lookup.stdout == 'count: 249000\n'
+
+    # The runs can still be merged later, into a file of their own.
+    merged_path = str(out_file_path) + '.merged'
+    result = bigsort.run(
+        input_filename=run_paths[0],
+        output_filename=merged_path,
+        extra_args=['--merge'] + run_paths[1:])
+    assert result.return_code == 0
+    assert DataFiles.find_first_incorrect_ascending_value(merged_path) == ()
+    for path in run_paths + index_paths + [merged_path]:
+        os.remove(path)
+
+
+def test_lazy_sort_replaces_the_runs_of_an_earlier_one(in_file_path, out_file_path, bigsort):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    result = bigsort.run(
+        input_filename=in_file_path, output_filename=out_file_path, run_size=40000, extra_args=['--lazy=500'])
+    assert result.return_code == 0
+    assert result.num_runs == 25
+
+    # Fewer runs this time, so runs and indexes from the earlier sort would be counted in if they were left behind.
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 100000)
+    result = bigsort.run(
+        input_filename=in_file_path, output_filename=out_file_path, run_size=40000, extra_args=['--lazy=500'])
+    assert result.return_code == 0
+    assert result.num_runs == 3
+    out_path = Path(out_file_path)
+    run_paths = list(out_path.parent.glob(out_path.name + '.0.*'))
+    index_paths = list(out_path.parent.glob(out_path.name + '.idx.0.*'))
+    assert len(run_paths) == 3
+    assert len(index_paths) == 3
+    lookup = bigsort.lookup(out_file_path, 0, 4294967295, runs=True)
+    assert lookup.stdout == 'count: 25000\n'
+    for path in run_paths + index_paths:
+        os.remove(path)
+
+
+def test_output_shards_split_the_sorted_output_into_ordered_parts(in_file_path, out_file_path, bigsort):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    if os.path.exists(out_file_path):
+        os.remove(out_file_path)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=40000,
+        memory=4 * 1024 * 1024,
+        extra_args=['--output-shards=4', '--threads=4'])
+    assert result.return_code == 0
+    assert result.num_runs == 25
+    assert not os.path.exists(out_file_path)
+    out_path = Path(out_file_path)
+    assert not list(out_path.parent.glob(out_path.name + '.0.*'))
+
+    # The manifest's key ranges follow on from each other, and the parts hold the sorted values between them.
+    with open(str(out_file_path) + '.shards') as manifest:
+        shards = [line.split() for line in manifest]
+    assert len(shards) == 4
+    expected_low = 0
+    merged_path = str(out_file_path) + '.merged'
+    with open(merged_path, 'wb') as merged:
+        for shard, (filename, low, end, count) in enumerate(shards):
+            assert filename == str(out_file_path) + '.part.' + str(shard)
+            assert int(low) == expected_low
+            assert os.path.getsize(filename) == int(count) * 4
+            assert 55000 < int(count) < 70000
+            with open(filename, 'rb') as part:
+                merged.write(part.read())
+            expected_low = int(end)
+            os.remove(filename)
+    assert expected_low == 1 << 32
+    assert DataFiles.find_first_incorrect_ascending_value(merged_path) == ()
+    os.remove(merged_path)
+    os.remove(str(out_file_path) + '.shards')
+
+
+def test_output_shards_require_named_output(in_file_path, bigsort):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 4000)
+    result = bigsort.run(input_filename=in_file_path, output_filename='-', extra_args=['--output-shards=2'])
+    assert result.return_code != 0
+    assert 'shards' in result.stderr
+
+
+def test_verify_checks_order_and_values(in_file_path, out_file_path, bigsort):
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 400000)
+    result = bigsort.run(input_filename=in_file_path, output_filename=out_file_path, run_size=10000)
+    assert result.return_code == 0
+    verified = bigsort.verify(out_file_path, in_file_path)
+    assert verified.returncode == 0
+    assert verified.stdout == 'values: 100000\nsorted: yes\ninput values: 100000\nsame values: yes\n'
+
+    # Swapping two values breaks the order, and changing one keeps the order but not the values.
+    with open(out_file_path, 'r+b') as file:
+        file.seek(4000)
+        file.write(struct.pack('=2L', 1001, 1000))
+    verified = bigsort.verify(out_file_path, in_file_path)
+    assert verified.returncode == 1
+    assert verified.stdout == 'values: 100000\nsorted: no (offset 4004)\ninput values: 100000\nsame values: yes\n'
+    with open(out_file_path, 'r+b') as file:
+        file.seek(4000)
+        file.write(struct.pack('=2L', 1000, 1000))
+    verified = bigsort.verify(out_file_path, in_file_path)
+    assert verified.returncode == 1
+    assert 'sorted: yes\n' in verified.stdout
+    assert 'same values: no\n' in verified.stdout
+    assert bigsort.verify(out_file_path).returncode == 0
+
+    # A file that isn't whole values can't be checked.
+    with open(out_file_path, 'ab') as file:
+        file.write(b'\x00')
+    verified = bigsort.verify(out_file_path)
+    assert verified.returncode == 2
+    assert 'ERROR' in verified.stderr
+
+
+def test_autotune_probes_once_and_reports_predicted_and_actual_times(
+        in_file_path, out_file_path, bigsort, make_cache_path, monkeypatch):
+    cache_home = make_cache_path('autotune_cache')
+    monkeypatch.setenv('XDG_CACHE_HOME', str(cache_home))
+    DataFiles.create_file_with_shuffled_ascending_integers(in_file_path, 1000000)
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=None,
+        memory=256 * 1024,
+        extra_args=['--autotune'])
+    assert result.return_code == 0
+    assert DataFiles.find_first_incorrect_ascending_value(out_file_path) == ()
+    assert 'device: probed' in result.stdout
+    assert 'run size: 262144' in result.stdout
+    assert 'predicted time:' in result.stdout
+    assert 'actual time:' in result.stdout
+    cache_paths = list((cache_home / 'bigsort').glob('device-*'))
+    assert len(cache_paths) == 1
+
+    # The probe is cached for the next sort on the same device.
+    result = bigsort.run(
+        input_filename=in_file_path,
+        output_filename=out_file_path,
+        run_size=None,
+        memory=256 * 1024,
+        extra_args=['--autotune', '--partition'])
+    assert result.return_code == 0
+    assert DataFiles.find_first_incorrect_ascending_value(out_file_path) == ()
+    assert 'device: cached probe' in result.stdout
+    os.remove(cache_paths[0])
+    os.rmdir(cache_home / 'bigsort')
+    os.rmdir(cache_home)
+
+
+def test_batch_sorts_every_job_with_shared_memory_and_threads(make_cache_path, bigsort):
+    # With 1MB split between two threads, the 2MB input is the only one that's too big for a thread's share.
+    sizes = [40000, 100000, 4, 200000, 2000000]
+    jobs = [(make_cache_path(f'batch.{i}.in'), make_cache_path(f'batch.{i}.out')) for i in range(len(sizes))]
+    for (input_path, _), size in zip(jobs, sizes):
+        DataFiles.create_file_with_shuffled_ascending_integers(input_path, size)
+    job_file_path = make_cache_path('batch.jobs')
+    with open(job_file_path, 'w') as job_file:
+        job_file.write('# input output\n\n')
+        job_file.writelines(f'{input_path} {output_path}\n' for input_path, output_path in jobs)
+
+    result = bigsort.run_batch(job_file_path, memory='1M', threads=2)
+    assert result.returncode == 0
+    assert 'small jobs: 4\n' in result.stdout
+    assert 'large jobs: 1\n' in result.stdout
+    for input_path, output_path in jobs:
+        assert bigsort.verify(output_path, input_path).returncode == 0
+
+    # A job that fails is reported, and the others are still sorted.
+    os.remove(jobs[1][1])
+    os.remove(jobs[1][0])
+    result = bigsort.run_batch(job_file_path, memory='1M', threads=2)
+    assert result.returncode == 1
+    assert 'failed jobs: 1\n' in result.stdout
+    assert not os.path.exists(jobs[1][1])
+    assert bigsort.verify(jobs[4][1], jobs[4][0]).returncode == 0
+
+    # Files come from the job file only.
+    result = bigsort.run(jobs[0][0], jobs[0][1], extra_args=[f'--batch={job_file_path}'])
+    assert result.return_code == 1
+    for input_path, output_path in jobs:
+        for path in (input_path, output_path):
+            if os.path.exists(path):
+                os.remove(path)
+    os.remove(job_file_path)